@@ -0,0 +1,27 @@
+/* Linux entry point for the RetroStore tester.
+ *
+ * Runs the unmodified app_main() from main/ against the ESP-IDF shim and the
+ * in-process mock RetroStore server, then drains the event queue the way the
+ * default event task would. Exits non-zero if any error was logged.
+ */
+#include <stdio.h>
+
+#include "host_shim.h"
+#include "mock_server.h"
+
+extern "C" void app_main(void);
+
+int main(int argc, char** argv) {
+  // Build the canned catalog up front so it is not counted against the
+  // tester's heap.
+  retrostore::mock::MockServer::Get();
+  app_main();
+  host_event_loop_run();
+
+  auto stats = retrostore::mock::MockServer::Get()->transport_stats();
+  printf("Mock transport: %ld requests, %ld handshakes, %ld resumed handshakes, "
+         "%ld dropped, %ld errors, %lld bytes sent, %lld bytes received\n",
+         stats.requests, stats.handshakes, stats.resumed_handshakes, stats.drops, stats.errors,
+         stats.request_bytes, stats.response_bytes);
+  return host_log_error_count() == 0 ? 0 : 1;
+}
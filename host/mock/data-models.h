@@ -0,0 +1,110 @@
+/* Host copy of the RetroStore SDK data models.
+ *
+ * Mirrors components/retrostore-c-sdk/src/data-models.h field for field so
+ * that code in main/ compiles against either.
+ */
+#pragma once
+
+#ifndef _RS_DATA_MODELS_H_
+#define _RS_DATA_MODELS_H_
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace retrostore {
+
+enum RsTrs80Model {
+  RsTrs80Model_UNKNOWN_MODEL = 0,
+  RsTrs80Model_MODEL_I = 1,
+  RsTrs80Model_MODEL_III = 2,
+  RsTrs80Model_MODEL_4 = 3,
+  RsTrs80Model_MODEL_4P = 4
+};
+
+enum RsMediaType {
+  RsMediaType_UNKNOWN = 0,
+  RsMediaType_DISK = 1,
+  RsMediaType_CASSETTE = 2,
+  RsMediaType_COMMAND = 3,
+  RsMediaType_BASIC = 4
+};
+
+struct RsMediaImage {
+  RsMediaType type;
+  std::string filename;
+  std::unique_ptr<uint8_t> data;
+  int data_size;
+  long uploadTime;
+  std::string description;
+};
+
+struct RsMediaImageRef {
+  RsMediaType type;
+  std::string filename;
+  int data_size;
+  std::string token;
+  long uploadTime;
+  std::string description;
+};
+
+struct RsMediaRegion {
+  int start;
+  int length;
+  std::unique_ptr<uint8_t> data;
+};
+
+struct RsApp {
+  std::string id;
+  std::string name;
+  std::string version;
+  std::string description;
+  int release_year;
+  std::vector<std::string> screenshot_urls;
+  std::string author;
+  RsTrs80Model model;
+};
+
+struct RsAppNano {
+  std::string id;
+  std::string name;
+  std::string version;
+  int release_year;
+  std::string author;
+  RsTrs80Model model;
+};
+
+struct RsRegisters {
+  int ix;
+  int iy;
+  int pc;
+  int sp;
+  int af;
+  int bc;
+  int de;
+  int hl;
+  int af_prime;
+  int bc_prime;
+  int de_prime;
+  int hl_prime;
+  int i;
+  int r_1;
+  int r_2;
+};
+
+struct RsMemoryRegion {
+  int start;
+  int length;
+  std::unique_ptr<uint8_t> data;
+};
+
+struct RsSystemState {
+  RsTrs80Model model;
+  RsRegisters registers;
+  std::vector<RsMemoryRegion> regions;
+};
+
+}  // namespace retrostore
+
+#endif /* _RS_DATA_MODELS_H_ */
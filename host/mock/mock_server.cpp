@@ -0,0 +1,351 @@
+#include "mock_server.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "host_shim.h"
+
+namespace retrostore {
+namespace mock {
+
+namespace {
+
+// 35 tracks, 10 sectors of 256 bytes: a single density TRS-80 disk.
+#define DISK_IMAGE_SIZE (35 * 10 * 256)
+
+std::string toLower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return s;
+}
+
+std::vector<std::string> splitQuery(const std::string& query) {
+  std::vector<std::string> terms;
+  const std::string separator(" OR ");
+  size_t pos = 0;
+  while (true) {
+    auto next = query.find(separator, pos);
+    auto term = query.substr(pos, next == std::string::npos ? std::string::npos : next - pos);
+    if (!term.empty()) terms.push_back(toLower(term));
+    if (next == std::string::npos) break;
+    pos = next + separator.size();
+  }
+  return terms;
+}
+
+// Deterministic filler so that images have the same bytes on every run.
+std::vector<uint8_t> fillerBytes(size_t size, uint32_t seed) {
+  std::vector<uint8_t> data(size);
+  uint32_t x = seed;
+  for (size_t i = 0; i < size; ++i) {
+    x = x * 1103515245 + 12345;
+    data[i] = (x >> 16) & 0xff;
+  }
+  return data;
+}
+
+int envInt(const char* name, int fallback) {
+  const char* value = getenv(name);
+  return value != nullptr && *value != '\0' ? atoi(value) : fallback;
+}
+
+int64_t nowMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void sleepMillis(int64_t millis) {
+  if (millis > 0) std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+}
+
+StoredImage makeImage(const std::string& appId, int index, RsMediaType type,
+                      const std::string& filename, std::vector<uint8_t> data) {
+  StoredImage image;
+  image.type = type;
+  image.filename = filename;
+  image.token = "media/" + appId + "/" + std::to_string(index);
+  image.data = std::move(data);
+  return image;
+}
+
+StoredApp makeApp(const std::string& id, const std::string& name, int year,
+                  const std::string& author, RsTrs80Model model,
+                  const std::string& description) {
+  StoredApp stored;
+  stored.app.id = id;
+  stored.app.name = name;
+  stored.app.version = "1.0";
+  stored.app.description = description;
+  stored.app.release_year = year;
+  stored.app.author = author;
+  stored.app.model = model;
+  stored.app.screenshot_urls.push_back(
+      "https://retrostore.org/screenshots/" + id + "/0.png");
+  return stored;
+}
+
+// Bytes glibc's malloc takes for an n byte block, as mallinfo2() counts them.
+long chunkSize(size_t n) {
+  return std::max<size_t>(32, (n + 8 + 15) & ~(size_t) 15);
+}
+
+// Process heap a stored state takes, its entries in states_ and
+// state_used_ included. Server storage is not part of the device's heap,
+// and a long soak run only shows the device's drift if this is exact.
+long storedSize(const StoredState& state) {
+  // Tree nodes are a color and three pointers followed by the value.
+  long bytes = chunkSize(32 + sizeof(std::pair<const int, StoredState>)) +
+               chunkSize(32 + sizeof(std::pair<const int, long>));
+  if (state.regions.capacity() > 0) {
+    bytes += chunkSize(state.regions.capacity() * sizeof(StoredRegion));
+  }
+  for (const auto& region : state.regions) {
+    if (region.data.capacity() > 0) bytes += chunkSize(region.data.capacity());
+  }
+  return bytes;
+}
+
+}  // namespace
+
+MockServer* MockServer::Get() {
+  static MockServer* server = new MockServer();
+  return server;
+}
+
+MockServer::MockServer()
+    : state_clock_(0), transport_stats_(), random_(envInt("RS_MOCK_SEED", 1)) {
+  transport_config_.rtt_ms = envInt("RS_MOCK_RTT_MS", 0);
+  transport_config_.handshake_ms = envInt("RS_MOCK_HANDSHAKE_MS", 0);
+  transport_config_.resumed_handshake_ms = envInt("RS_MOCK_RESUMED_HANDSHAKE_MS", 0);
+  transport_config_.session_resumption = envInt("RS_MOCK_SESSION_RESUMPTION", 0) != 0;
+  transport_config_.bandwidth_kbps = envInt("RS_MOCK_BANDWIDTH_KBPS", 0);
+  transport_config_.idle_timeout_ms = envInt("RS_MOCK_IDLE_TIMEOUT_MS", 30000);
+  transport_config_.keep_alive = envInt("RS_MOCK_KEEP_ALIVE", 1) != 0;
+  transport_config_.compression = envInt("RS_MOCK_COMPRESSION", 0) != 0;
+  transport_config_.streaming = envInt("RS_MOCK_STREAMING", 1) != 0;
+  transport_config_.drop_every = envInt("RS_MOCK_DROP_EVERY", 0);
+  transport_config_.loss_percent = envInt("RS_MOCK_LOSS_PERCENT", 0);
+  transport_config_.error_percent = envInt("RS_MOCK_ERROR_PERCENT", 0);
+  transport_config_.jitter_ms = envInt("RS_MOCK_JITTER_MS", 0);
+
+  {
+    auto app = makeApp("a2729dec-96b3-11e7-9539-e7341c560175", "Donkey Kong", 1981,
+                       "Wayne Westmoreland and Terry Gilman", RsTrs80Model_MODEL_III,
+                       "Climb the girders and rescue the lady from the ape.");
+    app.images.push_back(makeImage(app.app.id, 0, RsMediaType_COMMAND, "DONKEY.CMD",
+                                   fillerBytes(12 * 1024, 1)));
+    addApp(std::move(app));
+  }
+  {
+    auto app = makeApp("29b20252-680f-11e8-b4a9-1f10b5491ef5", "Breakdown", 1983,
+                       "Big Five Software", RsTrs80Model_MODEL_III,
+                       "Break through the wall, brick by brick.");
+    // The tester checks these exact bytes at the start, at offset 1242 and at
+    // the end of the image.
+    auto data = fillerBytes(6 * 1024, 2);
+    const uint8_t head[] = {1, 2, 0, 128, 49, 0, 155, 243, 205, 228};
+    const uint8_t middle[] = {254, 200, 40, 35, 254, 75, 40, 26, 254, 10};
+    const uint8_t tail[] = {2, 24, 224, 27, 24, 194, 2, 2, 0, 128};
+    memcpy(data.data(), head, sizeof(head));
+    memcpy(data.data() + 1242, middle, sizeof(middle));
+    memcpy(data.data() + data.size() - sizeof(tail), tail, sizeof(tail));
+    app.images.push_back(makeImage(app.app.id, 0, RsMediaType_COMMAND, "command.CMD",
+                                   std::move(data)));
+    app.images.push_back(makeImage(app.app.id, 1, RsMediaType_DISK, "breakdown.dsk",
+                                   fillerBytes(DISK_IMAGE_SIZE, 3)));
+    addApp(std::move(app));
+  }
+  {
+    auto app = makeApp("59a9ea84-e52c-11e8-9abc-ab7e2ee8e918", "Weerd", 1981,
+                       "Bill Mosley", RsTrs80Model_MODEL_I,
+                       "A strange little maze game.");
+    app.images.push_back(makeImage(app.app.id, 0, RsMediaType_DISK, "weerd.dsk",
+                                   fillerBytes(DISK_IMAGE_SIZE, 4)));
+    addApp(std::move(app));
+  }
+  {
+    auto app = makeApp("6b5b1c2e-5e0d-11e8-8f58-b7a8c3e6d101", "LDOS - Model I", 1983,
+                       "Logical Systems Inc.", RsTrs80Model_MODEL_I,
+                       "LDOS 5.3.1 operating system for the Model I.");
+    app.images.push_back(makeImage(app.app.id, 0, RsMediaType_DISK, "ldos531-1.dsk",
+                                   fillerBytes(DISK_IMAGE_SIZE, 5)));
+    addApp(std::move(app));
+  }
+  {
+    auto app = makeApp("6b5b1c2e-5e0d-11e8-8f58-b7a8c3e6d103", "LDOS - Model III", 1983,
+                       "Logical Systems Inc.", RsTrs80Model_MODEL_III,
+                       "LDOS 5.3.1 operating system for the Model III.");
+    app.images.push_back(makeImage(app.app.id, 0, RsMediaType_DISK, "ldos531-3.dsk",
+                                   fillerBytes(DISK_IMAGE_SIZE, 6)));
+    addApp(std::move(app));
+  }
+  {
+    auto app = makeApp("0e0c3f4a-7d2b-11e8-a3f1-4b9d2f0c7e11", "Scarfman", 1981,
+                       "The Cornsoft Group", RsTrs80Model_MODEL_I,
+                       "Eat the dots and avoid the monsters.");
+    app.images.push_back(makeImage(app.app.id, 0, RsMediaType_CASSETTE, "scarfman.cas",
+                                   fillerBytes(9 * 1024, 7)));
+    addApp(std::move(app));
+  }
+  {
+    auto app = makeApp("1f8d5a60-7d2b-11e8-a3f1-6f0e9a1b2c33", "Cosmic Fighter", 1982,
+                       "Big Five Software", RsTrs80Model_MODEL_III,
+                       "Defend the galaxy against waves of alien fighters.");
+    app.images.push_back(makeImage(app.app.id, 0, RsMediaType_COMMAND, "cosmic.CMD",
+                                   fillerBytes(10 * 1024, 8)));
+    addApp(std::move(app));
+  }
+}
+
+void MockServer::addApp(StoredApp app) {
+  apps_.push_back(std::move(app));
+}
+
+bool MockServer::Request(Connection* connection, const char* endpoint,
+                         size_t request_bytes, size_t response_bytes) {
+  const auto& config = transport_config_;
+  int64_t delay_ms = config.rtt_ms;
+  bool dropped = false;
+  bool failed = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = nowMillis();
+    if (connection->open && now - connection->last_used_ms > config.idle_timeout_ms) {
+      connection->open = false;
+    }
+    if (!connection->open) {
+      if (connection->has_session && config.session_resumption) {
+        transport_stats_.resumed_handshakes++;
+        delay_ms += config.resumed_handshake_ms;
+      } else {
+        transport_stats_.handshakes++;
+        delay_ms += config.handshake_ms;
+      }
+      connection->open = true;
+      connection->has_session = true;
+    }
+    transport_stats_.requests++;
+    transport_stats_.request_bytes += request_bytes;
+    if (config.jitter_ms > 0) delay_ms += random_() % (config.jitter_ms + 1);
+    // The request goes out but the response never arrives.
+    dropped = (config.drop_every > 0 && transport_stats_.requests % config.drop_every == 0) ||
+              (config.loss_percent > 0 && (int) (random_() % 100) < config.loss_percent);
+    // The server answers, but with an error status and no body.
+    failed = !dropped && config.error_percent > 0 &&
+             (int) (random_() % 100) < config.error_percent;
+    if (dropped) {
+      transport_stats_.drops++;
+      connection->open = false;
+    } else if (failed) {
+      transport_stats_.errors++;
+    } else {
+      transport_stats_.response_bytes += response_bytes;
+      if (config.bandwidth_kbps > 0) {
+        delay_ms += (request_bytes + response_bytes) / config.bandwidth_kbps;
+      }
+    }
+  }
+  sleepMillis(delay_ms);
+  if (dropped) return false;
+  connection->last_used_ms = nowMillis();
+  if (!config.keep_alive) connection->open = false;
+  return !failed;
+}
+
+const StoredApp* MockServer::FindApp(const std::string& id) const {
+  for (const auto& app : apps_) {
+    if (app.app.id == id) return &app;
+  }
+  return nullptr;
+}
+
+std::vector<const StoredApp*> MockServer::QueryApps(int start, int num,
+                                                    const std::string& query,
+                                                    const std::vector<RsMediaType>& hasTypes) const {
+  auto terms = splitQuery(query);
+  std::vector<const StoredApp*> matches;
+  for (const auto& app : apps_) {
+    if (!terms.empty()) {
+      auto name = toLower(app.app.name);
+      auto author = toLower(app.app.author);
+      bool found = false;
+      for (const auto& term : terms) {
+        if (name.find(term) != std::string::npos || author.find(term) != std::string::npos) {
+          found = true;
+          break;
+        }
+      }
+      if (!found) continue;
+    }
+    bool hasAllTypes = true;
+    for (auto type : hasTypes) {
+      bool hasType = false;
+      for (const auto& image : app.images) {
+        if (image.type == type) hasType = true;
+      }
+      if (!hasType) hasAllTypes = false;
+    }
+    if (!hasAllTypes) continue;
+    matches.push_back(&app);
+  }
+
+  std::vector<const StoredApp*> page;
+  for (int i = start; i < (int) matches.size() && (int) page.size() < num; ++i) {
+    page.push_back(matches[i]);
+  }
+  return page;
+}
+
+const StoredImage* MockServer::FindImage(const std::string& token) const {
+  for (const auto& app : apps_) {
+    for (const auto& image : app.images) {
+      if (image.token == token) return &image;
+    }
+  }
+  return nullptr;
+}
+
+int MockServer::PutState(StoredState state) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (states_.size() >= 900) {
+    auto oldest = std::min_element(
+        state_used_.begin(), state_used_.end(),
+        [](const std::pair<const int, long>& a, const std::pair<const int, long>& b) {
+          return a.second < b.second;
+        });
+    host_heap_exclude(-storedSize(states_[oldest->first]));
+    states_.erase(oldest->first);
+    state_used_.erase(oldest);
+  }
+  int token;
+  do {
+    token = rand() % 900 + 100;
+  } while (states_.find(token) != states_.end());
+  host_heap_exclude(storedSize(state));
+  states_[token] = std::move(state);
+  state_used_[token] = state_clock_++;
+  return token;
+}
+
+bool MockServer::GetState(int token, StoredState* state) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = states_.find(token);
+  if (it == states_.end()) return false;
+  state_used_[token] = state_clock_++;
+  // Stands in for the server reading the state from its storage.
+  HostServerHeap server_heap;
+  *state = it->second;
+  return true;
+}
+
+TransportStats MockServer::transport_stats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return transport_stats_;
+}
+
+}  // namespace mock
+}  // namespace retrostore
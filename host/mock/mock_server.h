@@ -0,0 +1,139 @@
+/* In-process stand-in for the RetroStore backend.
+ *
+ * Serves a small canned catalog (the apps and media images the tester
+ * expects) and keeps uploaded states in memory. Every RetroStore call on the
+ * host goes through Request() so that transport behaviour can be modelled
+ * in one place.
+ */
+#pragma once
+
+#ifndef _RS_MOCK_SERVER_H_
+#define _RS_MOCK_SERVER_H_
+
+#include <map>
+#include <mutex>
+#include <random>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "data-models.h"
+
+namespace retrostore {
+namespace mock {
+
+struct StoredImage {
+  RsMediaType type;
+  std::string filename;
+  std::string token;
+  std::string description;
+  std::vector<uint8_t> data;
+};
+
+struct StoredApp {
+  RsApp app;
+  std::vector<StoredImage> images;
+};
+
+struct StoredRegion {
+  int start;
+  std::vector<uint8_t> data;
+};
+
+struct StoredState {
+  RsTrs80Model model;
+  RsRegisters registers;
+  std::vector<StoredRegion> regions;
+};
+
+struct TransportConfig {
+  int rtt_ms;
+  int handshake_ms;
+  int resumed_handshake_ms;
+  // Whether a reconnect resumes the TLS session. Off by default, since the
+  // SDK's HTTP client does not reuse sessions; on, it shows what doing so
+  // would save.
+  bool session_resumption;
+  int bandwidth_kbps;
+  int idle_timeout_ms;
+  bool keep_alive;
+  bool compression;
+  // Whether the server answers in the streaming format the client asks for.
+  // If not, the client reads the whole response before decoding it.
+  bool streaming;
+  // Every drop_every-th request fails as if the WiFi dropped; 0 for never.
+  int drop_every;
+  // Faults injected at random, for soak runs: the share of requests lost
+  // like a drop, and of requests the server answers with an error, keeping
+  // the connection, in percent. Up to jitter_ms is added to every request.
+  int loss_percent;
+  int error_percent;
+  int jitter_ms;
+};
+
+struct TransportStats {
+  long requests;
+  long handshakes;
+  long resumed_handshakes;
+  long drops;
+  long errors;
+  long long request_bytes;
+  long long response_bytes;
+};
+
+// Client side of a (simulated) keep-alive HTTPS connection. Owned by each
+// RetroStore instance.
+struct Connection {
+  Connection() : open(false), has_session(false), last_used_ms(0) {}
+  bool open;
+  // Whether a TLS session ticket from an earlier handshake is available.
+  bool has_session;
+  int64_t last_used_ms;
+};
+
+class MockServer {
+ public:
+  static MockServer* Get();
+
+  // Accounts for one request to the given endpoint over `connection`,
+  // (re)connecting first if needed, and sleeps for the simulated transfer
+  // time. Returns false if the request failed at the transport level, in
+  // which case the connection is closed and the next request reconnects.
+  bool Request(Connection* connection, const char* endpoint,
+               size_t request_bytes, size_t response_bytes);
+
+  const StoredApp* FindApp(const std::string& id) const;
+  // Apps matching the query (terms separated by " OR ", matched
+  // case-insensitively against name and author) that have all hasTypes.
+  std::vector<const StoredApp*> QueryApps(int start, int num,
+                                          const std::string& query,
+                                          const std::vector<RsMediaType>& hasTypes) const;
+  const StoredImage* FindImage(const std::string& token) const;
+
+  // Stores the state and returns its token in the range [100, 999]. Once
+  // all tokens are in use, the least recently used state makes room.
+  int PutState(StoredState state);
+  bool GetState(int token, StoredState* state);
+
+  const TransportConfig& transport_config() const { return transport_config_; }
+  TransportStats transport_stats();
+
+ private:
+  MockServer();
+  void addApp(StoredApp app);
+
+  std::vector<StoredApp> apps_;
+  std::map<int, StoredState> states_;
+  // When each state was last stored or read, in PutState/GetState calls.
+  std::map<int, long> state_used_;
+  long state_clock_;
+  TransportConfig transport_config_;
+  TransportStats transport_stats_;
+  std::mt19937 random_;
+  std::mutex mutex_;
+};
+
+}  // namespace mock
+}  // namespace retrostore
+
+#endif /* _RS_MOCK_SERVER_H_ */
@@ -0,0 +1,307 @@
+#include "retrostore.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "host_shim.h"
+#include "mock_server.h"
+#include "rle.h"
+#include "state_stream.h"
+
+namespace retrostore {
+
+using mock::MockServer;
+using mock::StoredApp;
+using mock::StoredImage;
+using mock::StoredRegion;
+using mock::StoredState;
+
+namespace {
+
+// Size of a TCP segment on the simulated link.
+#define MOCK_SEGMENT_SIZE 1460
+
+// Moves `size` bytes of payload from `src` on one end to `dst` on the other
+// and returns the number of bytes on the wire. With compression negotiated
+// the sender compresses and the receiver decodes the stream straight into
+// `dst`, one segment at a time.
+size_t transfer(const uint8_t* src, size_t size, uint8_t* dst) {
+  if (size == 0) return 0;
+  if (!MockServer::Get()->transport_config().compression) {
+    memcpy(dst, src, size);
+    return size;
+  }
+  std::unique_ptr<uint8_t[]> wire(new uint8_t[RLE_COMPRESS_BOUND(size)]);
+  size_t wire_size = RleCompress(src, size, wire.get(), RLE_COMPRESS_BOUND(size));
+  RleDecoder decoder(dst, size);
+  for (size_t offset = 0; offset < wire_size; offset += MOCK_SEGMENT_SIZE) {
+    decoder.Feed(wire.get() + offset, std::min((size_t) MOCK_SEGMENT_SIZE, wire_size - offset));
+  }
+  return wire_size;
+}
+
+std::unique_ptr<uint8_t> receiveBytes(const uint8_t* src, size_t size, size_t* wire_bytes) {
+  std::unique_ptr<uint8_t> data(new uint8_t[std::max(size, (size_t) 1)]);
+  *wire_bytes += transfer(src, size, data.get());
+  return data;
+}
+
+size_t appSize(const RsApp& app) {
+  size_t size = app.id.size() + app.name.size() + app.version.size() +
+                app.description.size() + app.author.size() + 8;
+  for (const auto& url : app.screenshot_urls) size += url.size();
+  return size;
+}
+
+RsAppNano toNano(const RsApp& app) {
+  RsAppNano nano;
+  nano.id = app.id;
+  nano.name = app.name;
+  nano.version = app.version;
+  nano.release_year = app.release_year;
+  nano.author = app.author;
+  nano.model = app.model;
+  return nano;
+}
+
+RsMediaImageRef toRef(const StoredImage& image) {
+  RsMediaImageRef ref;
+  ref.type = image.type;
+  ref.filename = image.filename;
+  ref.data_size = image.data.size();
+  ref.token = image.token;
+  ref.uploadTime = 0;
+  ref.description = image.description;
+  return ref;
+}
+
+std::vector<const StoredImage*> imagesOfTypes(const StoredApp& app,
+                                              const std::vector<RsMediaType>& types) {
+  std::vector<const StoredImage*> images;
+  for (const auto& image : app.images) {
+    bool wanted = types.empty();
+    for (auto type : types) {
+      if (image.type == type) wanted = true;
+    }
+    if (wanted) images.push_back(&image);
+  }
+  return images;
+}
+
+}  // namespace
+
+RetroStore::RetroStore() {}
+
+bool RetroStore::FetchApp(const std::string& appId, RsApp* app) {
+  auto* server = MockServer::Get();
+  auto* stored = server->FindApp(appId);
+  if (!server->Request(&connection_, "getApp", appId.size(), stored ? appSize(stored->app) : 0)) {
+    return false;
+  }
+  if (stored == nullptr) return false;
+  *app = stored->app;
+  return true;
+}
+
+bool RetroStore::FetchApps(int start, int num, std::vector<RsApp>* apps) {
+  return FetchApps(start, num, "", apps);
+}
+
+bool RetroStore::FetchApps(int start, int num, const std::string& query, std::vector<RsApp>* apps) {
+  auto* server = MockServer::Get();
+  auto page = server->QueryApps(start, num, query, std::vector<RsMediaType>());
+  size_t response_bytes = 0;
+  for (auto* stored : page) response_bytes += appSize(stored->app);
+  if (!server->Request(&connection_, "listApps", query.size() + 8, response_bytes)) return false;
+  apps->clear();
+  for (auto* stored : page) apps->push_back(stored->app);
+  return true;
+}
+
+bool RetroStore::FetchAppsNano(int start, int num, std::vector<RsAppNano>* apps) {
+  return FetchAppsNano(start, num, "", std::vector<RsMediaType>(), apps);
+}
+
+bool RetroStore::FetchAppsNano(int start, int num, const std::string& query,
+                               const std::vector<RsMediaType>& hasTypes,
+                               std::vector<RsAppNano>* apps) {
+  auto* server = MockServer::Get();
+  auto page = server->QueryApps(start, num, query, hasTypes);
+  size_t response_bytes = 0;
+  for (auto* stored : page) {
+    response_bytes += stored->app.id.size() + stored->app.name.size() +
+                      stored->app.version.size() + stored->app.author.size() + 8;
+  }
+  if (!server->Request(&connection_, "listAppsNano", query.size() + hasTypes.size() + 8, response_bytes)) {
+    return false;
+  }
+  apps->clear();
+  for (auto* stored : page) apps->push_back(toNano(stored->app));
+  return true;
+}
+
+bool RetroStore::FetchMediaImages(const std::string& appId,
+                                  const std::vector<RsMediaType>& types,
+                                  std::vector<RsMediaImage>* images) {
+  auto* server = MockServer::Get();
+  auto* stored = server->FindApp(appId);
+  std::vector<const StoredImage*> found;
+  if (stored != nullptr) found = imagesOfTypes(*stored, types);
+  size_t response_bytes = 0;
+  std::vector<RsMediaImage> received;
+  for (auto* image : found) {
+    RsMediaImage out;
+    out.type = image->type;
+    out.filename = image->filename;
+    out.data_size = image->data.size();
+    out.data = receiveBytes(image->data.data(), image->data.size(), &response_bytes);
+    out.uploadTime = 0;
+    out.description = image->description;
+    response_bytes += image->filename.size();
+    received.push_back(std::move(out));
+  }
+  if (!server->Request(&connection_, "fetchMediaImages", appId.size() + types.size(), response_bytes)) {
+    return false;
+  }
+  if (stored == nullptr) return false;
+  *images = std::move(received);
+  return true;
+}
+
+bool RetroStore::FetchMediaImageRefs(const std::string& appId,
+                                     const std::vector<RsMediaType>& types,
+                                     std::vector<RsMediaImageRef>* images) {
+  auto* server = MockServer::Get();
+  auto* stored = server->FindApp(appId);
+  std::vector<const StoredImage*> found;
+  if (stored != nullptr) found = imagesOfTypes(*stored, types);
+  size_t response_bytes = 0;
+  for (auto* image : found) response_bytes += image->filename.size() + image->token.size() + 8;
+  if (!server->Request(&connection_, "fetchMediaImageRefs", appId.size() + types.size(), response_bytes)) {
+    return false;
+  }
+  if (stored == nullptr) return false;
+  images->clear();
+  for (auto* image : found) images->push_back(toRef(*image));
+  return true;
+}
+
+bool RetroStore::FetchMediaImageRegion(const RsMediaImageRef& ref, int start, int length,
+                                       RsMediaRegion* region) {
+  auto* server = MockServer::Get();
+  auto* image = server->FindImage(ref.token);
+  bool valid = image != nullptr && start >= 0 && length >= 0 &&
+               start <= (int) image->data.size();
+  if (valid && start + length > (int) image->data.size()) {
+    length = image->data.size() - start;
+  }
+  size_t response_bytes = 0;
+  std::unique_ptr<uint8_t> data;
+  if (valid) data = receiveBytes(image->data.data() + start, length, &response_bytes);
+  if (!server->Request(&connection_, "fetchMediaImageRegion", ref.token.size() + 8, response_bytes)) {
+    return false;
+  }
+  if (!valid) return false;
+  region->start = start;
+  region->length = length;
+  region->data = std::move(data);
+  return true;
+}
+
+int RetroStore::UploadState(RsSystemState& state) {
+  // The copy is what the server receives.
+  HostServerHeap server_heap;
+  StoredState stored;
+  stored.model = state.model;
+  stored.registers = state.registers;
+  size_t request_bytes = sizeof(RsRegisters);
+  for (const auto& region : state.regions) {
+    StoredRegion r;
+    r.start = region.start;
+    r.data.assign(region.length, 0);
+    if (region.data) {
+      request_bytes += transfer(region.data.get(), region.length, r.data.data());
+    }
+    request_bytes += 8;
+    stored.regions.push_back(std::move(r));
+  }
+  auto* server = MockServer::Get();
+  if (!server->Request(&connection_, "uploadState", request_bytes, 4)) return -1;
+  return server->PutState(std::move(stored));
+}
+
+bool RetroStore::DownloadState(int token, RsSystemState* state) {
+  return DownloadState(token, false, state);
+}
+
+bool RetroStore::DownloadState(int token, bool exclude_memory_region_data, RsSystemState* state) {
+  auto* server = MockServer::Get();
+  StoredState stored;
+  bool found = server->GetState(token, &stored);
+  size_t response_bytes = 0;
+  RsSystemState received;
+  bool decoded = false;
+  if (found) {
+    std::vector<RsRegionView> regions;
+    for (const auto& r : stored.regions) {
+      regions.push_back({r.start, (int) r.data.size(),
+                         exclude_memory_region_data ? nullptr : r.data.data()});
+    }
+    std::unique_ptr<RsStateEncoder> encoder;
+    {
+      HostServerHeap server_heap;
+      encoder.reset(new RsStateEncoder(stored.model, stored.registers, regions,
+                                       server->transport_config().compression));
+    }
+    response_bytes = encoder->size();
+    RsStateDecoder decoder(&received);
+    if (server->transport_config().streaming) {
+      // Decoded a segment at a time as it arrives.
+      uint8_t segment[MOCK_SEGMENT_SIZE];
+      size_t n;
+      decoded = true;
+      while (decoded && (n = encoder->Read(segment, sizeof(segment))) > 0) {
+        decoded = decoder.Feed(segment, n);
+      }
+    } else {
+      // Read into a buffer in full, then decoded.
+      std::unique_ptr<uint8_t[]> response(new uint8_t[std::max(response_bytes, (size_t) 1)]);
+      encoder->Read(response.get(), response_bytes);
+      decoded = decoder.Feed(response.get(), response_bytes);
+    }
+    decoded = decoded && decoder.complete();
+  }
+  if (!server->Request(&connection_, "downloadState", 8, response_bytes)) return false;
+  if (!found || !decoded) return false;
+
+  *state = std::move(received);
+  return true;
+}
+
+bool RetroStore::DownloadStateMemoryRange(int token, int start, int length,
+                                          RsMemoryRegion* region) {
+  auto* server = MockServer::Get();
+  StoredState stored;
+  bool found = server->GetState(token, &stored) && length >= 0;
+  size_t response_bytes = 0;
+  std::unique_ptr<uint8_t> data;
+  if (found) {
+    std::vector<uint8_t> range(length, 0);
+    for (const auto& r : stored.regions) {
+      int from = std::max(start, r.start);
+      int to = std::min(start + length, r.start + (int) r.data.size());
+      if (from >= to) continue;
+      memcpy(range.data() + (from - start), r.data.data() + (from - r.start), to - from);
+    }
+    data = receiveBytes(range.data(), length, &response_bytes);
+  }
+  if (!server->Request(&connection_, "downloadStateMemoryRange", 16, response_bytes)) return false;
+  if (!found) return false;
+
+  region->start = start;
+  region->length = length;
+  region->data = std::move(data);
+  return true;
+}
+
+}  // namespace retrostore
@@ -0,0 +1,63 @@
+/* Host stand-in for the RetroStore SDK client.
+ *
+ * Same public API as components/retrostore-c-sdk/src/retrostore.h, but every
+ * call is answered by the in-process MockServer instead of going over HTTPS.
+ */
+#pragma once
+
+#ifndef _RS_RETROSTORE_H_
+#define _RS_RETROSTORE_H_
+
+#include <string>
+#include <vector>
+
+#include "data-models.h"
+#include "mock_server.h"
+
+namespace retrostore {
+
+class RetroStore {
+ public:
+  RetroStore();
+
+  // Fetches the app with the given ID.
+  bool FetchApp(const std::string& appId, RsApp* app);
+  // Fetches a page of apps.
+  bool FetchApps(int start, int num, std::vector<RsApp>* apps);
+  // Fetches a page of apps matching the given query.
+  bool FetchApps(int start, int num, const std::string& query, std::vector<RsApp>* apps);
+  // Fetches a page of apps, with only the minimal set of fields.
+  bool FetchAppsNano(int start, int num, std::vector<RsAppNano>* apps);
+  // Fetches a page of apps matching the query and having all of the given
+  // media types, with only the minimal set of fields.
+  bool FetchAppsNano(int start, int num, const std::string& query,
+                     const std::vector<RsMediaType>& hasTypes,
+                     std::vector<RsAppNano>* apps);
+  // Fetches the media images of the given types, including their data.
+  bool FetchMediaImages(const std::string& appId,
+                        const std::vector<RsMediaType>& types,
+                        std::vector<RsMediaImage>* images);
+  // Fetches references to the media images of the given types, without data.
+  bool FetchMediaImageRefs(const std::string& appId,
+                           const std::vector<RsMediaType>& types,
+                           std::vector<RsMediaImageRef>* images);
+  // Fetches a range of bytes of the referenced media image.
+  bool FetchMediaImageRegion(const RsMediaImageRef& ref, int start, int length,
+                             RsMediaRegion* region);
+  // Uploads the given state and returns its token, or -1 on failure.
+  int UploadState(RsSystemState& state);
+  // Downloads the state with the given token.
+  bool DownloadState(int token, RsSystemState* state);
+  bool DownloadState(int token, bool exclude_memory_region_data, RsSystemState* state);
+  // Downloads a range of memory of the state with the given token. Parts of
+  // the range not covered by any region are filled with zeros.
+  bool DownloadStateMemoryRange(int token, int start, int length, RsMemoryRegion* region);
+
+ private:
+  // Kept open across calls, like the SDK's keep-alive HTTPS connection.
+  mock::Connection connection_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RS_RETROSTORE_H_ */
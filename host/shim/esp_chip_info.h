@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#define CHIP_FEATURE_EMB_FLASH (1 << 0)
+#define CHIP_FEATURE_WIFI_BGN  (1 << 1)
+#define CHIP_FEATURE_BLE       (1 << 4)
+#define CHIP_FEATURE_BT        (1 << 5)
+
+typedef struct {
+  int model;
+  uint32_t features;
+  uint16_t revision;
+  uint8_t cores;
+} esp_chip_info_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void esp_chip_info(esp_chip_info_t* out_info);
+
+#ifdef __cplusplus
+}
+#endif
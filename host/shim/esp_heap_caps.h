@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+
+// The host heap is the virtual heap of esp_system.h. It does not fragment,
+// so its largest free block is all of it.
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+
+typedef void (*esp_alloc_failed_hook_t)(size_t size, uint32_t caps, const char* function_name);
+
+// Called when operator new fails, before it throws.
+esp_err_t heap_caps_register_failed_alloc_callback(esp_alloc_failed_hook_t callback);
+
+// Called by operator new and delete, like the heap calls them on the device
+// with CONFIG_HEAP_USE_HOOKS. The defaults do nothing.
+void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps);
+void esp_heap_trace_free_hook(void* ptr);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,334 @@
+/* Minimal Linux implementation of the ESP-IDF APIs used by the tester.
+ *
+ * Only what main/ needs is implemented. Behaviour follows the IDF
+ * documentation closely enough for the tester's purposes, not more.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <malloc.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "esp_chip_info.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_spi_flash.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#include "host_shim.h"
+
+namespace {
+
+// Roughly the free heap of an ESP32 after WiFi is up.
+#define HOST_HEAP_SIZE (300 * 1024)
+
+const auto s_start = std::chrono::steady_clock::now();
+
+std::mutex s_log_mutex;
+int s_log_errors = 0;
+
+size_t s_heap_baseline = 0;
+std::atomic<long> s_heap_excluded(0);
+uint32_t s_min_free_heap = HOST_HEAP_SIZE;
+
+struct Handler {
+  esp_event_base_t base;
+  int32_t id;
+  esp_event_handler_t handler;
+  void* arg;
+};
+
+struct Event {
+  esp_event_base_t base;
+  int32_t id;
+  std::vector<uint8_t> data;
+};
+
+std::mutex s_event_mutex;
+std::vector<Handler> s_handlers;
+std::deque<Event> s_events;
+
+bool sameBase(esp_event_base_t a, esp_event_base_t b) {
+  // Every translation unit defines its own copy of a base, so compare names.
+  return a == b || strcmp(a, b) == 0;
+}
+
+// NVS lives in flash, so its contents do not count against the heap.
+struct NvsHandle {
+  std::string ns;
+  bool writable;
+};
+
+std::mutex s_nvs_mutex;
+bool s_nvs_initialized = false;
+std::map<std::pair<std::string, std::string>, std::vector<uint8_t>> s_nvs_blobs;
+std::map<nvs_handle_t, NvsHandle> s_nvs_handles;
+nvs_handle_t s_nvs_next_handle = 1;
+
+// Rough flash footprint of an entry, for the heap accounting.
+long nvsEntryBytes(const std::string& ns, const std::string& key, size_t length) {
+  return ns.size() + key.size() + length + 64;
+}
+
+bool validNvsName(const char* name) {
+  return name != NULL && name[0] != '\0' && strlen(name) < NVS_KEY_NAME_MAX_SIZE;
+}
+
+size_t heapInUse() {
+  long in_use = (long) mallinfo2().uordblks - s_heap_excluded;
+  return in_use > 0 ? in_use : 0;
+}
+
+}  // namespace
+
+extern "C" {
+
+uint32_t esp_log_timestamp(void) {
+  auto elapsed = std::chrono::steady_clock::now() - s_start;
+  return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+}
+
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...) {
+  std::lock_guard<std::mutex> lock(s_log_mutex);
+  if (level == ESP_LOG_ERROR) s_log_errors++;
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  fflush(stdout);
+}
+
+uint32_t esp_get_free_heap_size(void) {
+  if (s_heap_baseline == 0) s_heap_baseline = heapInUse();
+  auto in_use = heapInUse();
+  auto used = in_use > s_heap_baseline ? in_use - s_heap_baseline : 0;
+  uint32_t free_heap = used > HOST_HEAP_SIZE ? 0 : HOST_HEAP_SIZE - used;
+  if (free_heap < s_min_free_heap) s_min_free_heap = free_heap;
+  return free_heap;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void) {
+  esp_get_free_heap_size();
+  return s_min_free_heap;
+}
+
+void esp_restart(void) {
+  fprintf(stderr, "esp_restart() called, exiting.\n");
+  exit(2);
+}
+
+int64_t esp_timer_get_time(void) {
+  auto elapsed = std::chrono::steady_clock::now() - s_start;
+  return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+void vTaskDelay(const TickType_t ticks_to_delay) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks_to_delay * portTICK_PERIOD_MS));
+}
+
+TickType_t xTaskGetTickCount(void) {
+  return esp_log_timestamp() / portTICK_PERIOD_MS;
+}
+
+esp_err_t esp_event_loop_create_default(void) {
+  return ESP_OK;
+}
+
+esp_err_t esp_event_handler_register(esp_event_base_t event_base,
+                                     int32_t event_id,
+                                     esp_event_handler_t event_handler,
+                                     void* event_handler_arg) {
+  std::lock_guard<std::mutex> lock(s_event_mutex);
+  s_handlers.push_back({event_base, event_id, event_handler, event_handler_arg});
+  return ESP_OK;
+}
+
+esp_err_t esp_event_handler_unregister(esp_event_base_t event_base,
+                                       int32_t event_id,
+                                       esp_event_handler_t event_handler) {
+  std::lock_guard<std::mutex> lock(s_event_mutex);
+  for (auto it = s_handlers.begin(); it != s_handlers.end(); ++it) {
+    if (sameBase(it->base, event_base) && it->id == event_id && it->handler == event_handler) {
+      s_handlers.erase(it);
+      return ESP_OK;
+    }
+  }
+  return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_event_post(esp_event_base_t event_base,
+                         int32_t event_id,
+                         const void* event_data,
+                         size_t event_data_size,
+                         TickType_t ticks_to_wait) {
+  Event event;
+  event.base = event_base;
+  event.id = event_id;
+  if (event_data != NULL) {
+    auto* bytes = static_cast<const uint8_t*>(event_data);
+    event.data.assign(bytes, bytes + event_data_size);
+  }
+  std::lock_guard<std::mutex> lock(s_event_mutex);
+  s_events.push_back(std::move(event));
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_init(void) {
+  std::lock_guard<std::mutex> lock(s_nvs_mutex);
+  s_nvs_initialized = true;
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+  std::lock_guard<std::mutex> lock(s_nvs_mutex);
+  for (const auto& entry : s_nvs_blobs) {
+    host_heap_exclude(-nvsEntryBytes(entry.first.first, entry.first.second, entry.second.size()));
+  }
+  s_nvs_blobs.clear();
+  return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t* out_handle) {
+  std::lock_guard<std::mutex> lock(s_nvs_mutex);
+  if (!s_nvs_initialized) return ESP_ERR_NVS_NOT_INITIALIZED;
+  if (!validNvsName(name)) return ESP_ERR_NVS_INVALID_NAME;
+  *out_handle = s_nvs_next_handle++;
+  s_nvs_handles[*out_handle] = {name, open_mode == NVS_READWRITE};
+  return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {
+  std::lock_guard<std::mutex> lock(s_nvs_mutex);
+  s_nvs_handles.erase(handle);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length) {
+  std::lock_guard<std::mutex> lock(s_nvs_mutex);
+  auto h = s_nvs_handles.find(handle);
+  if (h == s_nvs_handles.end()) return ESP_ERR_NVS_INVALID_HANDLE;
+  if (!validNvsName(key)) return ESP_ERR_NVS_INVALID_NAME;
+  auto it = s_nvs_blobs.find(std::make_pair(h->second.ns, std::string(key)));
+  if (it == s_nvs_blobs.end()) return ESP_ERR_NVS_NOT_FOUND;
+  if (out_value == NULL) {
+    *length = it->second.size();
+    return ESP_OK;
+  }
+  if (*length < it->second.size()) {
+    *length = it->second.size();
+    return ESP_ERR_NVS_INVALID_LENGTH;
+  }
+  *length = it->second.size();
+  memcpy(out_value, it->second.data(), it->second.size());
+  return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+  std::lock_guard<std::mutex> lock(s_nvs_mutex);
+  auto h = s_nvs_handles.find(handle);
+  if (h == s_nvs_handles.end()) return ESP_ERR_NVS_INVALID_HANDLE;
+  if (!h->second.writable) return ESP_ERR_NVS_READ_ONLY;
+  if (!validNvsName(key)) return ESP_ERR_NVS_INVALID_NAME;
+  auto& blob = s_nvs_blobs[std::make_pair(h->second.ns, std::string(key))];
+  host_heap_exclude(nvsEntryBytes(h->second.ns, key, length) -
+                    (blob.empty() ? 0 : nvsEntryBytes(h->second.ns, key, blob.size())));
+  auto* bytes = static_cast<const uint8_t*>(value);
+  blob.assign(bytes, bytes + length);
+  return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key) {
+  std::lock_guard<std::mutex> lock(s_nvs_mutex);
+  auto h = s_nvs_handles.find(handle);
+  if (h == s_nvs_handles.end()) return ESP_ERR_NVS_INVALID_HANDLE;
+  if (!h->second.writable) return ESP_ERR_NVS_READ_ONLY;
+  auto it = s_nvs_blobs.find(std::make_pair(h->second.ns, std::string(key)));
+  if (it == s_nvs_blobs.end()) return ESP_ERR_NVS_NOT_FOUND;
+  host_heap_exclude(-nvsEntryBytes(h->second.ns, key, it->second.size()));
+  s_nvs_blobs.erase(it);
+  return ESP_OK;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+  std::lock_guard<std::mutex> lock(s_nvs_mutex);
+  auto h = s_nvs_handles.find(handle);
+  if (h == s_nvs_handles.end()) return ESP_ERR_NVS_INVALID_HANDLE;
+  if (!h->second.writable) return ESP_ERR_NVS_READ_ONLY;
+  for (auto it = s_nvs_blobs.begin(); it != s_nvs_blobs.end();) {
+    if (it->first.first == h->second.ns) {
+      host_heap_exclude(-nvsEntryBytes(it->first.first, it->first.second, it->second.size()));
+      it = s_nvs_blobs.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+  std::lock_guard<std::mutex> lock(s_nvs_mutex);
+  return s_nvs_handles.count(handle) ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+size_t spi_flash_get_chip_size(void) {
+  return 4 * 1024 * 1024;
+}
+
+void esp_chip_info(esp_chip_info_t* out_info) {
+  memset(out_info, 0, sizeof(*out_info));
+  out_info->cores = std::thread::hardware_concurrency();
+}
+
+}  // extern "C"
+
+void host_event_loop_run() {
+  while (true) {
+    Event event;
+    std::vector<Handler> handlers;
+    // Read before the queue: a task posts its last event before it ends.
+    int running = host_running_tasks();
+    bool idle;
+    {
+      std::lock_guard<std::mutex> lock(s_event_mutex);
+      idle = s_events.empty();
+      if (!idle) {
+        event = std::move(s_events.front());
+        s_events.pop_front();
+        handlers = s_handlers;
+      }
+    }
+    if (idle) {
+      if (running == 0) return;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+    for (const auto& h : handlers) {
+      if (!sameBase(h.base, event.base)) continue;
+      if (h.id != ESP_EVENT_ANY_ID && h.id != event.id) continue;
+      // Hand the handler its own base pointer so that `==` checks against it
+      // behave like on the device, where the linker merges the base strings.
+      h.handler(h.arg, h.base, event.id,
+                event.data.empty() ? NULL : event.data.data());
+    }
+  }
+}
+
+void host_heap_exclude(long bytes) {
+  s_heap_excluded += bytes;
+}
+
+int host_log_error_count() {
+  std::lock_guard<std::mutex> lock(s_log_mutex);
+  return s_log_errors;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Flash is mapped in pages of this size, and erased in sectors.
+#define SPI_FLASH_MMU_PAGE_SIZE 0x10000
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef uint32_t spi_flash_mmap_handle_t;
+
+typedef enum {
+  SPI_FLASH_MMAP_DATA,
+  SPI_FLASH_MMAP_INST,
+} spi_flash_mmap_memory_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+size_t spi_flash_get_chip_size(void);
+void spi_flash_munmap(spi_flash_mmap_handle_t handle);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE  1
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+// The host runs with a 1 kHz tick so tick counts and milliseconds match.
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS ((TickType_t) 1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY      ((TickType_t) 0xffffffffUL)
+#define pdMS_TO_TICKS(ms)  ((TickType_t) (ms))
+
+// Like the ESP32: two cores.
+#define portNUM_PROCESSORS 2
+
+// Critical sections are spinlocks, like between the two cores of the ESP32.
+typedef struct {
+  std::atomic_flag locked;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {ATOMIC_FLAG_INIT}
+
+inline void vPortEnterCritical(portMUX_TYPE* mux) {
+  while (mux->locked.test_and_set(std::memory_order_acquire)) {
+  }
+}
+
+inline void vPortExitCritical(portMUX_TYPE* mux) {
+  mux->locked.clear(std::memory_order_release);
+}
+
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux)  vPortExitCritical(mux)
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+// As in FreeRTOS, semaphores are queues of zero-sized items.
+typedef QueueHandle_t SemaphoreHandle_t;
+
+#define xSemaphoreCreateBinary() xQueueCreate(1, 0)
+// Only an initial count of 0 is supported.
+#define xSemaphoreCreateCounting(max_count, initial_count) xQueueCreate((max_count), 0)
+#define vSemaphoreDelete(semaphore) vQueueDelete(semaphore)
+#define xSemaphoreGive(semaphore) xQueueSend((semaphore), NULL, 0)
+#define xSemaphoreTake(semaphore, ticks) xQueueReceive((semaphore), NULL, (ticks))
+
+// A binary semaphore that starts out given. No priority inheritance.
+inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+  SemaphoreHandle_t mutex = xQueueCreate(1, 0);
+  xQueueSend(mutex, NULL, 0);
+  return mutex;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+// Tasks run as host threads. Core affinity and priorities are accepted but
+// ignored.
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define tskIDLE_PRIORITY ((UBaseType_t) 0U)
+
+typedef struct HostTask* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void vTaskDelay(const TickType_t ticks_to_delay);
+TickType_t xTaskGetTickCount(void);
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task_code, const char* name,
+                                   const uint32_t stack_depth, void* parameters,
+                                   UBaseType_t priority, TaskHandle_t* created_task,
+                                   const BaseType_t core_id);
+BaseType_t xTaskCreate(TaskFunction_t task_code, const char* name,
+                       const uint32_t stack_depth, void* parameters,
+                       UBaseType_t priority, TaskHandle_t* created_task);
+// Only deleting the calling task (NULL) is supported. Unlike on the device it
+// returns; the task ends when its function returns right after.
+void vTaskDelete(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+
+#ifdef __cplusplus
+}
+#endif
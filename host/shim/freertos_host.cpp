@@ -0,0 +1,133 @@
+/* FreeRTOS tasks, queues and semaphores on top of std::thread.
+ *
+ * Enough for the tester's worker tasks: every task is a detached thread, and
+ * queues copy items by value like their FreeRTOS counterparts.
+ */
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "host_shim.h"
+
+struct HostTask {
+  TaskFunction_t code;
+  void* parameters;
+};
+
+struct HostQueue {
+  UBaseType_t length;
+  UBaseType_t item_size;
+  std::deque<std::vector<uint8_t>> items;
+  std::mutex mutex;
+  std::condition_variable changed;
+};
+
+namespace {
+
+std::atomic<int> s_running_tasks(0);
+thread_local HostTask* s_current_task = nullptr;
+
+// Waits for `ready` while holding `lock`, at most `ticks` ticks.
+template <typename Predicate>
+bool waitFor(HostQueue* queue, std::unique_lock<std::mutex>* lock, TickType_t ticks,
+             Predicate ready) {
+  if (ticks == portMAX_DELAY) {
+    queue->changed.wait(*lock, ready);
+    return true;
+  }
+  return queue->changed.wait_for(*lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS),
+                                 ready);
+}
+
+}  // namespace
+
+extern "C" {
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task_code, const char* name,
+                                   const uint32_t stack_depth, void* parameters,
+                                   UBaseType_t priority, TaskHandle_t* created_task,
+                                   const BaseType_t core_id) {
+  auto* task = new HostTask{task_code, parameters};
+  if (created_task != NULL) *created_task = task;
+  s_running_tasks++;
+  std::thread([task]() {
+    s_current_task = task;
+    task->code(task->parameters);
+    delete task;
+    s_running_tasks--;
+  }).detach();
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task_code, const char* name,
+                       const uint32_t stack_depth, void* parameters,
+                       UBaseType_t priority, TaskHandle_t* created_task) {
+  return xTaskCreatePinnedToCore(task_code, name, stack_depth, parameters, priority,
+                                 created_task, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  if (task != NULL && task != s_current_task) {
+    fprintf(stderr, "vTaskDelete() of another task is not supported on the host.\n");
+    abort();
+  }
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+  return s_current_task;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  auto* queue = new HostQueue();
+  queue->length = length;
+  queue->item_size = item_size;
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+  delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks_to_wait) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!waitFor(queue, &lock, ticks_to_wait,
+               [queue]() { return queue->items.size() < queue->length; })) {
+    return pdFAIL;
+  }
+  auto* bytes = static_cast<const uint8_t*>(item);
+  queue->items.emplace_back(bytes, bytes + (item != NULL ? queue->item_size : 0));
+  queue->changed.notify_all();
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* buffer, TickType_t ticks_to_wait) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!waitFor(queue, &lock, ticks_to_wait, [queue]() { return !queue->items.empty(); })) {
+    return pdFAIL;
+  }
+  auto& item = queue->items.front();
+  if (buffer != NULL && !item.empty()) memcpy(buffer, item.data(), item.size());
+  queue->items.pop_front();
+  queue->changed.notify_all();
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(const QueueHandle_t queue) {
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return queue->items.size();
+}
+
+}  // extern "C"
+
+int host_running_tasks() {
+  return s_running_tasks;
+}
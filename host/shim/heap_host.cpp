@@ -0,0 +1,102 @@
+/* Heap hooks for the host.
+ *
+ * The device heap calls esp_heap_trace_alloc_hook() and
+ * esp_heap_trace_free_hook() on every allocation. Here the global operator
+ * new and delete do, which covers everything main/ allocates except through
+ * malloc().
+ */
+#include <cstdlib>
+#include <new>
+
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+
+#include "host_shim.h"
+
+namespace {
+
+esp_alloc_failed_hook_t s_failed_alloc_callback = nullptr;
+
+// Open HostServerHeap scopes on this thread.
+thread_local int t_server_depth = 0;
+
+void* allocate(size_t size) {
+  void* ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    if (s_failed_alloc_callback != nullptr) {
+      s_failed_alloc_callback(size, MALLOC_CAP_DEFAULT, __func__);
+    }
+    return nullptr;
+  }
+  if (t_server_depth == 0) esp_heap_trace_alloc_hook(ptr, size, MALLOC_CAP_DEFAULT);
+  return ptr;
+}
+
+void release(void* ptr) {
+  if (ptr == nullptr) return;
+  esp_heap_trace_free_hook(ptr);
+  free(ptr);
+}
+
+}  // namespace
+
+extern "C" __attribute__((weak)) void esp_heap_trace_alloc_hook(void* ptr, size_t size,
+                                                                uint32_t caps) {}
+
+extern "C" __attribute__((weak)) void esp_heap_trace_free_hook(void* ptr) {}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+  return esp_get_free_heap_size();
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+  return esp_get_free_heap_size();
+}
+
+esp_err_t heap_caps_register_failed_alloc_callback(esp_alloc_failed_hook_t callback) {
+  if (callback == nullptr) return ESP_ERR_INVALID_ARG;
+  s_failed_alloc_callback = callback;
+  return ESP_OK;
+}
+
+HostServerHeap::HostServerHeap() {
+  t_server_depth++;
+}
+
+HostServerHeap::~HostServerHeap() {
+  t_server_depth--;
+}
+
+void* operator new(size_t size) {
+  void* ptr = allocate(size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  release(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  release(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  release(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  release(ptr);
+}
@@ -0,0 +1,37 @@
+/* Host-only hooks into the ESP-IDF shim.
+ *
+ * Nothing in main/ includes this; it is used by host_main.cpp to drive the
+ * shimmed runtime.
+ */
+#pragma once
+
+#ifndef _RETROSTORE_HOST_SHIM_H_
+#define _RETROSTORE_HOST_SHIM_H_
+
+// Dispatches all queued events to their handlers, including events posted
+// by handlers or tasks while running. Returns once the queue is empty and all
+// tasks have ended.
+void host_event_loop_run();
+
+// Number of tasks created with xTaskCreate*() that have not ended yet.
+int host_running_tasks();
+
+// Tells the heap accounting that `bytes` more (or, if negative, fewer) bytes
+// of the process heap belong to the simulated server rather than the device.
+void host_heap_exclude(long bytes);
+
+// While one is alive, the allocations of the calling thread belong to the
+// simulated server: they are not passed to the heap hooks, so the heap
+// profiler does not charge them to the device call that led to them.
+class HostServerHeap {
+ public:
+  HostServerHeap();
+  ~HostServerHeap();
+  HostServerHeap(const HostServerHeap&) = delete;
+  HostServerHeap& operator=(const HostServerHeap&) = delete;
+};
+
+// Number of ESP_LOGE lines written so far. Used as the process exit status.
+int host_log_error_count();
+
+#endif /* _RETROSTORE_HOST_SHIM_H_ */
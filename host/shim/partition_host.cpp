@@ -0,0 +1,218 @@
+/* Flash partitions backed by files.
+ *
+ * The partition table is read from the project's partitions.csv, so the host
+ * sees the same partitions as the device. Each data partition is a file,
+ * erased to 0xFF when created, and esp_partition_mmap() maps it read-only
+ * with mmap(). The files are temporary unless RS_HOST_FLASH_DIR names a
+ * directory to keep them in, which makes flash contents survive restarts.
+ */
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+
+#ifndef HOST_PARTITIONS_CSV
+#define HOST_PARTITIONS_CSV "partitions.csv"
+#endif
+
+namespace {
+
+struct HostPartition {
+  esp_partition_t partition;
+  int fd;
+  // Writable mapping of the whole file, for read, write and erase.
+  uint8_t* data;
+};
+
+struct Mapping {
+  void* address;
+  size_t length;
+};
+
+std::mutex s_flash_mutex;
+bool s_loaded = false;
+std::vector<std::unique_ptr<HostPartition>> s_partitions;
+std::map<spi_flash_mmap_handle_t, Mapping> s_mappings;
+spi_flash_mmap_handle_t s_next_handle = 1;
+
+std::string trim(const std::string& s) {
+  size_t begin = s.find_first_not_of(" \t\r\n");
+  if (begin == std::string::npos) return "";
+  return s.substr(begin, s.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+// Parses "0x1000", "4096", "24K" or "2M".
+uint32_t parseSize(const std::string& s) {
+  char* end = nullptr;
+  unsigned long value = strtoul(s.c_str(), &end, 0);
+  if (*end == 'K' || *end == 'k') value *= 1024;
+  if (*end == 'M' || *end == 'm') value *= 1024 * 1024;
+  return value;
+}
+
+bool openBacking(HostPartition* p) {
+  const char* dir = getenv("RS_HOST_FLASH_DIR");
+  bool existed = false;
+  if (dir != nullptr && dir[0] != '\0') {
+    std::string path = std::string(dir) + "/" + p->partition.label + ".bin";
+    existed = access(path.c_str(), F_OK) == 0;
+    p->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  } else {
+    char path[] = "/tmp/rs_flash_XXXXXX";
+    p->fd = mkstemp(path);
+    if (p->fd >= 0) unlink(path);
+  }
+  if (p->fd < 0 || ftruncate(p->fd, p->partition.size) != 0) return false;
+  void* data = mmap(nullptr, p->partition.size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+  if (data == MAP_FAILED) return false;
+  p->data = static_cast<uint8_t*>(data);
+  if (!existed) memset(p->data, 0xff, p->partition.size);
+  return true;
+}
+
+void loadPartitions() {
+  if (s_loaded) return;
+  s_loaded = true;
+  FILE* f = fopen(HOST_PARTITIONS_CSV, "r");
+  if (f == nullptr) {
+    fprintf(stderr, "Cannot read partition table %s\n", HOST_PARTITIONS_CSV);
+    return;
+  }
+  char line[256];
+  uint32_t next_offset = 0x9000;
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    std::string s = trim(line);
+    if (s.empty() || s[0] == '#') continue;
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true) {
+      size_t comma = s.find(',', start);
+      fields.push_back(trim(s.substr(start, comma - start)));
+      if (comma == std::string::npos) break;
+      start = comma + 1;
+    }
+    if (fields.size() < 5) continue;
+
+    std::unique_ptr<HostPartition> p(new HostPartition());
+    p->fd = -1;
+    p->data = nullptr;
+    strncpy(p->partition.label, fields[0].c_str(), sizeof(p->partition.label) - 1);
+    p->partition.type = fields[1] == "app" ? ESP_PARTITION_TYPE_APP : ESP_PARTITION_TYPE_DATA;
+    // Named subtypes are not needed on the host.
+    p->partition.subtype = (esp_partition_subtype_t) (isdigit(fields[2][0]) ? parseSize(fields[2]) : 0);
+    p->partition.address = fields[3].empty() ? next_offset : parseSize(fields[3]);
+    p->partition.size = parseSize(fields[4]);
+    p->partition.encrypted = false;
+    next_offset = p->partition.address + p->partition.size;
+    // Apps are not flashed on the host, so only data partitions get a file.
+    if (p->partition.type == ESP_PARTITION_TYPE_DATA && !openBacking(p.get())) {
+      fprintf(stderr, "Cannot create backing file for partition %s\n", p->partition.label);
+      continue;
+    }
+    s_partitions.push_back(std::move(p));
+  }
+  fclose(f);
+}
+
+HostPartition* find(const esp_partition_t* partition) {
+  for (auto& p : s_partitions) {
+    if (&p->partition == partition) return p.get();
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+extern "C" {
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type,
+                                                esp_partition_subtype_t subtype,
+                                                const char* label) {
+  std::lock_guard<std::mutex> lock(s_flash_mutex);
+  loadPartitions();
+  for (auto& p : s_partitions) {
+    if (p->partition.type != type) continue;
+    if (subtype != ESP_PARTITION_SUBTYPE_ANY && p->partition.subtype != subtype) continue;
+    if (label != NULL && strcmp(label, p->partition.label) != 0) continue;
+    return &p->partition;
+  }
+  return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset,
+                             void* dst, size_t size) {
+  std::lock_guard<std::mutex> lock(s_flash_mutex);
+  auto* p = find(partition);
+  if (p == nullptr || p->data == nullptr) return ESP_ERR_INVALID_ARG;
+  if (src_offset > partition->size || size > partition->size - src_offset) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(dst, p->data + src_offset, size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset,
+                              const void* src, size_t size) {
+  std::lock_guard<std::mutex> lock(s_flash_mutex);
+  auto* p = find(partition);
+  if (p == nullptr || p->data == nullptr) return ESP_ERR_INVALID_ARG;
+  if (dst_offset > partition->size || size > partition->size - dst_offset) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  auto* bytes = static_cast<const uint8_t*>(src);
+  for (size_t i = 0; i < size; ++i) p->data[dst_offset + i] &= bytes[i];
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset,
+                                    size_t size) {
+  std::lock_guard<std::mutex> lock(s_flash_mutex);
+  auto* p = find(partition);
+  if (p == nullptr || p->data == nullptr) return ESP_ERR_INVALID_ARG;
+  if (offset % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (offset > partition->size || size > partition->size - offset) return ESP_ERR_INVALID_SIZE;
+  memset(p->data + offset, 0xff, size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t* partition, size_t offset, size_t size,
+                             spi_flash_mmap_memory_t memory, const void** out_ptr,
+                             spi_flash_mmap_handle_t* out_handle) {
+  std::lock_guard<std::mutex> lock(s_flash_mutex);
+  auto* p = find(partition);
+  if (p == nullptr || p->data == nullptr) return ESP_ERR_INVALID_ARG;
+  if (offset > partition->size || size > partition->size - offset) return ESP_ERR_INVALID_SIZE;
+  // Read-only, like the flash cache, so stray writes fault here too.
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t aligned = offset - offset % page;
+  size_t length = size + (offset - aligned);
+  void* address = mmap(nullptr, length, PROT_READ, MAP_SHARED, p->fd, aligned);
+  if (address == MAP_FAILED) return ESP_ERR_NO_MEM;
+  *out_handle = s_next_handle++;
+  s_mappings[*out_handle] = {address, length};
+  *out_ptr = static_cast<uint8_t*>(address) + (offset - aligned);
+  return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle) {
+  std::lock_guard<std::mutex> lock(s_flash_mutex);
+  auto it = s_mappings.find(handle);
+  if (it == s_mappings.end()) return;
+  munmap(it->second.address, it->second.length);
+  s_mappings.erase(it);
+}
+
+}  // extern "C"
@@ -0,0 +1,52 @@
+/* Host stand-in for the sdkconfig.h generated by the ESP-IDF build.
+ *
+ * Mirrors the defaults from main/Kconfig.projbuild so the tester compiles
+ * unchanged on Linux. Options that the host CMakeLists.txt can set are only
+ * defaulted here.
+ */
+#pragma once
+
+#define CONFIG_IDF_TARGET "linux"
+#define CONFIG_IDF_TARGET_LINUX 1
+
+#define CONFIG_RS_TEST_WIFI_SSID ""
+#define CONFIG_RS_TEST_WIFI_PASSWORD ""
+#define CONFIG_RS_WIFI_FAST_CONNECT 1
+
+#ifndef CONFIG_RS_TEST_ITERATIONS
+#define CONFIG_RS_TEST_ITERATIONS 1
+#endif
+
+#ifdef CONFIG_RS_BENCHMARK
+#ifndef CONFIG_RS_BENCHMARK_ITERATIONS
+#define CONFIG_RS_BENCHMARK_ITERATIONS 20
+#endif
+#if !defined(CONFIG_RS_BENCHMARK_FORMAT_CSV) && !defined(CONFIG_RS_BENCHMARK_FORMAT_JSON)
+#define CONFIG_RS_BENCHMARK_FORMAT_CSV 1
+#endif
+#endif
+
+#ifdef CONFIG_RS_HEAP_PROFILER
+#ifndef CONFIG_RS_HEAP_PROFILER_BLOCKS
+#define CONFIG_RS_HEAP_PROFILER_BLOCKS 512
+#endif
+#endif
+
+#ifdef CONFIG_RS_SOAK
+#ifndef CONFIG_RS_SOAK_TASKS
+#define CONFIG_RS_SOAK_TASKS 4
+#endif
+#ifndef CONFIG_RS_SOAK_SECONDS
+#define CONFIG_RS_SOAK_SECONDS 3600
+#endif
+#ifndef CONFIG_RS_SOAK_REPORT_SECONDS
+#define CONFIG_RS_SOAK_REPORT_SECONDS 60
+#endif
+#ifndef CONFIG_RS_SOAK_MAX_HEAP_DRIFT
+#define CONFIG_RS_SOAK_MAX_HEAP_DRIFT 4096
+#endif
+#ifndef CONFIG_RS_SOAK_MIX
+#define CONFIG_RS_SOAK_MIX \
+  "upload=1,download=2,range=2,app=2,apps=1,nano=3,query=2,refs=2,images=1,image_range=2"
+#endif
+#endif
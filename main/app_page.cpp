@@ -0,0 +1,145 @@
+#include "app_page.h"
+
+#include <cstring>
+
+#include "esp_log.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-app-page";
+
+const std::string& descriptionOf(const RsApp& app) { return app.description; }
+const std::string& descriptionOf(const RsAppNano& app) {
+  static const std::string empty;
+  return empty;
+}
+
+const std::vector<std::string>& screenshotsOf(const RsApp& app) { return app.screenshot_urls; }
+const std::vector<std::string>& screenshotsOf(const RsAppNano& app) {
+  static const std::vector<std::string> none;
+  return none;
+}
+
+// Hands out consecutive pieces of the arena while a page is packed.
+class Packer {
+ public:
+  Packer(uint8_t* arena, size_t num_views, size_t num_refs)
+      : views_(reinterpret_cast<RsAppView*>(arena)),
+        refs_(reinterpret_cast<RsStringRef*>(views_ + num_views)),
+        chars_(reinterpret_cast<char*>(refs_ + num_refs)) {}
+
+  RsAppView* nextView() { return views_++; }
+  RsStringRef* nextRef() { return refs_++; }
+  RsStringRef copy(const std::string& s) {
+    RsStringRef ref = {chars_, (int) s.size()};
+    memcpy(chars_, s.c_str(), s.size() + 1);
+    chars_ += s.size() + 1;
+    return ref;
+  }
+  uint8_t* end() const { return reinterpret_cast<uint8_t*>(chars_); }
+
+ private:
+  RsAppView* views_;
+  RsStringRef* refs_;
+  char* chars_;
+};
+
+}  // namespace
+
+bool RsStringRef::operator==(const char* other) const {
+  return strlen(other) == (size_t) length && memcmp(data, other, length) == 0;
+}
+
+RsAppPage::RsAppPage() : capacity_(0), used_(0), size_(0) {}
+
+bool RsAppPage::Fetch(RetroStore* rs, int start, int num) {
+  std::vector<RsApp> apps;
+  if (!rs->FetchApps(start, num, &apps)) return false;
+  Assign(apps);
+  return true;
+}
+
+bool RsAppPage::Fetch(RetroStore* rs, int start, int num, const std::string& query) {
+  std::vector<RsApp> apps;
+  if (!rs->FetchApps(start, num, query, &apps)) return false;
+  Assign(apps);
+  return true;
+}
+
+bool RsAppPage::FetchNano(RetroStore* rs, int start, int num) {
+  std::vector<RsAppNano> apps;
+  if (!rs->FetchAppsNano(start, num, &apps)) return false;
+  Assign(apps);
+  return true;
+}
+
+bool RsAppPage::FetchNano(RetroStore* rs, int start, int num, const std::string& query,
+                          const std::vector<RsMediaType>& hasTypes) {
+  std::vector<RsAppNano> apps;
+  if (!rs->FetchAppsNano(start, num, query, hasTypes, &apps)) return false;
+  Assign(apps);
+  return true;
+}
+
+void RsAppPage::reserve(size_t size) {
+  if (size <= capacity_) return;
+  arena_.reset(new uint8_t[size]);
+  capacity_ = size;
+}
+
+template <typename App>
+void RsAppPage::pack(const std::vector<App>& apps) {
+  size_t num_refs = 0;
+  size_t num_chars = 0;
+  for (const auto& app : apps) {
+    num_chars += app.id.size() + app.name.size() + app.version.size() +
+                 descriptionOf(app).size() + app.author.size() + 5;
+    for (const auto& url : screenshotsOf(app)) num_chars += url.size() + 1;
+    num_refs += screenshotsOf(app).size();
+  }
+  size_t needed = apps.size() * sizeof(RsAppView) + num_refs * sizeof(RsStringRef) + num_chars;
+  reserve(needed);
+
+  Packer packer(arena_.get(), apps.size(), num_refs);
+  for (const auto& app : apps) {
+    auto* view = packer.nextView();
+    view->id = packer.copy(app.id);
+    view->name = packer.copy(app.name);
+    view->version = packer.copy(app.version);
+    view->description = packer.copy(descriptionOf(app));
+    view->release_year = app.release_year;
+    view->num_screenshot_urls = screenshotsOf(app).size();
+    view->screenshot_urls = nullptr;
+    for (const auto& url : screenshotsOf(app)) {
+      auto* ref = packer.nextRef();
+      if (view->screenshot_urls == nullptr) view->screenshot_urls = ref;
+      *ref = packer.copy(url);
+    }
+    view->author = packer.copy(app.author);
+    view->model = app.model;
+  }
+  used_ = packer.end() - arena_.get();
+  size_ = apps.size();
+  if (used_ != needed) {
+    ESP_LOGE(TAG, "Packed %d bytes, expected %d.", (int) used_, (int) needed);
+  }
+}
+
+void RsAppPage::Assign(const std::vector<RsApp>& apps) {
+  pack(apps);
+}
+
+void RsAppPage::Assign(const std::vector<RsAppNano>& apps) {
+  pack(apps);
+}
+
+void RsAppPage::Clear() {
+  arena_.reset();
+  capacity_ = 0;
+  used_ = 0;
+  size_ = 0;
+}
+
+}  // namespace retrostore
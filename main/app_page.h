@@ -0,0 +1,93 @@
+#pragma once
+
+#ifndef _RETROSTORE_APP_PAGE_H_
+#define _RETROSTORE_APP_PAGE_H_
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "retrostore.h"
+
+namespace retrostore {
+
+// A null-terminated string stored in an RsAppPage's arena.
+struct RsStringRef {
+  const char* data;
+  int length;
+
+  const char* c_str() const { return data; }
+  bool operator==(const char* other) const;
+  bool operator!=(const char* other) const { return !(*this == other); }
+};
+
+// An app stored in an RsAppPage's arena. Apps fetched in nano form have an
+// empty description and no screenshot URLs.
+struct RsAppView {
+  RsStringRef id;
+  RsStringRef name;
+  RsStringRef version;
+  RsStringRef description;
+  int release_year;
+  const RsStringRef* screenshot_urls;
+  int num_screenshot_urls;
+  RsStringRef author;
+  RsTrs80Model model;
+};
+
+// A page of apps packed into one contiguous allocation: the RsAppView
+// entries, the screenshot URL references and all strings live in a single
+// arena, so holding a page costs one heap block and releasing it one free.
+// Fetching into the same page again reuses the arena when it is large
+// enough, so browsing page after page does not fragment the heap.
+//
+// The views are valid until the page is refilled, cleared or destroyed.
+class RsAppPage {
+ public:
+  RsAppPage();
+
+  // Fetches a page of apps, like RetroStore::FetchApps.
+  bool Fetch(RetroStore* rs, int start, int num);
+  bool Fetch(RetroStore* rs, int start, int num, const std::string& query);
+  // Fetches a page of apps with only the minimal set of fields, like
+  // RetroStore::FetchAppsNano.
+  bool FetchNano(RetroStore* rs, int start, int num);
+  bool FetchNano(RetroStore* rs, int start, int num, const std::string& query,
+                 const std::vector<RsMediaType>& hasTypes);
+
+  // Packs the given apps into the page, replacing its contents.
+  void Assign(const std::vector<RsApp>& apps);
+  void Assign(const std::vector<RsAppNano>& apps);
+
+  // Empties the page and frees the arena.
+  void Clear();
+
+  int size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const RsAppView& operator[](int i) const { return views()[i]; }
+  const RsAppView* begin() const { return views(); }
+  const RsAppView* end() const { return views() + size_; }
+
+  // Bytes used by the current page, and bytes allocated for the arena.
+  size_t arena_used() const { return used_; }
+  size_t arena_capacity() const { return capacity_; }
+
+ private:
+  const RsAppView* views() const { return reinterpret_cast<const RsAppView*>(arena_.get()); }
+  // Makes sure the arena holds at least `size` bytes, keeping it if it does.
+  void reserve(size_t size);
+  // Replaces the contents of the page with the given apps.
+  template <typename App>
+  void pack(const std::vector<App>& apps);
+
+  std::unique_ptr<uint8_t[]> arena_;
+  size_t capacity_;
+  size_t used_;
+  int size_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_APP_PAGE_H_ */
@@ -0,0 +1,176 @@
+#include "async_retrostore.h"
+
+#include <memory>
+
+#include "esp_log.h"
+
+#include "heap_profiler.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-async";
+
+// Runs `call`, charging its allocations to `site`.
+template <typename Call>
+auto profiled(const char* site, Call call) -> decltype(call()) {
+  HeapScope scope(site);
+  return call();
+}
+
+}  // namespace
+
+AsyncRetroStore::AsyncRetroStore(int queue_length, BaseType_t core, int workers)
+    : queue_length_(queue_length),
+      queue_(xQueueCreate(queue_length, sizeof(Job*))),
+      stopped_(xSemaphoreCreateCounting(workers, 0)) {
+  for (int i = 0; i < workers; ++i) {
+    std::unique_ptr<Worker> worker(new Worker());
+    worker->owner = this;
+    worker->task = nullptr;
+    if (xTaskCreatePinnedToCore(&AsyncRetroStore::run, "rs_async", ASYNC_RS_STACK_SIZE,
+                                worker.get(), ASYNC_RS_PRIORITY, &worker->task, core) != pdPASS) {
+      ESP_LOGE(TAG, "Creating worker task %d failed.", i);
+      continue;
+    }
+    workers_.push_back(std::move(worker));
+  }
+}
+
+AsyncRetroStore::~AsyncRetroStore() {
+  // One stop marker per worker; each worker takes exactly one.
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    Job* stop = nullptr;
+    xQueueSend(queue_, &stop, portMAX_DELAY);
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    xSemaphoreTake(stopped_, portMAX_DELAY);
+  }
+  vSemaphoreDelete(stopped_);
+  vQueueDelete(queue_);
+}
+
+bool AsyncRetroStore::Submit(Job job, TickType_t ticks_to_wait) {
+  auto* copy = new Job(std::move(job));
+  if (xQueueSend(queue_, &copy, ticks_to_wait) != pdPASS) {
+    ESP_LOGW(TAG, "Request queue full, %d waiting.", queued());
+    delete copy;
+    return false;
+  }
+  return true;
+}
+
+void AsyncRetroStore::run(void* arg) {
+  auto* worker = static_cast<Worker*>(arg);
+  auto* owner = worker->owner;
+  while (true) {
+    Job* job = nullptr;
+    xQueueReceive(owner->queue_, &job, portMAX_DELAY);
+    if (job == nullptr) break;
+    (*job)(&worker->rs);
+    delete job;
+  }
+  xSemaphoreGive(owner->stopped_);
+  vTaskDelete(NULL);
+}
+
+bool AsyncRetroStore::FetchApp(const std::string& appId,
+                               std::function<void(bool success, RsApp& app)> done) {
+  return Submit([appId, done](RetroStore* rs) {
+    RsApp app;
+    bool success = profiled("FetchApp", [&] { return rs->FetchApp(appId, &app); });
+    done(success, app);
+  });
+}
+
+bool AsyncRetroStore::FetchApps(int start, int num, const std::string& query,
+                                std::function<void(bool success, std::vector<RsApp>& apps)> done) {
+  return Submit([start, num, query, done](RetroStore* rs) {
+    std::vector<RsApp> apps;
+    bool success = profiled("FetchApps", [&] { return rs->FetchApps(start, num, query, &apps); });
+    done(success, apps);
+  });
+}
+
+bool AsyncRetroStore::FetchAppsNano(int start, int num, const std::string& query,
+                                    const std::vector<RsMediaType>& hasTypes,
+                                    std::function<void(bool success, std::vector<RsAppNano>& apps)> done) {
+  return Submit([start, num, query, hasTypes, done](RetroStore* rs) {
+    std::vector<RsAppNano> apps;
+    bool success = profiled("FetchAppsNano", [&] {
+      return rs->FetchAppsNano(start, num, query, hasTypes, &apps);
+    });
+    done(success, apps);
+  });
+}
+
+bool AsyncRetroStore::FetchMediaImages(const std::string& appId,
+                                       const std::vector<RsMediaType>& types,
+                                       std::function<void(bool success, std::vector<RsMediaImage>& images)> done) {
+  return Submit([appId, types, done](RetroStore* rs) {
+    std::vector<RsMediaImage> images;
+    bool success = profiled("FetchMediaImages", [&] {
+      return rs->FetchMediaImages(appId, types, &images);
+    });
+    done(success, images);
+  });
+}
+
+bool AsyncRetroStore::FetchMediaImageRefs(const std::string& appId,
+                                          const std::vector<RsMediaType>& types,
+                                          std::function<void(bool success, std::vector<RsMediaImageRef>& refs)> done) {
+  return Submit([appId, types, done](RetroStore* rs) {
+    std::vector<RsMediaImageRef> refs;
+    bool success = profiled("FetchMediaImageRefs", [&] {
+      return rs->FetchMediaImageRefs(appId, types, &refs);
+    });
+    done(success, refs);
+  });
+}
+
+bool AsyncRetroStore::FetchMediaImageRegion(const RsMediaImageRef& ref, int start, int length,
+                                            std::function<void(bool success, RsMediaRegion& region)> done) {
+  return Submit([ref, start, length, done](RetroStore* rs) {
+    RsMediaRegion region;
+    bool success = profiled("FetchMediaImageRegion", [&] {
+      return rs->FetchMediaImageRegion(ref, start, length, &region);
+    });
+    done(success, region);
+  });
+}
+
+bool AsyncRetroStore::UploadState(RsSystemState&& state, std::function<void(int token)> done) {
+  // std::function needs a copyable job, and the state is move-only.
+  std::shared_ptr<RsSystemState> owned(new RsSystemState(std::move(state)));
+  bool queued = Submit([owned, done](RetroStore* rs) {
+    done(profiled("UploadState", [&] { return rs->UploadState(*owned); }));
+  });
+  // The refused job is gone, so the state is only ours again.
+  if (!queued) state = std::move(*owned);
+  return queued;
+}
+
+bool AsyncRetroStore::DownloadState(int token, bool exclude_memory_region_data,
+                                    std::function<void(bool success, RsSystemState& state)> done) {
+  return Submit([token, exclude_memory_region_data, done](RetroStore* rs) {
+    RsSystemState state;
+    bool success = profiled("DownloadState", [&] {
+      return rs->DownloadState(token, exclude_memory_region_data, &state);
+    });
+    done(success, state);
+  });
+}
+
+bool AsyncRetroStore::DownloadStateMemoryRange(int token, int start, int length,
+                                               std::function<void(bool success, RsMemoryRegion& region)> done) {
+  return Submit([token, start, length, done](RetroStore* rs) {
+    RsMemoryRegion region;
+    bool success = profiled("DownloadStateMemoryRange", [&] {
+      return rs->DownloadStateMemoryRange(token, start, length, &region);
+    });
+    done(success, region);
+  });
+}
+
+}  // namespace retrostore
@@ -0,0 +1,100 @@
+#pragma once
+
+#ifndef _RETROSTORE_ASYNC_RETROSTORE_H_
+#define _RETROSTORE_ASYNC_RETROSTORE_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "retrostore.h"
+
+namespace retrostore {
+
+// Requests that can wait for the worker before new ones are refused.
+#define ASYNC_RS_QUEUE_LENGTH 8
+// Enough for a TLS handshake inside the SDK.
+#define ASYNC_RS_STACK_SIZE 16000
+#define ASYNC_RS_PRIORITY 5
+// The second core where there is one, away from the UI/emulator loop.
+#define ASYNC_RS_CORE (portNUM_PROCESSORS - 1)
+#define ASYNC_RS_WORKERS 1
+
+// Non-blocking front end for RetroStore.
+//
+// Requests are queued to worker tasks that each own a RetroStore (and so a
+// keep-alive connection) and run one request at a time. With one worker,
+// requests run in order; with several, the workers form a small connection
+// pool and as many requests are in flight at once. Queueing never blocks by
+// default: when the bounded queue is full the call returns false right away
+// and the caller can retry later. Completion callbacks run on a worker task;
+// callers that need the result on their own task should hand it over, e.g.
+// with a queue or an event.
+class AsyncRetroStore {
+ public:
+  typedef std::function<void(RetroStore* rs)> Job;
+
+  AsyncRetroStore(int queue_length = ASYNC_RS_QUEUE_LENGTH,
+                  BaseType_t core = ASYNC_RS_CORE,
+                  int workers = ASYNC_RS_WORKERS);
+  // Runs the requests still queued, then stops the workers. Blocks until
+  // they have.
+  ~AsyncRetroStore();
+
+  // Queues `job` to run on a worker. Returns false if the queue is still full
+  // after `ticks_to_wait`.
+  bool Submit(Job job, TickType_t ticks_to_wait = 0);
+
+  bool FetchApp(const std::string& appId,
+                std::function<void(bool success, RsApp& app)> done);
+  bool FetchApps(int start, int num, const std::string& query,
+                 std::function<void(bool success, std::vector<RsApp>& apps)> done);
+  bool FetchAppsNano(int start, int num, const std::string& query,
+                     const std::vector<RsMediaType>& hasTypes,
+                     std::function<void(bool success, std::vector<RsAppNano>& apps)> done);
+  bool FetchMediaImages(const std::string& appId, const std::vector<RsMediaType>& types,
+                        std::function<void(bool success, std::vector<RsMediaImage>& images)> done);
+  bool FetchMediaImageRefs(const std::string& appId, const std::vector<RsMediaType>& types,
+                           std::function<void(bool success, std::vector<RsMediaImageRef>& refs)> done);
+  bool FetchMediaImageRegion(const RsMediaImageRef& ref, int start, int length,
+                             std::function<void(bool success, RsMediaRegion& region)> done);
+  // Takes over `state`; it is released once the upload has completed. If
+  // the queue is full, `state` is left with the caller for a retry.
+  bool UploadState(RsSystemState&& state, std::function<void(int token)> done);
+  bool DownloadState(int token, bool exclude_memory_region_data,
+                     std::function<void(bool success, RsSystemState& state)> done);
+  bool DownloadStateMemoryRange(int token, int start, int length,
+                                std::function<void(bool success, RsMemoryRegion& region)> done);
+
+  // Requests waiting for a worker, not counting those running.
+  int queued() const { return uxQueueMessagesWaiting(queue_); }
+  int queue_length() const { return queue_length_; }
+  int workers() const { return workers_.size(); }
+  // The i-th worker task, e.g. to tell whether a callback runs on it.
+  TaskHandle_t worker(int i = 0) const { return workers_[i]->task; }
+
+ private:
+  struct Worker {
+    AsyncRetroStore* owner;
+    RetroStore rs;
+    TaskHandle_t task;
+  };
+
+  static void run(void* arg);
+
+  const int queue_length_;
+  QueueHandle_t queue_;
+  // Given once by every worker that has stopped.
+  SemaphoreHandle_t stopped_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_ASYNC_RETROSTORE_H_ */
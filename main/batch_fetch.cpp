@@ -0,0 +1,103 @@
+#include "batch_fetch.h"
+
+#include <algorithm>
+#include <memory>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+namespace retrostore {
+
+namespace {
+
+// Runs `fetch` for every index in [0, count) on the workers of `async` and
+// passes each result to `each` on the calling task as it completes. Two
+// requests per worker are kept queued or running, so a worker that finishes
+// picks up the next one without waiting for the caller. If `size` is given,
+// items are also held back while their sizes in flight would add up to more
+// than `max_bytes`, though one item is always let through.
+template <typename Result>
+bool runBatch(AsyncRetroStore* async, int count,
+              std::function<bool(RetroStore* rs, int index, Result* result)> fetch,
+              std::function<void(int index, bool success, Result& result)> each,
+              std::function<int(int index)> size = nullptr, int max_bytes = 0) {
+  if (count == 0) return true;
+  std::vector<Result> results(count);
+  std::unique_ptr<bool[]> succeeded(new bool[count]);
+  // Indices of completed items; never full, so workers do not wait on it.
+  auto completed = xQueueCreate(count, sizeof(int));
+
+  int max_in_flight = 2 * std::max(1, async->workers());
+  int next = 0;
+  int in_flight = 0;
+  int bytes_in_flight = 0;
+  int done = 0;
+  bool all = true;
+  while (done < count) {
+    if (next < count && in_flight < max_in_flight &&
+        (!size || in_flight == 0 || bytes_in_flight + size(next) <= max_bytes)) {
+      int index = next++;
+      in_flight++;
+      if (size) bytes_in_flight += size(index);
+      async->Submit([&, index](RetroStore* rs) {
+        succeeded[index] = fetch(rs, index, &results[index]);
+        xQueueSend(completed, &index, portMAX_DELAY);
+      }, portMAX_DELAY);
+      continue;
+    }
+    int index;
+    xQueueReceive(completed, &index, portMAX_DELAY);
+    in_flight--;
+    done++;
+    all = all && succeeded[index];
+    each(index, succeeded[index], results[index]);
+    results[index] = Result();
+    if (size) bytes_in_flight -= size(index);
+  }
+  vQueueDelete(completed);
+  return all;
+}
+
+}  // namespace
+
+bool FetchAppsBatch(AsyncRetroStore* async, const std::vector<std::string>& appIds,
+                    std::function<void(int index, bool success, RsApp& app)> each) {
+  return runBatch<RsApp>(async, appIds.size(), [&appIds](RetroStore* rs, int index, RsApp* app) {
+    return rs->FetchApp(appIds[index], app);
+  }, each);
+}
+
+bool FetchMediaImagesBatch(
+    AsyncRetroStore* async, const std::vector<std::string>& appIds,
+    const std::vector<RsMediaType>& types,
+    std::function<void(int index, bool success, std::vector<RsMediaImage>& images)> each) {
+  return runBatch<std::vector<RsMediaImage>>(
+      async, appIds.size(),
+      [&appIds, &types](RetroStore* rs, int index, std::vector<RsMediaImage>* images) {
+        return rs->FetchMediaImages(appIds[index], types, images);
+      },
+      each);
+}
+
+bool FetchMediaImageRefsBatch(
+    AsyncRetroStore* async, const std::vector<std::string>& appIds,
+    const std::vector<RsMediaType>& types,
+    std::function<void(int index, bool success, std::vector<RsMediaImageRef>& refs)> each) {
+  return runBatch<std::vector<RsMediaImageRef>>(
+      async, appIds.size(),
+      [&appIds, &types](RetroStore* rs, int index, std::vector<RsMediaImageRef>* refs) {
+        return rs->FetchMediaImageRefs(appIds[index], types, refs);
+      },
+      each);
+}
+
+bool FetchMediaImageDataBatch(
+    AsyncRetroStore* async, const std::vector<RsMediaImageRef>& refs,
+    std::function<void(int index, bool success, RsMediaRegion& data)> each,
+    int max_bytes) {
+  return runBatch<RsMediaRegion>(async, refs.size(), [&refs](RetroStore* rs, int index, RsMediaRegion* data) {
+    return rs->FetchMediaImageRegion(refs[index], 0, refs[index].data_size, data);
+  }, each, [&refs](int index) { return std::max(refs[index].data_size, 0); }, max_bytes);
+}
+
+}  // namespace retrostore
@@ -0,0 +1,58 @@
+#pragma once
+
+#ifndef _RETROSTORE_BATCH_FETCH_H_
+#define _RETROSTORE_BATCH_FETCH_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "async_retrostore.h"
+#include "retrostore.h"
+
+namespace retrostore {
+
+// A good pool size for batch fetches: enough to hide the round trip time,
+// few enough for the TLS buffers of every connection to fit in memory.
+#define BATCH_FETCH_WORKERS 4
+// Image bytes a media data batch holds at once, queued, running or waiting
+// for the caller. A larger image is fetched on its own.
+#define BATCH_FETCH_MAX_BYTES (64 * 1024)
+
+// Batch fetches keep every worker of `async` busy, so with a pool of N
+// workers a batch takes about 1/N of the round trips of fetching one item
+// after the other. Results are handed to `each` on the calling task as they
+// complete, which is not necessarily in order; `index` is the position of
+// the item in the input. Each result is released once `each` returns.
+//
+// The calls block until every item has completed and return false if any
+// failed. They must not be called from one of `async`'s workers.
+
+// Fetches the apps with the given IDs.
+bool FetchAppsBatch(AsyncRetroStore* async, const std::vector<std::string>& appIds,
+                    std::function<void(int index, bool success, RsApp& app)> each);
+
+// Fetches the media images of the given types, including their data, for
+// each app.
+bool FetchMediaImagesBatch(
+    AsyncRetroStore* async, const std::vector<std::string>& appIds,
+    const std::vector<RsMediaType>& types,
+    std::function<void(int index, bool success, std::vector<RsMediaImage>& images)> each);
+
+// Fetches references to the media images of the given types for each app.
+bool FetchMediaImageRefsBatch(
+    AsyncRetroStore* async, const std::vector<std::string>& appIds,
+    const std::vector<RsMediaType>& types,
+    std::function<void(int index, bool success, std::vector<RsMediaImageRef>& refs)> each);
+
+// Fetches the data of each referenced media image. Every image is held
+// whole, so fewer are in flight than there are workers once their sizes add
+// up to more than `max_bytes`.
+bool FetchMediaImageDataBatch(
+    AsyncRetroStore* async, const std::vector<RsMediaImageRef>& refs,
+    std::function<void(int index, bool success, RsMediaRegion& data)> each,
+    int max_bytes = BATCH_FETCH_MAX_BYTES);
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_BATCH_FETCH_H_ */
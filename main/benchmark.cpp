@@ -0,0 +1,173 @@
+#include "benchmark.h"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "heap_profiler.h"
+
+namespace retrostore {
+
+namespace {
+
+// Nearest-rank percentile over sorted values.
+int64_t percentile(const std::vector<int64_t>& sorted, int p) {
+  if (sorted.empty()) return 0;
+  size_t rank = (sorted.size() * p + 99) / 100;
+  if (rank == 0) rank = 1;
+  return sorted[rank - 1];
+}
+
+// Peak live bytes of the heap profiler site `name`, or -1 if it was not
+// measured. Site names are truncated like HeapScope truncates them.
+int32_t sitePeak(const std::string& name) {
+  if (!HeapProfiler::enabled()) return -1;
+  for (const auto& site : HeapProfiler::Sites()) {
+    if (strncmp(site.name, name.c_str(), sizeof(site.name) - 1) == 0) {
+      return site.peak_live_bytes;
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+size_t PayloadSize(const RsApp& app) {
+  size_t size = app.id.size() + app.name.size() + app.version.size() +
+                app.description.size() + app.author.size();
+  for (const auto& url : app.screenshot_urls) size += url.size();
+  return size;
+}
+
+size_t PayloadSize(const RsAppNano& app) {
+  return app.id.size() + app.name.size() + app.version.size() + app.author.size();
+}
+
+size_t PayloadSize(const RsMediaImage& image) {
+  return image.filename.size() + image.description.size() + image.data_size;
+}
+
+size_t PayloadSize(const RsMediaImageRef& ref) {
+  return ref.filename.size() + ref.description.size() + ref.token.size();
+}
+
+size_t PayloadSize(const RsSystemState& state) {
+  size_t size = sizeof(state.registers);
+  for (const auto& region : state.regions) {
+    if (region.data) size += region.length;
+  }
+  return size;
+}
+
+void Benchmark::Run(const std::string& name, int iterations, std::function<int()> op) {
+  auto it = std::find_if(ops_.begin(), ops_.end(),
+                         [&name](const std::pair<std::string, std::vector<Sample>>& e) {
+                           return e.first == name;
+                         });
+  if (it == ops_.end()) {
+    ops_.emplace_back(name, std::vector<Sample>());
+    it = ops_.end() - 1;
+  }
+  for (int i = 0; i < iterations; ++i) {
+    Sample sample;
+    sample.free_heap_before = esp_get_free_heap_size();
+    auto start = esp_timer_get_time();
+    {
+      HeapScope scope(name.c_str());
+      sample.bytes = op();
+    }
+    sample.micros = esp_timer_get_time() - start;
+    sample.free_heap_after = esp_get_free_heap_size();
+    it->second.push_back(sample);
+  }
+}
+
+void Benchmark::SetCounter(const std::string& name, int64_t value) {
+  for (auto& counter : counters_) {
+    if (counter.first == name) {
+      counter.second = value;
+      return;
+    }
+  }
+  counters_.emplace_back(name, value);
+}
+
+Benchmark::Summary Benchmark::summarize(const std::string& name,
+                                        const std::vector<Sample>& samples) const {
+  Summary summary = {};
+  summary.peak_heap = sitePeak(name);
+  summary.min_free_heap_after = UINT32_MAX;
+  summary.max_heap_retained = INT32_MIN;
+  std::vector<int64_t> micros;
+  int64_t total_micros = 0;
+  for (const auto& sample : samples) {
+    summary.count++;
+    if (sample.bytes < 0) {
+      summary.errors++;
+    } else {
+      summary.total_bytes += sample.bytes;
+    }
+    micros.push_back(sample.micros);
+    total_micros += sample.micros;
+    summary.min_free_heap_after = std::min(summary.min_free_heap_after, sample.free_heap_after);
+    summary.max_heap_retained =
+        std::max(summary.max_heap_retained,
+                 (int32_t) sample.free_heap_before - (int32_t) sample.free_heap_after);
+  }
+  std::sort(micros.begin(), micros.end());
+  summary.p50_micros = percentile(micros, 50);
+  summary.p95_micros = percentile(micros, 95);
+  summary.p99_micros = percentile(micros, 99);
+  if (summary.count == 0) summary.min_free_heap_after = summary.max_heap_retained = 0;
+  if (summary.count > 0) summary.mean_micros = total_micros / summary.count;
+  if (total_micros > 0) summary.bytes_per_sec = summary.total_bytes * 1000000 / total_micros;
+  return summary;
+}
+
+void Benchmark::PrintCsv() const {
+  printf("op,count,errors,p50_us,p95_us,p99_us,mean_us,total_bytes,bytes_per_sec,min_free_heap_after,"
+         "max_heap_retained,peak_heap\n");
+  for (const auto& op : ops_) {
+    auto s = summarize(op.first, op.second);
+    char peak[12] = "n/a";
+    if (s.peak_heap >= 0) snprintf(peak, sizeof(peak), "%" PRId32, s.peak_heap);
+    printf("%s,%d,%d,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRIu32 ",%" PRId32 ",%s\n",
+           op.first.c_str(), s.count, s.errors, s.p50_micros, s.p95_micros,
+           s.p99_micros, s.mean_micros, s.total_bytes, s.bytes_per_sec, s.min_free_heap_after,
+           s.max_heap_retained, peak);
+  }
+  if (counters_.empty()) return;
+  printf("\ncounter,value\n");
+  for (const auto& counter : counters_) {
+    printf("%s,%" PRId64 "\n", counter.first.c_str(), counter.second);
+  }
+}
+
+void Benchmark::PrintJson() const {
+  printf("{\"benchmarks\":[");
+  for (size_t i = 0; i < ops_.size(); ++i) {
+    auto s = summarize(ops_[i].first, ops_[i].second);
+    char peak[12] = "null";
+    if (s.peak_heap >= 0) snprintf(peak, sizeof(peak), "%" PRId32, s.peak_heap);
+    printf("%s{\"op\":\"%s\",\"count\":%d,\"errors\":%d,\"p50_us\":%" PRId64
+           ",\"p95_us\":%" PRId64 ",\"p99_us\":%" PRId64 ",\"mean_us\":%" PRId64
+           ",\"total_bytes\":%" PRId64 ",\"bytes_per_sec\":%" PRId64
+           ",\"min_free_heap_after\":%" PRIu32 ",\"max_heap_retained\":%" PRId32 ",\"peak_heap\":%s}",
+           i == 0 ? "" : ",", ops_[i].first.c_str(), s.count, s.errors,
+           s.p50_micros, s.p95_micros, s.p99_micros, s.mean_micros,
+           s.total_bytes, s.bytes_per_sec, s.min_free_heap_after, s.max_heap_retained,
+           peak);
+  }
+  printf("],\"counters\":{");
+  for (size_t i = 0; i < counters_.size(); ++i) {
+    printf("%s\"%s\":%" PRId64, i == 0 ? "" : ",",
+           counters_[i].first.c_str(), counters_[i].second);
+  }
+  printf("}}\n");
+}
+
+}  // namespace retrostore
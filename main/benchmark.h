@@ -0,0 +1,80 @@
+#pragma once
+
+#ifndef _RETROSTORE_BENCHMARK_H_
+#define _RETROSTORE_BENCHMARK_H_
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "retrostore.h"
+
+namespace retrostore {
+
+// Approximate payload sizes, used to report the bytes an API call moved.
+size_t PayloadSize(const RsApp& app);
+size_t PayloadSize(const RsAppNano& app);
+size_t PayloadSize(const RsMediaImage& image);
+size_t PayloadSize(const RsMediaImageRef& ref);
+size_t PayloadSize(const RsSystemState& state);
+
+// Collects per-call wall time, bytes transferred and the free heap before
+// and after each call for named operations and prints percentile summaries.
+// The free heap is sampled outside the call only, so it misses memory a call
+// allocates and frees again. The peak during a call comes from the heap
+// profiler, which charges each call to a site named after the operation;
+// without CONFIG_RS_HEAP_PROFILER it is printed as n/a (null in JSON).
+class Benchmark {
+ public:
+  // Calls `op` `iterations` times and records one sample per call. `op`
+  // returns the number of bytes it transferred, or a negative value if the
+  // call failed.
+  void Run(const std::string& name, int iterations, std::function<int()> op);
+
+  // Records a named value (e.g. cache hits) that is printed with the summary.
+  void SetCounter(const std::string& name, int64_t value);
+
+  // Prints one line per operation, preceded by a header line, followed by
+  // the counters as a second table.
+  void PrintCsv() const;
+  // Prints all operations and counters as a single JSON object.
+  void PrintJson() const;
+
+ private:
+  struct Sample {
+    int64_t micros;
+    int bytes;
+    uint32_t free_heap_before;
+    uint32_t free_heap_after;
+  };
+  struct Summary {
+    int count;
+    int errors;
+    int64_t p50_micros;
+    int64_t p95_micros;
+    int64_t p99_micros;
+    int64_t mean_micros;
+    int64_t total_bytes;
+    int64_t bytes_per_sec;
+    // Lowest free heap seen right after a call.
+    uint32_t min_free_heap_after;
+    // Most bytes the free heap shrank over one call, i.e. memory a call
+    // left allocated; negative if every call freed more than it kept.
+    int32_t max_heap_retained;
+    // Most bytes the operation's calls held allocated at once, or -1 if the
+    // heap profiler is off.
+    int32_t peak_heap;
+  };
+
+  Summary summarize(const std::string& name, const std::vector<Sample>& samples) const;
+
+  // In order of first use, so the output follows the benchmark order.
+  std::vector<std::pair<std::string, std::vector<Sample>>> ops_;
+  std::vector<std::pair<std::string, int64_t>> counters_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_BENCHMARK_H_ */
@@ -0,0 +1,414 @@
+#include "catalog_cache.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+#include "esp_log.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-catalog-cache";
+
+// Bumped whenever the entry format changes; older entries are then misses.
+#define CATALOG_CACHE_VERSION 1
+// Key of the entry holding the order of use. Entry keys are 'a' or 'q'
+// followed by a hash, so it cannot collide with them.
+#define CATALOG_CACHE_INDEX_KEY "lru"
+
+uint32_t fnv1a(const uint8_t* data, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+class Writer {
+ public:
+  explicit Writer(std::vector<uint8_t>* out) : out_(out) {}
+
+  void putByte(uint8_t value) { out_->push_back(value); }
+  void putInt(int32_t value) {
+    for (int i = 0; i < 4; ++i) out_->push_back((uint32_t) value >> (8 * i));
+  }
+  void putString(const std::string& value) {
+    putInt(value.size());
+    out_->insert(out_->end(), value.begin(), value.end());
+  }
+
+ private:
+  std::vector<uint8_t>* out_;
+};
+
+// Reads what Writer wrote. Once a read runs past the end, every further read
+// fails and ok() returns false.
+class Reader {
+ public:
+  Reader(const uint8_t* data, size_t length) : data_(data), length_(length), pos_(0), ok_(true) {}
+
+  uint8_t getByte() {
+    if (!ensure(1)) return 0;
+    return data_[pos_++];
+  }
+  int32_t getInt() {
+    if (!ensure(4)) return 0;
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) value |= (uint32_t) data_[pos_++] << (8 * i);
+    return value;
+  }
+  std::string getString() {
+    int32_t length = getInt();
+    if (length < 0 || !ensure(length)) return std::string();
+    std::string value((const char*) data_ + pos_, length);
+    pos_ += length;
+    return value;
+  }
+  bool ok() const { return ok_; }
+
+ private:
+  bool ensure(size_t n) {
+    if (ok_ && length_ - pos_ >= n) return true;
+    ok_ = false;
+    return false;
+  }
+
+  const uint8_t* data_;
+  size_t length_;
+  size_t pos_;
+  bool ok_;
+};
+
+void writeApp(const RsApp& app, Writer* w) {
+  w->putString(app.id);
+  w->putString(app.name);
+  w->putString(app.version);
+  w->putString(app.description);
+  w->putInt(app.release_year);
+  w->putInt(app.screenshot_urls.size());
+  for (const auto& url : app.screenshot_urls) w->putString(url);
+  w->putString(app.author);
+  w->putByte(app.model);
+}
+
+bool readApp(Reader* r, RsApp* app) {
+  app->id = r->getString();
+  app->name = r->getString();
+  app->version = r->getString();
+  app->description = r->getString();
+  app->release_year = r->getInt();
+  int num_urls = r->getInt();
+  app->screenshot_urls.clear();
+  for (int i = 0; i < num_urls && r->ok(); ++i) app->screenshot_urls.push_back(r->getString());
+  app->author = r->getString();
+  app->model = (RsTrs80Model) r->getByte();
+  return r->ok();
+}
+
+void writeAppsNano(const std::vector<RsAppNano>& apps, Writer* w) {
+  w->putInt(apps.size());
+  for (const auto& app : apps) {
+    w->putString(app.id);
+    w->putString(app.name);
+    w->putString(app.version);
+    w->putInt(app.release_year);
+    w->putString(app.author);
+    w->putByte(app.model);
+  }
+}
+
+bool readAppsNano(Reader* r, std::vector<RsAppNano>* apps) {
+  int count = r->getInt();
+  apps->clear();
+  for (int i = 0; i < count && r->ok(); ++i) {
+    RsAppNano app;
+    app.id = r->getString();
+    app.name = r->getString();
+    app.version = r->getString();
+    app.release_year = r->getInt();
+    app.author = r->getString();
+    app.model = (RsTrs80Model) r->getByte();
+    apps->push_back(std::move(app));
+  }
+  return r->ok();
+}
+
+}  // namespace
+
+CatalogCache::CatalogCache(RetroStore* rs, const char* nvs_namespace, int max_entries,
+                           int max_bytes)
+    : rs_(rs),
+      nvs_(0),
+      open_(false),
+      max_entries_(max_entries),
+      max_bytes_(max_bytes),
+      lru_bytes_(0),
+      lru_dirty_(false),
+      hits_(0),
+      misses_(0),
+      unchanged_(0),
+      updated_(0),
+      evicted_(0) {
+  auto err = nvs_open(nvs_namespace, NVS_READWRITE, &nvs_);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Opening NVS namespace %s failed (0x%x), caching disabled.", nvs_namespace, err);
+    return;
+  }
+  open_ = true;
+  loadIndex();
+}
+
+CatalogCache::~CatalogCache() {
+  if (!open_) return;
+  if (lru_dirty_) {
+    saveIndex();
+    nvs_commit(nvs_);
+  }
+  nvs_close(nvs_);
+}
+
+bool CatalogCache::FetchApp(const std::string& appId, RsApp* app) {
+  Request request = {true, appId, 0, 0, "", {}};
+  std::vector<uint8_t> payload;
+  if (!serve(request, &payload)) return false;
+  Reader r(payload.data(), payload.size());
+  return readApp(&r, app);
+}
+
+bool CatalogCache::FetchAppsNano(int start, int num, const std::string& query,
+                                 const std::vector<RsMediaType>& hasTypes,
+                                 std::vector<RsAppNano>* apps) {
+  Request request = {false, "", start, num, query, hasTypes};
+  std::vector<uint8_t> payload;
+  if (!serve(request, &payload)) return false;
+  Reader r(payload.data(), payload.size());
+  return readAppsNano(&r, apps);
+}
+
+int CatalogCache::Revalidate(int max) {
+  int done = 0;
+  while (!pending_.empty() && (max < 0 || done < max)) {
+    Request request = std::move(pending_.front());
+    pending_.pop_front();
+    pending_keys_.erase(keyOf(request));
+    done++;
+
+    std::vector<uint8_t> fresh;
+    if (!fetch(request, &fresh)) {
+      ESP_LOGW(TAG, "Revalidating %s failed.", keyOf(request).c_str());
+      continue;
+    }
+    std::vector<uint8_t> cached;
+    uint32_t validator;
+    if (load(request, &cached, &validator) && validator == fnv1a(fresh.data(), fresh.size())) {
+      unchanged_++;
+      continue;
+    }
+    store(request, fresh);
+    updated_++;
+  }
+  return done;
+}
+
+void CatalogCache::Clear() {
+  pending_.clear();
+  pending_keys_.clear();
+  lru_.clear();
+  lru_bytes_ = 0;
+  lru_dirty_ = false;
+  if (!open_) return;
+  nvs_erase_all(nvs_);
+  nvs_commit(nvs_);
+}
+
+std::vector<uint8_t> CatalogCache::serialize(const Request& request) {
+  std::vector<uint8_t> bytes;
+  Writer w(&bytes);
+  w.putByte(request.is_app);
+  w.putString(request.app_id);
+  w.putInt(request.start);
+  w.putInt(request.num);
+  w.putString(request.query);
+  w.putInt(request.has_types.size());
+  for (auto type : request.has_types) w.putByte(type);
+  return bytes;
+}
+
+std::string CatalogCache::keyOf(const Request& request) {
+  auto bytes = serialize(request);
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  snprintf(key, sizeof(key), "%c%08x", request.is_app ? 'a' : 'q',
+           (unsigned) fnv1a(bytes.data(), bytes.size()));
+  return key;
+}
+
+bool CatalogCache::fetch(const Request& request, std::vector<uint8_t>* payload) {
+  payload->clear();
+  Writer w(payload);
+  if (request.is_app) {
+    RsApp app;
+    if (!rs_->FetchApp(request.app_id, &app)) return false;
+    writeApp(app, &w);
+  } else {
+    std::vector<RsAppNano> apps;
+    if (!rs_->FetchAppsNano(request.start, request.num, request.query, request.has_types, &apps)) {
+      return false;
+    }
+    writeAppsNano(apps, &w);
+  }
+  return true;
+}
+
+// An entry is the format version, the request it answers, the payload's
+// validator and the payload.
+bool CatalogCache::load(const Request& request, std::vector<uint8_t>* payload,
+                        uint32_t* validator) {
+  if (!open_) return false;
+  auto key = keyOf(request);
+  size_t length = 0;
+  if (nvs_get_blob(nvs_, key.c_str(), nullptr, &length) != ESP_OK) return false;
+  std::vector<uint8_t> entry(length);
+  if (nvs_get_blob(nvs_, key.c_str(), entry.data(), &length) != ESP_OK) return false;
+
+  // The stored request tells apart requests whose keys collide.
+  auto header = serialize(request);
+  if (entry.size() < 1 + header.size() + 4 || entry[0] != CATALOG_CACHE_VERSION ||
+      !std::equal(header.begin(), header.end(), entry.begin() + 1)) {
+    return false;
+  }
+  Reader r(entry.data() + 1 + header.size(), 4);
+  *validator = r.getInt();
+  payload->assign(entry.begin() + 1 + header.size() + 4, entry.end());
+  return fnv1a(payload->data(), payload->size()) == *validator;
+}
+
+void CatalogCache::store(const Request& request, const std::vector<uint8_t>& payload) {
+  if (!open_) return;
+  std::vector<uint8_t> entry;
+  Writer w(&entry);
+  w.putByte(CATALOG_CACHE_VERSION);
+  auto header = serialize(request);
+  entry.insert(entry.end(), header.begin(), header.end());
+  w.putInt(fnv1a(payload.data(), payload.size()));
+  entry.insert(entry.end(), payload.begin(), payload.end());
+
+  auto key = keyOf(request);
+  if ((int) entry.size() > max_bytes_) {
+    ESP_LOGW(TAG, "Entry %s of %d bytes is too large to cache.", key.c_str(), (int) entry.size());
+    return;
+  }
+  // Replaced in place, so it does not count against the limits.
+  auto it = std::find_if(lru_.begin(), lru_.end(),
+                         [&key](const std::pair<std::string, int>& e) { return e.first == key; });
+  if (it != lru_.end()) {
+    lru_bytes_ -= it->second;
+    lru_.erase(it);
+  }
+  while (!lru_.empty() && ((int) lru_.size() >= max_entries_ ||
+                           lru_bytes_ + (int) entry.size() > max_bytes_)) {
+    evictOldest();
+  }
+  auto err = nvs_set_blob(nvs_, key.c_str(), entry.data(), entry.size());
+  // The partition is shared; make room from the cache's own entries.
+  while (err == ESP_ERR_NVS_NOT_ENOUGH_SPACE && !lru_.empty()) {
+    evictOldest();
+    err = nvs_set_blob(nvs_, key.c_str(), entry.data(), entry.size());
+  }
+  if (err == ESP_OK) {
+    lru_.push_back(std::make_pair(key, (int) entry.size()));
+    lru_bytes_ += entry.size();
+  }
+  lru_dirty_ = true;
+  saveIndex();
+  if (err == ESP_OK) err = nvs_commit(nvs_);
+  if (err != ESP_OK) ESP_LOGW(TAG, "Storing %s failed (0x%x).", key.c_str(), err);
+}
+
+void CatalogCache::touch(const std::string& key) {
+  auto it = std::find_if(lru_.begin(), lru_.end(),
+                         [&key](const std::pair<std::string, int>& e) { return e.first == key; });
+  if (it == lru_.end() || it + 1 == lru_.end()) return;
+  auto entry = *it;
+  lru_.erase(it);
+  lru_.push_back(entry);
+  lru_dirty_ = true;
+}
+
+void CatalogCache::evictOldest() {
+  nvs_erase_key(nvs_, lru_.front().first.c_str());
+  lru_bytes_ -= lru_.front().second;
+  lru_.erase(lru_.begin());
+  lru_dirty_ = true;
+  evicted_++;
+}
+
+// The index is the format version followed by the key and size of every
+// entry, least recently used first.
+void CatalogCache::loadIndex() {
+  size_t length = 0;
+  std::vector<uint8_t> index;
+  bool loaded = nvs_get_blob(nvs_, CATALOG_CACHE_INDEX_KEY, nullptr, &length) == ESP_OK;
+  if (loaded) {
+    index.resize(length);
+    loaded = nvs_get_blob(nvs_, CATALOG_CACHE_INDEX_KEY, index.data(), &length) == ESP_OK;
+  }
+  if (loaded) {
+    Reader r(index.data(), index.size());
+    loaded = r.getByte() == CATALOG_CACHE_VERSION;
+    int count = r.getInt();
+    for (int i = 0; i < count && r.ok(); ++i) {
+      auto key = r.getString();
+      int size = r.getInt();
+      lru_.push_back(std::make_pair(key, size));
+      lru_bytes_ += size;
+    }
+    loaded = loaded && r.ok();
+  }
+  if (!loaded) {
+    // Entries no index accounts for could never be evicted.
+    lru_.clear();
+    lru_bytes_ = 0;
+    nvs_erase_all(nvs_);
+    nvs_commit(nvs_);
+  }
+}
+
+void CatalogCache::saveIndex() {
+  std::vector<uint8_t> index;
+  Writer w(&index);
+  w.putByte(CATALOG_CACHE_VERSION);
+  w.putInt(lru_.size());
+  for (const auto& entry : lru_) {
+    w.putString(entry.first);
+    w.putInt(entry.second);
+  }
+  auto err = nvs_set_blob(nvs_, CATALOG_CACHE_INDEX_KEY, index.data(), index.size());
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Storing the cache index failed (0x%x).", err);
+    return;
+  }
+  lru_dirty_ = false;
+}
+
+bool CatalogCache::serve(const Request& request, std::vector<uint8_t>* payload) {
+  uint32_t validator;
+  if (load(request, payload, &validator)) {
+    hits_++;
+    touch(keyOf(request));
+    enqueue(request);
+    return true;
+  }
+  misses_++;
+  if (!fetch(request, payload)) return false;
+  store(request, *payload);
+  return true;
+}
+
+void CatalogCache::enqueue(const Request& request) {
+  if (!pending_keys_.insert(keyOf(request)).second) return;
+  pending_.push_back(request);
+}
+
+}  // namespace retrostore
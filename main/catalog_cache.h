@@ -0,0 +1,128 @@
+#pragma once
+
+#ifndef _RETROSTORE_CATALOG_CACHE_H_
+#define _RETROSTORE_CATALOG_CACHE_H_
+
+#include <deque>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "nvs.h"
+#include "retrostore.h"
+
+namespace retrostore {
+
+// NVS namespace the cache keeps its entries in.
+#define CATALOG_CACHE_NAMESPACE "rs_catalog"
+// The NVS partition is shared with the WiFi driver and the other caches, so
+// the cache keeps to at most this many entries and bytes of entries.
+#define CATALOG_CACHE_MAX_ENTRIES 32
+#define CATALOG_CACHE_MAX_BYTES (6 * 1024)
+
+// Cache of app metadata and nano query results, persisted in NVS.
+//
+// Hits are answered from flash without touching the network and queued for
+// revalidation. Revalidate() refetches queued entries, e.g. from an idle
+// loop, and compares the result against the entry's validator (a hash of
+// its contents, standing in for an ETag). Unchanged entries are not
+// rewritten, so revalidating costs no flash wear; changed entries are
+// replaced and served from then on.
+//
+// Storing an entry beyond `max_entries` or `max_bytes`, or into an NVS
+// partition that is full, evicts the least recently used entries first. The
+// order of use is kept in one more entry, written along with new entries and
+// on destruction, so hits cost no flash write.
+//
+// Requires nvs_flash_init(). Not thread-safe.
+class CatalogCache {
+ public:
+  CatalogCache(RetroStore* rs, const char* nvs_namespace = CATALOG_CACHE_NAMESPACE,
+               int max_entries = CATALOG_CACHE_MAX_ENTRIES,
+               int max_bytes = CATALOG_CACHE_MAX_BYTES);
+  ~CatalogCache();
+
+  // Same contract as RetroStore::FetchApp.
+  bool FetchApp(const std::string& appId, RsApp* app);
+  // Same contract as RetroStore::FetchAppsNano.
+  bool FetchAppsNano(int start, int num, const std::string& query,
+                     const std::vector<RsMediaType>& hasTypes,
+                     std::vector<RsAppNano>* apps);
+
+  // Revalidates up to `max` queued entries (all if negative) and returns the
+  // number revalidated. Entries that cannot be fetched stay in the cache and
+  // are dropped from the queue.
+  int Revalidate(int max = -1);
+  // Entries queued for revalidation.
+  int pending() const { return pending_.size(); }
+
+  // Erases all entries from flash.
+  void Clear();
+
+  // Entries in flash, and their size in bytes.
+  int size() const { return lru_.size(); }
+  int bytes() const { return lru_bytes_; }
+  // Requests served from flash.
+  long hits() const { return hits_; }
+  // Requests that went to the network.
+  long misses() const { return misses_; }
+  // Revalidations that found the entry unchanged.
+  long unchanged() const { return unchanged_; }
+  // Revalidations that replaced the entry.
+  long updated() const { return updated_; }
+  // Entries dropped to make room.
+  long evicted() const { return evicted_; }
+
+ private:
+  // What a cached entry answers. Serialized into each entry so that two
+  // requests whose keys collide are told apart.
+  struct Request {
+    bool is_app;
+    std::string app_id;
+    int start;
+    int num;
+    std::string query;
+    std::vector<RsMediaType> has_types;
+  };
+
+  static std::vector<uint8_t> serialize(const Request& request);
+  static std::string keyOf(const Request& request);
+  bool fetch(const Request& request, std::vector<uint8_t>* payload);
+  bool load(const Request& request, std::vector<uint8_t>* payload, uint32_t* validator);
+  void store(const Request& request, const std::vector<uint8_t>& payload);
+  bool serve(const Request& request, std::vector<uint8_t>* payload);
+  void enqueue(const Request& request);
+  // Moves the entry to the most recently used end.
+  void touch(const std::string& key);
+  // Removes the least recently used entry from flash.
+  void evictOldest();
+  void loadIndex();
+  void saveIndex();
+
+  RetroStore* rs_;
+  nvs_handle_t nvs_;
+  bool open_;
+  int max_entries_;
+  int max_bytes_;
+
+  // Keys and sizes of the entries in flash, least recently used first.
+  std::vector<std::pair<std::string, int>> lru_;
+  int lru_bytes_;
+  // Whether lru_ changed since it was last written.
+  bool lru_dirty_;
+
+  std::deque<Request> pending_;
+  std::set<std::string> pending_keys_;
+
+  long hits_;
+  long misses_;
+  long unchanged_;
+  long updated_;
+  long evicted_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_CATALOG_CACHE_H_ */
@@ -0,0 +1,161 @@
+#include "catalog_cursor.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "esp_log.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-catalog-cursor";
+
+}  // namespace
+
+RsCatalogCursor::RsCatalogCursor(AsyncRetroStore* async, const std::string& query,
+                                 const std::vector<RsMediaType>& hasTypes, int page_size,
+                                 int resident_pages)
+    : async_(async),
+      query_(query),
+      has_types_(hasTypes),
+      page_size_(std::max(1, page_size)),
+      mutex_(xSemaphoreCreateMutex()),
+      loaded_(xSemaphoreCreateBinary()),
+      size_(-1),
+      last_page_(-1),
+      hits_(0),
+      misses_(0),
+      prefetches_(0) {
+  // The page being read and the one being prefetched.
+  resident_pages = std::max(2, resident_pages);
+  for (int i = 0; i < resident_pages; ++i) {
+    std::unique_ptr<Slot> slot(new Slot());
+    slot->page = -1;
+    slot->state = EMPTY;
+    slot->count = 0;
+    slots_.push_back(std::move(slot));
+  }
+}
+
+RsCatalogCursor::~RsCatalogCursor() {
+  for (auto& slot : slots_) wait(slot.get());
+  vSemaphoreDelete(loaded_);
+  vSemaphoreDelete(mutex_);
+}
+
+const RsAppView* RsCatalogCursor::Get(int index) {
+  if (index < 0 || (size_ >= 0 && index >= size_)) return nullptr;
+  int page = index / page_size_;
+  Slot* slot = find(page);
+  if (slot != nullptr) {
+    hits_++;
+  } else {
+    misses_++;
+    slot = load(page, nullptr, portMAX_DELAY);
+    if (slot == nullptr) return nullptr;
+  }
+  wait(slot);
+
+  // Read ahead in the direction of travel.
+  int ahead = page < last_page_ ? page - 1 : page + 1;
+  last_page_ = page;
+  if (ahead >= 0 && (size_ < 0 || ahead * page_size_ < size_) && find(ahead) == nullptr) {
+    if (load(ahead, slot, 0) != nullptr) prefetches_++;
+  }
+
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  bool ready = slot->state == READY;
+  int count = slot->count;
+  if (!ready) {
+    // Try again on the next read.
+    slot->page = -1;
+    slot->state = EMPTY;
+  }
+  xSemaphoreGive(mutex_);
+  if (!ready) return nullptr;
+  if (count < page_size_) size_ = page * page_size_ + count;
+  int offset = index - page * page_size_;
+  return offset < count ? &slot->apps[offset] : nullptr;
+}
+
+int RsCatalogCursor::resident() {
+  int n = 0;
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  for (const auto& slot : slots_) {
+    if (slot->state != EMPTY) n++;
+  }
+  xSemaphoreGive(mutex_);
+  return n;
+}
+
+RsCatalogCursor::Slot* RsCatalogCursor::find(int page) {
+  Slot* found = nullptr;
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  for (auto& slot : slots_) {
+    if (slot->page == page && slot->state != EMPTY) found = slot.get();
+  }
+  xSemaphoreGive(mutex_);
+  return found;
+}
+
+RsCatalogCursor::Slot* RsCatalogCursor::load(int page, const Slot* keep,
+                                              TickType_t ticks_to_wait) {
+  // An empty slot, or else the page farthest from this one. Loading slots
+  // belong to the worker until it is done.
+  Slot* victim = nullptr;
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  for (auto& slot : slots_) {
+    if (slot->state == LOADING || slot.get() == keep) continue;
+    if (slot->state == EMPTY) {
+      victim = slot.get();
+      break;
+    }
+    if (victim == nullptr || abs(slot->page - page) > abs(victim->page - page)) {
+      victim = slot.get();
+    }
+  }
+  if (victim != nullptr) {
+    victim->page = page;
+    victim->state = LOADING;
+  }
+  xSemaphoreGive(mutex_);
+  if (victim == nullptr) return nullptr;
+
+  bool queued = async_->Submit([this, victim, page](RetroStore* rs) {
+    std::vector<RsAppNano> apps;
+    bool success = rs->FetchAppsNano(page * page_size_, page_size_, query_, has_types_, &apps);
+    // The slot is ours while it is loading, so packing needs no lock.
+    if (success) victim->apps.Assign(apps);
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    victim->state = success ? READY : FAILED;
+    victim->count = apps.size();
+    // Given before the mutex: once the slot no longer shows LOADING, the
+    // destructor may delete both, and giving the mutex is the job's last use
+    // of the cursor.
+    xSemaphoreGive(loaded_);
+    xSemaphoreGive(mutex_);
+  }, ticks_to_wait);
+  if (!queued) {
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    victim->page = -1;
+    victim->state = EMPTY;
+    xSemaphoreGive(mutex_);
+    if (ticks_to_wait != 0) ESP_LOGW(TAG, "Cannot queue the fetch of page %d.", page);
+    return nullptr;
+  }
+  return victim;
+}
+
+void RsCatalogCursor::wait(Slot* slot) {
+  while (true) {
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    bool loading = slot->state == LOADING;
+    xSemaphoreGive(mutex_);
+    if (!loading) return;
+    // Completions of other slots wake us too; check again after each.
+    xSemaphoreTake(loaded_, pdMS_TO_TICKS(100));
+  }
+}
+
+}  // namespace retrostore
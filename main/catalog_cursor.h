@@ -0,0 +1,100 @@
+#pragma once
+
+#ifndef _RETROSTORE_CATALOG_CURSOR_H_
+#define _RETROSTORE_CATALOG_CURSOR_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "app_page.h"
+#include "async_retrostore.h"
+#include "retrostore.h"
+
+namespace retrostore {
+
+// Apps per page, like the pages of the tester's catalog browser.
+#define CATALOG_CURSOR_PAGE_SIZE 5
+// Pages held at once: the one shown, the one being prefetched and the one
+// scrolled away from.
+#define CATALOG_CURSOR_RESIDENT_PAGES 3
+
+// Random access to the results of a nano query, one page at a time.
+//
+// Pages are fetched on demand through an AsyncRetroStore. Whenever an app
+// is read, the page after it (or before it, when scrolling back) is
+// prefetched in the background, so that by the time the reader reaches the
+// page boundary it is usually there already. At most `resident_pages` pages
+// are held; the one farthest from the current page makes room. Pages are
+// RsAppPage arenas and are refilled in place, so scrolling through the
+// whole catalog allocates no more than that.
+//
+// Not thread-safe: one reader, e.g. the UI task. `async` must outlive the
+// cursor.
+class RsCatalogCursor {
+ public:
+  RsCatalogCursor(AsyncRetroStore* async, const std::string& query = "",
+                  const std::vector<RsMediaType>& hasTypes = std::vector<RsMediaType>(),
+                  int page_size = CATALOG_CURSOR_PAGE_SIZE,
+                  int resident_pages = CATALOG_CURSOR_RESIDENT_PAGES);
+  // Waits for a prefetch still in flight.
+  ~RsCatalogCursor();
+
+  // The app at `index` in the results. Blocks if its page has to be
+  // fetched. Returns nullptr past the end of the results or if the page
+  // cannot be fetched. Valid until the next call.
+  const RsAppView* Get(int index);
+
+  // Number of results, or -1 while the last page has not been seen.
+  int size() const { return size_; }
+
+  // Reads answered from a page that was already there or on its way.
+  long hits() const { return hits_; }
+  // Reads that had to fetch their page first.
+  long misses() const { return misses_; }
+  long prefetches() const { return prefetches_; }
+  // Pages held right now.
+  int resident();
+
+ private:
+  enum SlotState { EMPTY, LOADING, READY, FAILED };
+
+  struct Slot {
+    int page;
+    SlotState state;
+    // The number of apps the server returned, which is less than the page
+    // size on the last page.
+    int count;
+    RsAppPage apps;
+  };
+
+  // The slot holding `page`, or nullptr.
+  Slot* find(int page);
+  // Starts fetching `page` into a free or evicted slot other than `keep`.
+  // Returns nullptr if no slot can be freed or the request cannot be queued.
+  Slot* load(int page, const Slot* keep, TickType_t ticks_to_wait);
+  // Waits until the slot is no longer loading.
+  void wait(Slot* slot);
+
+  AsyncRetroStore* async_;
+  const std::string query_;
+  const std::vector<RsMediaType> has_types_;
+  const int page_size_;
+  std::vector<std::unique_ptr<Slot>> slots_;
+  // Guards the slot states, which the worker updates.
+  SemaphoreHandle_t mutex_;
+  // Given whenever a load completes.
+  SemaphoreHandle_t loaded_;
+  int size_;
+  int last_page_;
+  long hits_;
+  long misses_;
+  long prefetches_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_CATALOG_CURSOR_H_ */
@@ -0,0 +1,399 @@
+#include "catalog_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#include "esp_log.h"
+
+#include "verify.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-catalog-index";
+
+#define INDEX_MAGIC 0x58495352  // "RSIX"
+#define INDEX_VERSION 1
+
+// Media types with a bit in IndexedApp::types.
+const RsMediaType INDEXED_TYPES[] = {RsMediaType_DISK, RsMediaType_CASSETTE,
+                                     RsMediaType_COMMAND, RsMediaType_BASIC};
+
+// The index is one block at the start of the partition: this header, the
+// apps in catalog order, the words in strcmp order, the posting lists the
+// words point into and the strings everything else points into. The header
+// is written last, so a sync cut short by a reset leaves no index rather
+// than a broken one.
+struct IndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_apps;
+  uint32_t num_words;
+  // uint16_t app numbers, in catalog order within each word.
+  uint32_t num_postings;
+  // Bytes following the header.
+  uint32_t length;
+  // Crc32 of the bytes following the header.
+  uint32_t checksum;
+};
+
+// Strings are offsets into the string table, null-terminated.
+struct IndexedApp {
+  uint32_t id;
+  uint32_t name;
+  uint32_t version;
+  uint32_t author;
+  uint16_t release_year;
+  uint8_t model;
+  // Bit n is set if the app has INDEXED_TYPES[n].
+  uint8_t types;
+};
+
+struct IndexedWord {
+  uint32_t text;
+  uint32_t first_posting;
+  uint32_t num_postings;
+};
+
+uint32_t sectorAlign(uint32_t offset) {
+  return (offset + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+}
+
+char lower(char c) {
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+bool isWordChar(char c) {
+  // Bytes of multi-byte UTF-8 characters count as letters.
+  return (c >= '0' && c <= '9') || (lower(c) >= 'a' && lower(c) <= 'z') || (c & 0x80);
+}
+
+std::string toLower(const std::string& s) {
+  std::string result(s);
+  for (auto& c : result) c = lower(c);
+  return result;
+}
+
+// The lowercase words in `s`.
+std::vector<std::string> wordsOf(const std::string& s) {
+  std::vector<std::string> result;
+  size_t i = 0;
+  while (i < s.size()) {
+    while (i < s.size() && !isWordChar(s[i])) ++i;
+    size_t begin = i;
+    while (i < s.size() && isWordChar(s[i])) ++i;
+    if (i > begin) result.push_back(toLower(s.substr(begin, i - begin)));
+  }
+  return result;
+}
+
+// Whether `haystack` contains `needle`, which is lowercase, ignoring case.
+bool containsLower(const char* haystack, const std::string& needle) {
+  size_t n = needle.size();
+  for (; *haystack != '\0'; ++haystack) {
+    size_t i = 0;
+    while (i < n && haystack[i] != '\0' && lower(haystack[i]) == needle[i]) ++i;
+    if (i == n) return true;
+  }
+  return n == 0;
+}
+
+std::vector<std::string> splitQuery(const std::string& query) {
+  std::vector<std::string> terms;
+  const std::string separator(" OR ");
+  size_t pos = 0;
+  while (true) {
+    auto next = query.find(separator, pos);
+    auto term = query.substr(pos, next == std::string::npos ? std::string::npos : next - pos);
+    if (!term.empty()) terms.push_back(toLower(term));
+    if (next == std::string::npos) break;
+    pos = next + separator.size();
+  }
+  return terms;
+}
+
+// Fetches all apps matching `hasTypes`, a page at a time.
+bool fetchAll(RetroStore* rs, const std::vector<RsMediaType>& hasTypes,
+              std::vector<RsAppNano>* apps) {
+  apps->clear();
+  while (true) {
+    std::vector<RsAppNano> page;
+    if (!rs->FetchAppsNano(apps->size(), CATALOG_INDEX_SYNC_PAGE, "", hasTypes, &page)) {
+      return false;
+    }
+    for (auto& app : page) apps->push_back(std::move(app));
+    if (page.size() < CATALOG_INDEX_SYNC_PAGE) return true;
+  }
+}
+
+template <typename T>
+void append(std::vector<uint8_t>* out, const T* items, size_t count) {
+  auto* bytes = reinterpret_cast<const uint8_t*>(items);
+  out->insert(out->end(), bytes, bytes + count * sizeof(T));
+}
+
+}  // namespace
+
+CatalogIndex::CatalogIndex(const char* partition_label)
+    : partition_(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                          partition_label)),
+      data_(nullptr),
+      handle_(0) {
+  if (partition_ == nullptr) {
+    ESP_LOGW(TAG, "Partition '%s' not found, catalog index disabled.", partition_label);
+    return;
+  }
+  load();
+  if (ready()) ESP_LOGI(TAG, "%d apps, %d words indexed.", apps(), words());
+}
+
+CatalogIndex::~CatalogIndex() {
+  unmap();
+}
+
+bool CatalogIndex::Sync(RetroStore* rs) {
+  if (partition_ == nullptr) return false;
+  std::vector<RsAppNano> catalog;
+  if (!fetchAll(rs, std::vector<RsMediaType>(), &catalog)) {
+    ESP_LOGW(TAG, "Fetching the catalog failed.");
+    return false;
+  }
+  if (catalog.size() > UINT16_MAX) {
+    ESP_LOGE(TAG, "%d apps are too many to index.", (int) catalog.size());
+    return false;
+  }
+  std::map<std::string, int> numbers;
+  for (int i = 0; i < catalog.size(); ++i) numbers[catalog[i].id] = i;
+  std::vector<uint8_t> types(catalog.size(), 0);
+  for (int t = 0; t < sizeof(INDEXED_TYPES) / sizeof(INDEXED_TYPES[0]); ++t) {
+    std::vector<RsAppNano> with_type;
+    if (!fetchAll(rs, std::vector<RsMediaType>(1, INDEXED_TYPES[t]), &with_type)) {
+      ESP_LOGW(TAG, "Fetching the apps with media type %d failed.", INDEXED_TYPES[t]);
+      return false;
+    }
+    for (const auto& app : with_type) {
+      auto it = numbers.find(app.id);
+      if (it != numbers.end()) types[it->second] |= 1 << t;
+    }
+  }
+
+  // Strings are deduplicated, which pays off for authors and versions.
+  std::vector<char> strings;
+  std::map<std::string, uint32_t> string_offsets;
+  auto intern = [&](const std::string& s) {
+    auto it = string_offsets.find(s);
+    if (it != string_offsets.end()) return it->second;
+    uint32_t offset = strings.size();
+    strings.insert(strings.end(), s.c_str(), s.c_str() + s.size() + 1);
+    string_offsets[s] = offset;
+    return offset;
+  };
+  std::vector<IndexedApp> apps(catalog.size());
+  std::map<std::string, std::vector<uint16_t>> postings;
+  for (int i = 0; i < catalog.size(); ++i) {
+    const auto& app = catalog[i];
+    apps[i] = {intern(app.id),
+               intern(app.name),
+               intern(app.version),
+               intern(app.author),
+               (uint16_t) app.release_year,
+               (uint8_t) app.model,
+               types[i]};
+    auto text = wordsOf(app.name);
+    auto author = wordsOf(app.author);
+    text.insert(text.end(), author.begin(), author.end());
+    for (const auto& word : text) {
+      auto& list = postings[word];
+      if (list.empty() || list.back() != i) list.push_back(i);
+    }
+  }
+  // std::map iterates in strcmp order, which the lookup relies on.
+  std::vector<IndexedWord> index_words;
+  std::vector<uint16_t> all_postings;
+  for (const auto& entry : postings) {
+    index_words.push_back({intern(entry.first), (uint32_t) all_postings.size(),
+                           (uint32_t) entry.second.size()});
+    all_postings.insert(all_postings.end(), entry.second.begin(), entry.second.end());
+  }
+
+  std::vector<uint8_t> body;
+  append(&body, apps.data(), apps.size());
+  append(&body, index_words.data(), index_words.size());
+  append(&body, all_postings.data(), all_postings.size());
+  append(&body, strings.data(), strings.size());
+  IndexHeader h;
+  h.magic = INDEX_MAGIC;
+  h.version = INDEX_VERSION;
+  h.num_apps = apps.size();
+  h.num_words = index_words.size();
+  h.num_postings = all_postings.size();
+  h.length = body.size();
+  h.checksum = Crc32(body.data(), body.size());
+  if (sizeof(h) + body.size() > partition_->size) {
+    ESP_LOGE(TAG, "The index needs %d bytes, the partition has %d.",
+             (int) (sizeof(h) + body.size()), (int) partition_->size);
+    return false;
+  }
+
+  unmap();
+  bool written =
+      esp_partition_erase_range(partition_, 0, sectorAlign(sizeof(h) + body.size())) ==
+          ESP_OK &&
+      esp_partition_write(partition_, sizeof(h), body.data(), body.size()) == ESP_OK &&
+      esp_partition_write(partition_, 0, &h, sizeof(h)) == ESP_OK;
+  if (!written) {
+    ESP_LOGE(TAG, "Writing the index failed.");
+    return false;
+  }
+  load();
+  ESP_LOGI(TAG, "Indexed %d apps, %d words in %d bytes.", (int) apps.size(),
+           (int) index_words.size(),
+           (int) (sizeof(h) + body.size()));
+  return ready();
+}
+
+bool CatalogIndex::FetchAppsNano(int start, int num, const std::string& query,
+                                 const std::vector<RsMediaType>& hasTypes,
+                                 std::vector<RsAppNano>* apps) {
+  if (!ready()) return false;
+  auto* h = reinterpret_cast<const IndexHeader*>(data_);
+  auto* indexed = reinterpret_cast<const IndexedApp*>(data_ + sizeof(IndexHeader));
+  apps->clear();
+
+  uint8_t required = 0;
+  for (auto type : hasTypes) {
+    bool known = false;
+    for (int t = 0; t < sizeof(INDEXED_TYPES) / sizeof(INDEXED_TYPES[0]); ++t) {
+      if (INDEXED_TYPES[t] == type) {
+        required |= 1 << t;
+        known = true;
+      }
+    }
+    // No app has a media type the index does not know.
+    if (!known) return true;
+  }
+
+  auto terms = splitQuery(query);
+  std::vector<uint32_t> bits((h->num_apps + 31) / 32, terms.empty() ? 0xffffffff : 0);
+  for (const auto& term : terms) match(term, &bits);
+
+  int matched = 0;
+  for (uint32_t i = 0; i < h->num_apps && (int) apps->size() < num; ++i) {
+    if ((bits[i / 32] & (1u << (i % 32))) == 0) continue;
+    const auto& app = indexed[i];
+    if ((app.types & required) != required) continue;
+    if (matched++ < start) continue;
+    RsAppNano nano;
+    nano.id = text(app.id);
+    nano.name = text(app.name);
+    nano.version = text(app.version);
+    nano.release_year = app.release_year;
+    nano.author = text(app.author);
+    nano.model = (RsTrs80Model) app.model;
+    apps->push_back(nano);
+  }
+  return true;
+}
+
+void CatalogIndex::Clear() {
+  if (partition_ == nullptr) return;
+  unmap();
+  esp_partition_erase_range(partition_, 0, SPI_FLASH_SEC_SIZE);
+}
+
+int CatalogIndex::apps() const {
+  return ready() ? reinterpret_cast<const IndexHeader*>(data_)->num_apps : 0;
+}
+
+int CatalogIndex::words() const {
+  return ready() ? reinterpret_cast<const IndexHeader*>(data_)->num_words : 0;
+}
+
+size_t CatalogIndex::size() const {
+  return ready() ? sizeof(IndexHeader) + reinterpret_cast<const IndexHeader*>(data_)->length
+                 : 0;
+}
+
+void CatalogIndex::load() {
+  IndexHeader h;
+  if (esp_partition_read(partition_, 0, &h, sizeof(h)) != ESP_OK || h.magic != INDEX_MAGIC) {
+    return;
+  }
+  uint64_t tables = (uint64_t) h.num_apps * sizeof(IndexedApp) +
+                    (uint64_t) h.num_words * sizeof(IndexedWord) +
+                    (uint64_t) h.num_postings * sizeof(uint16_t);
+  if (h.version != INDEX_VERSION || h.length > partition_->size - sizeof(h) ||
+      tables > h.length) {
+    ESP_LOGW(TAG, "Index in flash is from another version or corrupt, ignoring it.");
+    return;
+  }
+  const void* data;
+  spi_flash_mmap_handle_t handle;
+  auto err = esp_partition_mmap(partition_, 0, sizeof(h) + h.length, SPI_FLASH_MMAP_DATA,
+                                &data, &handle);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Mapping the index failed (0x%x).", err);
+    return;
+  }
+  auto* bytes = static_cast<const uint8_t*>(data);
+  if (Crc32(bytes + sizeof(h), h.length) != h.checksum) {
+    ESP_LOGW(TAG, "Index in flash is corrupt, ignoring it.");
+    spi_flash_munmap(handle);
+    return;
+  }
+  data_ = bytes;
+  handle_ = handle;
+}
+
+void CatalogIndex::unmap() {
+  if (data_ == nullptr) return;
+  spi_flash_munmap(handle_);
+  data_ = nullptr;
+}
+
+void CatalogIndex::match(const std::string& term, std::vector<uint32_t>* bits) const {
+  auto* h = reinterpret_cast<const IndexHeader*>(data_);
+  auto* indexed = reinterpret_cast<const IndexedApp*>(data_ + sizeof(IndexHeader));
+  auto* index_words = reinterpret_cast<const IndexedWord*>(indexed + h->num_apps);
+  auto* postings = reinterpret_cast<const uint16_t*>(index_words + h->num_words);
+
+  // Apps with a word starting with each of the term's words; a term without
+  // words, like "-", leaves every app a candidate.
+  std::vector<uint32_t> candidates(bits->size(), 0xffffffff);
+  for (const auto& word : wordsOf(term)) {
+    std::vector<uint32_t> with_word(bits->size(), 0);
+    auto* first = std::lower_bound(index_words, index_words + h->num_words, word,
+                                   [this](const IndexedWord& w, const std::string& s) {
+                                     return strcmp(text(w.text), s.c_str()) < 0;
+                                   });
+    for (auto* w = first; w < index_words + h->num_words; ++w) {
+      if (strncmp(text(w->text), word.c_str(), word.size()) != 0) break;
+      for (uint32_t p = 0; p < w->num_postings; ++p) {
+        uint16_t app = postings[w->first_posting + p];
+        with_word[app / 32] |= 1u << (app % 32);
+      }
+    }
+    for (size_t i = 0; i < candidates.size(); ++i) candidates[i] &= with_word[i];
+  }
+
+  // The words may be spread over the name and the author, or be separated
+  // differently than in the term; the term must appear as a whole.
+  for (uint32_t i = 0; i < h->num_apps; ++i) {
+    if ((candidates[i / 32] & (1u << (i % 32))) == 0) continue;
+    if (containsLower(text(indexed[i].name), term) ||
+        containsLower(text(indexed[i].author), term)) {
+      (*bits)[i / 32] |= 1u << (i % 32);
+    }
+  }
+}
+
+const char* CatalogIndex::text(uint32_t offset) const {
+  auto* h = reinterpret_cast<const IndexHeader*>(data_);
+  size_t strings = sizeof(IndexHeader) + h->num_apps * sizeof(IndexedApp) +
+                   h->num_words * sizeof(IndexedWord) + h->num_postings * sizeof(uint16_t);
+  return reinterpret_cast<const char*>(data_ + strings + offset);
+}
+
+}  // namespace retrostore
@@ -0,0 +1,87 @@
+#pragma once
+
+#ifndef _RETROSTORE_CATALOG_INDEX_H_
+#define _RETROSTORE_CATALOG_INDEX_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+
+#include "retrostore.h"
+
+namespace retrostore {
+
+// Label of the data partition in partitions.csv that holds the index.
+#define CATALOG_INDEX_PARTITION "rs_index"
+// Apps requested per call while syncing.
+#define CATALOG_INDEX_SYNC_PAGE 50
+
+// Full-text index of the catalog, kept in flash, that answers nano queries
+// without the network.
+//
+// Sync() downloads the whole catalog in nano form, plus which media types
+// each app has, and writes a compact index to the partition: the apps with
+// a bitmap of their media types, and a sorted table of the lowercase words
+// in their names and authors, each with the list of apps it occurs in. The
+// index survives restarts and is searched in place through the flash cache,
+// so a query costs a few binary searches and no copy of the catalog in RAM.
+// That makes it cheap enough to query on every keystroke.
+//
+// Queries take the same form as the server's: terms separated by " OR ",
+// each matched case-insensitively against the name and the author, and
+// optionally only apps that have all of `hasTypes`. Results come in catalog
+// order. Unlike the server, a term only matches at the start of a word:
+// "don" finds Donkey Kong, "onkey" does not.
+//
+// The index is as fresh as the last Sync(). Not thread-safe.
+class CatalogIndex {
+ public:
+  explicit CatalogIndex(const char* partition_label = CATALOG_INDEX_PARTITION);
+  ~CatalogIndex();
+
+  // Whether the partition was found. If not, every call fails.
+  bool ok() const { return partition_ != nullptr; }
+  // Whether an index is in flash, i.e. queries can be answered.
+  bool ready() const { return data_ != nullptr; }
+
+  // Rebuilds the index from the catalog on the server. The old index is
+  // erased first; if syncing fails part way, there is none until the next
+  // successful Sync().
+  bool Sync(RetroStore* rs);
+
+  // Same contract as RetroStore::FetchAppsNano, answered from the index.
+  // Fails if there is no index.
+  bool FetchAppsNano(int start, int num, const std::string& query,
+                     const std::vector<RsMediaType>& hasTypes,
+                     std::vector<RsAppNano>* apps);
+
+  // Erases the index.
+  void Clear();
+
+  // Apps in the index.
+  int apps() const;
+  // Distinct words in the index.
+  int words() const;
+  // Bytes of flash the index takes.
+  size_t size() const;
+
+ private:
+  // Maps the index in the partition, if there is a valid one.
+  void load();
+  void unmap();
+  // Sets the bits of the apps that match `term`, which is lowercase.
+  void match(const std::string& term, std::vector<uint32_t>* bits) const;
+  const char* text(uint32_t offset) const;
+
+  const esp_partition_t* partition_;
+  // The mapped index, starting with its header.
+  const uint8_t* data_;
+  spi_flash_mmap_handle_t handle_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_CATALOG_INDEX_H_ */
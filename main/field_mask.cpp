@@ -0,0 +1,95 @@
+#include "field_mask.h"
+
+namespace retrostore {
+
+namespace {
+
+void trimApp(RsFieldMask fields, RsApp* app) {
+  if (!(fields & RS_APP_ID)) std::string().swap(app->id);
+  if (!(fields & RS_APP_NAME)) std::string().swap(app->name);
+  if (!(fields & RS_APP_VERSION)) std::string().swap(app->version);
+  if (!(fields & RS_APP_DESCRIPTION)) std::string().swap(app->description);
+  if (!(fields & RS_APP_RELEASE_YEAR)) app->release_year = 0;
+  if (!(fields & RS_APP_SCREENSHOT_URLS)) std::vector<std::string>().swap(app->screenshot_urls);
+  if (!(fields & RS_APP_AUTHOR)) std::string().swap(app->author);
+  if (!(fields & RS_APP_MODEL)) app->model = RsTrs80Model_UNKNOWN_MODEL;
+}
+
+void trimImage(RsFieldMask fields, RsMediaImage* image) {
+  if (!(fields & RS_IMAGE_TYPE)) image->type = RsMediaType_UNKNOWN;
+  if (!(fields & RS_IMAGE_FILENAME)) std::string().swap(image->filename);
+  if (!(fields & RS_IMAGE_DATA)) image->data.reset();
+  if (!(fields & RS_IMAGE_UPLOAD_TIME)) image->uploadTime = 0;
+  if (!(fields & RS_IMAGE_DESCRIPTION)) std::string().swap(image->description);
+}
+
+}  // namespace
+
+bool FetchAppFields(RetroStore* rs, const std::string& appId, RsFieldMask fields, RsApp* app) {
+  // There is no nano call for a single app.
+  if (!rs->FetchApp(appId, app)) return false;
+  trimApp(fields, app);
+  return true;
+}
+
+bool FetchAppsFields(RetroStore* rs, int start, int num, const std::string& query,
+                     RsFieldMask fields, std::vector<RsApp>* apps) {
+  if ((fields & ~RS_APP_NANO_FIELDS) != 0) {
+    if (!rs->FetchApps(start, num, query, apps)) return false;
+    for (auto& app : *apps) trimApp(fields, &app);
+    return true;
+  }
+  std::vector<RsAppNano> nanos;
+  if (!rs->FetchAppsNano(start, num, query, std::vector<RsMediaType>(), &nanos)) return false;
+  apps->clear();
+  apps->reserve(nanos.size());
+  for (auto& nano : nanos) {
+    RsApp app;
+    app.id = std::move(nano.id);
+    app.name = std::move(nano.name);
+    app.version = std::move(nano.version);
+    app.release_year = nano.release_year;
+    app.author = std::move(nano.author);
+    app.model = nano.model;
+    trimApp(fields, &app);
+    apps->push_back(std::move(app));
+  }
+  return true;
+}
+
+bool FetchMediaImagesFields(RetroStore* rs, const std::string& appId,
+                            const std::vector<RsMediaType>& types, RsFieldMask fields,
+                            std::vector<RsMediaImage>* images) {
+  if (fields & RS_IMAGE_DATA) {
+    if (!rs->FetchMediaImages(appId, types, images)) return false;
+    for (auto& image : *images) trimImage(fields, &image);
+    return true;
+  }
+  std::vector<RsMediaImageRef> refs;
+  if (!rs->FetchMediaImageRefs(appId, types, &refs)) return false;
+  images->clear();
+  images->reserve(refs.size());
+  for (auto& ref : refs) {
+    RsMediaImage image;
+    image.type = ref.type;
+    image.filename = std::move(ref.filename);
+    image.data_size = ref.data_size;
+    image.uploadTime = ref.uploadTime;
+    image.description = std::move(ref.description);
+    trimImage(fields, &image);
+    images->push_back(std::move(image));
+  }
+  return true;
+}
+
+bool DownloadStateFields(RetroStore* rs, int token, RsFieldMask fields, RsSystemState* state) {
+  if (!rs->DownloadState(token, !(fields & RS_STATE_REGION_DATA), state)) return false;
+  if (!(fields & RS_STATE_MODEL)) state->model = RsTrs80Model_UNKNOWN_MODEL;
+  if (!(fields & RS_STATE_REGISTERS)) state->registers = RsRegisters();
+  if (!(fields & (RS_STATE_REGIONS | RS_STATE_REGION_DATA))) {
+    std::vector<RsMemoryRegion>().swap(state->regions);
+  }
+  return true;
+}
+
+}  // namespace retrostore
@@ -0,0 +1,71 @@
+#pragma once
+
+#ifndef _RETROSTORE_FIELD_MASK_H_
+#define _RETROSTORE_FIELD_MASK_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "retrostore.h"
+
+namespace retrostore {
+
+// Fields a caller wants filled in, as a bitwise OR of the flags below.
+typedef uint32_t RsFieldMask;
+
+// Fields of RsApp.
+#define RS_APP_ID (1 << 0)
+#define RS_APP_NAME (1 << 1)
+#define RS_APP_VERSION (1 << 2)
+#define RS_APP_DESCRIPTION (1 << 3)
+#define RS_APP_RELEASE_YEAR (1 << 4)
+#define RS_APP_SCREENSHOT_URLS (1 << 5)
+#define RS_APP_AUTHOR (1 << 6)
+#define RS_APP_MODEL (1 << 7)
+// The fields of RsAppNano, all a list view shows.
+#define RS_APP_NANO_FIELDS                                                           \
+  (RS_APP_ID | RS_APP_NAME | RS_APP_VERSION | RS_APP_RELEASE_YEAR | RS_APP_AUTHOR | \
+   RS_APP_MODEL)
+#define RS_APP_ALL_FIELDS 0xff
+
+// Fields of RsMediaImage. data_size is always filled in.
+#define RS_IMAGE_TYPE (1 << 0)
+#define RS_IMAGE_FILENAME (1 << 1)
+#define RS_IMAGE_DATA (1 << 2)
+#define RS_IMAGE_UPLOAD_TIME (1 << 3)
+#define RS_IMAGE_DESCRIPTION (1 << 4)
+#define RS_IMAGE_ALL_FIELDS 0x1f
+
+// Fields of RsSystemState. RS_STATE_REGIONS is the start and length of each
+// region, RS_STATE_REGION_DATA their bytes.
+#define RS_STATE_MODEL (1 << 0)
+#define RS_STATE_REGISTERS (1 << 1)
+#define RS_STATE_REGIONS (1 << 2)
+#define RS_STATE_REGION_DATA (1 << 3)
+#define RS_STATE_ALL_FIELDS 0x0f
+
+// Fetches with a field mask, for screens that show only some of the fields.
+//
+// Each picks the cheapest SDK call that carries every requested field:
+// FetchAppsNano for apps without description or screenshot URLs,
+// FetchMediaImageRefs for images without data, and DownloadState without
+// region data for states without it. Fields that were not requested are
+// left empty, zero or null even where the call returned them, so that
+// results held for a list screen do not keep them in RAM.
+
+// Same contract as RetroStore::FetchApp.
+bool FetchAppFields(RetroStore* rs, const std::string& appId, RsFieldMask fields, RsApp* app);
+// Same contract as RetroStore::FetchApps.
+bool FetchAppsFields(RetroStore* rs, int start, int num, const std::string& query,
+                     RsFieldMask fields, std::vector<RsApp>* apps);
+// Same contract as RetroStore::FetchMediaImages.
+bool FetchMediaImagesFields(RetroStore* rs, const std::string& appId,
+                            const std::vector<RsMediaType>& types, RsFieldMask fields,
+                            std::vector<RsMediaImage>* images);
+// Same contract as RetroStore::DownloadState.
+bool DownloadStateFields(RetroStore* rs, int token, RsFieldMask fields, RsSystemState* state);
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_FIELD_MASK_H_ */
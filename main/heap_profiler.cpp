@@ -0,0 +1,244 @@
+#include "heap_profiler.h"
+
+#include <cstring>
+#include <inttypes.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#ifndef CONFIG_RS_HEAP_PROFILER_BLOCKS
+#define CONFIG_RS_HEAP_PROFILER_BLOCKS 512
+#endif
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-heap";
+
+#define NO_SITE -1
+
+void logSite(const RsHeapSiteStats& site) {
+  ESP_LOGI(TAG, "%s: %u calls, %u allocations (%" PRIu64 " bytes, largest %u), %u frees, "
+           "%d bytes live (peak %d), min free %u, min largest free block %u, "
+           "fragmentation %u%%",
+           site.name, (unsigned) site.calls, (unsigned) site.allocations, site.allocated_bytes,
+           (unsigned) site.largest_allocation, (unsigned) site.frees, (int) site.live_bytes,
+           (int) site.peak_live_bytes, (unsigned) site.min_free_heap,
+           (unsigned) site.min_largest_free_block, (unsigned) site.max_fragmentation);
+}
+
+#ifdef CONFIG_RS_HEAP_PROFILER
+
+#define NUM_BLOCKS CONFIG_RS_HEAP_PROFILER_BLOCKS
+
+struct Block {
+  void* ptr;
+  uint32_t size;
+  int32_t site;
+};
+
+// Guards everything below; the hooks run on every task.
+portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+RsHeapSiteStats s_sites[HEAP_PROFILER_MAX_SITES];
+int s_num_sites = 0;
+// Open addressing with linear probing, keyed by pointer.
+Block s_blocks[NUM_BLOCKS];
+uint32_t s_untracked = 0;
+
+// The site the task is allocating for.
+thread_local int t_site = NO_SITE;
+
+size_t homeSlot(const void* ptr) {
+  return ((uintptr_t) ptr >> 3) * 2654435761u % NUM_BLOCKS;
+}
+
+bool remember(void* ptr, uint32_t size, int site) {
+  size_t i = homeSlot(ptr);
+  for (int n = 0; n < NUM_BLOCKS; ++n, i = (i + 1) % NUM_BLOCKS) {
+    if (s_blocks[i].ptr == nullptr) {
+      s_blocks[i] = {ptr, size, site};
+      return true;
+    }
+  }
+  return false;
+}
+
+// Removes the block from the table. The entries after it in the same
+// cluster are shifted back, so that lookups never need tombstones.
+bool forget(void* ptr, Block* block) {
+  size_t hole = homeSlot(ptr);
+  int n = 0;
+  for (; n < NUM_BLOCKS; ++n, hole = (hole + 1) % NUM_BLOCKS) {
+    if (s_blocks[hole].ptr == nullptr) return false;
+    if (s_blocks[hole].ptr == ptr) break;
+  }
+  if (n == NUM_BLOCKS) return false;
+  *block = s_blocks[hole];
+  size_t j = hole;
+  for (n = 1; n < NUM_BLOCKS; ++n) {
+    j = (j + 1) % NUM_BLOCKS;
+    if (s_blocks[j].ptr == nullptr) break;
+    size_t home = homeSlot(s_blocks[j].ptr);
+    // An entry may only move back if that does not put it before its home.
+    bool stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+    if (!stays) {
+      s_blocks[hole] = s_blocks[j];
+      hole = j;
+    }
+  }
+  s_blocks[hole].ptr = nullptr;
+  return true;
+}
+
+void onAllocationFailed(size_t size, uint32_t caps, const char* function_name) {
+  int site = t_site;
+  ESP_LOGE(TAG, "%s of %d bytes failed while allocating for %s.", function_name, (int) size,
+           site == NO_SITE ? "no site" : s_sites[site].name);
+  // Read without the lock: the device is about to go down, and a torn
+  // counter is better than no report.
+  for (int i = 0; i < s_num_sites; ++i) logSite(s_sites[i]);
+}
+
+#endif  // CONFIG_RS_HEAP_PROFILER
+
+}  // namespace
+
+#ifdef CONFIG_RS_HEAP_PROFILER
+
+HeapScope::HeapScope(const char* site) : site_(NO_SITE), previous_(t_site) {
+  portENTER_CRITICAL(&s_mux);
+  for (int i = 0; i < s_num_sites; ++i) {
+    if (strncmp(s_sites[i].name, site, HEAP_PROFILER_SITE_NAME_LENGTH - 1) == 0) {
+      site_ = i;
+      break;
+    }
+  }
+  if (site_ == NO_SITE && s_num_sites < HEAP_PROFILER_MAX_SITES) {
+    site_ = s_num_sites++;
+    auto& stats = s_sites[site_];
+    memset(&stats, 0, sizeof(stats));
+    strncpy(stats.name, site, HEAP_PROFILER_SITE_NAME_LENGTH - 1);
+    stats.min_free_heap = UINT32_MAX;
+    stats.min_largest_free_block = UINT32_MAX;
+  }
+  if (site_ != NO_SITE) s_sites[site_].calls++;
+  portEXIT_CRITICAL(&s_mux);
+  t_site = site_;
+}
+
+HeapScope::~HeapScope() {
+  t_site = previous_;
+  if (site_ == NO_SITE) return;
+  uint32_t free_heap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  uint32_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  uint32_t fragmentation = free_heap == 0 ? 0 : 100 - (uint64_t) largest * 100 / free_heap;
+  portENTER_CRITICAL(&s_mux);
+  auto& stats = s_sites[site_];
+  if (free_heap < stats.min_free_heap) stats.min_free_heap = free_heap;
+  if (largest < stats.min_largest_free_block) stats.min_largest_free_block = largest;
+  if (fragmentation > stats.max_fragmentation) stats.max_fragmentation = fragmentation;
+  portEXIT_CRITICAL(&s_mux);
+}
+
+bool HeapProfiler::enabled() {
+  return true;
+}
+
+std::vector<RsHeapSiteStats> HeapProfiler::Sites() {
+  // Allocated before taking the lock, which the hooks need.
+  std::vector<RsHeapSiteStats> sites(HEAP_PROFILER_MAX_SITES);
+  portENTER_CRITICAL(&s_mux);
+  int count = s_num_sites;
+  memcpy(sites.data(), s_sites, count * sizeof(RsHeapSiteStats));
+  portEXIT_CRITICAL(&s_mux);
+  sites.resize(count);
+  return sites;
+}
+
+uint32_t HeapProfiler::untracked() {
+  return s_untracked;
+}
+
+void HeapProfiler::Reset() {
+  portENTER_CRITICAL(&s_mux);
+  s_num_sites = 0;
+  s_untracked = 0;
+  memset(s_blocks, 0, sizeof(s_blocks));
+  portEXIT_CRITICAL(&s_mux);
+}
+
+void HeapProfiler::LogOnAllocationFailure() {
+  heap_caps_register_failed_alloc_callback(&onAllocationFailed);
+}
+
+#else  // CONFIG_RS_HEAP_PROFILER
+
+HeapScope::HeapScope(const char* site) : site_(NO_SITE), previous_(NO_SITE) {}
+
+HeapScope::~HeapScope() {}
+
+bool HeapProfiler::enabled() {
+  return false;
+}
+
+std::vector<RsHeapSiteStats> HeapProfiler::Sites() {
+  return std::vector<RsHeapSiteStats>();
+}
+
+uint32_t HeapProfiler::untracked() {
+  return 0;
+}
+
+void HeapProfiler::Reset() {}
+
+void HeapProfiler::LogOnAllocationFailure() {}
+
+#endif  // CONFIG_RS_HEAP_PROFILER
+
+void HeapProfiler::Log() {
+  if (!enabled()) return;
+  for (const auto& site : Sites()) logSite(site);
+  if (untracked() > 0) {
+    ESP_LOGW(TAG, "%u allocations were not tracked; raise CONFIG_RS_HEAP_PROFILER_BLOCKS.",
+             (unsigned) untracked());
+  }
+}
+
+}  // namespace retrostore
+
+#ifdef CONFIG_RS_HEAP_PROFILER
+
+// Called by the heap for every allocation and free (CONFIG_HEAP_USE_HOOKS).
+extern "C" void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+  using namespace retrostore;
+  int site = t_site;
+  if (site == NO_SITE || ptr == nullptr) return;
+  portENTER_CRITICAL(&s_mux);
+  auto& stats = s_sites[site];
+  stats.allocations++;
+  stats.allocated_bytes += size;
+  if (size > stats.largest_allocation) stats.largest_allocation = size;
+  if (remember(ptr, size, site)) {
+    stats.live_bytes += size;
+    if (stats.live_bytes > stats.peak_live_bytes) stats.peak_live_bytes = stats.live_bytes;
+  } else {
+    s_untracked++;
+  }
+  portEXIT_CRITICAL(&s_mux);
+}
+
+extern "C" void esp_heap_trace_free_hook(void* ptr) {
+  using namespace retrostore;
+  if (ptr == nullptr) return;
+  portENTER_CRITICAL(&s_mux);
+  Block block;
+  if (forget(ptr, &block)) {
+    s_sites[block.site].frees++;
+    s_sites[block.site].live_bytes -= block.size;
+  }
+  portEXIT_CRITICAL(&s_mux);
+}
+
+#endif  // CONFIG_RS_HEAP_PROFILER
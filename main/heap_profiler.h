@@ -0,0 +1,90 @@
+#pragma once
+
+#ifndef _RETROSTORE_HEAP_PROFILER_H_
+#define _RETROSTORE_HEAP_PROFILER_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "sdkconfig.h"
+
+namespace retrostore {
+
+// Most call sites the profiler tells apart; allocations in further sites are
+// not attributed.
+#define HEAP_PROFILER_MAX_SITES 32
+#define HEAP_PROFILER_SITE_NAME_LENGTH 32
+
+// Heap use attributed to one call site, e.g. one RetroStore API.
+struct RsHeapSiteStats {
+  char name[HEAP_PROFILER_SITE_NAME_LENGTH];
+  uint32_t calls;
+  uint32_t allocations;
+  uint32_t frees;
+  uint64_t allocated_bytes;
+  // Bytes allocated in this site that have not been freed yet, wherever they
+  // are freed. A site whose live bytes keep growing across calls leaks.
+  int32_t live_bytes;
+  int32_t peak_live_bytes;
+  uint32_t largest_allocation;
+  // Heap state at the end of the worst call: the least free heap, the
+  // smallest largest free block and the highest fragmentation, i.e. the
+  // share of the free heap not in the largest free block, in percent.
+  uint32_t min_free_heap;
+  uint32_t min_largest_free_block;
+  uint32_t max_fragmentation;
+};
+
+// Attributes every allocation the current task makes to `site` for as long
+// as the scope lives. Scopes nest; the innermost one wins. Costs nothing
+// unless CONFIG_RS_HEAP_PROFILER is set.
+//
+//   {
+//     HeapScope scope("FetchApp");
+//     rs->FetchApp(appId, &app);
+//   }
+class HeapScope {
+ public:
+  explicit HeapScope(const char* site);
+  ~HeapScope();
+  HeapScope(const HeapScope&) = delete;
+  HeapScope& operator=(const HeapScope&) = delete;
+
+ private:
+  int site_;
+  int previous_;
+};
+
+// Per-site heap statistics, collected through the heap's allocation hooks:
+// CONFIG_HEAP_USE_HOOKS on the device, operator new and delete on the host.
+//
+// The hooks run inside every allocation, so the profiler allocates nothing
+// itself: sites live in a fixed table, and up to
+// CONFIG_RS_HEAP_PROFILER_BLOCKS live blocks are remembered so that frees
+// can be charged to the site that made the allocation. Blocks beyond that
+// are counted as allocated but never as live.
+class HeapProfiler {
+ public:
+  // Whether the profiler was compiled in.
+  static bool enabled();
+
+  // Statistics of every site seen so far, in order of first use.
+  static std::vector<RsHeapSiteStats> Sites();
+  // Allocations that could not be remembered because the block table was
+  // full.
+  static uint32_t untracked();
+  // Forgets all statistics and remembered blocks. Only while no scope is
+  // open.
+  static void Reset();
+
+  // Logs one line per site.
+  static void Log();
+  // Logs the site that was allocating and the statistics of every site
+  // when an allocation fails, the usual last words of a device that runs
+  // out of memory after hours of use.
+  static void LogOnAllocationFailure();
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_HEAP_PROFILER_H_ */
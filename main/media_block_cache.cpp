@@ -0,0 +1,157 @@
+#include "media_block_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "esp_log.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-media-cache";
+
+}  // namespace
+
+MediaBlockCache::MediaBlockCache(RetroStore* rs, int block_size, int budget, int read_ahead)
+    : rs_(rs),
+      block_size_(std::max(block_size, 1)),
+      budget_(std::max(budget, block_size_)),
+      read_ahead_(std::max(read_ahead, 0)),
+      cached_bytes_(0),
+      last_end_(-1),
+      hits_(0),
+      misses_(0),
+      prefetched_(0),
+      requests_(0) {
+  // The block being read and its read-ahead must fit in the budget together.
+  int max_blocks = budget_ / block_size_;
+  if (read_ahead_ > max_blocks - 1) read_ahead_ = max_blocks - 1;
+}
+
+bool MediaBlockCache::Read(const RsMediaImageRef& ref, int start, int length,
+                           RsMediaRegion* region) {
+  if (length < 0) return false;
+  std::unique_ptr<uint8_t> data(new uint8_t[std::max(length, 1)]);
+  int read = 0;
+  if (!Read(ref, start, length, data.get(), &read)) return false;
+  region->start = start;
+  region->length = read;
+  region->data = std::move(data);
+  return true;
+}
+
+bool MediaBlockCache::Read(const RsMediaImageRef& ref, int start, int length,
+                           uint8_t* out, int* read) {
+  if (start < 0 || length < 0 || start > ref.data_size) return false;
+  int end = std::min(start + length, ref.data_size);
+  *read = 0;
+  if (end <= start) return true;
+
+  bool sequential = ref.token == last_token_ && start >= last_end_ &&
+                    start <= last_end_ + block_size_;
+  int first = start / block_size_;
+  int last = (end - 1) / block_size_;
+  int num_image_blocks = (ref.data_size + block_size_ - 1) / block_size_;
+  int max_run = budget_ / block_size_;
+  // Blocks up to here were fetched for this read and already counted.
+  int fetched_until = -1;
+
+  for (int b = first; b <= last; ++b) {
+    BlockKey key(ref.token, b);
+    const Block* block = find(key);
+    if (block != nullptr) {
+      if (b > fetched_until) hits_++;
+    } else {
+      // Fetch the run of missing blocks this read needs in one request.
+      int run_end = b;
+      while (run_end < last && run_end - b + 1 < max_run &&
+             index_.find(BlockKey(ref.token, run_end + 1)) == index_.end()) {
+        run_end++;
+      }
+      misses_ += run_end - b + 1;
+      fetched_until = run_end;
+      int extra = 0;
+      if (sequential && run_end == last) {
+        while (extra < read_ahead_ && run_end + extra + 1 < num_image_blocks &&
+               run_end - b + extra + 2 <= max_run &&
+               index_.find(BlockKey(ref.token, run_end + extra + 1)) == index_.end()) {
+          extra++;
+        }
+      }
+      if (!fetch(ref, b, run_end - b + 1 + extra)) return false;
+      prefetched_ += extra;
+      block = find(key);
+      if (block == nullptr) {
+        ESP_LOGW(TAG, "Block %d of '%s' missing after fetch.", b, ref.token.c_str());
+        return false;
+      }
+    }
+
+    int block_start = b * block_size_;
+    int from = std::max(start, block_start);
+    int to = std::min(end, block_start + block->length);
+    if (to <= from) return false;
+    memcpy(out + (from - start), block->data.get() + (from - block_start), to - from);
+    *read += to - from;
+  }
+
+  last_token_ = ref.token;
+  last_end_ = end;
+  return true;
+}
+
+void MediaBlockCache::Clear() {
+  lru_.clear();
+  index_.clear();
+  cached_bytes_ = 0;
+  last_token_.clear();
+  last_end_ = -1;
+}
+
+const MediaBlockCache::Block* MediaBlockCache::find(const BlockKey& key) {
+  auto it = index_.find(key);
+  if (it == index_.end()) return nullptr;
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return &lru_.front();
+}
+
+bool MediaBlockCache::fetch(const RsMediaImageRef& ref, int first_block, int num_blocks) {
+  int start = first_block * block_size_;
+  int length = std::min(num_blocks * block_size_, ref.data_size - start);
+  RsMediaRegion region;
+  requests_++;
+  if (!rs_->FetchMediaImageRegion(ref, start, length, &region)) {
+    ESP_LOGW(TAG, "Fetching %d+%d of '%s' failed.", start, length, ref.token.c_str());
+    return false;
+  }
+  // Insert back to front so that the first block ends up most recently used.
+  int blocks = (region.length + block_size_ - 1) / block_size_;
+  for (int i = blocks - 1; i >= 0; --i) {
+    int offset = i * block_size_;
+    insert(BlockKey(ref.token, first_block + i), region.data.get() + offset,
+           std::min(block_size_, region.length - offset));
+  }
+  return true;
+}
+
+void MediaBlockCache::insert(const BlockKey& key, const uint8_t* data, int length) {
+  if (index_.find(key) != index_.end()) return;
+  Block block;
+  block.key = key;
+  block.length = length;
+  block.data.reset(new uint8_t[length]);
+  memcpy(block.data.get(), data, length);
+  lru_.push_front(std::move(block));
+  index_[key] = lru_.begin();
+  cached_bytes_ += length;
+
+  while (cached_bytes_ > budget_ && lru_.size() > 1) {
+    auto& oldest = lru_.back();
+    cached_bytes_ -= oldest.length;
+    index_.erase(oldest.key);
+    lru_.pop_back();
+  }
+}
+
+}  // namespace retrostore
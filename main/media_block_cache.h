@@ -0,0 +1,92 @@
+#pragma once
+
+#ifndef _RETROSTORE_MEDIA_BLOCK_CACHE_H_
+#define _RETROSTORE_MEDIA_BLOCK_CACHE_H_
+
+#include <list>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <utility>
+
+#include "retrostore.h"
+
+namespace retrostore {
+
+#define MEDIA_CACHE_BLOCK_SIZE 1024
+#define MEDIA_CACHE_BUDGET (16 * 1024)
+#define MEDIA_CACHE_READ_AHEAD 2
+
+// LRU cache of fixed-size media image blocks, keyed by RsMediaImageRef::token.
+//
+// Small reads (e.g. an emulator reading one sector at a time) are served from
+// whole blocks, so the network is hit once per block instead of once per
+// read. Missing blocks needed by one read are fetched with a single request,
+// and when reads are detected to be sequential the request is extended by
+// `read_ahead` blocks. The cache never holds more than `budget` bytes of
+// block data.
+//
+// Not thread-safe.
+class MediaBlockCache {
+ public:
+  MediaBlockCache(RetroStore* rs,
+                  int block_size = MEDIA_CACHE_BLOCK_SIZE,
+                  int budget = MEDIA_CACHE_BUDGET,
+                  int read_ahead = MEDIA_CACHE_READ_AHEAD);
+
+  // Same contract as RetroStore::FetchMediaImageRegion: reads beyond the end
+  // of the image are truncated.
+  bool Read(const RsMediaImageRef& ref, int start, int length, RsMediaRegion* region);
+  // Copies up to `length` bytes at `start` into `out`; `read` receives the
+  // number of bytes copied.
+  bool Read(const RsMediaImageRef& ref, int start, int length, uint8_t* out, int* read);
+
+  // Drops all cached blocks; the counters are kept.
+  void Clear();
+
+  // Block lookups served from the cache.
+  long hits() const { return hits_; }
+  // Block lookups that required a request.
+  long misses() const { return misses_; }
+  // Blocks fetched ahead of being read.
+  long prefetched() const { return prefetched_; }
+  // Requests sent to the RetroStore.
+  long requests() const { return requests_; }
+  int cached_bytes() const { return cached_bytes_; }
+
+ private:
+  typedef std::pair<std::string, int> BlockKey;
+  struct Block {
+    BlockKey key;
+    int length;
+    std::unique_ptr<uint8_t[]> data;
+  };
+
+  const Block* find(const BlockKey& key);
+  bool fetch(const RsMediaImageRef& ref, int first_block, int num_blocks);
+  void insert(const BlockKey& key, const uint8_t* data, int length);
+
+  RetroStore* rs_;
+  const int block_size_;
+  const int budget_;
+  int read_ahead_;
+
+  // Most recently used first.
+  std::list<Block> lru_;
+  std::map<BlockKey, std::list<Block>::iterator> index_;
+  int cached_bytes_;
+
+  // End of the previous read, used to detect sequential access.
+  std::string last_token_;
+  int last_end_;
+
+  long hits_;
+  long misses_;
+  long prefetched_;
+  long requests_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_MEDIA_BLOCK_CACHE_H_ */
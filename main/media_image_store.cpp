@@ -0,0 +1,392 @@
+#include "media_image_store.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include "esp_log.h"
+
+#include "media_stream.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-image-store";
+
+#define ENTRY_MAGIC 0x52534d49  // "RSMI"
+#define ERASED_MAGIC 0xffffffff
+
+#define PROGRESS_KEY "progress"
+#define PROGRESS_VERSION 1
+
+const uint32_t FNV_OFFSET_BASIS = 2166136261u;
+
+uint32_t fnv1a(uint32_t hash, const uint8_t* data, size_t length) {
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+uint32_t fnv1a(const uint8_t* data, size_t length) {
+  return fnv1a(FNV_OFFSET_BASIS, data, length);
+}
+
+uint32_t tokenHash(const std::string& token) {
+  return fnv1a((const uint8_t*) token.data(), token.size());
+}
+
+uint32_t sectorAlign(uint32_t offset) {
+  return (offset + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+}
+
+// Continues `hash` over `length` bytes of flash, a small piece at a time.
+bool flashChecksum(const esp_partition_t* partition, uint32_t offset, int length,
+                   uint32_t* hash) {
+  uint8_t buffer[256];
+  for (int done = 0; done < length; done += sizeof(buffer)) {
+    int n = std::min<int>(sizeof(buffer), length - done);
+    if (esp_partition_read(partition, offset + done, buffer, n) != ESP_OK) return false;
+    *hash = fnv1a(*hash, buffer, n);
+  }
+  return true;
+}
+
+}  // namespace
+
+MappedMediaImage::MappedMediaImage() : data_(nullptr), size_(0), handle_(0) {}
+
+MappedMediaImage::~MappedMediaImage() {
+  Unmap();
+}
+
+MappedMediaImage::MappedMediaImage(MappedMediaImage&& other)
+    : data_(other.data_), size_(other.size_), handle_(other.handle_) {
+  other.data_ = nullptr;
+  other.size_ = 0;
+}
+
+MappedMediaImage& MappedMediaImage::operator=(MappedMediaImage&& other) {
+  if (this != &other) {
+    Unmap();
+    data_ = other.data_;
+    size_ = other.size_;
+    handle_ = other.handle_;
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+void MappedMediaImage::Unmap() {
+  if (data_ == nullptr) return;
+  spi_flash_munmap(handle_);
+  data_ = nullptr;
+  size_ = 0;
+}
+
+MediaImageStore::MediaImageStore(const char* partition_label, const char* nvs_namespace)
+    : partition_(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                          partition_label)),
+      nvs_(0),
+      nvs_open_(false),
+      downloading_(false),
+      progress_(),
+      slots_used_(0),
+      next_offset_(SPI_FLASH_SEC_SIZE) {
+  if (partition_ == nullptr) {
+    ESP_LOGW(TAG, "Partition '%s' not found, image store disabled.", partition_label);
+    return;
+  }
+  auto err = nvs_open(nvs_namespace, NVS_READWRITE, &nvs_);
+  if (err == ESP_OK) {
+    nvs_open_ = true;
+  } else {
+    ESP_LOGW(TAG, "Opening NVS namespace %s failed (0x%x), downloads will not resume.",
+             nvs_namespace, err);
+  }
+  const int num_slots = SPI_FLASH_SEC_SIZE / sizeof(Entry);
+  for (; slots_used_ < num_slots; ++slots_used_) {
+    Entry entry;
+    esp_partition_read(partition_, slots_used_ * sizeof(Entry), &entry, sizeof(entry));
+    if (entry.magic == ERASED_MAGIC) break;
+    if (entry.magic != ENTRY_MAGIC) continue;
+    entries_.push_back(entry);
+    uint32_t end = sectorAlign(entry.offset + entry.token_length + entry.size);
+    if (end > next_offset_) next_offset_ = end;
+  }
+  ESP_LOGI(TAG, "%d images stored, %d bytes free.", (int) entries_.size(), (int) free_bytes());
+  loadProgress();
+}
+
+MediaImageStore::~MediaImageStore() {
+  if (nvs_open_) nvs_close(nvs_);
+}
+
+bool MediaImageStore::Contains(const std::string& token) {
+  return find(token) != nullptr;
+}
+
+bool MediaImageStore::Map(const std::string& token, MappedMediaImage* image) {
+  auto* entry = find(token);
+  if (entry == nullptr) return false;
+  const void* data;
+  spi_flash_mmap_handle_t handle;
+  auto err = esp_partition_mmap(partition_, entry->offset + entry->token_length, entry->size,
+                                SPI_FLASH_MMAP_DATA, &data, &handle);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Mapping '%s' failed (0x%x).", token.c_str(), err);
+    return false;
+  }
+  image->Unmap();
+  image->data_ = static_cast<const uint8_t*>(data);
+  image->size_ = entry->size;
+  image->handle_ = handle;
+  return true;
+}
+
+bool MediaImageStore::Open(RetroStore* rs, const RsMediaImageRef& ref, MappedMediaImage* image) {
+  if (Map(ref.token, image)) return true;
+  return Download(rs, ref) == ref.data_size && Map(ref.token, image);
+}
+
+int MediaImageStore::Download(RetroStore* rs, const RsMediaImageRef& ref, int max_bytes) {
+  if (Contains(ref.token)) return ref.data_size;
+  if (!ok() || ref.data_size <= 0) return -1;
+  if (!downloading_ || progress_token_ != ref.token || progress_.size != (uint32_t) ref.data_size) {
+    uint32_t data_offset = allocate(ref.token, ref.data_size);
+    if (data_offset == 0) return -1;
+    progress_.version = PROGRESS_VERSION;
+    progress_.data_offset = data_offset;
+    progress_.size = ref.data_size;
+    progress_.verified = 0;
+    progress_.checksum = FNV_OFFSET_BASIS;
+    progress_token_ = ref.token;
+    downloading_ = true;
+    saveProgress();
+  } else {
+    ESP_LOGI(TAG, "Resuming '%s' at %d of %d bytes.", ref.token.c_str(),
+             (int) progress_.verified, ref.data_size);
+  }
+
+  int start = progress_.verified;
+  int length = ref.data_size - start;
+  if (max_bytes >= 0 && length > max_bytes) length = max_bytes;
+  auto success = StreamMediaImageRange(rs, ref, start, length,
+                                       [this](int offset, const uint8_t* data, int length) {
+    return writeChunk(offset, data, length);
+  });
+  // Only checkpoints are recorded while streaming.
+  if (downloading_ && progress_.verified < progress_.size) saveProgress();
+  if (!success) {
+    ESP_LOGW(TAG, "Downloading '%s' into flash stopped at %d of %d bytes.", ref.token.c_str(),
+             progress(ref.token), ref.data_size);
+    return -1;
+  }
+  if (progress_.verified < progress_.size) return progress_.verified;
+
+  uint32_t data_offset = progress_.data_offset;
+  uint32_t checksum = progress_.checksum;
+  dropProgress();
+  return commit(ref.token, data_offset, ref.data_size, checksum) ? ref.data_size : -1;
+}
+
+int MediaImageStore::progress(const std::string& token) const {
+  return downloading_ && progress_token_ == token ? progress_.verified : 0;
+}
+
+bool MediaImageStore::Put(const std::string& token, const uint8_t* data, int size) {
+  uint32_t data_offset = allocate(token, size);
+  if (data_offset == 0) return false;
+  if (esp_partition_write(partition_, data_offset, data, size) != ESP_OK) {
+    ESP_LOGW(TAG, "Writing '%s' failed.", token.c_str());
+    return false;
+  }
+  return commit(token, data_offset, size, fnv1a(data, size));
+}
+
+void MediaImageStore::Clear() {
+  if (!ok()) return;
+  if (downloading_) dropProgress();
+  // Only what was written needs erasing.
+  esp_partition_erase_range(partition_, 0, next_offset_);
+  entries_.clear();
+  slots_used_ = 0;
+  next_offset_ = SPI_FLASH_SEC_SIZE;
+}
+
+size_t MediaImageStore::free_bytes() const {
+  return ok() ? partition_->size - next_offset_ : 0;
+}
+
+const MediaImageStore::Entry* MediaImageStore::find(const std::string& token) {
+  auto hash = tokenHash(token);
+  // Newest first, should a token have been stored twice.
+  for (auto it = entries_.rbegin(); it != entries_.rend(); ++it) {
+    if (it->token_hash != hash || it->token_length != token.size()) continue;
+    std::string stored(token.size(), '\0');
+    esp_partition_read(partition_, it->offset, &stored[0], stored.size());
+    if (stored == token) return &*it;
+  }
+  return nullptr;
+}
+
+uint32_t MediaImageStore::allocate(const std::string& token, int size) {
+  if (!ok() || size <= 0) return 0;
+  // The space of an unfinished download is about to be reused.
+  if (downloading_) dropProgress();
+  uint32_t needed = sectorAlign(token.size() + size);
+  if (needed > partition_->size - SPI_FLASH_SEC_SIZE) {
+    ESP_LOGW(TAG, "'%s' (%d bytes) does not fit in the partition.", token.c_str(), size);
+    return 0;
+  }
+  const int num_slots = SPI_FLASH_SEC_SIZE / sizeof(Entry);
+  if (slots_used_ >= num_slots || needed > partition_->size - next_offset_) {
+    ESP_LOGI(TAG, "Image store full, erasing it.");
+    Clear();
+  }
+  if (esp_partition_erase_range(partition_, next_offset_, needed) != ESP_OK ||
+      esp_partition_write(partition_, next_offset_, token.data(), token.size()) != ESP_OK) {
+    ESP_LOGW(TAG, "Preparing flash for '%s' failed.", token.c_str());
+    return 0;
+  }
+  return next_offset_ + token.size();
+}
+
+bool MediaImageStore::commit(const std::string& token, uint32_t data_offset, int size,
+                             uint32_t checksum) {
+  // Read back through the same mapping readers will use.
+  const void* data;
+  spi_flash_mmap_handle_t handle;
+  if (esp_partition_mmap(partition_, data_offset, size, SPI_FLASH_MMAP_DATA, &data, &handle) != ESP_OK) {
+    return false;
+  }
+  bool intact = fnv1a(static_cast<const uint8_t*>(data), size) == checksum;
+  spi_flash_munmap(handle);
+  if (!intact) {
+    ESP_LOGW(TAG, "'%s' does not read back correctly.", token.c_str());
+    return false;
+  }
+
+  Entry entry = {};
+  entry.magic = ENTRY_MAGIC;
+  entry.token_hash = tokenHash(token);
+  entry.offset = data_offset - token.size();
+  entry.token_length = token.size();
+  entry.size = size;
+  entry.checksum = checksum;
+  if (esp_partition_write(partition_, slots_used_ * sizeof(Entry), &entry, sizeof(entry)) != ESP_OK) {
+    return false;
+  }
+  slots_used_++;
+  entries_.push_back(entry);
+  next_offset_ = sectorAlign(data_offset + size);
+  return true;
+}
+
+void MediaImageStore::loadProgress() {
+  if (!nvs_open_) return;
+  size_t length = 0;
+  if (nvs_get_blob(nvs_, PROGRESS_KEY, nullptr, &length) != ESP_OK) return;
+  std::vector<uint8_t> record(length);
+  if (length <= sizeof(Progress) ||
+      nvs_get_blob(nvs_, PROGRESS_KEY, record.data(), &length) != ESP_OK) {
+    dropProgress();
+    return;
+  }
+  memcpy(&progress_, record.data(), sizeof(Progress));
+  progress_token_.assign((const char*) record.data() + sizeof(Progress), length - sizeof(Progress));
+
+  // The download can only be resumed while its image is still the first
+  // thing in the free space, its token intact.
+  uint32_t token_offset = progress_.data_offset - progress_token_.size();
+  std::string stored(progress_token_.size(), '\0');
+  bool valid = progress_.version == PROGRESS_VERSION && token_offset == next_offset_ &&
+               progress_.verified <= progress_.size &&
+               progress_.size <= partition_->size - progress_.data_offset &&
+               esp_partition_read(partition_, token_offset, &stored[0], stored.size()) == ESP_OK &&
+               stored == progress_token_ && find(progress_token_) == nullptr;
+
+  // A reset may have come after writing more chunks, up to the next
+  // checkpoint, but before recording them. Flash can only be erased a sector
+  // at a time, so resume at the start of the sector the verified bytes end
+  // in and erase from there to past anything written since.
+  uint32_t resume_offset = (progress_.data_offset + progress_.verified) / SPI_FLASH_SEC_SIZE *
+                           SPI_FLASH_SEC_SIZE;
+  uint32_t keep = resume_offset > token_offset ? resume_offset - progress_.data_offset : 0;
+  uint32_t kept_checksum = FNV_OFFSET_BASIS;
+  valid = valid && keep > 0 &&
+          flashChecksum(partition_, progress_.data_offset, keep, &kept_checksum);
+  uint32_t checksum = kept_checksum;
+  valid = valid &&
+          flashChecksum(partition_, resume_offset, progress_.verified - keep, &checksum) &&
+          checksum == progress_.checksum;
+  if (!valid) {
+    dropProgress();
+    return;
+  }
+  uint32_t erase_end = std::min(
+      sectorAlign(progress_.data_offset + progress_.verified + MEDIA_IMAGE_STORE_CHECKPOINT_BYTES +
+                  MEDIA_STREAM_CHUNK_SIZE),
+      sectorAlign(progress_.data_offset + progress_.size));
+  if (esp_partition_erase_range(partition_, resume_offset, erase_end - resume_offset) != ESP_OK) {
+    dropProgress();
+    return;
+  }
+  progress_.verified = keep;
+  progress_.checksum = kept_checksum;
+  downloading_ = true;
+  saveProgress();
+  ESP_LOGI(TAG, "Download of '%s' can resume at %d of %d bytes.", progress_token_.c_str(),
+           (int) progress_.verified, (int) progress_.size);
+}
+
+void MediaImageStore::saveProgress() {
+  if (!nvs_open_) return;
+  std::vector<uint8_t> record(sizeof(Progress) + progress_token_.size());
+  memcpy(record.data(), &progress_, sizeof(Progress));
+  memcpy(record.data() + sizeof(Progress), progress_token_.data(), progress_token_.size());
+  auto err = nvs_set_blob(nvs_, PROGRESS_KEY, record.data(), record.size());
+  if (err == ESP_OK) err = nvs_commit(nvs_);
+  if (err != ESP_OK) ESP_LOGW(TAG, "Recording download progress failed (0x%x).", err);
+}
+
+void MediaImageStore::dropProgress() {
+  downloading_ = false;
+  progress_token_.clear();
+  if (!nvs_open_) return;
+  nvs_erase_key(nvs_, PROGRESS_KEY);
+  nvs_commit(nvs_);
+}
+
+bool MediaImageStore::writeChunk(int offset, const uint8_t* data, int length) {
+  if (offset != (int) progress_.verified || length > (int) (progress_.size - progress_.verified)) {
+    return false;
+  }
+  uint32_t address = progress_.data_offset + offset;
+  if (esp_partition_write(partition_, address, data, length) != ESP_OK) return false;
+  uint8_t buffer[256];
+  for (int done = 0; done < length; done += sizeof(buffer)) {
+    int n = std::min<int>(sizeof(buffer), length - done);
+    if (esp_partition_read(partition_, address + done, buffer, n) != ESP_OK ||
+        memcmp(buffer, data + done, n) != 0) {
+      // Writing on top of these bytes cannot fix them, so start over.
+      ESP_LOGW(TAG, "Chunk at %d of '%s' does not read back correctly.", offset,
+               progress_token_.c_str());
+      dropProgress();
+      return false;
+    }
+  }
+  uint32_t before = progress_.verified;
+  progress_.verified += length;
+  progress_.checksum = fnv1a(progress_.checksum, data, length);
+  if (before / MEDIA_IMAGE_STORE_CHECKPOINT_BYTES !=
+      progress_.verified / MEDIA_IMAGE_STORE_CHECKPOINT_BYTES) {
+    saveProgress();
+  }
+  return true;
+}
+
+}  // namespace retrostore
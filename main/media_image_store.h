@@ -0,0 +1,158 @@
+#pragma once
+
+#ifndef _RETROSTORE_MEDIA_IMAGE_STORE_H_
+#define _RETROSTORE_MEDIA_IMAGE_STORE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "nvs.h"
+
+#include "retrostore.h"
+
+namespace retrostore {
+
+// Label of the data partition in partitions.csv that holds the images.
+#define MEDIA_IMAGE_STORE_PARTITION "rs_images"
+// NVS namespace that records the progress of an interrupted download.
+#define MEDIA_IMAGE_STORE_NAMESPACE "rs_images"
+// Bytes downloaded between progress records. Each record is an NVS write in
+// the partition shared with WiFi, so a reset costs up to this many bytes of
+// download instead.
+#define MEDIA_IMAGE_STORE_CHECKPOINT_BYTES (64 * 1024)
+
+// Read-only view of a stored image, mapped straight from flash. Unmapped when
+// destroyed. Move-only.
+class MappedMediaImage {
+ public:
+  MappedMediaImage();
+  ~MappedMediaImage();
+  MappedMediaImage(MappedMediaImage&& other);
+  MappedMediaImage& operator=(MappedMediaImage&& other);
+  MappedMediaImage(const MappedMediaImage&) = delete;
+  MappedMediaImage& operator=(const MappedMediaImage&) = delete;
+
+  const uint8_t* data() const { return data_; }
+  int size() const { return size_; }
+  bool mapped() const { return data_ != nullptr; }
+  void Unmap();
+
+ private:
+  friend class MediaImageStore;
+
+  const uint8_t* data_;
+  int size_;
+  spi_flash_mmap_handle_t handle_;
+};
+
+// Keeps downloaded media images in a flash partition, keyed by
+// RsMediaImageRef::token, and maps them into the address space on demand.
+//
+// Images are streamed into flash a chunk at a time, so storing one never
+// holds it in RAM, and reading a mapped image costs no RAM either: an
+// emulator reads its sectors straight from the flash cache. Images survive
+// restarts, so launching the same app again needs no download.
+//
+// The first sector of the partition is a directory; images follow, each
+// starting on a sector boundary. Space is not reclaimed image by image:
+// when the partition is full the store is wiped and refilled.
+//
+// Downloads are resumable. Every chunk is read back from flash before it
+// counts, and how far the download got is recorded in NVS along with a
+// checksum of the verified bytes, every MEDIA_IMAGE_STORE_CHECKPOINT_BYTES
+// and whenever a download stops short. A download cut short by a dropped
+// connection or a reset continues from there instead of from the start.
+// Only the newest download can be resumed; storing another image discards
+// its progress.
+//
+// Resuming requires nvs_flash_init(). Not thread-safe.
+class MediaImageStore {
+ public:
+  explicit MediaImageStore(const char* partition_label = MEDIA_IMAGE_STORE_PARTITION,
+                           const char* nvs_namespace = MEDIA_IMAGE_STORE_NAMESPACE);
+  ~MediaImageStore();
+
+  // Whether the partition was found. If not, every call fails.
+  bool ok() const { return partition_ != nullptr; }
+
+  bool Contains(const std::string& token);
+  // Maps the stored image with the given token.
+  bool Map(const std::string& token, MappedMediaImage* image);
+  // Maps the referenced image, downloading it into flash first if it is not
+  // stored yet.
+  bool Open(RetroStore* rs, const RsMediaImageRef& ref, MappedMediaImage* image);
+  // Downloads up to `max_bytes` more of the referenced image into flash, or
+  // all that is missing if negative, resuming an earlier download of it.
+  // Returns how many bytes of the image are in flash, ref.data_size once
+  // it is stored, or -1 if the download failed; what was verified before
+  // the failure is kept.
+  int Download(RetroStore* rs, const RsMediaImageRef& ref, int max_bytes = -1);
+  // Bytes of an unfinished download of the image that are in flash and
+  // verified; 0 if there is none.
+  int progress(const std::string& token) const;
+  // Stores an image that is already in memory.
+  bool Put(const std::string& token, const uint8_t* data, int size);
+
+  // Erases all images.
+  void Clear();
+
+  int images() const { return entries_.size(); }
+  // Bytes left for images.
+  size_t free_bytes() const;
+
+ private:
+  struct Entry {
+    uint32_t magic;
+    uint32_t token_hash;
+    uint32_t offset;
+    uint32_t token_length;
+    uint32_t size;
+    uint32_t checksum;
+    uint32_t reserved[2];
+  };
+
+  // Unfinished download, as recorded in NVS followed by its token.
+  struct Progress {
+    uint32_t version;
+    uint32_t data_offset;
+    uint32_t size;
+    // Bytes written and read back.
+    uint32_t verified;
+    // Running checksum of the verified bytes.
+    uint32_t checksum;
+  };
+
+  const Entry* find(const std::string& token);
+  // Reserves space for an image and writes its token, erasing the store
+  // first if it is full. Returns the offset of the image data, or 0.
+  uint32_t allocate(const std::string& token, int size);
+  // Checks the written image against `checksum` and adds it to the
+  // directory.
+  bool commit(const std::string& token, uint32_t data_offset, int size, uint32_t checksum);
+  // Picks up the recorded download, if it is intact.
+  void loadProgress();
+  void saveProgress();
+  void dropProgress();
+  // Writes a chunk at `offset` into the image being downloaded and reads
+  // it back.
+  bool writeChunk(int offset, const uint8_t* data, int length);
+
+  const esp_partition_t* partition_;
+  nvs_handle_t nvs_;
+  bool nvs_open_;
+  bool downloading_;
+  Progress progress_;
+  std::string progress_token_;
+  std::vector<Entry> entries_;
+  // Directory slots written so far, including any left broken by a reset.
+  int slots_used_;
+  // Start of the free space, on a sector boundary.
+  uint32_t next_offset_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_MEDIA_IMAGE_STORE_H_ */
@@ -0,0 +1,67 @@
+#include "media_stream.h"
+
+#include <cstring>
+
+#include "esp_log.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-media-stream";
+
+}  // namespace
+
+bool StreamMediaImage(RetroStore* rs, const RsMediaImageRef& ref,
+                      const RsMediaSink& sink, int chunk_size) {
+  return StreamMediaImageRange(rs, ref, 0, ref.data_size, sink, chunk_size);
+}
+
+bool StreamMediaImageRange(RetroStore* rs, const RsMediaImageRef& ref,
+                           int start, int length, const RsMediaSink& sink,
+                           int chunk_size) {
+  if (chunk_size <= 0) {
+    ESP_LOGW(TAG, "Invalid chunk size: %d", chunk_size);
+    return false;
+  }
+  if (start < 0 || length < 0 || start + length > ref.data_size) {
+    ESP_LOGW(TAG, "Invalid range %d+%d of '%s'.", start, length, ref.token.c_str());
+    return false;
+  }
+  int end = start + length;
+  int offset = start;
+  while (offset < end) {
+    int count = end - offset;
+    if (count > chunk_size) count = chunk_size;
+    // Every chunk is the same size, so the allocator hands back the block
+    // freed by the previous iteration instead of fragmenting the heap.
+    RsMediaRegion region;
+    if (!rs->FetchMediaImageRegion(ref, offset, count, &region)) {
+      ESP_LOGW(TAG, "Fetching region %d+%d of '%s' failed.",
+               offset, count, ref.token.c_str());
+      return false;
+    }
+    if (region.length <= 0) {
+      ESP_LOGW(TAG, "Empty region at %d of '%s'.", offset, ref.token.c_str());
+      return false;
+    }
+    if (!sink(offset, region.data.get(), region.length)) return false;
+    offset += region.length;
+  }
+  return true;
+}
+
+bool StreamMediaImage(RetroStore* rs, const RsMediaImageRef& ref,
+                      uint8_t* buffer, int buffer_size, int chunk_size) {
+  if (buffer_size < ref.data_size) {
+    ESP_LOGW(TAG, "Buffer too small: %d < %d", buffer_size, ref.data_size);
+    return false;
+  }
+  return StreamMediaImage(rs, ref, [buffer, buffer_size](int offset, const uint8_t* data, int length) {
+    if (offset + length > buffer_size) return false;
+    memcpy(buffer + offset, data, length);
+    return true;
+  }, chunk_size);
+}
+
+}  // namespace retrostore
@@ -0,0 +1,42 @@
+#pragma once
+
+#ifndef _RETROSTORE_MEDIA_STREAM_H_
+#define _RETROSTORE_MEDIA_STREAM_H_
+
+#include <functional>
+#include <stdint.h>
+
+#include "retrostore.h"
+
+namespace retrostore {
+
+// Default number of bytes fetched per request when streaming.
+#define MEDIA_STREAM_CHUNK_SIZE 4096
+
+// Receives consecutive chunks of a media image, in order. `offset` is the
+// position of `data` within the image. Returning false aborts the stream.
+typedef std::function<bool(int offset, const uint8_t* data, int length)> RsMediaSink;
+
+// Downloads the referenced media image in chunks of at most `chunk_size`
+// bytes and pushes each one to `sink` as it arrives, so that only a single
+// chunk is held in memory at a time. Returns false if a request fails or the
+// sink aborts.
+bool StreamMediaImage(RetroStore* rs, const RsMediaImageRef& ref,
+                      const RsMediaSink& sink,
+                      int chunk_size = MEDIA_STREAM_CHUNK_SIZE);
+
+// Like the above, but streams only the `length` bytes starting at `start`,
+// e.g. to resume an interrupted download.
+bool StreamMediaImageRange(RetroStore* rs, const RsMediaImageRef& ref,
+                           int start, int length, const RsMediaSink& sink,
+                           int chunk_size = MEDIA_STREAM_CHUNK_SIZE);
+
+// Downloads the referenced media image into a caller-owned buffer, which must
+// hold at least ref.data_size bytes.
+bool StreamMediaImage(RetroStore* rs, const RsMediaImageRef& ref,
+                      uint8_t* buffer, int buffer_size,
+                      int chunk_size = MEDIA_STREAM_CHUNK_SIZE);
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_MEDIA_STREAM_H_ */
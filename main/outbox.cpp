@@ -0,0 +1,385 @@
+#include "outbox.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <set>
+#include <utility>
+
+#include "esp_log.h"
+#include "esp_spi_flash.h"
+
+#include "verify.h"
+#include "wifi.h"
+
+namespace retrostore {
+
+namespace {
+
+ESP_EVENT_DEFINE_BASE(WINSTON_EVENT);
+
+static const char *TAG = "rs-outbox";
+
+#define SAVE_MAGIC 0x424f5352  // "RSOB"
+#define LIVE 0xffffffff
+
+// Precedes the slot name and the serialized snapshot of every save in
+// flash. Each save starts on a sector boundary and is only ever written
+// over once it is no longer live. The header is written last, so a save cut
+// short by a reset is not found again.
+struct SaveHeader {
+  uint32_t magic;
+  // Cleared to 0, without an erase, once the save is uploaded or replaced.
+  uint32_t live;
+  uint32_t seq;
+  uint32_t slot_length;
+  uint32_t data_length;
+  // Crc32 of the slot name and the snapshot.
+  uint32_t checksum;
+};
+
+uint32_t sectorAlign(uint32_t offset) {
+  return (offset + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+}
+
+class Lock {
+ public:
+  explicit Lock(SemaphoreHandle_t mutex) : mutex_(mutex) { xSemaphoreTake(mutex_, portMAX_DELAY); }
+  ~Lock() { xSemaphoreGive(mutex_); }
+
+ private:
+  SemaphoreHandle_t mutex_;
+};
+
+}  // namespace
+
+RsOutbox::RsOutbox(UploadDone uploaded, const char* partition_label)
+    : partition_(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                          partition_label)),
+      uploaded_(uploaded),
+      listening_(false),
+      wake_(xSemaphoreCreateBinary()),
+      stopped_(xSemaphoreCreateBinary()),
+      mutex_(xSemaphoreCreateMutex()),
+      next_seq_(1),
+      next_offset_(0),
+      online_(true),
+      stopping_(false),
+      retry_ms_(RS_OUTBOX_RETRY_MS) {
+  if (partition_ == nullptr) {
+    ESP_LOGW(TAG, "Partition '%s' not found, saves are only queued in RAM.", partition_label);
+  } else {
+    recover();
+  }
+  if (xTaskCreate(&RsOutbox::run, "rs_outbox", RS_OUTBOX_STACK_SIZE, this, RS_OUTBOX_PRIORITY,
+                  nullptr) != pdPASS) {
+    ESP_LOGE(TAG, "Creating the worker task failed.");
+    xSemaphoreGive(stopped_);
+  }
+}
+
+RsOutbox::~RsOutbox() {
+  if (listening_) {
+    esp_event_handler_unregister(WINSTON_EVENT, ESP_EVENT_ANY_ID, &RsOutbox::onWifiEvent);
+  }
+  {
+    Lock lock(mutex_);
+    stopping_ = true;
+  }
+  xSemaphoreGive(wake_);
+  xSemaphoreTake(stopped_, portMAX_DELAY);
+  vSemaphoreDelete(mutex_);
+  vSemaphoreDelete(stopped_);
+  vSemaphoreDelete(wake_);
+}
+
+bool RsOutbox::Save(const std::string& slot, const RsSystemState& state) {
+  auto snapshot = std::make_shared<RsStateSnapshot>();
+  snapshot->Assign(state);
+  bool persisted;
+  {
+    Lock lock(mutex_);
+    QueuedSave save;
+    save.seq = next_seq_++;
+    save.slot = slot;
+    // Written before the save it replaces is retired, so that a reset in
+    // between leaves at least one of them in flash.
+    persisted = persist(save.seq, slot, *snapshot, &save.offset, &save.length);
+    if (!persisted) save.in_ram = snapshot;
+    auto replaced = std::find_if(saves_.begin(), saves_.end(),
+                                 [&slot](const QueuedSave& save) { return save.slot == slot; });
+    if (replaced != saves_.end()) {
+      retire(*replaced);
+      saves_.erase(replaced);
+    }
+    saves_.push_back(save);
+  }
+  xSemaphoreGive(wake_);
+  return persisted;
+}
+
+bool RsOutbox::Fetch(FetchJob fetch, std::function<void()> failed) {
+  {
+    Lock lock(mutex_);
+    if (fetches_.size() >= RS_OUTBOX_QUEUE_LENGTH) {
+      ESP_LOGW(TAG, "Fetch queue full, %d waiting.", (int) fetches_.size());
+      return false;
+    }
+    fetches_.push_back({fetch, failed, 0});
+  }
+  xSemaphoreGive(wake_);
+  return true;
+}
+
+void RsOutbox::SetOnline(bool online) {
+  {
+    Lock lock(mutex_);
+    if (online == online_) return;
+    online_ = online;
+    retry_ms_ = RS_OUTBOX_RETRY_MS;
+  }
+  ESP_LOGI(TAG, "%s.", online ? "Online, sending queued requests" : "Offline, holding requests");
+  xSemaphoreGive(wake_);
+}
+
+bool RsOutbox::online() {
+  Lock lock(mutex_);
+  return online_;
+}
+
+void RsOutbox::ListenToWifi() {
+  if (listening_) return;
+  esp_event_handler_register(WINSTON_EVENT, ESP_EVENT_ANY_ID, &RsOutbox::onWifiEvent, this);
+  listening_ = true;
+}
+
+int RsOutbox::pending_saves() {
+  Lock lock(mutex_);
+  return saves_.size();
+}
+
+int RsOutbox::pending_fetches() {
+  Lock lock(mutex_);
+  return fetches_.size();
+}
+
+void RsOutbox::onWifiEvent(void* arg, esp_event_base_t base, int32_t id, void* data) {
+  auto* outbox = static_cast<RsOutbox*>(arg);
+  if (id == WIFI_CONNECTED) outbox->SetOnline(true);
+  if (id == WIFI_DISCONNECTED) outbox->SetOnline(false);
+}
+
+void RsOutbox::run(void* arg) {
+  auto* outbox = static_cast<RsOutbox*>(arg);
+  TickType_t wait = 0;
+  while (true) {
+    xSemaphoreTake(outbox->wake_, wait);
+    bool idle;
+    {
+      Lock lock(outbox->mutex_);
+      if (outbox->stopping_) break;
+      idle = !outbox->online_ || (outbox->saves_.empty() && outbox->fetches_.empty());
+    }
+    if (idle) {
+      wait = portMAX_DELAY;
+      continue;
+    }
+    if (outbox->sendNext()) {
+      wait = 0;
+      continue;
+    }
+    Lock lock(outbox->mutex_);
+    wait = pdMS_TO_TICKS(outbox->retry_ms_);
+    ESP_LOGI(TAG, "Request failed, retrying in %d ms.", outbox->retry_ms_);
+    outbox->retry_ms_ = std::min(outbox->retry_ms_ * 2, RS_OUTBOX_MAX_RETRY_MS);
+  }
+  xSemaphoreGive(outbox->stopped_);
+  vTaskDelete(NULL);
+}
+
+bool RsOutbox::sendNext() {
+  QueuedSave save;
+  PendingFetch fetch;
+  bool is_save;
+  {
+    Lock lock(mutex_);
+    is_save = !saves_.empty();
+    if (is_save) {
+      save = saves_.front();
+      if (!save.in_ram) {
+        // Mapped only for as long as it takes to copy it into RAM.
+        SaveHeader h;
+        const void* data;
+        spi_flash_mmap_handle_t handle;
+        bool loaded =
+            esp_partition_read(partition_, save.offset, &h, sizeof(h)) == ESP_OK &&
+            esp_partition_mmap(partition_, save.offset + sizeof(h) + h.slot_length,
+                               h.data_length, SPI_FLASH_MMAP_DATA, &data, &handle) == ESP_OK;
+        if (loaded) {
+          loaded = upload_.Load(static_cast<const uint8_t*>(data), h.data_length);
+          spi_flash_munmap(handle);
+        }
+        if (!loaded) {
+          ESP_LOGE(TAG, "Save to '%s' cannot be read back, dropping it.", save.slot.c_str());
+          retire(save);
+          saves_.pop_front();
+          return true;
+        }
+      }
+    } else {
+      fetch = fetches_.front();
+    }
+  }
+
+  if (is_save) {
+    int token = save.in_ram ? save.in_ram->Upload(&rs_) : upload_.Upload(&rs_);
+    if (token < 0) return false;
+    {
+      Lock lock(mutex_);
+      // It may have been replaced while uploading.
+      if (!saves_.empty() && saves_.front().seq == save.seq) {
+        retire(save);
+        saves_.pop_front();
+      }
+      retry_ms_ = RS_OUTBOX_RETRY_MS;
+    }
+    ESP_LOGI(TAG, "Save to '%s' uploaded, token %d.", save.slot.c_str(), token);
+    if (uploaded_) uploaded_(save.slot, token);
+    return true;
+  }
+
+  bool success = fetch.job(&rs_);
+  bool gave_up = false;
+  {
+    Lock lock(mutex_);
+    auto& front = fetches_.front();
+    if (success || ++front.attempts >= RS_OUTBOX_FETCH_ATTEMPTS) {
+      gave_up = !success;
+      fetches_.pop_front();
+    }
+    if (success) retry_ms_ = RS_OUTBOX_RETRY_MS;
+  }
+  if (gave_up && fetch.failed) fetch.failed();
+  return success;
+}
+
+void RsOutbox::recover() {
+  // Live saves can be anywhere, so every sector that no live save covers is
+  // looked at.
+  uint32_t offset = 0;
+  while (offset + sizeof(SaveHeader) <= partition_->size) {
+    SaveHeader h;
+    uint32_t end = offset + SPI_FLASH_SEC_SIZE;
+    uint32_t room = partition_->size - offset - sizeof(h);
+    if (esp_partition_read(partition_, offset, &h, sizeof(h)) == ESP_OK &&
+        h.magic == SAVE_MAGIC && h.live == LIVE && h.slot_length <= room &&
+        h.data_length <= room - h.slot_length) {
+      std::string slot(h.slot_length, '\0');
+      std::vector<uint8_t> data(h.data_length);
+      bool intact = esp_partition_read(partition_, offset + sizeof(h), &slot[0],
+                                       slot.size()) == ESP_OK &&
+                    esp_partition_read(partition_, offset + sizeof(h) + slot.size(),
+                                       data.data(), data.size()) == ESP_OK &&
+                    Crc32(data.data(), data.size(),
+                          Crc32((const uint8_t*) slot.data(), slot.size())) == h.checksum;
+      if (intact) {
+        QueuedSave save;
+        save.seq = h.seq;
+        save.slot = slot;
+        save.offset = offset;
+        save.length = sectorAlign(sizeof(h) + h.slot_length + h.data_length);
+        saves_.push_back(save);
+        end = offset + save.length;
+      } else {
+        ESP_LOGW(TAG, "Save at %d is corrupt, skipping it.", (int) offset);
+      }
+    }
+    offset = end;
+  }
+  std::sort(saves_.begin(), saves_.end(),
+            [](const QueuedSave& a, const QueuedSave& b) { return a.seq < b.seq; });
+  // A reset between writing a save and retiring the one it replaces leaves
+  // both; the newer one wins.
+  std::set<std::string> newer;
+  for (auto it = saves_.rbegin(); it != saves_.rend();) {
+    if (newer.insert(it->slot).second) {
+      ++it;
+    } else {
+      retire(*it);
+      it = std::deque<QueuedSave>::reverse_iterator(saves_.erase(std::next(it).base()));
+    }
+  }
+  next_offset_ = 0;
+  if (!saves_.empty()) {
+    next_seq_ = saves_.back().seq + 1;
+    next_offset_ = saves_.back().offset + saves_.back().length;
+    ESP_LOGI(TAG, "%d saves still to upload.", (int) saves_.size());
+  }
+}
+
+bool RsOutbox::persist(uint32_t seq, const std::string& slot, const RsStateSnapshot& snapshot,
+                       uint32_t* offset_out, uint32_t* length_out) {
+  if (partition_ == nullptr) return false;
+  uint32_t needed = sectorAlign(sizeof(SaveHeader) + slot.size() + snapshot.size());
+  // The free stretches between the saves in flash, in address order.
+  std::vector<std::pair<uint32_t, uint32_t>> used;
+  for (const auto& save : saves_) {
+    if (!save.in_ram) used.push_back(std::make_pair(save.offset, save.offset + save.length));
+  }
+  std::sort(used.begin(), used.end());
+  std::vector<std::pair<uint32_t, uint32_t>> gaps;
+  uint32_t at = 0;
+  for (const auto& extent : used) {
+    if (extent.first > at) gaps.push_back(std::make_pair(at, extent.first));
+    at = std::max(at, extent.second);
+  }
+  if (at < partition_->size) gaps.push_back(std::make_pair(at, (uint32_t) partition_->size));
+  // The first stretch with room from next_offset_ on, else from the start.
+  uint32_t offset = UINT32_MAX;
+  for (const auto& gap : gaps) {
+    uint32_t from = std::max(gap.first, next_offset_);
+    if (from < gap.second && gap.second - from >= needed) {
+      offset = from;
+      break;
+    }
+  }
+  for (size_t i = 0; i < gaps.size() && offset == UINT32_MAX; ++i) {
+    if (gaps[i].second - gaps[i].first >= needed) offset = gaps[i].first;
+  }
+  if (offset == UINT32_MAX) {
+    ESP_LOGW(TAG, "No room in flash for the save to '%s', keeping it in RAM.", slot.c_str());
+    return false;
+  }
+  // Saves are written to freshly erased sectors only, so whatever a reset
+  // left behind there does not matter.
+  SaveHeader h;
+  h.magic = SAVE_MAGIC;
+  h.live = LIVE;
+  h.seq = seq;
+  h.slot_length = slot.size();
+  h.data_length = snapshot.size();
+  h.checksum = Crc32(snapshot.data(), snapshot.size(),
+                     Crc32((const uint8_t*) slot.data(), slot.size()));
+  bool written =
+      esp_partition_erase_range(partition_, offset, needed) == ESP_OK &&
+      esp_partition_write(partition_, offset + sizeof(h), slot.data(), slot.size()) == ESP_OK &&
+      esp_partition_write(partition_, offset + sizeof(h) + slot.size(), snapshot.data(),
+                          snapshot.size()) == ESP_OK &&
+      esp_partition_write(partition_, offset, &h, sizeof(h)) == ESP_OK;
+  if (!written) {
+    ESP_LOGW(TAG, "Writing the save to '%s' failed, keeping it in RAM.", slot.c_str());
+    return false;
+  }
+  next_offset_ = offset + needed;
+  *offset_out = offset;
+  *length_out = needed;
+  return true;
+}
+
+void RsOutbox::retire(const QueuedSave& save) {
+  if (save.in_ram) return;
+  uint32_t dead = 0;
+  esp_partition_write(partition_, save.offset + offsetof(SaveHeader, live), &dead, sizeof(dead));
+}
+
+}  // namespace retrostore
@@ -0,0 +1,142 @@
+#pragma once
+
+#ifndef _RETROSTORE_OUTBOX_H_
+#define _RETROSTORE_OUTBOX_H_
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "esp_event.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "retrostore.h"
+#include "state_snapshot.h"
+
+namespace retrostore {
+
+// Label of the data partition in partitions.csv that keeps queued saves.
+#define RS_OUTBOX_PARTITION "rs_outbox"
+// Fetches that can wait before new ones are refused.
+#define RS_OUTBOX_QUEUE_LENGTH 16
+// Times a fetch is tried before giving up on it.
+#define RS_OUTBOX_FETCH_ATTEMPTS 3
+// Delay before retrying a failed request, doubling up to the maximum while
+// requests keep failing.
+#define RS_OUTBOX_RETRY_MS 1000
+#define RS_OUTBOX_MAX_RETRY_MS 30000
+#define RS_OUTBOX_STACK_SIZE 16000
+#define RS_OUTBOX_PRIORITY 4
+
+// Outbound queue that rides out WiFi drops.
+//
+// Saves are written to flash before Save() returns and uploaded in order by
+// a worker task with its own RetroStore. A failed upload stays queued and
+// is retried with backoff; a restart picks up where the last boot left off.
+// Saving to a slot whose previous save is still queued replaces it, so after
+// a long time offline only the newest state of each slot is uploaded.
+//
+// Fetches wait in a bounded queue in RAM and run after the queued saves.
+//
+// While offline, which ListenToWifi() derives from WIFI_CONNECTED and
+// WIFI_DISCONNECTED, nothing is sent. The queues drain as soon as the
+// connection is back.
+//
+// The partition is written round like a ring, skipping the saves still
+// queued, so saving the same slots over and over never fills it up. A save
+// that does not fit next to the queued ones is kept in RAM only. Thread-safe.
+// Callbacks run on the worker task.
+class RsOutbox {
+ public:
+  // Called once the save queued under `slot` has been uploaded.
+  typedef std::function<void(const std::string& slot, int token)> UploadDone;
+  // Returns false if the fetch failed and should be tried again.
+  typedef std::function<bool(RetroStore* rs)> FetchJob;
+
+  // Saves left by an earlier boot are reported to `uploaded` as well.
+  explicit RsOutbox(UploadDone uploaded = nullptr,
+                    const char* partition_label = RS_OUTBOX_PARTITION);
+  // Stops the worker. Queued saves stay in flash for the next RsOutbox;
+  // queued fetches are dropped.
+  ~RsOutbox();
+
+  // Queues `state` for upload, replacing a queued save to the same slot.
+  // Returns false if it could not be written to flash; it is still uploaded,
+  // but lost if the device restarts first.
+  bool Save(const std::string& slot, const RsSystemState& state);
+  // Queues a fetch. `failed` is called if it still fails after
+  // RS_OUTBOX_FETCH_ATTEMPTS tries. Returns false if the queue is full.
+  bool Fetch(FetchJob fetch, std::function<void()> failed = nullptr);
+
+  // Pauses or resumes sending. Resuming retries right away.
+  void SetOnline(bool online);
+  bool online();
+  // Follows the WiFi state through the events posted by wifi.cpp.
+  void ListenToWifi();
+
+  // Saves not uploaded yet, and fetches not run yet.
+  int pending_saves();
+  int pending_fetches();
+  // Whether saves are persisted, i.e. the partition was found.
+  bool persistent() const { return partition_ != nullptr; }
+
+ private:
+  struct QueuedSave {
+    uint32_t seq;
+    std::string slot;
+    // Where the save is in flash and the sectors it takes, unless it is only
+    // kept in RAM.
+    uint32_t offset;
+    uint32_t length;
+    std::shared_ptr<RsStateSnapshot> in_ram;
+  };
+  struct PendingFetch {
+    FetchJob job;
+    std::function<void()> failed;
+    int attempts;
+  };
+
+  static void run(void* arg);
+  static void onWifiEvent(void* arg, esp_event_base_t base, int32_t id, void* data);
+
+  void recover();
+  // Writes the save to flash, after the last one written and wrapping round
+  // to the start, into sectors no queued save takes. Fails if the partition
+  // is missing or there is no such room.
+  bool persist(uint32_t seq, const std::string& slot, const RsStateSnapshot& snapshot,
+               uint32_t* offset, uint32_t* length);
+  // Marks a save that is leaving the queue as done in flash.
+  void retire(const QueuedSave& save);
+  // Sends the oldest queued request. Returns false if it failed.
+  bool sendNext();
+
+  const esp_partition_t* partition_;
+  UploadDone uploaded_;
+  bool listening_;
+  // Only used by the worker. The snapshot is reused for every save
+  // uploaded from flash.
+  RetroStore rs_;
+  RsStateSnapshot upload_;
+  // Given to wake the worker.
+  SemaphoreHandle_t wake_;
+  SemaphoreHandle_t stopped_;
+  // Guards everything below.
+  SemaphoreHandle_t mutex_;
+  std::deque<QueuedSave> saves_;
+  std::deque<PendingFetch> fetches_;
+  uint32_t next_seq_;
+  // Where the search for room for the next save starts.
+  uint32_t next_offset_;
+  bool online_;
+  bool stopping_;
+  int retry_ms_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_OUTBOX_H_ */
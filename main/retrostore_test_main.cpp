@@ -3,13 +3,16 @@
  * This serves both as a test and as documentation on
  * how to use the API.
  */
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <set>
 #include <stdio.h>
 #include <vector>
 
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "esp_system.h"
 #include "esp_event.h"
@@ -18,12 +21,33 @@
 #include "esp_spi_flash.h"
 #include "esp_chip_info.h"
 
+#include "app_page.h"
+#include "async_retrostore.h"
+#include "batch_fetch.h"
+#include "benchmark.h"
+#include "catalog_cache.h"
+#include "catalog_cursor.h"
+#include "catalog_index.h"
+#include "field_mask.h"
+#include "heap_profiler.h"
+#include "media_block_cache.h"
+#include "media_image_store.h"
+#include "media_stream.h"
+#include "outbox.h"
+#include "soak.h"
+#include "state_delta.h"
+#include "state_ranges.h"
+#include "state_snapshot.h"
+#include "state_stream.h"
+#include "verify.h"
 #include "retrostore.h"
+#include "rle.h"
 #include "wifi.h"
-
-#define NUM_TEST_ITERATIONS 1
+#include "wifi_cache.h"
 
 static const char *TAG = "retrostore-tester";
+// The tests call the RetroStore synchronously, TLS handshakes included.
+#define TEST_TASK_STACK_SIZE 16000
 ESP_EVENT_DEFINE_BASE(WINSTON_EVENT);
 
 using namespace std;
@@ -46,7 +70,7 @@ void createRandomTestState(RsSystemState* state) {
     RsMemoryRegion region;
     region.start = rand() % 1000 + 1;
     region.length = 1024;
-    std::unique_ptr<uint8_t> data(static_cast<uint8_t*>(malloc(sizeof(uint8_t) * 1024)));
+    std::unique_ptr<uint8_t> data(new uint8_t[region.length]);
     for (int d = 0; d < region.length; ++d) {
       data.get()[d] = rand() % 256;
     }
@@ -55,6 +79,20 @@ void createRandomTestState(RsSystemState* state) {
   }
 }
 
+// A 48 KB Model III memory image: mostly zeros, a screen of spaces and a
+// block of program code.
+void createRepresentativeTestState(RsSystemState* state) {
+  state->model = RsTrs80Model_MODEL_III;
+  RsMemoryRegion region;
+  region.start = 0x4000;
+  region.length = 48 * 1024;
+  region.data.reset(new uint8_t[region.length]);
+  memset(region.data.get(), 0, region.length);
+  memset(region.data.get(), 0x20, 1024);
+  for (int i = 0x1200; i < 0x3200; ++i) region.data.get()[i] = rand() % 256;
+  state->regions.push_back(std::move(region));
+}
+
 void testUploadDownloadSystemState() {
   ESP_LOGI(TAG, "testUploadDownloadSystemState()...");
   // Create a random state to upload.
@@ -89,18 +127,12 @@ void testUploadDownloadSystemState() {
       ESP_LOGE(TAG, "Start of memory region %d does not match.", i);
       success = false;
     }
-    if (state1.regions[i].length != state2.regions[i].length) {
-      ESP_LOGE(TAG, "Start of memory region %d does not match.", i);
+    int d = FirstDifference(state2.regions[i], state1.regions[i].data.get(),
+                            state1.regions[i].length);
+    if (d >= 0) {
+      ESP_LOGE(TAG, "Memory region %d differs first at %d", i, d);
       success = false;
     }
-
-    for (int d = 0; d < state1.regions[i].length; ++d) {
-      if (state1.regions[i].data.get()[d] != state2.regions[i].data.get()[d]) {
-        ESP_LOGE(TAG, "Memory region %d differs first at %d", i, d);
-        success = false;
-        break;
-      }
-    }
   }
   if (!success) return;
 
@@ -134,23 +166,28 @@ bool helper_checkRegion(const RsMemoryRegion& region, int length, const uint8_t*
              region.length, length);
     return false;
   }
-  bool success = true;
-  for (int i = 0; i < length; ++i) {
-    if (region.data.get()[i] != want[i]) {
-      ESP_LOGE(TAG, "Recv data at idx=%d does not match. (%d vs %d)",
-              i, region.data.get()[i], want[i]);
-      success = false;
-    }
+  int i = FirstDifference(region, want, length);
+  if (i >= 0) {
+    ESP_LOGE(TAG, "Recv data at idx=%d does not match. (%d vs %d)",
+             i, region.data.get()[i], want[i]);
+    return false;
   }
-  return success;
+  return true;
 }
 
-bool helper_downloadAndCheckMemoryRegion(int n, int token, int start, int length, const uint8_t* want) {
+// Checks the range both on the server and against a local copy of the state.
+bool helper_downloadAndCheckMemoryRegion(int n, int token, const RsStateMemoryIndex& local,
+                                         int start, int length, const uint8_t* want) {
   RsMemoryRegion region;
   if (!rs.DownloadStateMemoryRange(token, start, length, &region)) {
     ESP_LOGE(TAG, "n=%d Downloading memory regions failed.", n);
     return false;
   }
+  if (!helper_checkRegion(region, length, want)) return false;
+  if (!local.ReadRange(start, length, &region)) {
+    ESP_LOGE(TAG, "n=%d Reading memory regions locally failed.", n);
+    return false;
+  }
   return helper_checkRegion(region, length, want);
 }
 
@@ -160,15 +197,13 @@ bool helper_checkMediaRegion(const RsMediaRegion& region, int length, const uint
              region.length, length);
     return false;
   }
-  bool success = true;
-  for (int i = 0; i < length; ++i) {
-    if (region.data.get()[i] != want[i]) {
-      ESP_LOGE(TAG, "Recv data at idx=%d does not match. (%d vs %d)",
-              i, region.data.get()[i], want[i]);
-      success = false;
-    }
+  int i = FirstDifference(region, want, length);
+  if (i >= 0) {
+    ESP_LOGE(TAG, "Recv data at idx=%d does not match. (%d vs %d)",
+             i, region.data.get()[i], want[i]);
+    return false;
   }
-  return success;
+  return true;
 }
 
 bool helper_downloadAndCheckMediaImageRegion(const RsMediaImageRef& ref, int start, int length, const uint8_t* want) {
@@ -225,28 +260,108 @@ void testDownloadStateMemoryRegions() {
     return;
   }
   ESP_LOGI(TAG, "Got token: %d", token);
+  // The same queries are answered from the downloaded state.
+  RsSystemState downloaded;
+  if (!rs.DownloadState(token, &downloaded)) {
+    ESP_LOGE(TAG, "FAILED: Downloading the state.");
+    return;
+  }
+  RsStateMemoryIndex local(downloaded);
 
   // Exact match of uploads
   uint8_t want1[] = {42, 43, 44, 45};
-  if (!helper_downloadAndCheckMemoryRegion(1, token, 1000, 4, want1)) return;
+  if (!helper_downloadAndCheckMemoryRegion(1, token, local, 1000, 4, want1)) return;
   uint8_t want2[] = {11, 22, 33, 44, 55, 66};
-  if (!helper_downloadAndCheckMemoryRegion(2, token, 1108, 6, want2)) return;
+  if (!helper_downloadAndCheckMemoryRegion(2, token, local, 1108, 6, want2)) return;
 
   // Requesting two connected regions at once..
   uint8_t want3[] = {1, 2, 3, 4, 5, 6, 7, 8, 11, 22, 33, 44, 55, 66};
-  if (!helper_downloadAndCheckMemoryRegion(3, token, 1100, 14, want3)) return;
+  if (!helper_downloadAndCheckMemoryRegion(3, token, local, 1100, 14, want3)) return;
 
   // Requesting more (padding) should result in '0'.
   uint8_t want4[] = {0, 0, 42, 43, 44, 45, 0, 0};
-  if (!helper_downloadAndCheckMemoryRegion(4, token, 998, 8, want4)) return;
+  if (!helper_downloadAndCheckMemoryRegion(4, token, local, 998, 8, want4)) return;
 
   // Request half into one.
   uint8_t want5[] = {44, 45, 0, 0};
-  if (!helper_downloadAndCheckMemoryRegion(5, token, 1002, 4, want5)) return;
+  if (!helper_downloadAndCheckMemoryRegion(5, token, local, 1002, 4, want5)) return;
 
   // Request half into one across and half into another region.
   uint8_t want6[] = {44, 55, 66, 0, 0, 0, 0, 0, 0, 101, 102, 103};
-  if (!helper_downloadAndCheckMemoryRegion(6, token, 1111, 12, want6)) return;
+  if (!helper_downloadAndCheckMemoryRegion(6, token, local, 1111, 12, want6)) return;
+
+  // The same six ranges as one batch. They are close enough to be fetched
+  // with a single request.
+  std::vector<RsMemoryRange> ranges = {
+    {1000, 4}, {1108, 6}, {1100, 14}, {998, 8}, {1002, 4}, {1111, 12}};
+  const uint8_t* wants[] = {want1, want2, want3, want4, want5, want6};
+  if (CoalesceMemoryRanges(ranges, STATE_RANGES_MAX_GAP).size() != 1) {
+    ESP_LOGE(TAG, "FAILED: Ranges were not coalesced into one request.");
+    return;
+  }
+  std::vector<RsMemoryRegion> regions;
+  if (!DownloadStateMemoryRanges(&rs, token, ranges, &regions)) {
+    ESP_LOGE(TAG, "Downloading batched memory regions failed.");
+    return;
+  }
+  if (regions.size() != ranges.size()) {
+    ESP_LOGE(TAG, "FAILED: Expected %d batched regions, got %d", ranges.size(), regions.size());
+    return;
+  }
+  for (int i = 0; i < ranges.size(); ++i) {
+    if (regions[i].start != ranges[i].start) {
+      ESP_LOGE(TAG, "FAILED: Batched region %d starts at %d", i, regions[i].start);
+      return;
+    }
+    if (!helper_checkRegion(regions[i], ranges[i].length, wants[i])) return;
+  }
+
+  // With a negative gap only overlapping ranges are merged, the result must
+  // be the same.
+  if (!DownloadStateMemoryRanges(&rs, token, ranges, &regions, -1)) {
+    ESP_LOGE(TAG, "Downloading uncoalesced memory regions failed.");
+    return;
+  }
+  for (int i = 0; i < ranges.size(); ++i) {
+    if (!helper_checkRegion(regions[i], ranges[i].length, wants[i])) return;
+  }
+  if (!local.ReadRanges(ranges, &regions) || regions.size() != ranges.size()) {
+    ESP_LOGE(TAG, "FAILED: Reading batched memory regions locally.");
+    return;
+  }
+  for (int i = 0; i < ranges.size(); ++i) {
+    if (!helper_checkRegion(regions[i], ranges[i].length, wants[i])) return;
+  }
+
+  // Where regions overlap, the one later in the state wins, even if it
+  // starts at a lower address.
+  RsSystemState overlapping;
+  overlapping.model = RsTrs80Model_MODEL_III;
+  {
+    RsMemoryRegion region;
+    region.start = 10;
+    region.length = 4;
+    region.data.reset(new uint8_t[4]{5, 5, 5, 5});
+    overlapping.regions.push_back(std::move(region));
+  }
+  {
+    RsMemoryRegion region;
+    region.start = 0;
+    region.length = 20;
+    region.data.reset(new uint8_t[20]);
+    memset(region.data.get(), 1, 20);
+    overlapping.regions.push_back(std::move(region));
+  }
+  token = rs.UploadState(overlapping);
+  if (token < 100 || token > 999 || !rs.DownloadState(token, &downloaded)) {
+    ESP_LOGE(TAG, "FAILED: Uploading the overlapping state.");
+    return;
+  }
+  RsStateMemoryIndex overlapped(downloaded);
+  uint8_t want7[] = {1};
+  if (!helper_downloadAndCheckMemoryRegion(7, token, overlapped, 10, 1, want7)) return;
+  uint8_t want8[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0};
+  if (!helper_downloadAndCheckMemoryRegion(8, token, overlapped, 10, 11, want8)) return;
 
   ESP_LOGI(TAG, "testDownloadStateMemoryRegions()...SUCCESS");
 }
@@ -598,44 +713,2183 @@ void testFailFetchMediaImageRangeTest() {
   ESP_LOGI(TAG, "testFailFetchMediaImageRangeTest()...SUCCESS");
 }
 
-void initWifi() {
-  ESP_LOGI(TAG, "Connecting to Wifi...");
-  auto* wifi = new Wifi();
-  wifi->connect(CONFIG_RS_TEST_WIFI_SSID, CONFIG_RS_TEST_WIFI_PASSWORD);
+void testFieldMasks() {
+  ESP_LOGI(TAG, "testFieldMasks()...");
+
+  // A list view: nano fields only, fetched with the nano call.
+  std::vector<RsApp> full;
+  std::vector<RsApp> listed;
+  if (!rs.FetchApps(0, 5, "", &full) ||
+      !FetchAppsFields(&rs, 0, 5, "", RS_APP_NANO_FIELDS, &listed) ||
+      full.size() != listed.size()) {
+    ESP_LOGE(TAG, "FAILED: Fetching apps with the nano fields.");
+    return;
+  }
+  size_t full_bytes = 0;
+  size_t listed_bytes = 0;
+  for (int i = 0; i < full.size(); ++i) {
+    if (listed[i].id != full[i].id || listed[i].name != full[i].name ||
+        listed[i].author != full[i].author || listed[i].release_year != full[i].release_year ||
+        !listed[i].description.empty() || !listed[i].screenshot_urls.empty()) {
+      ESP_LOGE(TAG, "FAILED: App %d does not have exactly the nano fields.", i);
+      return;
+    }
+    full_bytes += PayloadSize(full[i]);
+    listed_bytes += PayloadSize(listed[i]);
+  }
+  ESP_LOGI(TAG, "Listing 5 apps: %d bytes, %d with all fields.", (int) listed_bytes,
+           (int) full_bytes);
+
+  // A detail view: needs the description, so the full call, trimmed.
+  if (!FetchAppsFields(&rs, 0, 5, "", RS_APP_NAME | RS_APP_DESCRIPTION, &listed) ||
+      listed.size() != full.size() || listed[0].description != full[0].description ||
+      listed[0].name != full[0].name || !listed[0].id.empty() || !listed[0].version.empty()) {
+    ESP_LOGE(TAG, "FAILED: Fetching apps with name and description.");
+    return;
+  }
+  RsApp app;
+  if (!FetchAppFields(&rs, full[0].id, RS_APP_NAME, &app) || app.name != full[0].name ||
+      !app.description.empty() || app.model != RsTrs80Model_UNKNOWN_MODEL) {
+    ESP_LOGE(TAG, "FAILED: Fetching an app by name only.");
+    return;
+  }
+
+  // Images without data come from the refs.
+  const std::string BREAKDOWN_ID("29b20252-680f-11e8-b4a9-1f10b5491ef5");
+  std::vector<RsMediaType> types;
+  std::vector<RsMediaImage> images;
+  std::vector<RsMediaImage> named;
+  if (!rs.FetchMediaImages(BREAKDOWN_ID, types, &images) ||
+      !FetchMediaImagesFields(&rs, BREAKDOWN_ID, types, RS_IMAGE_TYPE | RS_IMAGE_FILENAME,
+                              &named) ||
+      named.size() != images.size() || named.empty()) {
+    ESP_LOGE(TAG, "FAILED: Fetching images without data.");
+    return;
+  }
+  for (int i = 0; i < images.size(); ++i) {
+    if (named[i].data || named[i].filename != images[i].filename ||
+        named[i].type != images[i].type || named[i].data_size != images[i].data_size) {
+      ESP_LOGE(TAG, "FAILED: Image %d without data is wrong.", i);
+      return;
+    }
+  }
+
+  // The layout of a state, without its memory or model.
+  RsSystemState state;
+  createRandomTestState(&state);
+  int token = rs.UploadState(state);
+  RsSystemState layout;
+  if (token < 0 ||
+      !DownloadStateFields(&rs, token, RS_STATE_REGISTERS | RS_STATE_REGIONS, &layout) ||
+      layout.model != RsTrs80Model_UNKNOWN_MODEL ||
+      memcmp(&layout.registers, &state.registers, sizeof(RsRegisters)) != 0 ||
+      !SameRegionLayout(state, layout) || layout.regions[0].data) {
+    ESP_LOGE(TAG, "FAILED: Downloading the state layout.");
+    return;
+  }
+  ESP_LOGI(TAG, "testFieldMasks()...SUCCESS");
 }
 
-void runAllTests() {
-  auto initialFreeHeapKb = esp_get_free_heap_size() / 1024;
-  ESP_LOGI(TAG, "RetroStore API tests running... Initial free heap: %d", initialFreeHeapKb);
-  srand(time(nullptr));
+#ifdef CONFIG_RS_BENCHMARK
+// Calls every API CONFIG_RS_BENCHMARK_ITERATIONS times and prints a summary.
+void runBenchmarks() {
+  ESP_LOGI(TAG, "Running benchmark, %d iterations per API...", CONFIG_RS_BENCHMARK_ITERATIONS);
+  const int n = CONFIG_RS_BENCHMARK_ITERATIONS;
+  const std::string DONKEY_KONG_ID("a2729dec-96b3-11e7-9539-e7341c560175");
+  const std::string BREAKDOWN_ID("29b20252-680f-11e8-b4a9-1f10b5491ef5");
+  std::vector<RsMediaType> commandType;
+  commandType.push_back(RsMediaType_COMMAND);
 
-  for (int i = 0; i < NUM_TEST_ITERATIONS; ++i) {
-    testUploadDownloadSystemState();
-    testDownloadStateMemoryRegions();
-    testFailDownloadSystemState();
-    testFetchSingleApp();
-    testFetchSingleAppFail();
-    testFetchMultipleApps();
-    testQueryApps();
-    testQueryAppsWithMediaTypes();
-    testFetchMultipleAppsNano();
-    testQueryAppsNano();
-    testFetchMediaImages();
-    testFetchMediaImageRefsTest();
-    testFailFetchMediaImageRangeTest();
-    testFetchMediaImageRangeTest();
-    auto newFreeHeapKb = esp_get_free_heap_size() / 1024;
-    auto diffHeapKb =  initialFreeHeapKb - newFreeHeapKb;
-    ESP_LOGI(TAG, "After run [%d], free heap is %d, total diff is %d kb", i, newFreeHeapKb, diffHeapKb);
+  RsSystemState state;
+  createRandomTestState(&state);
+  int token = rs.UploadState(state);
+  std::vector<RsMediaImageRef> refs;
+  if (token < 0 || !rs.FetchMediaImageRefs(BREAKDOWN_ID, commandType, &refs) || refs.empty()) {
+    ESP_LOGE(TAG, "FAILED: Benchmark setup.");
+    return;
+  }
+  const RsMediaImageRef ref = refs[0];
+
+  // Only the benchmark's own calls from here on.
+  HeapProfiler::Reset();
+  Benchmark bench;
+  bench.Run("UploadState", n, [&]() {
+    return rs.UploadState(state) < 0 ? -1 : (int) PayloadSize(state);
+  });
+  // Autosave of a 48 KB state where a few bytes change between snapshots.
+  RsSystemState autosave;
+  {
+    RsMemoryRegion region;
+    region.start = 0x4000;
+    region.length = 48 * 1024;
+    region.data.reset(new uint8_t[region.length]);
+    memset(region.data.get(), 0, region.length);
+    autosave.regions.push_back(std::move(region));
+  }
+  bench.Run("UploadState 48K", n, [&]() {
+    autosave.regions[0].data.get()[rand() % autosave.regions[0].length]++;
+    return rs.UploadState(autosave) < 0 ? -1 : (int) PayloadSize(autosave);
+  });
+  DeltaUploader uploader(&rs);
+  bench.Run("DeltaUploader 48K", n, [&]() {
+    autosave.regions[0].data.get()[rand() % autosave.regions[0].length]++;
+    return uploader.Upload(autosave) < 0 ? -1 : uploader.last_upload_bytes();
+  });
+  {
+    RsStateSnapshot snapshot;
+    snapshot.Assign(autosave);
+    bench.Run("RsStateSnapshot.Upload 48K", n, [&]() {
+      autosave.regions[0].data.get()[rand() % autosave.regions[0].length]++;
+      snapshot.Assign(autosave);
+      return snapshot.Upload(&rs) < 0 ? -1 : (int) snapshot.size();
+    });
+  }
+  bench.Run("DownloadState", n, [&]() {
+    RsSystemState s;
+    return rs.DownloadState(token, &s) ? (int) PayloadSize(s) : -1;
+  });
+  {
+    // Two 64 KB banks, all of a Model 4's memory.
+    RsSystemState banks;
+    banks.model = RsTrs80Model_MODEL_4;
+    for (int bank = 0; bank < 2; ++bank) {
+      RsMemoryRegion region;
+      region.start = bank * 0x10000;
+      region.length = 0x10000;
+      region.data.reset(new uint8_t[region.length]);
+      memset(region.data.get(), bank, region.length);
+      banks.regions.push_back(std::move(region));
+    }
+    int banks_token = rs.UploadState(banks);
+    banks.regions.clear();
+    bench.Run("DownloadState 128K", n, [&]() {
+      RsSystemState s;
+      return rs.DownloadState(banks_token, &s) ? (int) PayloadSize(s) : -1;
+    });
+  }
+  bench.Run("DownloadStateMemoryRange", n, [&]() {
+    RsMemoryRegion region;
+    return rs.DownloadStateMemoryRange(token, state.regions[0].start, 256, &region) ? region.length : -1;
+  });
+  // Six small ranges of the same state, one request each versus batched.
+  const int base = state.regions[0].start;
+  std::vector<RsMemoryRange> ranges = {
+    {base, 16}, {base + 16, 8}, {base + 100, 32}, {base + 128, 4}, {base + 500, 64}, {base + 900, 100}};
+  bench.Run("DownloadStateMemoryRange x6", n, [&]() {
+    int bytes = 0;
+    for (const auto& range : ranges) {
+      RsMemoryRegion region;
+      if (!rs.DownloadStateMemoryRange(token, range.start, range.length, &region)) return -1;
+      bytes += region.length;
+    }
+    return bytes;
+  });
+  bench.Run("DownloadStateMemoryRanges x6", n, [&]() {
+    std::vector<RsMemoryRegion> regions;
+    if (!DownloadStateMemoryRanges(&rs, token, ranges, &regions)) return -1;
+    int bytes = 0;
+    for (const auto& region : regions) bytes += region.length;
+    return bytes;
+  });
+  RsSystemState downloaded;
+  rs.DownloadState(token, &downloaded);
+  RsStateMemoryIndex local(downloaded);
+  bench.Run("RsStateMemoryIndex.ReadRanges x6", n, [&]() {
+    std::vector<RsMemoryRegion> regions;
+    if (!local.ReadRanges(ranges, &regions)) return -1;
+    int bytes = 0;
+    for (const auto& region : regions) bytes += region.length;
+    return bytes;
+  });
+  bench.Run("FetchApp", n, [&]() {
+    RsApp app;
+    return rs.FetchApp(DONKEY_KONG_ID, &app) ? (int) PayloadSize(app) : -1;
+  });
+  bench.Run("FetchApps", n, [&]() {
+    std::vector<RsApp> apps;
+    if (!rs.FetchApps(0, 5, &apps)) return -1;
+    int bytes = 0;
+    for (const auto& app : apps) bytes += PayloadSize(app);
+    return bytes;
+  });
+  bench.Run("FetchAppsFields nano", n, [&]() {
+    std::vector<RsApp> apps;
+    if (!FetchAppsFields(&rs, 0, 5, "", RS_APP_NANO_FIELDS, &apps)) return -1;
+    int bytes = 0;
+    for (const auto& app : apps) bytes += PayloadSize(app);
+    return bytes;
+  });
+  RsAppPage page;
+  bench.Run("FetchAppsPage", n, [&]() {
+    if (!page.Fetch(&rs, 0, 5)) return -1;
+    return (int) page.arena_used();
+  });
+  CatalogCache catalog(&rs);
+  std::vector<RsMediaType> noTypes;
+  bench.Run("CatalogCache FetchAppsNano", n, [&]() {
+    std::vector<RsAppNano> apps;
+    if (!catalog.FetchAppsNano(0, 5, "", noTypes, &apps)) return -1;
+    int bytes = 0;
+    for (const auto& app : apps) bytes += PayloadSize(app);
+    return bytes;
+  });
+  catalog.Revalidate();
+  bench.SetCounter("catalog_cache_hits", catalog.hits());
+  bench.SetCounter("catalog_cache_misses", catalog.misses());
+  catalog.Clear();
+  // Typing "donkey" one letter at a time, with a query per keystroke.
+  const std::string typed = "donkey";
+  bench.Run("Search as you type", n, [&]() {
+    int bytes = 0;
+    for (int i = 1; i <= typed.size(); ++i) {
+      std::vector<RsAppNano> apps;
+      if (!rs.FetchAppsNano(0, 5, typed.substr(0, i), noTypes, &apps)) return -1;
+      for (const auto& app : apps) bytes += PayloadSize(app);
+    }
+    return bytes;
+  });
+  {
+    CatalogIndex index;
+    if (index.Sync(&rs)) {
+      bench.Run("CatalogIndex search as you type", n, [&]() {
+        int bytes = 0;
+        for (int i = 1; i <= typed.size(); ++i) {
+          std::vector<RsAppNano> apps;
+          if (!index.FetchAppsNano(0, 5, typed.substr(0, i), noTypes, &apps)) return -1;
+          for (const auto& app : apps) bytes += PayloadSize(app);
+        }
+        return bytes;
+      });
+      bench.SetCounter("catalog_index_bytes", index.size());
+    }
+    index.Clear();
+  }
+  bench.Run("FetchAppsNano", n, [&]() {
+    std::vector<RsAppNano> apps;
+    if (!rs.FetchAppsNano(0, 5, &apps)) return -1;
+    int bytes = 0;
+    for (const auto& app : apps) bytes += PayloadSize(app);
+    return bytes;
+  });
+  bench.Run("FetchMediaImages", n, [&]() {
+    std::vector<RsMediaImage> images;
+    if (!rs.FetchMediaImages(BREAKDOWN_ID, commandType, &images)) return -1;
+    int bytes = 0;
+    for (const auto& image : images) bytes += PayloadSize(image);
+    return bytes;
+  });
+  bench.Run("FetchMediaImageRefs", n, [&]() {
+    std::vector<RsMediaImageRef> r;
+    if (!rs.FetchMediaImageRefs(BREAKDOWN_ID, commandType, &r)) return -1;
+    int bytes = 0;
+    for (const auto& imageRef : r) bytes += PayloadSize(imageRef);
+    return bytes;
+  });
+  bench.Run("FetchMediaImageRegion", n, [&]() {
+    RsMediaRegion region;
+    return rs.FetchMediaImageRegion(ref, 1242, 10, &region) ? region.length : -1;
+  });
+  bench.Run("StreamMediaImage", n, [&]() {
+    int bytes = 0;
+    auto success = StreamMediaImage(&rs, ref, [&bytes](int offset, const uint8_t* data, int length) {
+      bytes += length;
+      return true;
+    });
+    return success ? bytes : -1;
+  });
+  // Sector-sized reads through the block cache, for comparison with the
+  // uncached FetchMediaImageRegion above.
+  MediaBlockCache cache(&rs);
+  bench.Run("MediaBlockCache.Read", n * 10, [&]() {
+    static int offset = 0;
+    RsMediaRegion region;
+    if (!cache.Read(ref, offset, 256, &region)) return -1;
+    offset = (offset + 256) % ref.data_size;
+    return region.length;
+  });
+  bench.SetCounter("media_cache_hits", cache.hits());
+  bench.SetCounter("media_cache_misses", cache.misses());
+  bench.SetCounter("media_cache_prefetched", cache.prefetched());
+  bench.SetCounter("media_cache_requests", cache.requests());
+  // The same image mapped from flash after the first download.
+  MediaImageStore store;
+  bench.Run("MediaImageStore.Open", n, [&]() {
+    MappedMediaImage image;
+    return store.Open(&rs, ref, &image) ? image.size() : -1;
+  });
+  store.Clear();
+
+  // Compressed vs. raw size and CPU cost on representative payloads.
+  RsSystemState representative;
+  createRepresentativeTestState(&representative);
+  // The first 16 KB of a disk image; a whole one, compressed and decoded,
+  // would not fit in the heap next to the state.
+  std::vector<RsMediaImageRef> diskRefs;
+  std::vector<RsMediaType> diskType;
+  diskType.push_back(RsMediaType_DISK);
+  RsMediaRegion disk;
+  bool haveDisk = rs.FetchMediaImageRefs(BREAKDOWN_ID, diskType, &diskRefs) && !diskRefs.empty() &&
+                  rs.FetchMediaImageRegion(diskRefs[0], 0, 16 * 1024, &disk);
+  struct Payload {
+    const char* name;
+    const uint8_t* data;
+    int length;
+  };
+  std::vector<Payload> payloads;
+  payloads.push_back({"state48k", representative.regions[0].data.get(), representative.regions[0].length});
+  payloads.push_back({"random1k", state.regions[0].data.get(), state.regions[0].length});
+  if (haveDisk) {
+    payloads.push_back({"disk16k", disk.data.get(), disk.length});
+  }
+  for (const auto& payload : payloads) {
+    // Sized exactly rather than by RLE_COMPRESS_BOUND, to keep the peak heap
+    // use of this benchmark low.
+    size_t compressedSize = RleCompressedSize(payload.data, payload.length);
+    std::unique_ptr<uint8_t[]> compressed(new uint8_t[compressedSize]);
+    std::unique_ptr<uint8_t[]> decoded(new uint8_t[payload.length]);
+    bench.Run(std::string("RleCompress ") + payload.name, n, [&]() {
+      return RleCompress(payload.data, payload.length, compressed.get(), compressedSize) > 0
+          ? payload.length : -1;
+    });
+    bench.Run(std::string("RleDecode ") + payload.name, n, [&]() {
+      RleDecoder decoder(decoded.get(), payload.length);
+      return decoder.Feed(compressed.get(), compressedSize) ? (int) decoder.size() : -1;
+    });
+    bench.SetCounter(std::string("rle_") + payload.name + "_raw_bytes", payload.length);
+    bench.SetCounter(std::string("rle_") + payload.name + "_wire_bytes", compressedSize);
   }
 
-  ESP_LOGI(TAG, "DONE. All tests run.");
+  // Checking a 48 KB state against a copy, byte by byte as the tests used
+  // to, then a word at a time, and checksumming it.
+  {
+    const auto& region = representative.regions[0];
+    std::unique_ptr<uint8_t[]> copy(new uint8_t[region.length]);
+    memcpy(copy.get(), region.data.get(), region.length);
+    bench.Run("Compare bytewise 48K", n, [&]() {
+      for (int i = 0; i < region.length; ++i) {
+        if (region.data.get()[i] != copy[i]) return -1;
+      }
+      return region.length;
+    });
+    bench.Run("FirstDifference 48K", n, [&]() {
+      return FirstDifference(region.data.get(), copy.get(), region.length) < 0 ? region.length : -1;
+    });
+    bench.Run("Crc32 48K", n, [&]() {
+      return Crc32(region) != 0 ? region.length : -1;
+    });
+    bench.Run("Hash32 48K", n, [&]() {
+      return Hash32(region) != 0 ? region.length : -1;
+    });
+  }
+
+  // Prefetching the first catalog page and its COMMAND images, one request
+  // after the other vs. over a pool of connections.
+  bench.Run("Prefetch page serial", n, [&]() {
+    std::vector<RsAppNano> page;
+    if (!rs.FetchAppsNano(0, 5, &page)) return -1;
+    int bytes = 0;
+    for (const auto& app : page) {
+      std::vector<RsMediaImage> images;
+      if (!rs.FetchMediaImages(app.id, commandType, &images)) return -1;
+      for (const auto& image : images) bytes += PayloadSize(image);
+    }
+    return bytes;
+  });
+  {
+    AsyncRetroStore pool(ASYNC_RS_QUEUE_LENGTH, ASYNC_RS_CORE, BATCH_FETCH_WORKERS);
+    bench.Run("Prefetch page batched", n, [&]() {
+      std::vector<RsAppNano> page;
+      if (!rs.FetchAppsNano(0, 5, &page)) return -1;
+      std::vector<std::string> ids;
+      for (const auto& app : page) ids.push_back(app.id);
+      int bytes = 0;
+      if (!FetchMediaImagesBatch(&pool, ids, commandType,
+                                 [&](int index, bool success, std::vector<RsMediaImage>& images) {
+            for (const auto& image : images) bytes += PayloadSize(image);
+          })) {
+        return -1;
+      }
+      return bytes;
+    });
+  }
+
+  // Scrolling through the catalog a page at a time, with a short pause on
+  // every app as if it were displayed: one request per page boundary vs. a
+  // cursor that prefetches the next page meanwhile.
+  const int DISPLAY_MS = 2;
+  bench.Run("Scroll catalog paged", n, [&]() {
+    int bytes = 0;
+    for (int start = 0;; start += CATALOG_CURSOR_PAGE_SIZE) {
+      std::vector<RsAppNano> page;
+      if (!rs.FetchAppsNano(start, CATALOG_CURSOR_PAGE_SIZE, &page)) return -1;
+      for (const auto& app : page) {
+        bytes += PayloadSize(app);
+        vTaskDelay(pdMS_TO_TICKS(DISPLAY_MS));
+      }
+      if (page.size() < CATALOG_CURSOR_PAGE_SIZE) return bytes;
+    }
+  });
+  {
+    AsyncRetroStore async;
+    bench.Run("Scroll catalog cursor", n, [&]() {
+      RsCatalogCursor cursor(&async);
+      int bytes = 0;
+      for (int i = 0;; ++i) {
+        const RsAppView* app = cursor.Get(i);
+        if (app == nullptr) return cursor.size() == i ? bytes : -1;
+        bytes += app->id.length + app->name.length + app->version.length + app->author.length;
+        vTaskDelay(pdMS_TO_TICKS(DISPLAY_MS));
+      }
+    });
+  }
+
+#ifdef CONFIG_RS_BENCHMARK_FORMAT_JSON
+  bench.PrintJson();
+#else
+  bench.PrintCsv();
+#endif
+  HeapProfiler::Log();
+  ESP_LOGI(TAG, "Benchmark done.");
 }
+#endif
 
-void event_handler(void* arg, esp_event_base_t event_base,
-                   int32_t event_id, void* event_data) {
-  if (event_base == WINSTON_EVENT && event_id == WIFI_CONNECTED) {
-    runAllTests();
+void testStreamMediaImage() {
+  ESP_LOGI(TAG, "testStreamMediaImage()...");
+
+  const std::string BREAKDOWN_ID("29b20252-680f-11e8-b4a9-1f10b5491ef5");
+  std::vector<RsMediaType> types;
+  types.push_back(RsMediaType_COMMAND);
+  std::vector<RsMediaImage> images;
+  std::vector<RsMediaImageRef> imageRefs;
+  if (!rs.FetchMediaImages(BREAKDOWN_ID, types, &images) ||
+      !rs.FetchMediaImageRefs(BREAKDOWN_ID, types, &imageRefs)) {
+    ESP_LOGE(TAG, "Downloading media images failed.");
+    return;
+  }
+  const auto& ref = imageRefs[0];
+
+  // Stream through a sink with an odd chunk size, so the last chunk is short.
+  int received = 0;
+  int largestChunk = 0;
+  bool inOrder = true;
+  auto success = StreamMediaImage(&rs, ref, [&](int offset, const uint8_t* data, int length) {
+    if (offset != received) inOrder = false;
+    if (memcmp(data, images[0].data.get() + offset, length) != 0) {
+      ESP_LOGE(TAG, "Streamed data at offset %d does not match.", offset);
+      return false;
+    }
+    received += length;
+    if (length > largestChunk) largestChunk = length;
+    return true;
+  }, 1000);
+  if (!success) {
+    ESP_LOGE(TAG, "FAILED: Streaming media image to sink.");
+    return;
+  }
+  if (!inOrder || received != ref.data_size || largestChunk > 1000) {
+    ESP_LOGE(TAG, "FAILED: Streamed %d of %d bytes, in order: %d, largest chunk: %d",
+             received, ref.data_size, inOrder, largestChunk);
+    return;
+  }
+
+  // Stream into a caller-owned buffer.
+  std::unique_ptr<uint8_t[]> buffer(new uint8_t[ref.data_size]);
+  if (!StreamMediaImage(&rs, ref, buffer.get(), ref.data_size)) {
+    ESP_LOGE(TAG, "FAILED: Streaming media image to buffer.");
+    return;
+  }
+  if (memcmp(buffer.get(), images[0].data.get(), ref.data_size) != 0) {
+    ESP_LOGE(TAG, "FAILED: Streamed buffer does not match media image.");
+    return;
+  }
+
+  // A buffer that is too small must be rejected.
+  if (StreamMediaImage(&rs, ref, buffer.get(), ref.data_size - 1)) {
+    ESP_LOGE(TAG, "FAILED: Streaming into a too small buffer should fail.");
+    return;
+  }
+  ESP_LOGI(TAG, "testStreamMediaImage()...SUCCESS");
+}
+
+bool helper_readAndCheckCachedRegion(MediaBlockCache* cache, const RsMediaImageRef& ref,
+                                     int start, int length, const uint8_t* want) {
+  RsMediaRegion region;
+  if (!cache->Read(ref, start, length, &region)) {
+    ESP_LOGE(TAG, "token=%s Reading cached media image region failed.", ref.token.c_str());
+    return false;
+  }
+  return helper_checkMediaRegion(region, length, want);
+}
+
+void testMediaBlockCache() {
+  ESP_LOGI(TAG, "testMediaBlockCache()...");
+
+  const std::string BREAKDOWN_ID("29b20252-680f-11e8-b4a9-1f10b5491ef5");
+  std::vector<RsMediaType> types;
+  types.push_back(RsMediaType_COMMAND);
+  std::vector<RsMediaImage> images;
+  std::vector<RsMediaImageRef> imageRefs;
+  if (!rs.FetchMediaImages(BREAKDOWN_ID, types, &images) ||
+      !rs.FetchMediaImageRefs(BREAKDOWN_ID, types, &imageRefs)) {
+    ESP_LOGE(TAG, "Downloading media images failed.");
+    return;
+  }
+  const auto& ref = imageRefs[0];
+
+  // Same reads as testFetchMediaImageRangeTest, twice. The second round must
+  // be served from the cache.
+  MediaBlockCache cache(&rs, 512, 4 * 1024, 2);
+  uint8_t want1[] = {1, 2, 0, 128, 49, 0, 155, 243, 205, 228};
+  uint8_t want2[] = {2, 24, 224, 27, 24, 194, 2, 2, 0, 128};
+  uint8_t want3[] = {254, 200, 40, 35, 254, 75, 40, 26, 254, 10};
+  for (int round = 0; round < 2; ++round) {
+    if (!helper_readAndCheckCachedRegion(&cache, ref, 0, 10, want1)) return;
+    if (!helper_readAndCheckCachedRegion(&cache, ref, ref.data_size - 10, 10, want2)) return;
+    if (!helper_readAndCheckCachedRegion(&cache, ref, 1242, 10, want3)) return;
+  }
+  if (cache.requests() != 3 || cache.hits() != 3) {
+    ESP_LOGE(TAG, "FAILED: Expected 3 requests and 3 hits, got %ld and %ld",
+             cache.requests(), cache.hits());
+    return;
+  }
+
+  // Read the whole image sector by sector, which crosses block boundaries
+  // and evicts earlier blocks.
+  cache.Clear();
+  auto requestsBefore = cache.requests();
+  const int SECTOR = 100;
+  int reads = 0;
+  for (int offset = 0; offset < ref.data_size; offset += SECTOR) {
+    RsMediaRegion region;
+    if (!cache.Read(ref, offset, SECTOR, &region)) {
+      ESP_LOGE(TAG, "FAILED: Reading sector at %d.", offset);
+      return;
+    }
+    int want = std::min(SECTOR, ref.data_size - offset);
+    if (region.length != want ||
+        memcmp(region.data.get(), images[0].data.get() + offset, want) != 0) {
+      ESP_LOGE(TAG, "FAILED: Sector at %d does not match.", offset);
+      return;
+    }
+    reads++;
+  }
+  auto requests = cache.requests() - requestsBefore;
+  if (requests * 5 > reads) {
+    ESP_LOGE(TAG, "FAILED: %ld requests for %d sequential reads.", requests, reads);
+    return;
+  }
+  if (cache.cached_bytes() > 4 * 1024) {
+    ESP_LOGE(TAG, "FAILED: Cache exceeds its budget: %d", cache.cached_bytes());
+    return;
+  }
+  ESP_LOGI(TAG, "%d sequential reads took %ld requests, %ld blocks prefetched.",
+           reads, requests, cache.prefetched());
+  ESP_LOGI(TAG, "testMediaBlockCache()...SUCCESS");
+}
+
+bool helper_sameState(const RsSystemState& a, const RsSystemState& b) {
+  if (a.model != b.model || memcmp(&a.registers, &b.registers, sizeof(RsRegisters)) != 0) {
+    return false;
+  }
+  if (!SameRegionLayout(a, b)) return false;
+  for (int i = 0; i < a.regions.size(); ++i) {
+    if (memcmp(a.regions[i].data.get(), b.regions[i].data.get(), a.regions[i].length) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void testDeltaUpload() {
+  ESP_LOGI(TAG, "testDeltaUpload()...");
+
+  RsSystemState state;
+  createRandomTestState(&state);
+  {
+    RsMemoryRegion region;
+    region.start = 0x4000;
+    region.length = 4096;
+    region.data.reset(new uint8_t[4096]);
+    memset(region.data.get(), 0, 4096);
+    state.regions.push_back(std::move(region));
+  }
+
+  DeltaUploader uploader(&rs);
+  if (uploader.Upload(state) < 0 || uploader.chain().size() != 1) {
+    ESP_LOGE(TAG, "FAILED: Uploading base state.");
+    return;
+  }
+
+  // Touch three bytes in two pages and a register.
+  state.regions[1].data.get()[10] = 1;
+  state.regions[1].data.get()[11] = 2;
+  state.regions[1].data.get()[3000] = 3;
+  state.registers.pc = 0x4321;
+  if (uploader.Upload(state) < 0 || uploader.chain().size() != 2) {
+    ESP_LOGE(TAG, "FAILED: Uploading delta state.");
+    return;
+  }
+  if (uploader.last_upload_bytes() != 2 * STATE_DELTA_PAGE_SIZE) {
+    ESP_LOGE(TAG, "FAILED: Delta upload sent %d bytes", uploader.last_upload_bytes());
+    return;
+  }
+
+  // Nothing changed, nothing to upload.
+  auto token = uploader.chain().back();
+  if (uploader.Upload(state) != token || uploader.last_upload_bytes() != 0) {
+    ESP_LOGE(TAG, "FAILED: Unchanged state was uploaded again.");
+    return;
+  }
+
+  RsSystemState restored;
+  if (!DownloadStateChain(&rs, uploader.chain(), &restored)) {
+    ESP_LOGE(TAG, "FAILED: Downloading state chain.");
+    return;
+  }
+  if (!helper_sameState(state, restored)) {
+    ESP_LOGE(TAG, "FAILED: Restored state does not match the last snapshot.");
+    return;
+  }
+
+  // A different region layout starts a new chain.
+  state.regions.pop_back();
+  if (uploader.Upload(state) < 0 || uploader.chain().size() != 1) {
+    ESP_LOGE(TAG, "FAILED: Layout change did not start a new chain.");
+    return;
+  }
+
+  // Changes on both sides of the boundary between two adjacent regions.
+  RsSystemState adjacent;
+  for (int start = 0; start < 2048; start += 1024) {
+    RsMemoryRegion region;
+    region.start = start;
+    region.length = 1024;
+    region.data.reset(new uint8_t[1024]);
+    memset(region.data.get(), 0, 1024);
+    adjacent.regions.push_back(std::move(region));
+  }
+  DeltaUploader adjacent_uploader(&rs);
+  adjacent_uploader.Upload(adjacent);
+  adjacent.regions[0].data.get()[1023] = 7;
+  adjacent.regions[1].data.get()[0] = 9;
+  if (adjacent_uploader.Upload(adjacent) < 0 || adjacent_uploader.chain().size() != 2 ||
+      !DownloadStateChain(&rs, adjacent_uploader.chain(), &restored) ||
+      !helper_sameState(adjacent, restored)) {
+    ESP_LOGE(TAG, "FAILED: Changes at the boundary of adjacent regions were not restored.");
+    return;
+  }
+  ESP_LOGI(TAG, "testDeltaUpload()...SUCCESS");
+}
+
+bool helper_rleRoundTrip(const char* name, const uint8_t* data, int length, int feedSize) {
+  std::unique_ptr<uint8_t[]> compressed(new uint8_t[RLE_COMPRESS_BOUND(length) + 1]);
+  auto compressedSize = RleCompress(data, length, compressed.get(), RLE_COMPRESS_BOUND(length));
+  if (length > 0 && compressedSize == 0) {
+    ESP_LOGE(TAG, "FAILED: %s: Compressing failed.", name);
+    return false;
+  }
+  if (compressedSize != RleCompressedSize(data, length)) {
+    ESP_LOGE(TAG, "FAILED: %s: Size mismatch %d vs %d", name, compressedSize,
+             RleCompressedSize(data, length));
+    return false;
+  }
+  std::unique_ptr<uint8_t[]> decoded(new uint8_t[length + 1]);
+  RleDecoder decoder(decoded.get(), length);
+  for (int i = 0; i < compressedSize; i += feedSize) {
+    if (!decoder.Feed(compressed.get() + i, std::min(feedSize, (int) compressedSize - i))) {
+      ESP_LOGE(TAG, "FAILED: %s: Decoding overflowed.", name);
+      return false;
+    }
+  }
+  if (!decoder.complete() || decoder.size() != length ||
+      memcmp(decoded.get(), data, length) != 0) {
+    ESP_LOGE(TAG, "FAILED: %s: Round trip does not match.", name);
+    return false;
+  }
+  ESP_LOGI(TAG, "%s: %d -> %d bytes", name, length, compressedSize);
+  return true;
+}
+
+void testRleCodec() {
+  ESP_LOGI(TAG, "testRleCodec()...");
+
+  RsSystemState state;
+  createRepresentativeTestState(&state);
+  const auto& region = state.regions[0];
+  if (!helper_rleRoundTrip("state", region.data.get(), region.length, 1460)) return;
+  if (RleCompressedSize(region.data.get(), region.length) > region.length / 4) {
+    ESP_LOGE(TAG, "FAILED: Representative state compressed poorly.");
+    return;
+  }
+
+  uint8_t random[1000];
+  for (int i = 0; i < sizeof(random); ++i) random[i] = rand() % 256;
+  if (!helper_rleRoundTrip("random", random, sizeof(random), 1)) return;
+  if (RleCompressedSize(random, sizeof(random)) > RLE_COMPRESS_BOUND(sizeof(random))) {
+    ESP_LOGE(TAG, "FAILED: Random data exceeds the compress bound.");
+    return;
+  }
+
+  // Runs right at and around the packet limits.
+  uint8_t runs[700];
+  int pos = 0;
+  for (int run : {1, 2, 3, 129, 130, 131, 260, 2}) {
+    memset(runs + pos, run % 7, run);
+    pos += run;
+  }
+  if (!helper_rleRoundTrip("runs", runs, pos, 3)) return;
+  if (!helper_rleRoundTrip("empty", runs, 0, 1)) return;
+
+  // The decoder must not write past its buffer.
+  uint8_t compressed[RLE_COMPRESS_BOUND(sizeof(runs))];
+  auto size = RleCompress(runs, pos, compressed, sizeof(compressed));
+  uint8_t small[100];
+  RleDecoder decoder(small, sizeof(small));
+  if (decoder.Feed(compressed, size)) {
+    ESP_LOGE(TAG, "FAILED: Decoder overflowed its buffer.");
+    return;
+  }
+  ESP_LOGI(TAG, "testRleCodec()...SUCCESS");
+}
+
+void testVerify() {
+  ESP_LOGI(TAG, "testVerify()...");
+  const char* check = "123456789";
+  const char* spam = "Nobody inspects the spammish repetition";
+  if (Crc32((const uint8_t*) check, 9) != 0xcbf43926 ||
+      Crc32((const uint8_t*) check + 4, 5, Crc32((const uint8_t*) check, 4)) != 0xcbf43926 ||
+      Hash32(nullptr, 0) != 0x02cc5d05 || Hash32((const uint8_t*) "abc", 3) != 0x32d153ff ||
+      Hash32((const uint8_t*) spam, strlen(spam)) != 0xe2293b2f) {
+    ESP_LOGE(TAG, "FAILED: Checksums do not match the reference values.");
+    return;
+  }
+
+  // Every length and every alignment around the word-wide loop.
+  uint8_t a[100];
+  uint8_t b[sizeof(a) + 8];
+  for (int i = 0; i < sizeof(a); ++i) a[i] = rand() % 256;
+  for (int shift = 0; shift < 8; ++shift) {
+    uint8_t* c = b + shift;
+    for (int length = 0; length <= 70; ++length) {
+      memcpy(c, a + 1, length);
+      if (FirstDifference(a + 1, c, length) != -1) {
+        ESP_LOGE(TAG, "FAILED: Equal buffers differ (length %d, shift %d).", length, shift);
+        return;
+      }
+      for (int at = 0; at < length; ++at) {
+        c[at] ^= 0x40;
+        int found = FirstDifference(a + 1, c, length);
+        c[at] ^= 0x40;
+        if (found != at) {
+          ESP_LOGE(TAG, "FAILED: Difference at %d found at %d (length %d).", at, found, length);
+          return;
+        }
+      }
+    }
+  }
+
+  RsMemoryRegion region;
+  region.start = 0;
+  region.length = sizeof(a);
+  region.data.reset(new uint8_t[region.length]);
+  memcpy(region.data.get(), a, sizeof(a));
+  if (FirstDifference(region, a, sizeof(a)) != -1 || FirstDifference(region, a, 50) != 50 ||
+      Crc32(region) != Crc32(a, sizeof(a)) || Hash32(region) != Hash32(a, sizeof(a))) {
+    ESP_LOGE(TAG, "FAILED: Checking a memory region.");
+    return;
+  }
+  RsMediaRegion empty;
+  empty.length = 0;
+  if (FirstDifference(empty, a, 0) != -1 || FirstDifference(empty, a, 1) != 0 ||
+      Crc32(empty) != 0) {
+    ESP_LOGE(TAG, "FAILED: Checking an empty media region.");
+    return;
+  }
+  ESP_LOGI(TAG, "testVerify()...SUCCESS");
+}
+
+// The statistics of `site`, all zero if it has not been used yet.
+RsHeapSiteStats heapSite(const char* site) {
+  for (const auto& stats : HeapProfiler::Sites()) {
+    if (strcmp(stats.name, site) == 0) return stats;
+  }
+  RsHeapSiteStats none = {};
+  return none;
+}
+
+void testHeapProfiler() {
+  ESP_LOGI(TAG, "testHeapProfiler()...");
+  if (!HeapProfiler::enabled()) {
+    ESP_LOGI(TAG, "testHeapProfiler()...SKIPPED (CONFIG_RS_HEAP_PROFILER is not set)");
+    return;
+  }
+  // Every call of the AsyncRetroStore test has freed what it allocated.
+  auto fetch = heapSite("FetchApp");
+  if (fetch.calls == 0 || fetch.allocations == 0 || fetch.live_bytes != 0 ||
+      fetch.min_free_heap == 0) {
+    ESP_LOGE(TAG, "FAILED: FetchApp: %d calls, %d allocations, %d bytes live.",
+             (int) fetch.calls, (int) fetch.allocations, (int) fetch.live_bytes);
+    return;
+  }
+
+  auto before = heapSite("testHeapProfiler");
+  auto before_inner = heapSite("testHeapProfiler.inner");
+  std::unique_ptr<uint8_t[]> outer_block;
+  std::unique_ptr<uint8_t[]> inner_block;
+  {
+    HeapScope scope("testHeapProfiler");
+    outer_block.reset(new uint8_t[1000]);
+    {
+      HeapScope inner("testHeapProfiler.inner");
+      inner_block.reset(new uint8_t[300]);
+    }
+  }
+  auto during = heapSite("testHeapProfiler");
+  auto during_inner = heapSite("testHeapProfiler.inner");
+  if (during.calls != before.calls + 1 || during.allocations != before.allocations + 1 ||
+      during.live_bytes != before.live_bytes + 1000 || during.largest_allocation < 1000 ||
+      during.peak_live_bytes < 1000 || during_inner.allocations != before_inner.allocations + 1 ||
+      during_inner.live_bytes != before_inner.live_bytes + 300) {
+    ESP_LOGE(TAG, "FAILED: Allocations were not charged to their scopes.");
+    return;
+  }
+
+  // Frees are charged to the allocating site, wherever they happen.
+  outer_block.reset();
+  inner_block.reset();
+  auto after = heapSite("testHeapProfiler");
+  auto after_inner = heapSite("testHeapProfiler.inner");
+  if (after.live_bytes != before.live_bytes || after.frees != before.frees + 1 ||
+      after_inner.live_bytes != before_inner.live_bytes) {
+    ESP_LOGE(TAG, "FAILED: Frees were not charged to the allocating scope.");
+    return;
+  }
+  ESP_LOGI(TAG, "testHeapProfiler()...SUCCESS");
+}
+
+bool helper_streamRoundTrip(const char* name, const RsSystemState& state, bool rle,
+                            int feedSize) {
+  RsStateEncoder encoder(state, rle);
+  RsSystemState decoded;
+  RsStateDecoder decoder(&decoded);
+  std::unique_ptr<uint8_t[]> piece(new uint8_t[feedSize]);
+  size_t total = 0;
+  for (size_t n; (n = encoder.Read(piece.get(), feedSize)) > 0; total += n) {
+    if (!decoder.Feed(piece.get(), n)) {
+      ESP_LOGE(TAG, "FAILED: %s: Decoding failed at byte %d.", name, (int) total);
+      return false;
+    }
+  }
+  if (total != encoder.size() || !decoder.complete() || !helper_sameState(state, decoded)) {
+    ESP_LOGE(TAG, "FAILED: %s: Round trip does not match.", name);
+    return false;
+  }
+  return true;
+}
+
+void testStateStream() {
+  ESP_LOGI(TAG, "testStateStream()...");
+
+  RsSystemState state;
+  createRandomTestState(&state);
+  createRepresentativeTestState(&state);
+  state.registers.pc = 0xffff;
+  for (bool rle : {false, true}) {
+    for (int feedSize : {1, 7, 1460, 100000}) {
+      if (!helper_streamRoundTrip(rle ? "rle" : "plain", state, rle, feedSize)) return;
+    }
+  }
+
+  // Straight into an image of the address space.
+  {
+    std::unique_ptr<uint8_t[]> memory(new uint8_t[0x10000]);
+    memset(memory.get(), 0, 0x10000);
+    RsStateEncoder encoder(state, true);
+    std::vector<uint8_t> encoded(encoder.size());
+    encoder.Read(encoded.data(), encoded.size());
+    RsSystemState decoded;
+    RsStateDecoder decoder(&decoded, [&memory](int start, int length) -> uint8_t* {
+      return start >= 0 && start + length <= 0x10000 ? memory.get() + start : nullptr;
+    });
+    if (!decoder.Feed(encoded.data(), encoded.size()) || !decoder.complete() ||
+        decoded.regions.size() != state.regions.size()) {
+      ESP_LOGE(TAG, "FAILED: Decoding into memory failed.");
+      return;
+    }
+    for (int i = 0; i < state.regions.size(); ++i) {
+      const auto& region = state.regions[i];
+      if (decoded.regions[i].data || decoded.regions[i].length != region.length ||
+          memcmp(memory.get() + region.start, region.data.get(), region.length) != 0) {
+        ESP_LOGE(TAG, "FAILED: Region %d was not decoded into memory.", i);
+        return;
+      }
+    }
+  }
+
+  // Regions sent without data, cut-off input and garbage.
+  {
+    std::vector<RsRegionView> regions = {{0x4000, 100, nullptr}};
+    RsStateEncoder encoder(RsTrs80Model_MODEL_I, state.registers, regions);
+    std::vector<uint8_t> encoded(encoder.size());
+    encoder.Read(encoded.data(), encoded.size());
+    RsSystemState decoded;
+    RsStateDecoder decoder(&decoded);
+    if (!decoder.Feed(encoded.data(), encoded.size() - 1) || decoder.complete() ||
+        !decoder.Feed(encoded.data() + encoded.size() - 1, 1) || !decoder.complete() ||
+        decoded.regions.size() != 1 || decoded.regions[0].length != 100 ||
+        decoded.regions[0].data || decoded.model != RsTrs80Model_MODEL_I) {
+      ESP_LOGE(TAG, "FAILED: Region without data was not decoded.");
+      return;
+    }
+    std::vector<uint8_t> garbage(64, 0xff);
+    RsStateDecoder garbage_decoder(&decoded);
+    if (garbage_decoder.Feed(garbage.data(), garbage.size())) {
+      ESP_LOGE(TAG, "FAILED: Garbage was decoded.");
+      return;
+    }
+    // A region claiming 2^35 bytes with data claiming 0x80000010, which
+    // does not fit an int.
+    std::vector<uint8_t> huge = {0x1a, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01,
+                                 0x12, 0x90, 0x80, 0x80, 0x80, 0x08};
+    huge.resize(huge.size() + 100, 0x55);
+    RsStateDecoder huge_decoder(&decoded);
+    if (huge_decoder.Feed(huge.data(), huge.size())) {
+      ESP_LOGE(TAG, "FAILED: Region data longer than 2 GB was decoded.");
+      return;
+    }
+  }
+
+  // Downloading a state should not take much more than the state itself.
+  // Sized so that the upload, the download and the state fit the device's
+  // heap next to each other, with the state above released first.
+  state.regions.clear();
+  {
+    const int BANK_SIZE = 0x4000;
+    RsSystemState big;
+    big.model = RsTrs80Model_MODEL_4;
+    big.registers = state.registers;
+    for (int bank = 0; bank < 2; ++bank) {
+      RsMemoryRegion region;
+      region.start = bank * 0x10000;
+      region.length = BANK_SIZE;
+      region.data.reset(new uint8_t[region.length]);
+      for (int i = 0; i < region.length; ++i) region.data.get()[i] = rand() % 256;
+      big.regions.push_back(std::move(region));
+    }
+    int token = rs.UploadState(big);
+    RsSystemState downloaded;
+    bool success;
+    {
+      HeapScope scope("testStateStream.DownloadState");
+      success = token >= 0 && rs.DownloadState(token, &downloaded);
+    }
+    if (!success || !helper_sameState(big, downloaded)) {
+      ESP_LOGE(TAG, "FAILED: Downloading the 32 KB state.");
+      return;
+    }
+    if (HeapProfiler::enabled()) {
+      int peak = heapSite("testStateStream.DownloadState").peak_live_bytes;
+      ESP_LOGI(TAG, "Downloading a 32 KB state peaked at %d bytes.", peak);
+      // The regions plus a bounded decoding buffer, not a second copy.
+      if (peak > 2 * BANK_SIZE * 5 / 4) {
+        ESP_LOGE(TAG, "FAILED: Downloading the state peaked at %d bytes, more than 1.25x its size.",
+                 peak);
+        return;
+      }
+    }
+  }
+  ESP_LOGI(TAG, "testStateStream()...SUCCESS");
+}
+
+void testAppPage() {
+  ESP_LOGI(TAG, "testAppPage()...");
+
+  std::vector<RsApp> apps;
+  if (!rs.FetchApps(0, 5, &apps)) {
+    ESP_LOGE(TAG, "FAILED: Downloading apps failed.");
+    return;
+  }
+  RsAppPage page;
+  if (!page.Fetch(&rs, 0, 5)) {
+    ESP_LOGE(TAG, "FAILED: Downloading app page failed.");
+    return;
+  }
+  if (page.size() != apps.size()) {
+    ESP_LOGE(TAG, "FAILED: Expected %d apps in page, got %d", apps.size(), page.size());
+    return;
+  }
+  for (int i = 0; i < page.size(); ++i) {
+    const auto& want = apps[i];
+    const auto& got = page[i];
+    if (got.id != want.id.c_str() || got.name != want.name.c_str() ||
+        got.version != want.version.c_str() || got.author != want.author.c_str() ||
+        got.description != want.description.c_str()) {
+      ESP_LOGE(TAG, "FAILED: Strings of app %d do not match: %s", i, got.name.c_str());
+      return;
+    }
+    if (got.release_year != want.release_year || got.model != want.model) {
+      ESP_LOGE(TAG, "FAILED: Fields of app %d do not match.", i);
+      return;
+    }
+    if (got.num_screenshot_urls != want.screenshot_urls.size()) {
+      ESP_LOGE(TAG, "FAILED: App %d has %d screenshots, expected %d", i,
+               got.num_screenshot_urls, want.screenshot_urls.size());
+      return;
+    }
+    for (int j = 0; j < got.num_screenshot_urls; ++j) {
+      if (got.screenshot_urls[j] != want.screenshot_urls[j].c_str()) {
+        ESP_LOGE(TAG, "FAILED: Screenshot URL %d of app %d does not match.", j, i);
+        return;
+      }
+    }
+  }
+
+  // Browsing the same or a smaller page again must not reallocate.
+  auto capacity = page.arena_capacity();
+  auto* first = page.begin();
+  std::vector<RsMediaType> hasType;
+  if (!page.FetchNano(&rs, 0, 1, "Weerd", hasType)) {
+    ESP_LOGE(TAG, "FAILED: Downloading nano app page failed.");
+    return;
+  }
+  if (page.size() != 1 || page[0].name != "Weerd" || page[0].num_screenshot_urls != 0) {
+    ESP_LOGE(TAG, "FAILED: Unexpected nano app page.");
+    return;
+  }
+  if (page.begin() != first || page.arena_capacity() != capacity) {
+    ESP_LOGE(TAG, "FAILED: Refilling the page reallocated its arena.");
+    return;
+  }
+  page.Clear();
+  if (!page.empty() || page.arena_capacity() != 0) {
+    ESP_LOGE(TAG, "FAILED: Clearing the page did not free it.");
+    return;
+  }
+  ESP_LOGI(TAG, "testAppPage()...SUCCESS");
+}
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+// Against the mock's catalog, whose contents are known. The index matches
+// word prefixes where the server matches substrings, so on a real catalog
+// the results may rightly differ; and syncing rewrites the partition.
+void testCatalogIndex() {
+  ESP_LOGI(TAG, "testCatalogIndex()...");
+  {
+    CatalogIndex index;
+    if (!index.ok() || !index.Sync(&rs) || !index.ready()) {
+      ESP_LOGE(TAG, "FAILED: Syncing the index failed.");
+      return;
+    }
+  }
+
+  struct Query {
+    int start;
+    int num;
+    const char* query;
+    std::vector<RsMediaType> hasTypes;
+    // Names of the apps found, in catalog order.
+    std::vector<std::string> expected;
+  };
+  const std::vector<std::string> ALL = {"Donkey Kong", "Breakdown", "Weerd", "LDOS - Model I",
+                                        "LDOS - Model III", "Scarfman", "Cosmic Fighter"};
+  const Query queries[] = {
+      {0, 100, "", {}, ALL},
+      {0, 1, "Weerd", {}, {"Weerd"}},
+      {0, 10, "ldos OR donkey", {}, {"Donkey Kong", "LDOS - Model I", "LDOS - Model III"}},
+      {0, 10, "ldos OR donkey", {RsMediaType_COMMAND}, {"Donkey Kong"}},
+      {1, 2, "ldos OR donkey", {}, {"LDOS - Model I", "LDOS - Model III"}},
+      {0, 10, "don", {}, {"Donkey Kong"}},
+      {0, 10, "model iii", {}, {"LDOS - Model III"}},
+      {0, 10, "LDOS - Model I", {}, {"LDOS - Model I", "LDOS - Model III"}},
+      {0, 10, "", {RsMediaType_DISK}, {"Breakdown", "Weerd", "LDOS - Model I", "LDOS - Model III"}},
+      {0, 10, "", {RsMediaType_DISK, RsMediaType_COMMAND}, {"Breakdown"}},
+      {0, 10, "nothing like this", {}, {}},
+  };
+  // A fresh instance, so that the index is read back from flash.
+  CatalogIndex index;
+  if (!index.ready() || index.apps() != ALL.size()) {
+    ESP_LOGE(TAG, "FAILED: The index was not read back, %d apps.", index.apps());
+    return;
+  }
+  std::vector<RsAppNano> server;
+  if (!rs.FetchAppsNano(0, 100, &server) || server.size() != ALL.size()) {
+    ESP_LOGE(TAG, "FAILED: Fetching the catalog failed.");
+    return;
+  }
+  for (const auto& q : queries) {
+    std::vector<RsAppNano> actual;
+    if (!index.FetchAppsNano(q.start, q.num, q.query, q.hasTypes, &actual)) {
+      ESP_LOGE(TAG, "FAILED: Query '%s' failed.", q.query);
+      return;
+    }
+    bool same = q.expected.size() == actual.size();
+    for (int i = 0; same && i < actual.size(); ++i) {
+      same = actual[i].name == q.expected[i];
+      // The fields are those of the server's app.
+      for (const auto& app : server) {
+        if (app.id != actual[i].id) continue;
+        same = same && app.name == actual[i].name && app.version == actual[i].version &&
+               app.release_year == actual[i].release_year && app.author == actual[i].author &&
+               app.model == actual[i].model;
+      }
+    }
+    if (!same) {
+      ESP_LOGE(TAG, "FAILED: Query '%s' found %d apps, expected %d.", q.query,
+               (int) actual.size(), (int) q.expected.size());
+      return;
+    }
+  }
+
+  index.Clear();
+  if (index.ready() || CatalogIndex().ready()) {
+    ESP_LOGE(TAG, "FAILED: The index is still there after Clear().");
+    return;
+  }
+  ESP_LOGI(TAG, "testCatalogIndex()...SUCCESS");
+}
+#endif
+
+void testCatalogCache() {
+  ESP_LOGI(TAG, "testCatalogCache()...");
+  const auto DONKEY_KONG_ID = "a2729dec-96b3-11e7-9539-e7341c560175";
+
+  RsApp want;
+  if (!rs.FetchApp(DONKEY_KONG_ID, &want)) {
+    ESP_LOGE(TAG, "FAILED: Downloading app.");
+    return;
+  }
+  {
+    CatalogCache cache(&rs);
+    cache.Clear();
+    RsApp app;
+    if (!cache.FetchApp(DONKEY_KONG_ID, &app) || cache.misses() != 1) {
+      ESP_LOGE(TAG, "FAILED: First fetch should be a miss.");
+      return;
+    }
+    std::vector<RsAppNano> apps;
+    std::vector<RsMediaType> hasType;
+    if (!cache.FetchAppsNano(0, 1, "Weerd", hasType, &apps) || cache.misses() != 2) {
+      ESP_LOGE(TAG, "FAILED: First query should be a miss.");
+      return;
+    }
+    if (cache.FetchApp("a2729dec_XXXX_11e7-9539-e7341c560175", &app)) {
+      ESP_LOGE(TAG, "FAILED: Fetching a non-existent app should fail.");
+      return;
+    }
+  }
+
+  // A new instance, as after a reboot, is served from flash.
+  CatalogCache cache(&rs);
+  RsApp app;
+  if (!cache.FetchApp(DONKEY_KONG_ID, &app) || cache.hits() != 1 || cache.misses() != 0) {
+    ESP_LOGE(TAG, "FAILED: Cached app was not served from flash.");
+    return;
+  }
+  if (app.id != want.id || app.name != want.name || app.description != want.description ||
+      app.author != want.author || app.release_year != want.release_year ||
+      app.model != want.model || app.screenshot_urls != want.screenshot_urls) {
+    ESP_LOGE(TAG, "FAILED: Cached app does not match: %s", app.name.c_str());
+    return;
+  }
+  std::vector<RsAppNano> apps;
+  std::vector<RsMediaType> hasType;
+  if (!cache.FetchAppsNano(0, 1, "Weerd", hasType, &apps) || cache.hits() != 2) {
+    ESP_LOGE(TAG, "FAILED: Cached query was not served from flash.");
+    return;
+  }
+  if (apps.size() != 1 || apps[0].name != "Weerd") {
+    ESP_LOGE(TAG, "FAILED: Cached query result does not match.");
+    return;
+  }
+  // Repeated hits are revalidated once.
+  cache.FetchApp(DONKEY_KONG_ID, &app);
+  if (cache.pending() != 2) {
+    ESP_LOGE(TAG, "FAILED: Expected 2 entries pending revalidation, got %d", cache.pending());
+    return;
+  }
+  if (cache.Revalidate() != 2 || cache.unchanged() != 2 || cache.updated() != 0) {
+    ESP_LOGE(TAG, "FAILED: Revalidation should have found both entries unchanged.");
+    return;
+  }
+  cache.Clear();
+  if (!cache.FetchApp(DONKEY_KONG_ID, &app) || cache.misses() != 1) {
+    ESP_LOGE(TAG, "FAILED: Fetch after clearing should be a miss.");
+    return;
+  }
+  cache.Clear();
+
+  // With room for two entries the least recently used one is evicted, also
+  // after a reboot.
+  const auto BREAKDOWN_ID = "29b20252-680f-11e8-b4a9-1f10b5491ef5";
+  {
+    CatalogCache small(&rs, CATALOG_CACHE_NAMESPACE, 2);
+    small.FetchApp(DONKEY_KONG_ID, &app);
+    small.FetchAppsNano(0, 1, "Weerd", hasType, &apps);
+    small.FetchApp(DONKEY_KONG_ID, &app);
+  }
+  {
+    CatalogCache small(&rs, CATALOG_CACHE_NAMESPACE, 2);
+    if (!small.FetchApp(BREAKDOWN_ID, &app) || small.evicted() != 1 || small.size() != 2 ||
+        !small.FetchApp(DONKEY_KONG_ID, &app) || small.hits() != 1 ||
+        !small.FetchAppsNano(0, 1, "Weerd", hasType, &apps) || small.misses() != 2) {
+      ESP_LOGE(TAG, "FAILED: Expected the query to be evicted (%ld hits, %ld misses, %ld evicted).",
+               small.hits(), small.misses(), small.evicted());
+      return;
+    }
+    small.Clear();
+  }
+  ESP_LOGI(TAG, "testCatalogCache()...SUCCESS");
+}
+
+void testCatalogCursor() {
+  ESP_LOGI(TAG, "testCatalogCursor()...");
+  std::vector<RsAppNano> all;
+  if (!rs.FetchAppsNano(0, 100, &all) || all.size() < 5) {
+    ESP_LOGE(TAG, "FAILED: Fetching the whole catalog failed.");
+    return;
+  }
+
+  AsyncRetroStore async;
+  {
+    // Two apps per page and two pages resident: the one read and the next.
+    RsCatalogCursor cursor(&async, "", std::vector<RsMediaType>(), 2, 2);
+    int n = 0;
+    for (const RsAppView* app; (app = cursor.Get(n)) != nullptr; ++n) {
+      if (n >= all.size() || app->id != all[n].id.c_str()) {
+        ESP_LOGE(TAG, "FAILED: App %d is not the one FetchAppsNano returned.", n);
+        return;
+      }
+      if (cursor.resident() > 2) {
+        ESP_LOGE(TAG, "FAILED: %d pages resident.", cursor.resident());
+        return;
+      }
+    }
+    if (n != all.size() || cursor.size() != all.size() || cursor.prefetches() == 0 ||
+        cursor.hits() <= cursor.misses()) {
+      ESP_LOGE(TAG, "FAILED: Read %d of %d apps, %ld hits, %ld misses, %ld prefetches.", n,
+               (int) all.size(), cursor.hits(), cursor.misses(), cursor.prefetches());
+      return;
+    }
+    // And back up, prefetching backwards.
+    long prefetches = cursor.prefetches();
+    for (int i = all.size() - 1; i >= 0; --i) {
+      const RsAppView* app = cursor.Get(i);
+      if (app == nullptr || app->id != all[i].id.c_str()) {
+        ESP_LOGE(TAG, "FAILED: App %d is wrong when scrolling back.", i);
+        return;
+      }
+    }
+    if (cursor.prefetches() == prefetches || cursor.Get(-1) != nullptr ||
+        cursor.Get(all.size()) != nullptr) {
+      ESP_LOGE(TAG, "FAILED: Scrolling back did not prefetch, or read past the ends.");
+      return;
+    }
+  }
+  {
+    RsCatalogCursor cursor(&async, "Weerd");
+    const RsAppView* app = cursor.Get(0);
+    if (app == nullptr || app->name != "Weerd" || cursor.Get(1) != nullptr ||
+        cursor.size() != 1) {
+      ESP_LOGE(TAG, "FAILED: Query results are wrong.");
+      return;
+    }
+  }
+  ESP_LOGI(TAG, "testCatalogCursor()...SUCCESS");
+}
+
+void testAsyncRetroStore() {
+  ESP_LOGI(TAG, "testAsyncRetroStore()...");
+  const auto DONKEY_KONG_ID = "a2729dec-96b3-11e7-9539-e7341c560175";
+  const auto TIMEOUT = pdMS_TO_TICKS(10000);
+
+  auto done = xSemaphoreCreateBinary();
+  {
+    AsyncRetroStore async;
+    std::string name;
+    TaskHandle_t calledOn = nullptr;
+    auto queued = async.FetchApp(DONKEY_KONG_ID, [&](bool success, RsApp& app) {
+      if (success) name = app.name;
+      calledOn = xTaskGetCurrentTaskHandle();
+      xSemaphoreGive(done);
+    });
+    if (!queued || xSemaphoreTake(done, TIMEOUT) != pdTRUE) {
+      ESP_LOGE(TAG, "FAILED: FetchApp did not complete.");
+      vSemaphoreDelete(done);
+      return;
+    }
+    if (name != "Donkey Kong") {
+      ESP_LOGE(TAG, "FAILED: Unexpected app: %s", name.c_str());
+    }
+    if (calledOn != async.worker() || calledOn == xTaskGetCurrentTaskHandle()) {
+      ESP_LOGE(TAG, "FAILED: Callback did not run on the worker task.");
+    }
+
+    // Upload and download, chained from the callback.
+    RsSystemState state;
+    createRandomTestState(&state);
+    std::vector<uint8_t> want(state.regions[0].data.get(),
+                              state.regions[0].data.get() + state.regions[0].length);
+    bool matches = false;
+    async.UploadState(std::move(state), [&](int token) {
+      if (token < 0) {
+        xSemaphoreGive(done);
+        return;
+      }
+      async.DownloadState(token, false, [&](bool success, RsSystemState& downloaded) {
+        matches = success && downloaded.regions.size() == 1 &&
+                  downloaded.regions[0].length == (int) want.size() &&
+                  memcmp(downloaded.regions[0].data.get(), want.data(), want.size()) == 0;
+        xSemaphoreGive(done);
+      });
+    });
+    if (xSemaphoreTake(done, TIMEOUT) != pdTRUE || !matches) {
+      ESP_LOGE(TAG, "FAILED: Uploaded state did not round-trip.");
+    }
+  }
+
+  // A full queue refuses requests instead of blocking.
+  {
+    AsyncRetroStore async(1);
+    auto started = xSemaphoreCreateBinary();
+    auto gate = xSemaphoreCreateBinary();
+    async.Submit([&](RetroStore* rs) {
+      xSemaphoreGive(started);
+      xSemaphoreTake(gate, portMAX_DELAY);
+    });
+    xSemaphoreTake(started, TIMEOUT);
+    int completed = 0;
+    auto count = [&](RetroStore* rs) { completed++; };
+    bool second = async.Submit(count);
+    bool third = async.Submit(count);
+    RsSystemState refused;
+    createRandomTestState(&refused);
+    bool uploaded = async.UploadState(std::move(refused), [](int token) {});
+    xSemaphoreGive(gate);
+    if (!second || third) {
+      ESP_LOGE(TAG, "FAILED: Expected the queue to take exactly one more request.");
+    }
+    if (uploaded || refused.regions.size() != 1 || !refused.regions[0].data) {
+      ESP_LOGE(TAG, "FAILED: A refused upload did not leave the state with the caller.");
+    }
+    async.Submit([&](RetroStore* rs) { xSemaphoreGive(done); });
+    if (xSemaphoreTake(done, TIMEOUT) != pdTRUE || completed != 1) {
+      ESP_LOGE(TAG, "FAILED: Queued requests did not complete, %d did.", completed);
+    }
+    vSemaphoreDelete(started);
+    vSemaphoreDelete(gate);
+  }
+  vSemaphoreDelete(done);
+  ESP_LOGI(TAG, "testAsyncRetroStore()...SUCCESS");
+}
+
+void testBatchFetch() {
+  ESP_LOGI(TAG, "testBatchFetch()...");
+  AsyncRetroStore pool(ASYNC_RS_QUEUE_LENGTH, ASYNC_RS_CORE, BATCH_FETCH_WORKERS);
+
+  // The first page of the catalog, then its COMMAND images.
+  std::vector<RsAppNano> page;
+  if (!rs.FetchAppsNano(0, 5, &page) || page.size() != 5) {
+    ESP_LOGE(TAG, "FAILED: Downloading the first page failed.");
+    return;
+  }
+  std::vector<std::string> ids;
+  for (const auto& app : page) ids.push_back(app.id);
+
+  std::vector<std::string> names(ids.size());
+  int delivered = 0;
+  auto success = FetchAppsBatch(&pool, ids, [&](int index, bool success, RsApp& app) {
+    if (success) names[index] = app.name;
+    delivered++;
+  });
+  if (!success || delivered != ids.size()) {
+    ESP_LOGE(TAG, "FAILED: Batch of apps failed, %d delivered.", delivered);
+    return;
+  }
+  for (int i = 0; i < ids.size(); ++i) {
+    if (names[i] != page[i].name) {
+      ESP_LOGE(TAG, "FAILED: App %d is %s, expected %s", i, names[i].c_str(), page[i].name.c_str());
+      return;
+    }
+  }
+
+  std::vector<RsMediaType> commandType;
+  commandType.push_back(RsMediaType_COMMAND);
+  std::vector<RsMediaImageRef> refs;
+  success = FetchMediaImageRefsBatch(&pool, ids, commandType,
+                                     [&](int index, bool success, std::vector<RsMediaImageRef>& r) {
+    for (auto& ref : r) refs.push_back(ref);
+  });
+  if (!success || refs.empty()) {
+    ESP_LOGE(TAG, "FAILED: Batch of media image refs failed.");
+    return;
+  }
+  int images = 0;
+  success = FetchMediaImagesBatch(&pool, ids, commandType,
+                                  [&](int index, bool success, std::vector<RsMediaImage>& i) {
+    images += i.size();
+  });
+  if (!success || images != refs.size()) {
+    ESP_LOGE(TAG, "FAILED: Batch of media images returned %d images, expected %d", images, refs.size());
+    return;
+  }
+  int complete = 0;
+  success = FetchMediaImageDataBatch(&pool, refs, [&](int index, bool success, RsMediaRegion& data) {
+    if (success && data.length == refs[index].data_size) complete++;
+  });
+  if (!success || complete != refs.size()) {
+    ESP_LOGE(TAG, "FAILED: Only %d of %d media images downloaded.", complete, refs.size());
+    return;
+  }
+  // With a budget below every image they are fetched one at a time, and
+  // still all delivered.
+  complete = 0;
+  success = FetchMediaImageDataBatch(&pool, refs, [&](int index, bool success, RsMediaRegion& data) {
+    if (success && data.length == refs[index].data_size) complete++;
+  }, 1);
+  if (!success || complete != refs.size()) {
+    ESP_LOGE(TAG, "FAILED: Only %d of %d media images downloaded one at a time.", complete,
+             refs.size());
+    return;
+  }
+
+  // A failing item is reported without affecting the others.
+  ids.push_back("a2729dec_XXXX_11e7-9539-e7341c560175");
+  int failed = -1;
+  success = FetchAppsBatch(&pool, ids, [&](int index, bool success, RsApp& app) {
+    if (!success) failed = index;
+  });
+  if (success || failed != ids.size() - 1) {
+    ESP_LOGE(TAG, "FAILED: Expected only the last app to fail, got %d", failed);
+    return;
+  }
+  ESP_LOGI(TAG, "testBatchFetch()...SUCCESS");
+}
+
+void testStateSnapshot() {
+  ESP_LOGI(TAG, "testStateSnapshot()...");
+  // Three regions, out of order, with a gap between the first two.
+  RsSystemState state;
+  createRandomTestState(&state);
+  state.regions[0].start = 0x5000;
+  const int starts[] = {0x8000, 0x4000};
+  for (int start : starts) {
+    RsMemoryRegion region;
+    region.start = start;
+    region.length = 512;
+    region.data.reset(new uint8_t[region.length]);
+    for (int d = 0; d < region.length; ++d) region.data.get()[d] = rand() % 256;
+    state.regions.push_back(std::move(region));
+  }
+
+  RsStateSnapshot snapshot;
+  snapshot.Assign(state);
+  if (snapshot.model() != state.model || snapshot.registers().hl_prime != state.registers.hl_prime ||
+      snapshot.num_regions() != 3) {
+    ESP_LOGE(TAG, "FAILED: Snapshot does not hold the state.");
+    return;
+  }
+  for (int i = 1; i < snapshot.num_regions(); ++i) {
+    if (snapshot.region(i - 1).start >= snapshot.region(i).start) {
+      ESP_LOGE(TAG, "FAILED: Snapshot regions are not sorted.");
+      return;
+    }
+  }
+  for (const auto& region : state.regions) {
+    for (int d = 0; d < region.length; d += 97) {
+      const uint8_t* byte = snapshot.Find(region.start + d);
+      if (byte == nullptr || *byte != region.data.get()[d]) {
+        ESP_LOGE(TAG, "FAILED: Looking up 0x%x in the snapshot.", region.start + d);
+        return;
+      }
+    }
+  }
+  if (snapshot.Find(0x4000 + 512) != nullptr || snapshot.Find(0x3fff) != nullptr ||
+      snapshot.Find(0x8000 + 512) != nullptr) {
+    ESP_LOGE(TAG, "FAILED: Found an address outside every region.");
+    return;
+  }
+  // A range across a gap reads zeros in between, like DownloadStateMemoryRange.
+  uint8_t range[1024];
+  snapshot.Read(0x4000 + 256, sizeof(range), range);
+  if (memcmp(range, state.regions[2].data.get() + 256, 256) != 0 || range[256] != 0 ||
+      range[sizeof(range) - 1] != 0) {
+    ESP_LOGE(TAG, "FAILED: Reading across a gap.");
+    return;
+  }
+
+  // Uploading hands the arena to the SDK; the server gets the same bytes.
+  int token = snapshot.Upload(&rs);
+  RsSystemState downloaded;
+  if (token < 0 || !rs.DownloadState(token, &downloaded) || downloaded.regions.size() != 3) {
+    ESP_LOGE(TAG, "FAILED: Uploading the snapshot.");
+    return;
+  }
+  for (const auto& region : downloaded.regions) {
+    int i = snapshot.FindRegion(region.start);
+    if (i < 0 || snapshot.region(i).length != region.length ||
+        memcmp(snapshot.region(i).data, region.data.get(), region.length) != 0) {
+      ESP_LOGE(TAG, "FAILED: Uploaded region at 0x%x differs.", region.start);
+      return;
+    }
+  }
+
+  // The arena is the serialized form.
+  RsStateSnapshot loaded;
+  if (!loaded.Load(snapshot.data(), snapshot.size()) || loaded.size() != snapshot.size() ||
+      memcmp(loaded.data(), snapshot.data(), snapshot.size()) != 0 ||
+      loaded.Load(snapshot.data(), snapshot.size() - 1) || !loaded.empty()) {
+    ESP_LOGE(TAG, "FAILED: Restoring a serialized snapshot.");
+    return;
+  }
+  RsStateSnapshot fetched;
+  if (!fetched.Download(&rs, token) || fetched.size() != snapshot.size() ||
+      memcmp(fetched.data(), snapshot.data(), snapshot.size()) != 0) {
+    ESP_LOGE(TAG, "FAILED: Downloading into a snapshot.");
+    return;
+  }
+
+  // Capturing from a memory image merges touching ranges.
+  std::unique_ptr<uint8_t[]> memory(new uint8_t[0x10000]);
+  for (int a = 0; a < 0x10000; ++a) memory[a] = a * 7;
+  size_t capacity = snapshot.arena_capacity();
+  snapshot.Capture(RsTrs80Model_MODEL_4, state.registers, memory.get(),
+                   {{0x3c00, 0x400}, {0x4000, 0x100}, {0x9000, 0x10}});
+  if (snapshot.num_regions() != 2 || snapshot.region(0).length != 0x500 ||
+      *snapshot.Find(0x4050) != memory[0x4050] || snapshot.arena_capacity() != capacity) {
+    ESP_LOGE(TAG, "FAILED: Capturing memory into the snapshot.");
+    return;
+  }
+
+  // Overlapping regions: the one later in the state wins, and lookups
+  // agree with Read.
+  for (bool small_last : {true, false}) {
+    RsSystemState overlapping;
+    overlapping.model = RsTrs80Model_MODEL_III;
+    for (int i = 0; i < 2; ++i) {
+      bool small = (i == 1) == small_last;
+      RsMemoryRegion region;
+      region.start = small ? 0x4100 : 0x4000;
+      region.length = small ? 0x10 : 0x1000;
+      region.data.reset(new uint8_t[region.length]);
+      memset(region.data.get(), small ? 2 : 1, region.length);
+      overlapping.regions.push_back(std::move(region));
+    }
+    snapshot.Assign(overlapping);
+    uint8_t read[3];
+    snapshot.Read(0x4104, 1, read);
+    snapshot.Read(0x4200, 1, read + 1);
+    snapshot.Read(0x5000, 1, read + 2);
+    uint8_t inside = small_last ? 2 : 1;
+    if (snapshot.Find(0x4200) == nullptr || *snapshot.Find(0x4200) != 1 ||
+        snapshot.Find(0x4104) == nullptr || *snapshot.Find(0x4104) != inside ||
+        snapshot.Find(0x5000) != nullptr || read[0] != inside || read[1] != 1 || read[2] != 0) {
+      ESP_LOGE(TAG, "FAILED: Overlapping regions were not flattened (small region %s).",
+               small_last ? "last" : "first");
+      return;
+    }
+    for (int i = 1; i < snapshot.num_regions(); ++i) {
+      if (snapshot.region(i).start < snapshot.region(i - 1).start + snapshot.region(i - 1).length) {
+        ESP_LOGE(TAG, "FAILED: Snapshot regions %d and %d overlap.", i - 1, i);
+        return;
+      }
+    }
+  }
+
+  // A serialized snapshot whose regions overlap is rejected: the second
+  // region, moved from 0x12400 to 0x12340, overlaps the first.
+  {
+    RsSystemState adjacent;
+    adjacent.model = RsTrs80Model_MODEL_III;
+    for (int start : {0x12300, 0x12400}) {
+      RsMemoryRegion region;
+      region.start = start;
+      region.length = 0x100;
+      region.data.reset(new uint8_t[region.length]);
+      memset(region.data.get(), 0, region.length);
+      adjacent.regions.push_back(std::move(region));
+    }
+    snapshot.Assign(adjacent);
+    std::vector<uint8_t> bytes(snapshot.data(), snapshot.data() + snapshot.size());
+    const uint8_t moved[] = {0x00, 0x24, 0x01, 0x00};
+    auto at = std::search(bytes.begin(), bytes.end(), moved, moved + 4);
+    RsStateSnapshot loaded;
+    if (at == bytes.end() || !loaded.Load(bytes.data(), bytes.size())) {
+      ESP_LOGE(TAG, "FAILED: Loading the adjacent regions.");
+      return;
+    }
+    *at = 0x40;
+    *(at + 1) = 0x23;
+    if (loaded.Load(bytes.data(), bytes.size())) {
+      ESP_LOGE(TAG, "FAILED: A snapshot with overlapping regions was loaded.");
+      return;
+    }
+  }
+  ESP_LOGI(TAG, "testStateSnapshot()...SUCCESS");
+}
+
+void testOutbox() {
+  ESP_LOGI(TAG, "testOutbox()...");
+  const auto DONKEY_KONG_ID = "a2729dec-96b3-11e7-9539-e7341c560175";
+  const auto TIMEOUT = pdMS_TO_TICKS(10000);
+
+  // Callbacks run on the worker; the semaphore hands their results over.
+  auto done = xSemaphoreCreateBinary();
+  std::vector<std::pair<std::string, int>> uploads;
+  auto uploaded = [&](const std::string& slot, int token) {
+    if (slot.compare(0, 5, "test-") != 0) return;
+    uploads.push_back(std::make_pair(slot, token));
+    xSemaphoreGive(done);
+  };
+
+  RsSystemState first, second, replacement;
+  createRandomTestState(&first);
+  createRandomTestState(&second);
+  createRandomTestState(&replacement);
+  {
+    RsOutbox outbox(uploaded);
+    outbox.ListenToWifi();
+    esp_event_post(WINSTON_EVENT, WIFI_DISCONNECTED, NULL, 0, portMAX_DELAY);
+    for (int i = 0; i < 100 && outbox.online(); ++i) vTaskDelay(pdMS_TO_TICKS(10));
+    if (outbox.online()) {
+      ESP_LOGE(TAG, "FAILED: Still online after WIFI_DISCONNECTED.");
+      return;
+    }
+    // Saving over and over takes many times the partition, which is written
+    // round past the queued saves, so every save is persisted.
+    bool persisted = true;
+    for (int i = 0; i < 100; ++i) {
+      persisted = outbox.Save("test-1", first) && persisted;
+      persisted = outbox.Save("test-2", second) && persisted;
+    }
+    persisted = outbox.Save("test-1", replacement) && persisted;
+    if (!persisted) {
+      ESP_LOGE(TAG, "FAILED: Saves were kept in RAM only.");
+      return;
+    }
+    outbox.Fetch([](RetroStore* rs) { return true; });
+    vTaskDelay(pdMS_TO_TICKS(50));
+    if (!outbox.persistent() || outbox.pending_saves() != 2 || outbox.pending_fetches() != 1 ||
+        !uploads.empty()) {
+      ESP_LOGE(TAG, "FAILED: Requests did not wait while offline (%d saves, %d fetches queued).",
+               outbox.pending_saves(), outbox.pending_fetches());
+      return;
+    }
+  }
+
+  // As after a restart: the saves are still in flash, the replaced one gone.
+  {
+    RsOutbox outbox(uploaded);
+    for (int i = 0; i < 2; ++i) {
+      if (xSemaphoreTake(done, TIMEOUT) != pdTRUE) {
+        ESP_LOGE(TAG, "FAILED: Queued saves were not uploaded after a restart.");
+        return;
+      }
+    }
+    RsSystemState downloaded;
+    if (uploads.size() != 2 || uploads[0].first != "test-2" || uploads[1].first != "test-1" ||
+        !rs.DownloadState(uploads[0].second, &downloaded) ||
+        !helper_sameState(downloaded, second) ||
+        !rs.DownloadState(uploads[1].second, &downloaded) ||
+        !helper_sameState(downloaded, replacement)) {
+      ESP_LOGE(TAG, "FAILED: Uploaded saves do not match the newest state of each slot.");
+      return;
+    }
+
+    outbox.SetOnline(false);
+    std::string name;
+    outbox.Fetch([&](RetroStore* rs) {
+      RsApp app;
+      if (!rs->FetchApp(DONKEY_KONG_ID, &app)) return false;
+      name = app.name;
+      xSemaphoreGive(done);
+      return true;
+    });
+    vTaskDelay(pdMS_TO_TICKS(50));
+    if (!name.empty()) {
+      ESP_LOGE(TAG, "FAILED: Fetch ran while offline.");
+      return;
+    }
+    outbox.SetOnline(true);
+    if (xSemaphoreTake(done, TIMEOUT) != pdTRUE || name != "Donkey Kong") {
+      ESP_LOGE(TAG, "FAILED: Fetch did not run once online.");
+      return;
+    }
+
+    // Going offline and back cuts the backoff short.
+    int attempts = 0;
+    outbox.Fetch([&](RetroStore* rs) { attempts++; return false; },
+                 [&]() { xSemaphoreGive(done); });
+    bool failed = false;
+    for (int i = 0; i < 100 && !failed; ++i) {
+      failed = xSemaphoreTake(done, pdMS_TO_TICKS(50)) == pdTRUE;
+      outbox.SetOnline(false);
+      outbox.SetOnline(true);
+    }
+    if (!failed || attempts != RS_OUTBOX_FETCH_ATTEMPTS || outbox.pending_fetches() != 0) {
+      ESP_LOGE(TAG, "FAILED: Failing fetch was tried %d times.", attempts);
+      return;
+    }
+  }
+  vSemaphoreDelete(done);
+  ESP_LOGI(TAG, "testOutbox()...SUCCESS");
+}
+
+// The soak operations the tests use: one that succeeds and one that fails
+// every time, to be counted as a failure.
+std::vector<RsSoakOp> soakTestOps() {
+  const std::string DONKEY_KONG_ID("a2729dec-96b3-11e7-9539-e7341c560175");
+  return {
+    {"app", 0, [DONKEY_KONG_ID](RetroStore* rs) {
+      RsApp app;
+      if (!rs->FetchApp(DONKEY_KONG_ID, &app)) return RS_SOAK_FAILED;
+      return app.name == "Donkey Kong" ? RS_SOAK_OK : RS_SOAK_WRONG;
+    }},
+    {"missing", 0, [](RetroStore* rs) {
+      RsApp app;
+      return rs->FetchApp("no-such-app", &app) ? RS_SOAK_WRONG : RS_SOAK_FAILED;
+    }},
+  };
+}
+
+void testSoakMix() {
+  ESP_LOGI(TAG, "testSoakMix()...");
+  auto ops = soakTestOps();
+  if (ParseSoakMix("app=3,bogus=1", &ops) || ParseSoakMix("app=x", &ops) ||
+      ParseSoakMix("app=0,missing=0", &ops) || ops[0].weight != 0) {
+    ESP_LOGE(TAG, "FAILED: A bad soak mix was accepted.");
+    return;
+  }
+  if (!ParseSoakMix("app=3,missing=1", &ops) || ops[0].weight != 3 || ops[1].weight != 1) {
+    ESP_LOGE(TAG, "FAILED: Parsing the soak mix failed.");
+    return;
+  }
+  ESP_LOGI(TAG, "testSoakMix()...SUCCESS");
+}
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+// A short soak run against the mock server, which answers fast enough for
+// hundreds of calls in a fraction of a second. On the device this would
+// load the production server and see too few calls to judge.
+void testSoak() {
+  ESP_LOGI(TAG, "testSoak()...");
+  auto ops = soakTestOps();
+  ParseSoakMix("app=3,missing=1", &ops);
+
+  RsSoakConfig config;
+  config.tasks = 2;
+  config.duration_ms = 600;
+  config.report_ms = 200;
+  // Too short a run for the allocator's caches to settle; this only checks
+  // that nothing grows without bound.
+  config.max_heap_drift = 16 * 1024;
+  RsSoakTest soak(ops, config);
+  if (!soak.Run()) {
+    ESP_LOGE(TAG, "FAILED: Soak run failed.");
+    return;
+  }
+  if (soak.calls() == 0 || soak.wrong() != 0 || soak.failures() == 0 ||
+      soak.failures() == soak.calls()) {
+    ESP_LOGE(TAG, "FAILED: %ld calls, %ld failed, %ld wrong.", soak.calls(), soak.failures(),
+             soak.wrong());
+    return;
+  }
+  ESP_LOGI(TAG, "Soak run: %ld calls, %ld failed, heap drift %d bytes.", soak.calls(),
+           soak.failures(), soak.heap_drift());
+  ESP_LOGI(TAG, "testSoak()...SUCCESS");
+}
+#endif
+
+void testWifiCache() {
+  ESP_LOGI(TAG, "testWifiCache()...");
+  WifiApCache cache("wifi_test");
+  cache.Clear();
+  WifiApRecord record = {};
+  if (cache.Load("home", &record)) {
+    ESP_LOGE(TAG, "FAILED: Loaded a record from an empty cache.");
+    return;
+  }
+  WifiApRecord saved = {{0x24, 0x0a, 0xc4, 0x01, 0x02, 0x03}, 11, 0x0a01a8c0, 0x00ffffff,
+                        0x0101a8c0, 0x0101a8c0};
+  cache.Save("home", saved);
+  // Saving it again changes nothing.
+  cache.Save("home", saved);
+  if (!cache.Load("home", &record) || memcmp(&record, &saved, sizeof(record)) != 0) {
+    ESP_LOGE(TAG, "FAILED: Loading the saved record.");
+    return;
+  }
+  if (cache.Load("homf", &record) || cache.Load("home2", &record)) {
+    ESP_LOGE(TAG, "FAILED: Loaded the record of another network.");
+    return;
+  }
+  cache.Clear();
+  if (cache.Load("home", &record)) {
+    ESP_LOGE(TAG, "FAILED: Loaded a cleared record.");
+    return;
+  }
+
+  WifiBackoff backoff(250, 2000, 6);
+  const int want[] = {250, 500, 1000, 2000, 2000, 2000, -1};
+  for (int i = 0; i < sizeof(want) / sizeof(want[0]); ++i) {
+    int delay = backoff.Next();
+    if (delay != want[i]) {
+      ESP_LOGE(TAG, "FAILED: Retry %d after %d ms, expected %d.", i + 1, delay, want[i]);
+      return;
+    }
+  }
+  backoff.Reset();
+  if (backoff.failures() != 0 || backoff.Next() != 250) {
+    ESP_LOGE(TAG, "FAILED: Backoff does not start over once connected.");
+    return;
+  }
+  ESP_LOGI(TAG, "testWifiCache()...SUCCESS");
+}
+
+void testMediaImageStore() {
+  ESP_LOGI(TAG, "testMediaImageStore()...");
+  const std::string BREAKDOWN_ID("29b20252-680f-11e8-b4a9-1f10b5491ef5");
+  std::vector<RsMediaType> types;
+  types.push_back(RsMediaType_DISK);
+
+  std::vector<RsMediaImage> images;
+  std::vector<RsMediaImageRef> refs;
+  if (!rs.FetchMediaImages(BREAKDOWN_ID, types, &images) || images.size() != 1 ||
+      !rs.FetchMediaImageRefs(BREAKDOWN_ID, types, &refs) || refs.size() != 1) {
+    ESP_LOGE(TAG, "FAILED: Fetching the disk image failed.");
+    return;
+  }
+  const auto& want = images[0];
+  {
+    MediaImageStore store;
+    if (!store.ok()) {
+      ESP_LOGE(TAG, "FAILED: Image store partition missing.");
+      return;
+    }
+    store.Clear();
+    MappedMediaImage image;
+    if (!store.Open(&rs, refs[0], &image)) {
+      ESP_LOGE(TAG, "FAILED: Downloading the disk image into flash failed.");
+      return;
+    }
+    if (image.size() != want.data_size || memcmp(image.data(), want.data.get(), image.size()) != 0) {
+      ESP_LOGE(TAG, "FAILED: Mapped image does not match the download.");
+      return;
+    }
+    uint8_t small[300];
+    for (int i = 0; i < sizeof(small); ++i) small[i] = rand() % 256;
+    if (!store.Put("test/small", small, sizeof(small))) {
+      ESP_LOGE(TAG, "FAILED: Storing an image from memory failed.");
+      return;
+    }
+  }
+
+  // A new instance, as after a reboot, finds the images without a download.
+  MediaImageStore store;
+  MappedMediaImage image;
+  if (store.images() != 2 || !store.Contains(refs[0].token) || !store.Map(refs[0].token, &image)) {
+    ESP_LOGE(TAG, "FAILED: Stored image not found after reopening, %d stored.", store.images());
+    return;
+  }
+  if (image.size() != want.data_size || memcmp(image.data(), want.data.get(), image.size()) != 0) {
+    ESP_LOGE(TAG, "FAILED: Reopened image does not match.");
+    return;
+  }
+  MappedMediaImage moved(std::move(image));
+  if (image.mapped() || !moved.mapped()) {
+    ESP_LOGE(TAG, "FAILED: Moving a mapped image did not transfer the mapping.");
+    return;
+  }
+  if (store.Contains("test/missing") || store.Map("test/missing", &image)) {
+    ESP_LOGE(TAG, "FAILED: Found an image that was never stored.");
+    return;
+  }
+  moved.Unmap();
+  store.Clear();
+  if (store.images() != 0 || store.Contains(refs[0].token)) {
+    ESP_LOGE(TAG, "FAILED: Clearing the store left images behind.");
+    return;
+  }
+
+  // A download cut short is resumed, also by a new instance.
+  const int first = 3 * MEDIA_STREAM_CHUNK_SIZE;
+  if (store.Download(&rs, refs[0], first) != first || store.progress(refs[0].token) != first ||
+      store.Contains(refs[0].token)) {
+    ESP_LOGE(TAG, "FAILED: Partial download reported %d bytes.", store.progress(refs[0].token));
+    return;
+  }
+  // Progress is only recorded at checkpoints and when a download stops. A
+  // reset in between leaves the older record while more was written; put
+  // that record back after downloading further.
+  {
+    nvs_handle_t nvs;
+    size_t length = 0;
+    std::vector<uint8_t> record;
+    bool saved = nvs_open(MEDIA_IMAGE_STORE_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK;
+    if (saved) {
+      saved = nvs_get_blob(nvs, "progress", nullptr, &length) == ESP_OK;
+      record.resize(length);
+      saved = saved && nvs_get_blob(nvs, "progress", record.data(), &length) == ESP_OK &&
+              store.Download(&rs, refs[0], 5 * MEDIA_STREAM_CHUNK_SIZE) == first + 5 * MEDIA_STREAM_CHUNK_SIZE &&
+              nvs_set_blob(nvs, "progress", record.data(), record.size()) == ESP_OK &&
+              nvs_commit(nvs) == ESP_OK;
+      nvs_close(nvs);
+    }
+    if (!saved) {
+      ESP_LOGE(TAG, "FAILED: Rolling back the recorded progress.");
+      return;
+    }
+  }
+  {
+    MediaImageStore reopened;
+    int resumed_at = reopened.progress(refs[0].token);
+    // Rewound to a sector boundary at most.
+    if (resumed_at <= first - SPI_FLASH_SEC_SIZE || resumed_at > first) {
+      ESP_LOGE(TAG, "FAILED: Reopened store resumes at %d instead of near %d.", resumed_at, first);
+      return;
+    }
+    if (!reopened.Open(&rs, refs[0], &image) || reopened.progress(refs[0].token) != 0) {
+      ESP_LOGE(TAG, "FAILED: Resuming the download failed.");
+      return;
+    }
+    if (image.size() != want.data_size || memcmp(image.data(), want.data.get(), image.size()) != 0) {
+      ESP_LOGE(TAG, "FAILED: Resumed image does not match the download.");
+      return;
+    }
+    image.Unmap();
+    // Storing another image gives up on an unfinished download.
+    reopened.Clear();
+    if (reopened.Download(&rs, refs[0], first) != first || !reopened.Put("test/small", want.data.get(), 100) ||
+        reopened.progress(refs[0].token) != 0) {
+      ESP_LOGE(TAG, "FAILED: Storing another image kept the unfinished download.");
+      return;
+    }
+    reopened.Clear();
+  }
+  ESP_LOGI(TAG, "testMediaImageStore()...SUCCESS");
+}
+
+#ifdef CONFIG_RS_SOAK
+// Calls the APIs the tests cover from CONFIG_RS_SOAK_TASKS tasks for
+// CONFIG_RS_SOAK_SECONDS, checking every result, to find the leaks,
+// slowdowns and races a single pass does not show.
+void runSoak() {
+  ESP_LOGI(TAG, "Running soak test...");
+  const std::string DONKEY_KONG_ID("a2729dec-96b3-11e7-9539-e7341c560175");
+  const std::string BREAKDOWN_ID("29b20252-680f-11e8-b4a9-1f10b5491ef5");
+  const std::string QUERY("kong OR breakdown");
+  std::vector<RsMediaType> commandType;
+  commandType.push_back(RsMediaType_COMMAND);
+
+  // What every call is checked against. Injected faults may fail any of
+  // these calls, so they are tried a few times.
+  RsSystemState state;
+  createRandomTestState(&state);
+  int token = -1;
+  std::vector<RsApp> apps, queried;
+  std::vector<RsAppNano> nanos;
+  std::vector<RsMediaImage> images;
+  std::vector<RsMediaImageRef> refs;
+  bool ready = false;
+  for (int attempt = 0; attempt < 10 && !ready; ++attempt) {
+    if (token < 0) token = rs.UploadState(state);
+    ready = token >= 0 && rs.FetchApps(0, 5, &apps) && rs.FetchAppsNano(0, 5, &nanos) &&
+            rs.FetchApps(0, 5, QUERY, &queried) && !queried.empty() &&
+            rs.FetchMediaImages(BREAKDOWN_ID, commandType, &images) && images.size() == 1 &&
+            rs.FetchMediaImageRefs(BREAKDOWN_ID, commandType, &refs) && refs.size() == 1;
+  }
+  if (!ready) {
+    ESP_LOGE(TAG, "FAILED: Soak test setup.");
+    return;
+  }
+  const RsMediaImage& image = images[0];
+  const RsMediaImageRef& ref = refs[0];
+  const RsMemoryRegion& memory = state.regions[0];
+  auto sameIds = [](const std::vector<RsApp>& a, const std::vector<RsApp>& b) {
+    if (a.size() != b.size()) return false;
+    for (int i = 0; i < a.size(); ++i) {
+      if (a[i].id != b[i].id) return false;
+    }
+    return true;
+  };
+
+  std::vector<RsSoakOp> ops = {
+    {"upload", 0, [](RetroStore* rs) {
+      RsSystemState up, down;
+      createRandomTestState(&up);
+      int t = rs->UploadState(up);
+      if (t < 0 || !rs->DownloadState(t, &down)) return RS_SOAK_FAILED;
+      return helper_sameState(up, down) ? RS_SOAK_OK : RS_SOAK_WRONG;
+    }},
+    {"download", 0, [&](RetroStore* rs) {
+      RsSystemState down;
+      if (!rs->DownloadState(token, &down)) return RS_SOAK_FAILED;
+      return helper_sameState(state, down) ? RS_SOAK_OK : RS_SOAK_WRONG;
+    }},
+    {"range", 0, [&](RetroStore* rs) {
+      int offset = rand() % (memory.length - 256);
+      RsMemoryRegion region;
+      if (!rs->DownloadStateMemoryRange(token, memory.start + offset, 256, &region)) {
+        return RS_SOAK_FAILED;
+      }
+      return region.length == 256 && FirstDifference(region, memory.data.get() + offset, 256) < 0
+                 ? RS_SOAK_OK : RS_SOAK_WRONG;
+    }},
+    {"app", 0, [&](RetroStore* rs) {
+      RsApp app;
+      if (!rs->FetchApp(DONKEY_KONG_ID, &app)) return RS_SOAK_FAILED;
+      return app.name == "Donkey Kong" ? RS_SOAK_OK : RS_SOAK_WRONG;
+    }},
+    {"apps", 0, [&](RetroStore* rs) {
+      std::vector<RsApp> result;
+      if (!rs->FetchApps(0, 5, &result)) return RS_SOAK_FAILED;
+      return sameIds(apps, result) ? RS_SOAK_OK : RS_SOAK_WRONG;
+    }},
+    {"nano", 0, [&](RetroStore* rs) {
+      std::vector<RsAppNano> result;
+      if (!rs->FetchAppsNano(0, 5, &result)) return RS_SOAK_FAILED;
+      if (result.size() != nanos.size()) return RS_SOAK_WRONG;
+      for (int i = 0; i < result.size(); ++i) {
+        if (result[i].id != nanos[i].id) return RS_SOAK_WRONG;
+      }
+      return RS_SOAK_OK;
+    }},
+    {"query", 0, [&](RetroStore* rs) {
+      std::vector<RsApp> result;
+      if (!rs->FetchApps(0, 5, QUERY, &result)) return RS_SOAK_FAILED;
+      return sameIds(queried, result) ? RS_SOAK_OK : RS_SOAK_WRONG;
+    }},
+    {"refs", 0, [&](RetroStore* rs) {
+      std::vector<RsMediaImageRef> result;
+      if (!rs->FetchMediaImageRefs(BREAKDOWN_ID, commandType, &result)) return RS_SOAK_FAILED;
+      return result.size() == 1 && result[0].token == ref.token ? RS_SOAK_OK : RS_SOAK_WRONG;
+    }},
+    {"images", 0, [&](RetroStore* rs) {
+      std::vector<RsMediaImage> result;
+      if (!rs->FetchMediaImages(BREAKDOWN_ID, commandType, &result)) return RS_SOAK_FAILED;
+      return result.size() == 1 && result[0].data_size == image.data_size &&
+                     FirstDifference(result[0].data.get(), image.data.get(), image.data_size) < 0
+                 ? RS_SOAK_OK : RS_SOAK_WRONG;
+    }},
+    {"image_range", 0, [&](RetroStore* rs) {
+      int length = std::min(256, ref.data_size);
+      int start = rand() % (ref.data_size - length + 1);
+      RsMediaRegion region;
+      if (!rs->FetchMediaImageRegion(ref, start, length, &region)) return RS_SOAK_FAILED;
+      return region.length == length &&
+                     FirstDifference(region, image.data.get() + start, length) < 0
+                 ? RS_SOAK_OK : RS_SOAK_WRONG;
+    }},
+  };
+  if (!ParseSoakMix(CONFIG_RS_SOAK_MIX, &ops)) {
+    ESP_LOGE(TAG, "FAILED: Soak test mix '%s' is not valid.", CONFIG_RS_SOAK_MIX);
+    return;
+  }
+
+  RsSoakConfig config;
+  config.tasks = CONFIG_RS_SOAK_TASKS;
+  config.duration_ms = CONFIG_RS_SOAK_SECONDS * 1000;
+  config.report_ms = CONFIG_RS_SOAK_REPORT_SECONDS * 1000;
+  config.max_heap_drift = CONFIG_RS_SOAK_MAX_HEAP_DRIFT;
+  // Only the soak test's own calls from here on.
+  HeapProfiler::Reset();
+  RsSoakTest soak(ops, config);
+  bool passed = soak.Run();
+  HeapProfiler::Log();
+  if (!passed) {
+    ESP_LOGE(TAG, "FAILED: Soak test.");
+    return;
+  }
+  ESP_LOGI(TAG, "Soak test... SUCCESS");
+}
+#endif
+
+void initWifi() {
+  ESP_LOGI(TAG, "Connecting to Wifi...");
+  auto* wifi = new Wifi();
+  wifi->connect(CONFIG_RS_TEST_WIFI_SSID, CONFIG_RS_TEST_WIFI_PASSWORD);
+}
+
+void runAllTests() {
+  auto initialFreeHeapKb = esp_get_free_heap_size() / 1024;
+  ESP_LOGI(TAG, "RetroStore API tests running... Initial free heap: %d", initialFreeHeapKb);
+  srand(time(nullptr));
+
+  for (int i = 0; i < CONFIG_RS_TEST_ITERATIONS; ++i) {
+    testUploadDownloadSystemState();
+    testDownloadStateMemoryRegions();
+    testFailDownloadSystemState();
+    testFetchSingleApp();
+    testFetchSingleAppFail();
+    testFetchMultipleApps();
+    testQueryApps();
+    testQueryAppsWithMediaTypes();
+    testFetchMultipleAppsNano();
+    testQueryAppsNano();
+    testFetchMediaImages();
+    testFetchMediaImageRefsTest();
+    testFieldMasks();
+    testFailFetchMediaImageRangeTest();
+    testFetchMediaImageRangeTest();
+    testStreamMediaImage();
+    testMediaBlockCache();
+    testDeltaUpload();
+    testStateSnapshot();
+    testRleCodec();
+    testStateStream();
+    testVerify();
+    testAppPage();
+    testCatalogCache();
+#ifdef CONFIG_IDF_TARGET_LINUX
+    testCatalogIndex();
+#endif
+    testCatalogCursor();
+    testAsyncRetroStore();
+    testHeapProfiler();
+    testBatchFetch();
+    testMediaImageStore();
+    testOutbox();
+    testSoakMix();
+#ifdef CONFIG_IDF_TARGET_LINUX
+    testSoak();
+#endif
+    testWifiCache();
+    auto newFreeHeapKb = esp_get_free_heap_size() / 1024;
+    auto diffHeapKb =  initialFreeHeapKb - newFreeHeapKb;
+    ESP_LOGI(TAG, "After run [%d], free heap is %d, total diff is %d kb", i, newFreeHeapKb, diffHeapKb);
+  }
+
+  ESP_LOGI(TAG, "DONE. All tests run.");
+  HeapProfiler::Log();
+
+#ifdef CONFIG_RS_BENCHMARK
+  runBenchmarks();
+#endif
+#ifdef CONFIG_RS_SOAK
+  runSoak();
+#endif
+}
+
+void testTask(void* arg) {
+  runAllTests();
+  vTaskDelete(NULL);
+}
+
+// Set once the tester task runs. WIFI_CONNECTED is posted again on every
+// reconnect, and the tests share the global RetroStore.
+bool testsStarted = false;
+
+void event_handler(void* arg, esp_event_base_t event_base,
+                   int32_t event_id, void* event_data) {
+  if (event_base == WINSTON_EVENT && event_id == WIFI_CONNECTED) {
+    if (testsStarted) {
+      ESP_LOGI(TAG, "Reconnected to Wifi.");
+      return;
+    }
+    // Keep the event task free, and its stack at the default size.
+    if (xTaskCreate(&testTask, "rs_tester", TEST_TASK_STACK_SIZE, NULL, 5, NULL) != pdPASS) {
+      ESP_LOGE(TAG, "Creating the tester task failed.");
+      return;
+    }
+    testsStarted = true;
   } else {
     ESP_LOGW(TAG, "Received unknown event.");
   }
@@ -660,6 +2914,7 @@ void app_main(void)
   ESP_ERROR_CHECK(esp_event_handler_register(WINSTON_EVENT, WIFI_CONNECTED,
                                              &event_handler, NULL));
 
+  HeapProfiler::LogOnAllocationFailure();
   initNvs();
   initWifi();
 
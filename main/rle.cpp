@@ -0,0 +1,107 @@
+#include "rle.h"
+
+#include <cstring>
+
+namespace retrostore {
+
+namespace {
+
+#define RLE_MAX_LITERAL 128
+#define RLE_MIN_REPEAT 3
+#define RLE_MAX_REPEAT (127 + RLE_MIN_REPEAT)
+
+// Length of the run of identical bytes at `src`, capped at RLE_MAX_REPEAT.
+size_t runLength(const uint8_t* src, size_t length) {
+  size_t run = 1;
+  while (run < length && run < RLE_MAX_REPEAT && src[run] == src[0]) run++;
+  return run;
+}
+
+// Encodes into `dst` if it is not null, and returns the encoded size either
+// way, or 0 if `dst` is too small.
+size_t encode(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity) {
+  size_t in = 0;
+  size_t out = 0;
+  while (in < length) {
+    size_t run = runLength(src + in, length - in);
+    if (run >= RLE_MIN_REPEAT) {
+      if (dst != nullptr) {
+        if (out + 2 > capacity) return 0;
+        dst[out] = 128 + (run - RLE_MIN_REPEAT);
+        dst[out + 1] = src[in];
+      }
+      out += 2;
+      in += run;
+      continue;
+    }
+    // Collect literals up to the next run worth encoding.
+    size_t start = in;
+    while (in < length && in - start < RLE_MAX_LITERAL &&
+           runLength(src + in, length - in) < RLE_MIN_REPEAT) {
+      in++;
+    }
+    size_t literals = in - start;
+    if (dst != nullptr) {
+      if (out + 1 + literals > capacity) return 0;
+      dst[out] = literals - 1;
+      memcpy(dst + out + 1, src + start, literals);
+    }
+    out += 1 + literals;
+  }
+  return out;
+}
+
+}  // namespace
+
+size_t RleCompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity) {
+  if (length == 0) return 0;
+  return encode(src, length, dst, capacity);
+}
+
+size_t RleCompressedSize(const uint8_t* src, size_t length) {
+  return encode(src, length, nullptr, 0);
+}
+
+RleDecoder::RleDecoder(uint8_t* dst, size_t capacity)
+    : dst_(dst), capacity_(capacity), size_(0), state_(CONTROL), remaining_(0) {}
+
+bool RleDecoder::Feed(const uint8_t* data, size_t length) {
+  size_t i = 0;
+  while (i < length) {
+    switch (state_) {
+      case CONTROL: {
+        uint8_t control = data[i++];
+        if (control < 128) {
+          state_ = LITERAL;
+          remaining_ = control + 1;
+        } else {
+          state_ = REPEAT;
+          remaining_ = control - 128 + RLE_MIN_REPEAT;
+        }
+        break;
+      }
+      case LITERAL: {
+        size_t n = length - i;
+        if (n > (size_t) remaining_) n = remaining_;
+        if (size_ + n > capacity_) return false;
+        memcpy(dst_ + size_, data + i, n);
+        size_ += n;
+        i += n;
+        remaining_ -= n;
+        if (remaining_ == 0) state_ = CONTROL;
+        break;
+      }
+      case REPEAT: {
+        if (size_ + remaining_ > capacity_) return false;
+        memset(dst_ + size_, data[i++], remaining_);
+        size_ += remaining_;
+        remaining_ = 0;
+        state_ = CONTROL;
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace retrostore
@@ -0,0 +1,61 @@
+#pragma once
+
+#ifndef _RETROSTORE_RLE_H_
+#define _RETROSTORE_RLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace retrostore {
+
+// Byte-oriented run-length codec for memory snapshots and disk images.
+//
+// TRS-80 memory and disk images are dominated by runs of zeros and fill
+// bytes, which this handles well at no memory cost beyond the output. The
+// stream is a sequence of packets, each starting with a control byte `c`:
+//
+//   c < 128   the next c + 1 bytes are literals
+//   c >= 128  the next byte is repeated c - 128 + 3 times
+//
+// Incompressible data grows by at most one byte per 128.
+
+// Upper bound of the compressed size of `n` bytes.
+#define RLE_COMPRESS_BOUND(n) ((n) + ((n) + 127) / 128)
+
+// Compresses `length` bytes of `src` into `dst` and returns the compressed
+// size, or 0 if `capacity` is too small.
+size_t RleCompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity);
+
+// Returns the compressed size of `length` bytes of `src` without writing it.
+size_t RleCompressedSize(const uint8_t* src, size_t length);
+
+// Streaming decoder. Compressed input can be fed in arbitrary pieces (e.g.
+// as it arrives from the network) and is decoded straight into a
+// caller-provided destination buffer.
+class RleDecoder {
+ public:
+  RleDecoder(uint8_t* dst, size_t capacity);
+
+  // Decodes the next piece of input. Returns false if the output would
+  // exceed the destination buffer.
+  bool Feed(const uint8_t* data, size_t length);
+
+  // Number of bytes written to the destination so far.
+  size_t size() const { return size_; }
+  // Whether the input so far ended on a packet boundary.
+  bool complete() const { return state_ == CONTROL; }
+
+ private:
+  enum State { CONTROL, LITERAL, REPEAT };
+
+  uint8_t* dst_;
+  size_t capacity_;
+  size_t size_;
+  State state_;
+  // Bytes left in the current packet.
+  int remaining_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_RLE_H_ */
@@ -0,0 +1,316 @@
+#include "soak.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+
+#include "heap_profiler.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-soak";
+
+class Lock {
+ public:
+  explicit Lock(SemaphoreHandle_t mutex) : mutex_(mutex) { xSemaphoreTake(mutex_, portMAX_DELAY); }
+  ~Lock() { xSemaphoreGive(mutex_); }
+
+ private:
+  SemaphoreHandle_t mutex_;
+};
+
+// Xorshift; each worker has its own state, so picking needs no lock.
+uint32_t nextRandom(uint32_t* state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+// Nearest-rank percentile over sorted values.
+int32_t percentile(const std::vector<int32_t>& sorted, int p) {
+  if (sorted.empty()) return 0;
+  size_t rank = (sorted.size() * p + 99) / 100;
+  if (rank == 0) rank = 1;
+  return sorted[rank - 1];
+}
+
+double percent(long part, long whole) {
+  return whole > 0 ? 100.0 * part / whole : 0;
+}
+
+}  // namespace
+
+bool ParseSoakMix(const std::string& mix, std::vector<RsSoakOp>* ops) {
+  std::vector<int> weights(ops->size(), 0);
+  size_t pos = 0;
+  while (pos < mix.size()) {
+    size_t end = mix.find(',', pos);
+    if (end == std::string::npos) end = mix.size();
+    auto item = mix.substr(pos, end - pos);
+    pos = end + 1;
+    if (item.empty()) continue;
+    auto eq = item.find('=');
+    if (eq == std::string::npos) {
+      ESP_LOGW(TAG, "Expected name=weight in the soak mix, got '%s'.", item.c_str());
+      return false;
+    }
+    auto name = item.substr(0, eq);
+    auto value = item.substr(eq + 1);
+    char* rest;
+    long weight = strtol(value.c_str(), &rest, 10);
+    if (value.empty() || *rest != '\0' || weight < 0 || weight > 1000) {
+      ESP_LOGW(TAG, "Weight of '%s' in the soak mix is not a number from 0 to 1000.",
+               name.c_str());
+      return false;
+    }
+    auto it = std::find_if(ops->begin(), ops->end(),
+                           [&name](const RsSoakOp& op) { return op.name == name; });
+    if (it == ops->end()) {
+      ESP_LOGW(TAG, "Unknown operation '%s' in the soak mix.", name.c_str());
+      return false;
+    }
+    weights[it - ops->begin()] = weight;
+  }
+  int total = 0;
+  for (int weight : weights) total += weight;
+  if (total == 0) {
+    ESP_LOGW(TAG, "The soak mix '%s' runs no operation.", mix.c_str());
+    return false;
+  }
+  for (size_t i = 0; i < ops->size(); ++i) (*ops)[i].weight = weights[i];
+  return true;
+}
+
+RsSoakTest::RsSoakTest(const std::vector<RsSoakOp>& ops, const RsSoakConfig& config)
+    : ops_(ops),
+      config_(config),
+      total_weight_(0),
+      started_(0),
+      parked_(xSemaphoreCreateCounting(std::max(config.tasks, 1), 0)),
+      resume_(xSemaphoreCreateCounting(std::max(config.tasks, 1), 0)),
+      done_(xSemaphoreCreateCounting(std::max(config.tasks, 1), 0)),
+      mutex_(xSemaphoreCreateMutex()),
+      pausing_(false),
+      stopping_(false),
+      next_seed_((uint32_t) esp_timer_get_time()),
+      stats_(ops.size()),
+      calls_(0),
+      failures_(0),
+      wrong_(0),
+      heap_drift_(0) {
+  for (const auto& op : ops_) total_weight_ += std::max(op.weight, 0);
+  // Allocated up front, so they are part of the baseline.
+  for (auto& stats : stats_) {
+    stats.calls = stats.failures = stats.wrong = 0;
+    stats.interval_calls = stats.interval_failures = stats.interval_wrong = 0;
+    stats.micros.reserve(RS_SOAK_SAMPLES);
+    stats.first_p50 = stats.last_p50 = -1;
+  }
+}
+
+RsSoakTest::~RsSoakTest() {
+  stop();
+  vSemaphoreDelete(parked_);
+  vSemaphoreDelete(resume_);
+  vSemaphoreDelete(done_);
+  vSemaphoreDelete(mutex_);
+}
+
+bool RsSoakTest::Run() {
+  if (total_weight_ <= 0) {
+    ESP_LOGE(TAG, "No operation to run.");
+    return false;
+  }
+  int intervals = std::max((config_.duration_ms + config_.report_ms - 1) / config_.report_ms, 1);
+  ESP_LOGI(TAG, "Soak test: %d tasks for %d x %d ms.", config_.tasks, intervals,
+           config_.report_ms);
+  for (int i = 0; i < config_.tasks; ++i) {
+    if (xTaskCreate(&RsSoakTest::run, "rs_soak", RS_SOAK_STACK_SIZE, this, RS_SOAK_PRIORITY,
+                    nullptr) != pdPASS) {
+      ESP_LOGE(TAG, "Creating worker task %d failed.", i);
+      break;
+    }
+    started_++;
+  }
+
+  auto start = esp_timer_get_time();
+  uint32_t baseline = 0;
+  for (int interval = 1; interval <= intervals; ++interval) {
+    int64_t due = start + (int64_t) interval * config_.report_ms * 1000;
+    int64_t now = esp_timer_get_time();
+    if (due > now) vTaskDelay(pdMS_TO_TICKS((due - now + 999) / 1000));
+    pause();
+    uint32_t free_heap = esp_get_free_heap_size();
+    if (interval == 1) baseline = free_heap;
+    heap_drift_ = (int) baseline - (int) free_heap;
+    report((esp_timer_get_time() - start) / 1000, free_heap);
+    if (interval < intervals) resume();
+  }
+  stop();
+
+  for (const auto& op : ops_) {
+    const auto& stats = stats_[&op - &ops_[0]];
+    if (stats.calls == 0) continue;
+    ESP_LOGI(TAG, "%-12s %8ld calls, %5.1f%% failed, p50 %d us at first, %d us at last.",
+             op.name.c_str(), stats.calls, percent(stats.failures, stats.calls),
+             (int) stats.first_p50, (int) stats.last_p50);
+    if (stats.first_p50 > 0 && stats.last_p50 > 2 * stats.first_p50) {
+      ESP_LOGW(TAG, "%s got slower over the run.", op.name.c_str());
+    }
+  }
+  ESP_LOGI(TAG, "Soak test done: %ld calls, %.1f%% failed, heap drift %d bytes.", calls_,
+           percent(failures_, calls_), heap_drift_);
+  bool ok = true;
+  if (wrong_ > 0) {
+    ESP_LOGE(TAG, "%ld calls returned wrong data.", wrong_);
+    ok = false;
+  }
+  if (heap_drift_ > config_.max_heap_drift) {
+    ESP_LOGE(TAG, "Free heap dropped by %d bytes after warm-up, more than %d.", heap_drift_,
+             config_.max_heap_drift);
+    ok = false;
+  }
+  if (calls_ - failures_ - wrong_ == 0) {
+    ESP_LOGE(TAG, "No call succeeded.");
+    ok = false;
+  }
+  return ok;
+}
+
+void RsSoakTest::run(void* arg) {
+  auto* soak = static_cast<RsSoakTest*>(arg);
+  uint32_t seed;
+  {
+    Lock lock(soak->mutex_);
+    soak->next_seed_ += 0x9e3779b9;
+    seed = soak->next_seed_ | 1;
+  }
+  soak->work(seed);
+  xSemaphoreGive(soak->done_);
+  vTaskDelete(NULL);
+}
+
+void RsSoakTest::work(uint32_t seed) {
+  RetroStore rs;
+  uint32_t random = seed;
+  while (true) {
+    bool pausing, stopping;
+    {
+      Lock lock(mutex_);
+      pausing = pausing_;
+      stopping = stopping_;
+    }
+    if (stopping) return;
+    if (pausing) {
+      xSemaphoreGive(parked_);
+      xSemaphoreTake(resume_, portMAX_DELAY);
+      continue;
+    }
+    int op = 0;
+    int pick = nextRandom(&random) % total_weight_;
+    while (pick >= std::max(ops_[op].weight, 0)) pick -= std::max(ops_[op++].weight, 0);
+    auto start = esp_timer_get_time();
+    RsSoakResult result;
+    {
+      HeapScope scope(ops_[op].name.c_str());
+      result = ops_[op].run(&rs);
+    }
+    record(op, result, esp_timer_get_time() - start, &random);
+  }
+}
+
+void RsSoakTest::record(int op, RsSoakResult result, int32_t micros, uint32_t* random) {
+  Lock lock(mutex_);
+  auto& stats = stats_[op];
+  calls_++;
+  stats.calls++;
+  stats.interval_calls++;
+  if (result == RS_SOAK_FAILED) {
+    failures_++;
+    stats.failures++;
+    stats.interval_failures++;
+  } else if (result == RS_SOAK_WRONG) {
+    wrong_++;
+    stats.wrong++;
+    stats.interval_wrong++;
+  }
+  // Reservoir sampling: every call of the interval is kept with the same
+  // chance.
+  if (stats.micros.size() < RS_SOAK_SAMPLES) {
+    stats.micros.push_back(micros);
+  } else {
+    uint32_t slot = nextRandom(random) % stats.interval_calls;
+    if (slot < RS_SOAK_SAMPLES) stats.micros[slot] = micros;
+  }
+}
+
+void RsSoakTest::pause() {
+  {
+    Lock lock(mutex_);
+    pausing_ = true;
+  }
+  for (int i = 0; i < started_; ++i) xSemaphoreTake(parked_, portMAX_DELAY);
+}
+
+void RsSoakTest::resume() {
+  {
+    Lock lock(mutex_);
+    pausing_ = false;
+  }
+  for (int i = 0; i < started_; ++i) xSemaphoreGive(resume_);
+}
+
+void RsSoakTest::stop() {
+  if (started_ == 0) return;
+  {
+    Lock lock(mutex_);
+    stopping_ = true;
+  }
+  // Wakes parked workers; running ones see stopping_ after their call.
+  for (int i = 0; i < started_; ++i) xSemaphoreGive(resume_);
+  for (int i = 0; i < started_; ++i) xSemaphoreTake(done_, portMAX_DELAY);
+  started_ = 0;
+}
+
+void RsSoakTest::report(int elapsed_ms, uint32_t free_heap) {
+  Lock lock(mutex_);
+  long calls = 0;
+  long failures = 0;
+  for (const auto& stats : stats_) {
+    calls += stats.interval_calls;
+    failures += stats.interval_failures;
+  }
+  ESP_LOGI(TAG, "[%8.1f s] %ld calls, %.1f%% failed, free heap %u (%+d since warm-up), "
+           "low-water %u",
+           elapsed_ms / 1000.0, calls, percent(failures, calls), (unsigned) free_heap, -heap_drift_,
+           (unsigned) esp_get_minimum_free_heap_size());
+  for (size_t i = 0; i < ops_.size(); ++i) {
+    auto& stats = stats_[i];
+    if (stats.interval_calls == 0) continue;
+    // Sorting in place is fine, the samples are dropped below.
+    std::sort(stats.micros.begin(), stats.micros.end());
+    int32_t p50 = percentile(stats.micros, 50);
+    ESP_LOGI(TAG, "[%8.1f s]   %-12s %6ld calls %5.1f%% failed  p50 %7d  p95 %7d  p99 %7d us",
+             elapsed_ms / 1000.0, ops_[i].name.c_str(), stats.interval_calls,
+             percent(stats.interval_failures, stats.interval_calls), (int) p50,
+             (int) percentile(stats.micros, 95), (int) percentile(stats.micros, 99));
+    if (stats.interval_wrong > 0) {
+      ESP_LOGE(TAG, "[%8.1f s]   %s returned wrong data %ld times.", elapsed_ms / 1000.0,
+               ops_[i].name.c_str(), stats.interval_wrong);
+    }
+    if (stats.first_p50 < 0) stats.first_p50 = p50;
+    stats.last_p50 = p50;
+    stats.interval_calls = stats.interval_failures = stats.interval_wrong = 0;
+    stats.micros.clear();
+  }
+}
+
+}  // namespace retrostore
@@ -0,0 +1,135 @@
+#pragma once
+
+#ifndef _RETROSTORE_SOAK_H_
+#define _RETROSTORE_SOAK_H_
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "retrostore.h"
+
+namespace retrostore {
+
+// The workers call the RetroStore synchronously, TLS handshakes included.
+#define RS_SOAK_STACK_SIZE 16000
+#define RS_SOAK_PRIORITY 5
+// Latencies kept per operation and report interval. Past this many calls a
+// random sample of them is kept, so memory use does not grow with the rate.
+#define RS_SOAK_SAMPLES 256
+
+enum RsSoakResult {
+  RS_SOAK_OK,
+  // The call failed, e.g. the request was lost. Expected now and then.
+  RS_SOAK_FAILED,
+  // The call succeeded but returned the wrong data. Never expected.
+  RS_SOAK_WRONG,
+};
+
+struct RsSoakOp {
+  std::string name;
+  // Relative share of the calls.
+  int weight;
+  // Runs the operation once. Called from several tasks at once, each with
+  // its own RetroStore.
+  std::function<RsSoakResult(RetroStore* rs)> run;
+};
+
+struct RsSoakConfig {
+  int tasks;
+  int duration_ms;
+  int report_ms;
+  // Bytes the free heap may lose between the end of the first report
+  // interval and the end of the run.
+  int max_heap_drift;
+};
+
+// Sets the weights of `ops` from a mix like "upload=2,nano=4". Operations
+// the mix leaves out get weight 0. Returns false, changing nothing, if the
+// mix names an unknown operation, has a malformed weight or gives every
+// operation weight 0.
+bool ParseSoakMix(const std::string& mix, std::vector<RsSoakOp>* ops);
+
+// Load generator for long runs against a server, the host mock included.
+//
+// Worker tasks call randomly chosen operations back to back, in proportion
+// to their weights. Every report interval the workers are parked between
+// calls, so that the free heap is measured with no call in flight, and one
+// line per operation is logged with its calls, failure rate and p50, p95
+// and p99 latency in that interval.
+//
+// The heap after the first interval, once caches and connections are set
+// up, is the baseline; a leak shows as drift from it. Latency that keeps
+// growing shows in the per-interval percentiles.
+class RsSoakTest {
+ public:
+  // Operations with weight 0 are never called.
+  RsSoakTest(const std::vector<RsSoakOp>& ops, const RsSoakConfig& config);
+  ~RsSoakTest();
+
+  // Runs the workers for config.duration_ms, rounded up to whole report
+  // intervals, and logs the reports and a summary. Returns false, logging
+  // why, if any call returned wrong data, the heap drifted by more than
+  // config.max_heap_drift or no call succeeded. Call once.
+  bool Run();
+
+  // Totals over the run.
+  long calls() const { return calls_; }
+  long failures() const { return failures_; }
+  long wrong() const { return wrong_; }
+  // Free heap lost from the baseline to the end of the run, in bytes.
+  int heap_drift() const { return heap_drift_; }
+
+ private:
+  struct OpStats {
+    long calls;
+    long failures;
+    long wrong;
+    // This interval's calls, failures and wrong results, and a sample of
+    // its latencies.
+    long interval_calls;
+    long interval_failures;
+    long interval_wrong;
+    std::vector<int32_t> micros;
+    // p50 of the first interval with calls, and of the latest one.
+    int32_t first_p50;
+    int32_t last_p50;
+  };
+
+  static void run(void* arg);
+  void work(uint32_t seed);
+  void record(int op, RsSoakResult result, int32_t micros, uint32_t* random);
+  // Parks all workers between calls; returns once they are.
+  void pause();
+  void resume();
+  void stop();
+  void report(int elapsed_ms, uint32_t free_heap);
+
+  std::vector<RsSoakOp> ops_;
+  RsSoakConfig config_;
+  int total_weight_;
+  int started_;
+  // Given by a worker once it is parked, taken by it to go on, and given
+  // once it has stopped.
+  SemaphoreHandle_t parked_;
+  SemaphoreHandle_t resume_;
+  SemaphoreHandle_t done_;
+  // Guards everything below.
+  SemaphoreHandle_t mutex_;
+  bool pausing_;
+  bool stopping_;
+  uint32_t next_seed_;
+  std::vector<OpStats> stats_;
+  long calls_;
+  long failures_;
+  long wrong_;
+  int heap_drift_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_SOAK_H_ */
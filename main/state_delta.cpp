@@ -0,0 +1,184 @@
+#include "state_delta.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "esp_log.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-state-delta";
+
+bool sameRegisters(const RsRegisters& a, const RsRegisters& b) {
+  return memcmp(&a, &b, sizeof(RsRegisters)) == 0;
+}
+
+int memoryBytes(const RsSystemState& state) {
+  int bytes = 0;
+  for (const auto& region : state.regions) bytes += region.length;
+  return bytes;
+}
+
+}  // namespace
+
+void CopySystemState(const RsSystemState& from, RsSystemState* to) {
+  to->model = from.model;
+  to->registers = from.registers;
+  to->regions.clear();
+  for (const auto& r : from.regions) {
+    RsMemoryRegion region;
+    region.start = r.start;
+    region.length = r.length;
+    if (r.data) {
+      region.data.reset(new uint8_t[std::max(r.length, 1)]);
+      memcpy(region.data.get(), r.data.get(), r.length);
+    }
+    to->regions.push_back(std::move(region));
+  }
+}
+
+bool SameRegionLayout(const RsSystemState& a, const RsSystemState& b) {
+  if (a.regions.size() != b.regions.size()) return false;
+  for (size_t i = 0; i < a.regions.size(); ++i) {
+    if (a.regions[i].start != b.regions[i].start ||
+        a.regions[i].length != b.regions[i].length) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<RsMemoryRange> DirtyRanges(const RsSystemState& previous,
+                                       const RsSystemState& current,
+                                       int page_size) {
+  std::vector<RsMemoryRange> dirty;
+  for (size_t i = 0; i < current.regions.size(); ++i) {
+    const auto& prev = previous.regions[i];
+    const auto& cur = current.regions[i];
+    // Ranges are only merged within a region, even where the next region
+    // starts right after this one.
+    size_t first_in_region = dirty.size();
+    for (int offset = 0; offset < cur.length; offset += page_size) {
+      int length = std::min(page_size, cur.length - offset);
+      bool changed = !prev.data || !cur.data ||
+                     memcmp(prev.data.get() + offset, cur.data.get() + offset, length) != 0;
+      if (!changed) continue;
+      int start = cur.start + offset;
+      if (dirty.size() > first_in_region && dirty.back().start + dirty.back().length == start) {
+        dirty.back().length += length;
+      } else {
+        dirty.push_back({start, length});
+      }
+    }
+  }
+  return dirty;
+}
+
+DeltaUploader::DeltaUploader(RetroStore* rs, int page_size, int max_chain)
+    : rs_(rs),
+      page_size_(std::max(page_size, 1)),
+      max_chain_(max_chain),
+      has_previous_(false),
+      last_upload_bytes_(0) {}
+
+int DeltaUploader::Upload(const RsSystemState& state) {
+  last_upload_bytes_ = 0;
+  if (!has_previous_ || !SameRegionLayout(previous_, state) ||
+      (int) chain_.size() > max_chain_) {
+    return uploadFull(state);
+  }
+
+  auto dirty = DirtyRanges(previous_, state, page_size_);
+  if (dirty.empty() && previous_.model == state.model &&
+      sameRegisters(previous_.registers, state.registers)) {
+    return chain_.back();
+  }
+  int dirty_bytes = 0;
+  for (const auto& range : dirty) dirty_bytes += range.length;
+  if (dirty_bytes * 2 > memoryBytes(state)) return uploadFull(state);
+
+  RsSystemState delta;
+  delta.model = state.model;
+  delta.registers = state.registers;
+  for (const auto& range : dirty) {
+    // Dirty ranges never span regions, find the one this range is in.
+    bool found = false;
+    for (const auto& r : state.regions) {
+      if (range.start < r.start || range.start + range.length > r.start + r.length) continue;
+      RsMemoryRegion region;
+      region.start = range.start;
+      region.length = range.length;
+      region.data.reset(new uint8_t[range.length]);
+      memcpy(region.data.get(), r.data.get() + (range.start - r.start), range.length);
+      delta.regions.push_back(std::move(region));
+      found = true;
+      break;
+    }
+    if (!found) {
+      ESP_LOGE(TAG, "Dirty range %d+%d is not within one region.", range.start, range.length);
+      return -1;
+    }
+  }
+
+  int token = rs_->UploadState(delta);
+  if (token < 0) {
+    ESP_LOGW(TAG, "Uploading delta state failed.");
+    return -1;
+  }
+  last_upload_bytes_ = dirty_bytes;
+  chain_.push_back(token);
+  CopySystemState(state, &previous_);
+  return token;
+}
+
+int DeltaUploader::uploadFull(const RsSystemState& state) {
+  RsSystemState copy;
+  CopySystemState(state, &copy);
+  int token = rs_->UploadState(copy);
+  if (token < 0) {
+    ESP_LOGW(TAG, "Uploading full state failed.");
+    return -1;
+  }
+  last_upload_bytes_ = memoryBytes(state);
+  chain_.clear();
+  chain_.push_back(token);
+  previous_ = std::move(copy);
+  has_previous_ = true;
+  return token;
+}
+
+bool DownloadStateChain(RetroStore* rs, const std::vector<int>& chain, RsSystemState* state) {
+  if (chain.empty()) return false;
+  if (!rs->DownloadState(chain[0], state)) {
+    ESP_LOGW(TAG, "Downloading base state %d failed.", chain[0]);
+    return false;
+  }
+  for (size_t i = 1; i < chain.size(); ++i) {
+    RsSystemState delta;
+    if (!rs->DownloadState(chain[i], &delta)) {
+      ESP_LOGW(TAG, "Downloading delta state %d failed.", chain[i]);
+      return false;
+    }
+    state->model = delta.model;
+    state->registers = delta.registers;
+    for (const auto& d : delta.regions) {
+      bool applied = false;
+      for (auto& r : state->regions) {
+        if (d.start < r.start || d.start + d.length > r.start + r.length) continue;
+        memcpy(r.data.get() + (d.start - r.start), d.data.get(), d.length);
+        applied = true;
+        break;
+      }
+      if (!applied) {
+        ESP_LOGW(TAG, "Delta region %d+%d of state %d is outside the base state.",
+                 d.start, d.length, chain[i]);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace retrostore
@@ -0,0 +1,73 @@
+#pragma once
+
+#ifndef _RETROSTORE_STATE_DELTA_H_
+#define _RETROSTORE_STATE_DELTA_H_
+
+#include <vector>
+
+#include "retrostore.h"
+#include "state_ranges.h"
+
+namespace retrostore {
+
+#define STATE_DELTA_PAGE_SIZE 256
+// Number of deltas after which the next snapshot is uploaded in full again,
+// bounding the number of downloads needed to restore.
+#define STATE_DELTA_MAX_CHAIN 8
+
+// Deep copy of a state, including region data.
+void CopySystemState(const RsSystemState& from, RsSystemState* to);
+
+// Whether both states have the same regions (starts and lengths).
+bool SameRegionLayout(const RsSystemState& a, const RsSystemState& b);
+
+// Address ranges of `current` whose content differs from `previous`, at
+// `page_size` granularity, with adjacent dirty pages of the same region
+// merged. Both states must have the same region layout.
+std::vector<RsMemoryRange> DirtyRanges(const RsSystemState& previous,
+                                       const RsSystemState& current,
+                                       int page_size = STATE_DELTA_PAGE_SIZE);
+
+// Uploads successive snapshots of a state as a chain of tokens: a full base
+// state followed by delta states holding only the pages that changed since
+// the previous snapshot (plus model and registers).
+//
+// The RetroStore has no notion of deltas, so the chain has to be kept by the
+// caller and restored with DownloadStateChain(). A full upload starts a new
+// chain when there is no previous snapshot, the region layout changed, the
+// chain reached `max_chain` deltas, or the delta would be more than half of
+// the full state.
+class DeltaUploader {
+ public:
+  DeltaUploader(RetroStore* rs,
+                int page_size = STATE_DELTA_PAGE_SIZE,
+                int max_chain = STATE_DELTA_MAX_CHAIN);
+
+  // Uploads the snapshot and returns the token of the uploaded base or delta
+  // state, or -1 on failure. If nothing changed since the previous snapshot
+  // nothing is uploaded and the previous token is returned.
+  int Upload(const RsSystemState& state);
+
+  // Tokens to restore the latest snapshot, base first.
+  const std::vector<int>& chain() const { return chain_; }
+  // Memory bytes sent by the last Upload().
+  int last_upload_bytes() const { return last_upload_bytes_; }
+
+ private:
+  int uploadFull(const RsSystemState& state);
+
+  RetroStore* rs_;
+  const int page_size_;
+  const int max_chain_;
+  RsSystemState previous_;
+  bool has_previous_;
+  std::vector<int> chain_;
+  int last_upload_bytes_;
+};
+
+// Downloads the base state of the chain and applies its deltas in order.
+bool DownloadStateChain(RetroStore* rs, const std::vector<int>& chain, RsSystemState* state);
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_STATE_DELTA_H_ */
@@ -0,0 +1,165 @@
+#include "state_ranges.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#include "esp_log.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-state-ranges";
+
+}  // namespace
+
+std::vector<RsMemoryRange> CoalesceMemoryRanges(const std::vector<RsMemoryRange>& ranges,
+                                                int max_gap) {
+  std::vector<RsMemoryRange> sorted;
+  for (const auto& range : ranges) {
+    if (range.length > 0) sorted.push_back(range);
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const RsMemoryRange& a, const RsMemoryRange& b) { return a.start < b.start; });
+
+  std::vector<RsMemoryRange> merged;
+  for (const auto& range : sorted) {
+    if (!merged.empty()) {
+      auto& back = merged.back();
+      int back_end = back.start + back.length;
+      if (range.start <= back_end + max_gap) {
+        back.length = std::max(back_end, range.start + range.length) - back.start;
+        continue;
+      }
+    }
+    merged.push_back(range);
+  }
+  return merged;
+}
+
+bool DownloadStateMemoryRanges(RetroStore* rs, int token,
+                               const std::vector<RsMemoryRange>& ranges,
+                               std::vector<RsMemoryRegion>* regions,
+                               int max_gap) {
+  for (const auto& range : ranges) {
+    if (range.length < 0) {
+      ESP_LOGW(TAG, "Invalid range length: %d", range.length);
+      return false;
+    }
+  }
+  auto spans = CoalesceMemoryRanges(ranges, max_gap);
+
+  std::vector<RsMemoryRegion> fetched;
+  for (const auto& span : spans) {
+    RsMemoryRegion region;
+    if (!rs->DownloadStateMemoryRange(token, span.start, span.length, &region)) {
+      ESP_LOGW(TAG, "Downloading %d+%d of state %d failed.", span.start, span.length, token);
+      return false;
+    }
+    fetched.push_back(std::move(region));
+  }
+
+  regions->clear();
+  for (const auto& range : ranges) {
+    RsMemoryRegion region;
+    region.start = range.start;
+    region.length = range.length;
+    region.data.reset(new uint8_t[std::max(range.length, 1)]);
+    if (range.length > 0) {
+      // Every non-empty range lies entirely within one fetched span.
+      auto span = std::find_if(fetched.begin(), fetched.end(), [&range](const RsMemoryRegion& r) {
+        return range.start >= r.start && range.start + range.length <= r.start + r.length;
+      });
+      if (span == fetched.end()) {
+        ESP_LOGW(TAG, "Range %d+%d not covered by the response.", range.start, range.length);
+        return false;
+      }
+      memcpy(region.data.get(), span->data.get() + (range.start - span->start), range.length);
+    }
+    regions->push_back(std::move(region));
+  }
+  return true;
+}
+
+RsStateMemoryIndex::RsStateMemoryIndex(const RsSystemState& state) : overlapping_(false) {
+  entries_.reserve(state.regions.size());
+  for (int i = 0; i < state.regions.size(); ++i) {
+    const auto& region = state.regions[i];
+    // Regions downloaded without data hold nothing to read.
+    if (region.data == nullptr || region.length <= 0) continue;
+    entries_.push_back({region.start, region.start + region.length, region.data.get(), i, 0});
+  }
+  std::sort(entries_.begin(), entries_.end(),
+            [](const Entry& a, const Entry& b) { return a.start < b.start; });
+  int max_end = INT_MIN;
+  for (auto& entry : entries_) {
+    if (entry.start < max_end) overlapping_ = true;
+    max_end = std::max(max_end, entry.end);
+    entry.max_end = max_end;
+  }
+}
+
+bool RsStateMemoryIndex::ReadRange(int start, int length, RsMemoryRegion* region) const {
+  if (length < 0) {
+    ESP_LOGW(TAG, "Invalid range length: %d", length);
+    return false;
+  }
+  region->start = start;
+  region->length = length;
+  region->data.reset(new uint8_t[std::max(length, 1)]);
+  Read(start, length, region->data.get());
+  return true;
+}
+
+bool RsStateMemoryIndex::ReadRanges(const std::vector<RsMemoryRange>& ranges,
+                                    std::vector<RsMemoryRegion>* regions) const {
+  regions->clear();
+  regions->reserve(ranges.size());
+  for (const auto& range : ranges) {
+    RsMemoryRegion region;
+    if (!ReadRange(range.start, range.length, &region)) return false;
+    regions->push_back(std::move(region));
+  }
+  return true;
+}
+
+void RsStateMemoryIndex::Read(int start, int length, uint8_t* out) const {
+  int end = start + length;
+  // Entries from the first one that reaches past `start` (max_end only
+  // grows) up to the first one that starts at or after `end`.
+  auto first = std::upper_bound(entries_.begin(), entries_.end(), start,
+                                [](int start, const Entry& entry) { return start < entry.max_end; });
+  auto last = std::lower_bound(first, entries_.end(), end,
+                               [](const Entry& entry, int end) { return entry.start < end; });
+  if (overlapping_) {
+    // Copied in state order, so that the region later in the state
+    // overwrites the earlier ones.
+    std::vector<const Entry*> hits;
+    for (auto it = first; it != last; ++it) {
+      if (it->end > start) hits.push_back(&*it);
+    }
+    std::sort(hits.begin(), hits.end(),
+              [](const Entry* a, const Entry* b) { return a->position < b->position; });
+    memset(out, 0, length);
+    for (const auto* entry : hits) {
+      int from = std::max(start, entry->start);
+      int to = std::min(end, entry->end);
+      memcpy(out + (from - start), entry->data + (from - entry->start), to - from);
+    }
+    return;
+  }
+  // Zero only the gaps between the pieces that are copied.
+  int filled = start;
+  for (auto it = first; it != last; ++it) {
+    int from = std::max(start, it->start);
+    int to = std::min(end, it->end);
+    if (from >= to) continue;
+    if (from > filled) memset(out + (filled - start), 0, from - filled);
+    memcpy(out + (from - start), it->data + (from - it->start), to - from);
+    filled = std::max(filled, to);
+  }
+  if (filled < end) memset(out + (filled - start), 0, end - filled);
+}
+
+}  // namespace retrostore
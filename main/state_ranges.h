@@ -0,0 +1,79 @@
+#pragma once
+
+#ifndef _RETROSTORE_STATE_RANGES_H_
+#define _RETROSTORE_STATE_RANGES_H_
+
+#include <vector>
+
+#include "retrostore.h"
+
+namespace retrostore {
+
+// Ranges closer than this are fetched together; the bytes in between are
+// cheaper to transfer than another round trip.
+#define STATE_RANGES_MAX_GAP 512
+
+struct RsMemoryRange {
+  int start;
+  int length;
+};
+
+// Sorts the ranges and merges those that overlap, touch, or are separated by
+// at most `max_gap` bytes.
+std::vector<RsMemoryRange> CoalesceMemoryRanges(const std::vector<RsMemoryRange>& ranges,
+                                                int max_gap);
+
+// Downloads several memory ranges of the state with the given token. The
+// ranges are coalesced first, so ranges that are close together cost a
+// single DownloadStateMemoryRange request. `regions` receives one region per
+// requested range, in the order of `ranges`, with the same zero-fill
+// semantics as DownloadStateMemoryRange.
+bool DownloadStateMemoryRanges(RetroStore* rs, int token,
+                               const std::vector<RsMemoryRange>& ranges,
+                               std::vector<RsMemoryRegion>* regions,
+                               int max_gap = STATE_RANGES_MAX_GAP);
+
+// Answers memory range queries from a state held in memory, with the same
+// semantics as RetroStore::DownloadStateMemoryRange: bytes that no region
+// holds read as zero, and a range may span several regions or only part of
+// one. Peeking at a state that was already downloaded costs no request.
+//
+// The regions are indexed by start address, along with the furthest end of
+// any region up to each one, so a query only visits the regions it
+// overlaps. Where regions overlap, the one later in the state wins, as on
+// the server. The state must not change or go away while it is indexed.
+class RsStateMemoryIndex {
+ public:
+  explicit RsStateMemoryIndex(const RsSystemState& state);
+
+  // Same contract as RetroStore::DownloadStateMemoryRange.
+  bool ReadRange(int start, int length, RsMemoryRegion* region) const;
+  // Same contract as DownloadStateMemoryRanges.
+  bool ReadRanges(const std::vector<RsMemoryRange>& ranges,
+                  std::vector<RsMemoryRegion>* regions) const;
+  // Copies `length` bytes starting at `start` into `out`.
+  void Read(int start, int length, uint8_t* out) const;
+
+  // Regions with data.
+  int size() const { return entries_.size(); }
+
+ private:
+  struct Entry {
+    int start;
+    int end;
+    const uint8_t* data;
+    // Index of the region in the state; the highest one wins where regions
+    // overlap.
+    int position;
+    // Furthest end of this and every earlier entry.
+    int max_end;
+  };
+
+  std::vector<Entry> entries_;
+  // Whether any two regions overlap, so that Read has to copy by position.
+  bool overlapping_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_STATE_RANGES_H_ */
@@ -0,0 +1,257 @@
+#include "state_snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "esp_log.h"
+
+namespace retrostore {
+
+namespace {
+
+static const char *TAG = "rs-state-snapshot";
+
+#define SNAPSHOT_MAGIC 0x53535352  // "RSSS"
+
+}  // namespace
+
+RsStateSnapshot::RsStateSnapshot() : capacity_(0), used_(0) {}
+
+bool RsStateSnapshot::Download(RetroStore* rs, int token) {
+  RsSystemState state;
+  if (!rs->DownloadState(token, &state)) return false;
+  Assign(state);
+  return true;
+}
+
+int RsStateSnapshot::Upload(RetroStore* rs) {
+  RsSystemState state;
+  state.model = model();
+  state.registers = registers();
+  state.regions.resize(num_regions());
+  for (int i = 0; i < num_regions(); ++i) {
+    const auto& entry = index()[i];
+    state.regions[i].start = entry.start;
+    state.regions[i].length = entry.length;
+    state.regions[i].data.reset(arena_.get() + entry.offset);
+  }
+  int token = rs->UploadState(state);
+  // The bytes belong to the arena.
+  for (auto& region : state.regions) region.data.release();
+  return token;
+}
+
+void RsStateSnapshot::Assign(const RsSystemState& state) {
+  std::vector<Source> sources;
+  sources.reserve(state.regions.size());
+  for (const auto& region : state.regions) {
+    sources.push_back({region.start, region.length, region.data.get()});
+  }
+  pack(state.model, state.registers, sources);
+}
+
+void RsStateSnapshot::Capture(RsTrs80Model model, const RsRegisters& registers,
+                              const uint8_t* memory, const std::vector<RsMemoryRange>& ranges) {
+  auto merged = CoalesceMemoryRanges(ranges, 0);
+  std::vector<Source> sources;
+  sources.reserve(merged.size());
+  for (const auto& range : merged) {
+    sources.push_back({range.start, range.length, memory + range.start});
+  }
+  pack(model, registers, sources);
+}
+
+bool RsStateSnapshot::Load(const uint8_t* data, size_t size) {
+  used_ = 0;
+  Header h;
+  if (size < sizeof(Header)) return false;
+  memcpy(&h, data, sizeof(Header));
+  if (h.magic != SNAPSHOT_MAGIC || h.num_regions < 0 ||
+      (size_t) h.num_regions > (size - sizeof(Header)) / sizeof(IndexEntry) ||
+      size != sizeof(Header) + h.num_regions * sizeof(IndexEntry) + h.data_bytes) {
+    ESP_LOGW(TAG, "Not a valid snapshot (%d bytes).", (int) size);
+    return false;
+  }
+  // Every region must lie within the data and the index must be sorted
+  // without overlaps, or lookups would read out of bounds or disagree.
+  const size_t data_start = sizeof(Header) + h.num_regions * sizeof(IndexEntry);
+  IndexEntry previous = {};
+  for (int i = 0; i < h.num_regions; ++i) {
+    IndexEntry entry;
+    memcpy(&entry, data + sizeof(Header) + i * sizeof(IndexEntry), sizeof(entry));
+    if (entry.length < 0 || entry.offset < data_start || entry.offset > size ||
+        (size_t) entry.length > size - entry.offset ||
+        (i > 0 && (int64_t) entry.start < (int64_t) previous.start + previous.length)) {
+      ESP_LOGW(TAG, "Region %d of the snapshot is invalid.", i);
+      return false;
+    }
+    previous = entry;
+  }
+  reserve(size);
+  memcpy(arena_.get(), data, size);
+  used_ = size;
+  return true;
+}
+
+void RsStateSnapshot::Clear() {
+  arena_.reset();
+  capacity_ = 0;
+  used_ = 0;
+}
+
+RsTrs80Model RsStateSnapshot::model() const {
+  return empty() ? RsTrs80Model_UNKNOWN_MODEL : (RsTrs80Model) header()->model;
+}
+
+const RsRegisters& RsStateSnapshot::registers() const {
+  static const RsRegisters none = {};
+  return empty() ? none : header()->registers;
+}
+
+int RsStateSnapshot::num_regions() const {
+  return empty() ? 0 : header()->num_regions;
+}
+
+RsRegionView RsStateSnapshot::region(int i) const {
+  const auto& entry = index()[i];
+  return {entry.start, entry.length, arena_.get() + entry.offset};
+}
+
+int RsStateSnapshot::FindRegion(int address) const {
+  if (empty()) return -1;
+  const IndexEntry* begin = index();
+  const IndexEntry* end = begin + num_regions();
+  // The last region starting at or before the address.
+  auto it = std::upper_bound(begin, end, address, [](int address, const IndexEntry& entry) {
+    return address < entry.start;
+  });
+  if (it == begin) return -1;
+  --it;
+  return address < it->start + it->length ? it - begin : -1;
+}
+
+const uint8_t* RsStateSnapshot::Find(int address) const {
+  int i = FindRegion(address);
+  if (i < 0) return nullptr;
+  return arena_.get() + index()[i].offset + (address - index()[i].start);
+}
+
+void RsStateSnapshot::Read(int address, int length, uint8_t* out) const {
+  memset(out, 0, length);
+  if (empty()) return;
+  const IndexEntry* begin = index();
+  const IndexEntry* end = begin + num_regions();
+  // Regions starting after the end of the range cannot contribute.
+  auto last = std::lower_bound(begin, end, address + length, [](const IndexEntry& entry, int end) {
+    return entry.start < end;
+  });
+  for (auto it = begin; it != last; ++it) {
+    int from = std::max(address, (int) it->start);
+    int to = std::min(address + length, (int) (it->start + it->length));
+    if (from >= to) continue;
+    memcpy(out + (from - address), arena_.get() + it->offset + (from - it->start), to - from);
+  }
+}
+
+void RsStateSnapshot::reserve(size_t size) {
+  if (size <= capacity_) return;
+  arena_.reset(new uint8_t[size]);
+  capacity_ = size;
+}
+
+void RsStateSnapshot::flatten(std::vector<Source>& sources) {
+  std::vector<int> order(sources.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&sources](int a, int b) {
+    return sources[a].start < sources[b].start;
+  });
+  bool overlapping = false;
+  int64_t max_end = INT64_MIN;
+  for (int i : order) {
+    if (sources[i].length <= 0) continue;
+    if (sources[i].start < max_end) overlapping = true;
+    max_end = std::max(max_end, (int64_t) sources[i].start + sources[i].length);
+  }
+  if (!overlapping) {
+    std::vector<Source> sorted;
+    sorted.reserve(sources.size());
+    for (int i : order) sorted.push_back(sources[i]);
+    sources.swap(sorted);
+    return;
+  }
+
+  // Rare, so simply: between each pair of neighbouring boundaries, the last
+  // source that covers the stretch owns it.
+  std::vector<int64_t> bounds;
+  for (const auto& source : sources) {
+    if (source.length <= 0) continue;
+    bounds.push_back(source.start);
+    bounds.push_back((int64_t) source.start + source.length);
+  }
+  std::sort(bounds.begin(), bounds.end());
+  bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+  std::vector<Source> pieces;
+  int last_owner = -1;
+  for (size_t b = 0; b + 1 < bounds.size(); ++b) {
+    int owner = -1;
+    for (int i = sources.size() - 1; i >= 0 && owner < 0; --i) {
+      const auto& source = sources[i];
+      if (source.length > 0 && source.start <= bounds[b] &&
+          bounds[b + 1] <= (int64_t) source.start + source.length) {
+        owner = i;
+      }
+    }
+    if (owner < 0) {
+      last_owner = -1;
+      continue;
+    }
+    int length = bounds[b + 1] - bounds[b];
+    if (owner == last_owner) {
+      pieces.back().length += length;
+      continue;
+    }
+    const auto& source = sources[owner];
+    const uint8_t* data =
+        source.data != nullptr ? source.data + (bounds[b] - source.start) : nullptr;
+    pieces.push_back({(int) bounds[b], length, data});
+    last_owner = owner;
+  }
+  sources.swap(pieces);
+}
+
+void RsStateSnapshot::pack(RsTrs80Model model, const RsRegisters& registers,
+                           std::vector<Source>& sources) {
+  flatten(sources);
+  size_t data_bytes = 0;
+  for (const auto& source : sources) data_bytes += std::max(0, source.length);
+  size_t data_start = sizeof(Header) + sources.size() * sizeof(IndexEntry);
+  size_t needed = data_start + data_bytes;
+  reserve(needed);
+
+  Header h;
+  h.magic = SNAPSHOT_MAGIC;
+  h.model = model;
+  h.registers = registers;
+  h.num_regions = sources.size();
+  h.data_bytes = data_bytes;
+  memcpy(arena_.get(), &h, sizeof(h));
+
+  auto* entry = reinterpret_cast<IndexEntry*>(arena_.get() + sizeof(Header));
+  uint32_t offset = data_start;
+  for (const auto& source : sources) {
+    int length = std::max(0, source.length);
+    entry->start = source.start;
+    entry->length = length;
+    entry->offset = offset;
+    if (source.data != nullptr) {
+      memcpy(arena_.get() + offset, source.data, length);
+    } else {
+      memset(arena_.get() + offset, 0, length);
+    }
+    offset += length;
+    entry++;
+  }
+  used_ = needed;
+}
+
+}  // namespace retrostore
@@ -0,0 +1,125 @@
+#pragma once
+
+#ifndef _RETROSTORE_STATE_SNAPSHOT_H_
+#define _RETROSTORE_STATE_SNAPSHOT_H_
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "retrostore.h"
+#include "state_ranges.h"
+
+namespace retrostore {
+
+// A memory region stored in an RsStateSnapshot's arena.
+struct RsRegionView {
+  int start;
+  int length;
+  const uint8_t* data;
+};
+
+// A system state packed into one contiguous allocation: the model, the
+// registers, an index of the memory regions sorted by start address and the
+// region bytes all live in a single arena. Taking a snapshot costs one heap
+// block instead of one per region, and looking up an address is a binary
+// search over the index.
+//
+// The arena holds offsets rather than pointers, so it doubles as the
+// serialized form: data() and size() can be written to flash or sent as is,
+// and Load() restores them. Refilling a snapshot reuses the arena when it is
+// large enough.
+//
+// Overlapping regions are split when packed, keeping the bytes of the region
+// later in the state, as on the server; the index never overlaps. The views
+// are valid until the snapshot is refilled, cleared or destroyed.
+class RsStateSnapshot {
+ public:
+  RsStateSnapshot();
+
+  // Downloads the state with the given token, like RetroStore::DownloadState.
+  bool Download(RetroStore* rs, int token);
+  // Uploads the snapshot, like RetroStore::UploadState, and returns the
+  // token or -1. The region bytes are handed to the SDK in place, not copied.
+  int Upload(RetroStore* rs);
+
+  // Packs the given state, replacing the contents of the snapshot. Regions
+  // without data are stored as zeros. Where regions overlap, the one later
+  // in `state` wins, and the snapshot may hold more or fewer regions than
+  // `state`.
+  void Assign(const RsSystemState& state);
+  // Packs the given ranges of `memory`, an image of the address space
+  // starting at address 0. Overlapping and adjacent ranges are merged.
+  void Capture(RsTrs80Model model, const RsRegisters& registers, const uint8_t* memory,
+               const std::vector<RsMemoryRange>& ranges);
+  // Restores a snapshot from its serialized form. Returns false, leaving the
+  // snapshot empty, if `data` is not a valid snapshot, including one whose
+  // regions overlap.
+  bool Load(const uint8_t* data, size_t size);
+
+  // Empties the snapshot and frees the arena.
+  void Clear();
+
+  bool empty() const { return used_ == 0; }
+  RsTrs80Model model() const;
+  const RsRegisters& registers() const;
+  int num_regions() const;
+  // Regions in order of start address.
+  RsRegionView region(int i) const;
+
+  // Index of the region that holds `address`, or -1.
+  int FindRegion(int address) const;
+  // The byte at `address`, or nullptr if no region holds it.
+  const uint8_t* Find(int address) const;
+  // Copies `length` bytes starting at `address` into `out`. Bytes that no
+  // region holds read as zero, as with RetroStore::DownloadStateMemoryRange.
+  void Read(int address, int length, uint8_t* out) const;
+
+  // The serialized snapshot.
+  const uint8_t* data() const { return arena_.get(); }
+  size_t size() const { return used_; }
+  // Bytes allocated for the arena.
+  size_t arena_capacity() const { return capacity_; }
+
+ private:
+  struct Header {
+    uint32_t magic;
+    int32_t model;
+    RsRegisters registers;
+    int32_t num_regions;
+    uint32_t data_bytes;
+  };
+  struct IndexEntry {
+    int32_t start;
+    int32_t length;
+    // From the start of the arena.
+    uint32_t offset;
+  };
+  // A region to be packed; `data` may be null for zeros.
+  struct Source {
+    int start;
+    int length;
+    const uint8_t* data;
+  };
+
+  const Header* header() const { return reinterpret_cast<const Header*>(arena_.get()); }
+  const IndexEntry* index() const {
+    return reinterpret_cast<const IndexEntry*>(arena_.get() + sizeof(Header));
+  }
+  // Makes sure the arena holds at least `size` bytes, keeping it if it does.
+  void reserve(size_t size);
+  // Sorts the sources by start address and splits overlapping ones, so that
+  // each byte comes from the last source in the original order that has it.
+  static void flatten(std::vector<Source>& sources);
+  // Replaces the contents of the snapshot.
+  void pack(RsTrs80Model model, const RsRegisters& registers, std::vector<Source>& sources);
+
+  std::unique_ptr<uint8_t[]> arena_;
+  size_t capacity_;
+  size_t used_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_STATE_SNAPSHOT_H_ */
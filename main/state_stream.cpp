@@ -0,0 +1,337 @@
+#include "state_stream.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+namespace retrostore {
+
+namespace {
+
+#define WIRE_VARINT 0
+#define WIRE_FIXED64 1
+#define WIRE_LENGTH 2
+#define WIRE_FIXED32 5
+
+// SystemState fields.
+#define FIELD_MODEL 1
+#define FIELD_REGISTERS 2
+#define FIELD_REGION 3
+// MemoryRegion fields.
+#define FIELD_START 1
+#define FIELD_DATA 2
+#define FIELD_LENGTH 3
+#define FIELD_RLE_DATA 4
+
+// Registers fields 1 to 15.
+int RsRegisters::* const REGISTER_FIELDS[] = {
+    &RsRegisters::ix,       &RsRegisters::iy,       &RsRegisters::pc,
+    &RsRegisters::sp,       &RsRegisters::af,       &RsRegisters::bc,
+    &RsRegisters::de,       &RsRegisters::hl,       &RsRegisters::af_prime,
+    &RsRegisters::bc_prime, &RsRegisters::de_prime, &RsRegisters::hl_prime,
+    &RsRegisters::i,        &RsRegisters::r_1,      &RsRegisters::r_2};
+#define NUM_REGISTER_FIELDS (sizeof(REGISTER_FIELDS) / sizeof(REGISTER_FIELDS[0]))
+
+// Negative numbers take ten bytes, as int32 fields do in protobuf.
+void putVarint(std::vector<uint8_t>* out, int64_t signed_value) {
+  uint64_t value = signed_value;
+  while (value >= 0x80) {
+    out->push_back((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
+
+size_t varintSize(int64_t signed_value) {
+  uint64_t value = signed_value;
+  size_t size = 1;
+  for (; value >= 0x80; value >>= 7) size++;
+  return size;
+}
+
+void putKey(std::vector<uint8_t>* out, int field, int wire_type) {
+  putVarint(out, field << 3 | wire_type);
+}
+
+}  // namespace
+
+RsStateEncoder::RsStateEncoder(RsTrs80Model model, const RsRegisters& registers,
+                               const std::vector<RsRegionView>& regions, bool rle)
+    : flushed_(0), size_(0), piece_(0), piece_offset_(0) {
+  encode(model, registers, regions, rle);
+}
+
+RsStateEncoder::RsStateEncoder(const RsSystemState& state, bool rle)
+    : flushed_(0), size_(0), piece_(0), piece_offset_(0) {
+  std::vector<RsRegionView> regions;
+  regions.reserve(state.regions.size());
+  for (const auto& region : state.regions) {
+    regions.push_back({region.start, region.length, region.data.get()});
+  }
+  encode(state.model, state.registers, regions, rle);
+}
+
+size_t RsStateEncoder::Read(uint8_t* dst, size_t capacity) {
+  size_t n = 0;
+  while (n < capacity && piece_ < pieces_.size()) {
+    const auto& piece = pieces_[piece_];
+    const uint8_t* src = piece.data != nullptr ? piece.data : fields_.data() + piece.offset;
+    size_t take = std::min(capacity - n, piece.length - piece_offset_);
+    memcpy(dst + n, src + piece_offset_, take);
+    n += take;
+    piece_offset_ += take;
+    if (piece_offset_ == piece.length) {
+      piece_++;
+      piece_offset_ = 0;
+    }
+  }
+  return n;
+}
+
+void RsStateEncoder::encode(RsTrs80Model model, const RsRegisters& registers,
+                            const std::vector<RsRegionView>& regions, bool rle) {
+  putKey(&fields_, FIELD_MODEL, WIRE_VARINT);
+  putVarint(&fields_, model);
+
+  std::vector<uint8_t> message;
+  for (int i = 0; i < NUM_REGISTER_FIELDS; ++i) {
+    putKey(&message, i + 1, WIRE_VARINT);
+    putVarint(&message, registers.*REGISTER_FIELDS[i]);
+  }
+  putKey(&fields_, FIELD_REGISTERS, WIRE_LENGTH);
+  putVarint(&fields_, message.size());
+  fields_.insert(fields_.end(), message.begin(), message.end());
+
+  compressed_.reserve(regions.size());
+  for (const auto& region : regions) {
+    const uint8_t* data = region.data;
+    size_t data_length = region.length;
+    if (rle && data != nullptr) {
+      compressed_.emplace_back(RLE_COMPRESS_BOUND(data_length));
+      auto& packed = compressed_.back();
+      packed.resize(RleCompress(data, data_length, packed.data(), packed.size()));
+      data = packed.data();
+      data_length = packed.size();
+    }
+    size_t size = 2 + varintSize(region.start) + varintSize(region.length);
+    if (data != nullptr) size += 1 + varintSize(data_length) + data_length;
+    putKey(&fields_, FIELD_REGION, WIRE_LENGTH);
+    putVarint(&fields_, size);
+    putKey(&fields_, FIELD_START, WIRE_VARINT);
+    putVarint(&fields_, region.start);
+    putKey(&fields_, FIELD_LENGTH, WIRE_VARINT);
+    putVarint(&fields_, region.length);
+    if (data == nullptr) continue;
+    putKey(&fields_, rle ? FIELD_RLE_DATA : FIELD_DATA, WIRE_LENGTH);
+    putVarint(&fields_, data_length);
+    flushFields();
+    pieces_.push_back({0, data, data_length});
+  }
+  flushFields();
+  for (const auto& piece : pieces_) size_ += piece.length;
+}
+
+void RsStateEncoder::flushFields() {
+  if (fields_.size() == flushed_) return;
+  pieces_.push_back({flushed_, nullptr, fields_.size() - flushed_});
+  flushed_ = fields_.size();
+}
+
+RsStateDecoder::RsStateDecoder(RsSystemState* state, RegionTarget target)
+    : state_(state),
+      target_(target),
+      decode_state_(KEY),
+      message_(SYSTEM_STATE),
+      message_left_(0),
+      field_left_(0),
+      field_(0),
+      wire_type_(0),
+      varint_(0),
+      shift_(0),
+      has_start_(false),
+      has_length_(false),
+      dst_(nullptr),
+      dst_offset_(0),
+      rle_(nullptr, 0),
+      region_bytes_(0) {
+  state_->model = RsTrs80Model_UNKNOWN_MODEL;
+  state_->registers = RsRegisters();
+  state_->regions.clear();
+}
+
+bool RsStateDecoder::Feed(const uint8_t* data, size_t length) {
+  size_t i = 0;
+  while (i < length && decode_state_ != FAILED) {
+    if (decode_state_ == KEY || decode_state_ == VARINT || decode_state_ == LENGTH) {
+      if (!consume(data[i++])) decode_state_ = FAILED;
+      continue;
+    }
+    // Bytes of a field, as many as there are at once.
+    size_t n = std::min<uint64_t>(length - i, field_left_);
+    if (decode_state_ == BYTES) {
+      if (dst_offset_ + n > (size_t) state_->regions.back().length) {
+        decode_state_ = FAILED;
+        break;
+      }
+      memcpy(dst_ + dst_offset_, data + i, n);
+      dst_offset_ += n;
+      region_bytes_ += n;
+    } else if (decode_state_ == RLE_BYTES && !rle_.Feed(data + i, n)) {
+      decode_state_ = FAILED;
+      break;
+    }
+    i += n;
+    field_left_ -= n;
+    if (message_ != SYSTEM_STATE) message_left_ -= n;
+    if (field_left_ == 0 && !endOfField()) decode_state_ = FAILED;
+  }
+  return decode_state_ != FAILED;
+}
+
+bool RsStateDecoder::complete() const {
+  return decode_state_ == KEY && message_ == SYSTEM_STATE && shift_ == 0;
+}
+
+bool RsStateDecoder::consume(uint8_t byte) {
+  if (message_ != SYSTEM_STATE) {
+    if (message_left_ == 0) return false;
+    message_left_--;
+  }
+  if (shift_ >= 64) return false;
+  varint_ |= (uint64_t) (byte & 0x7f) << shift_;
+  shift_ += 7;
+  if (byte & 0x80) return true;
+  uint64_t value = varint_;
+  varint_ = 0;
+  shift_ = 0;
+
+  switch (decode_state_) {
+    case KEY:
+      field_ = value >> 3;
+      wire_type_ = value & 7;
+      if (wire_type_ == WIRE_VARINT) {
+        decode_state_ = VARINT;
+      } else if (wire_type_ == WIRE_LENGTH) {
+        decode_state_ = LENGTH;
+      } else if (wire_type_ == WIRE_FIXED64 || wire_type_ == WIRE_FIXED32) {
+        return skip(wire_type_ == WIRE_FIXED64 ? 8 : 4);
+      } else {
+        return false;
+      }
+      return true;
+    case VARINT:
+      decode_state_ = KEY;
+      return onVarint(value) && endOfMessage();
+    case LENGTH:
+      return onLength(value);
+    default:
+      return false;
+  }
+}
+
+bool RsStateDecoder::onVarint(uint64_t value) {
+  if (message_ == SYSTEM_STATE) {
+    if (field_ == FIELD_MODEL) state_->model = (RsTrs80Model) (int32_t) value;
+  } else if (message_ == REGISTERS) {
+    if (field_ >= 1 && field_ <= NUM_REGISTER_FIELDS) {
+      state_->registers.*REGISTER_FIELDS[field_ - 1] = (int32_t) value;
+    }
+  } else {
+    auto& region = state_->regions.back();
+    if (field_ == FIELD_START) {
+      region.start = (int32_t) value;
+      has_start_ = true;
+    } else if (field_ == FIELD_LENGTH) {
+      if (value > INT32_MAX) return false;
+      // Where the data came first, it already set the length.
+      if (dst_ != nullptr) return (int32_t) value == region.length;
+      region.length = (int32_t) value;
+      has_length_ = true;
+    }
+  }
+  return true;
+}
+
+bool RsStateDecoder::onLength(uint64_t length) {
+  if (message_ != SYSTEM_STATE && length > message_left_) return false;
+  // No message or region is anywhere near this big; lengths beyond it do
+  // not fit the int fields they end up in.
+  bool known =
+      (message_ == SYSTEM_STATE && (field_ == FIELD_REGISTERS || field_ == FIELD_REGION)) ||
+      (message_ == MEMORY_REGION && (field_ == FIELD_DATA || field_ == FIELD_RLE_DATA));
+  if (known && length > INT32_MAX) return false;
+  if (message_ == SYSTEM_STATE && field_ == FIELD_REGISTERS) {
+    message_ = REGISTERS;
+    message_left_ = length;
+    decode_state_ = KEY;
+    return endOfMessage();
+  }
+  if (message_ == SYSTEM_STATE && field_ == FIELD_REGION) {
+    state_->regions.emplace_back();
+    auto& region = state_->regions.back();
+    region.start = 0;
+    region.length = 0;
+    has_start_ = false;
+    has_length_ = false;
+    dst_ = nullptr;
+    dst_offset_ = 0;
+    message_ = MEMORY_REGION;
+    message_left_ = length;
+    decode_state_ = KEY;
+    return endOfMessage();
+  }
+  if (message_ == MEMORY_REGION && (field_ == FIELD_DATA || field_ == FIELD_RLE_DATA)) {
+    auto& region = state_->regions.back();
+    if (dst_ != nullptr) return false;
+    if (field_ == FIELD_DATA) {
+      if (has_length_ && length != region.length) return false;
+      region.length = length;
+      has_length_ = true;
+    } else if (!has_length_) {
+      // The size of the decompressed bytes is needed up front.
+      return false;
+    }
+    dst_ = regionDestination(region.length);
+    if (dst_ == nullptr) return false;
+    if (field_ == FIELD_RLE_DATA) rle_ = RleDecoder(dst_, region.length);
+    decode_state_ = field_ == FIELD_DATA ? BYTES : RLE_BYTES;
+    field_left_ = length;
+    return field_left_ > 0 || endOfField();
+  }
+  return skip(length);
+}
+
+bool RsStateDecoder::skip(uint64_t length) {
+  if (message_ != SYSTEM_STATE && length > message_left_) return false;
+  decode_state_ = SKIP;
+  field_left_ = length;
+  return field_left_ > 0 || endOfField();
+}
+
+bool RsStateDecoder::endOfField() {
+  if (decode_state_ == RLE_BYTES) {
+    if (!rle_.complete() || rle_.size() != state_->regions.back().length) return false;
+    region_bytes_ += rle_.size();
+  }
+  decode_state_ = KEY;
+  return endOfMessage();
+}
+
+bool RsStateDecoder::endOfMessage() {
+  if (message_ != SYSTEM_STATE && message_left_ == 0) message_ = SYSTEM_STATE;
+  return true;
+}
+
+uint8_t* RsStateDecoder::regionDestination(int length) {
+  auto& region = state_->regions.back();
+  if (target_) {
+    // The target is chosen by address.
+    if (!has_start_) return nullptr;
+    uint8_t* dst = target_(region.start, length);
+    if (dst != nullptr) return dst;
+  }
+  region.data.reset(new (std::nothrow) uint8_t[std::max(length, 1)]);
+  return region.data.get();
+}
+
+}  // namespace retrostore
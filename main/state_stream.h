@@ -0,0 +1,132 @@
+#pragma once
+
+#ifndef _RETROSTORE_STATE_STREAM_H_
+#define _RETROSTORE_STATE_STREAM_H_
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "retrostore.h"
+#include "rle.h"
+#include "state_snapshot.h"
+
+namespace retrostore {
+
+// Streaming codec for system states in the protobuf wire format of the
+// RetroStore API:
+//
+//   SystemState  { 1: model, 2: Registers, 3: repeated MemoryRegion }
+//   Registers    { 1: ix ... 15: r_2, in RsRegisters order }
+//   MemoryRegion { 1: start, 3: length, 2: data, 4: RLE compressed data }
+//
+// A decoder that has to see the whole response first holds it twice: once
+// as received and once decoded. These decode the response as it arrives,
+// field by field, with region bytes going straight to their destination, so
+// downloading a state costs little more than the state itself.
+
+// Produces the encoded state a piece at a time, e.g. one network segment per
+// Read(). Region bytes are read from where they are, not copied; they must
+// stay valid while encoding. Regions without data are sent with their start
+// and length only.
+class RsStateEncoder {
+ public:
+  // With `rle`, region bytes are sent RLE compressed (see rle.h) as field 4.
+  RsStateEncoder(RsTrs80Model model, const RsRegisters& registers,
+                 const std::vector<RsRegionView>& regions, bool rle = false);
+  explicit RsStateEncoder(const RsSystemState& state, bool rle = false);
+
+  // Size of the encoded state.
+  size_t size() const { return size_; }
+  // Copies up to `capacity` more bytes of the encoded state into `dst` and
+  // returns how many; 0 once all have been read.
+  size_t Read(uint8_t* dst, size_t capacity);
+
+ private:
+  struct Piece {
+    // Into fields_ if `data` is null.
+    size_t offset;
+    const uint8_t* data;
+    size_t length;
+  };
+
+  void encode(RsTrs80Model model, const RsRegisters& registers,
+              const std::vector<RsRegionView>& regions, bool rle);
+  // Adds the field bytes written since the last piece.
+  void flushFields();
+
+  // Keys, lengths and numbers.
+  std::vector<uint8_t> fields_;
+  size_t flushed_;
+  // Compressed region bytes, when sending RLE.
+  std::vector<std::vector<uint8_t>> compressed_;
+  std::vector<Piece> pieces_;
+  size_t size_;
+  size_t piece_;
+  size_t piece_offset_;
+};
+
+// Decodes an encoded state fed in arbitrary pieces, as it arrives.
+//
+// Region bytes are written to the destination the RegionTarget returns, e.g.
+// the emulator's memory, leaving the region's `data` null. Without a
+// target, or where it returns nullptr, each region gets a buffer of exactly
+// its length. Either way nothing but the destination holds them. A region's
+// start and length must precede its data, as RsStateEncoder sends them.
+class RsStateDecoder {
+ public:
+  typedef std::function<uint8_t*(int start, int length)> RegionTarget;
+
+  // Decodes into `state`, replacing its contents.
+  explicit RsStateDecoder(RsSystemState* state, RegionTarget target = nullptr);
+
+  // Decodes the next piece of input. Returns false, and keeps failing, if
+  // the input is not a valid state.
+  bool Feed(const uint8_t* data, size_t length);
+
+  // Whether the input so far is a complete state.
+  bool complete() const;
+  // Bytes of region data decoded so far.
+  size_t region_bytes() const { return region_bytes_; }
+
+ private:
+  enum State { KEY, VARINT, LENGTH, BYTES, RLE_BYTES, SKIP, FAILED };
+  enum Message { SYSTEM_STATE, REGISTERS, MEMORY_REGION };
+
+  bool consume(uint8_t byte);
+  // Handles a decoded varint or length for the current field.
+  bool onVarint(uint64_t value);
+  bool onLength(uint64_t length);
+  // Passes over `length` bytes of a field this does not know.
+  bool skip(uint64_t length);
+  // Called once all bytes of a length-delimited field are read.
+  bool endOfField();
+  // Leaves the nested message once all of it is read.
+  bool endOfMessage();
+  // Where the bytes of the current region go.
+  uint8_t* regionDestination(int length);
+
+  RsSystemState* state_;
+  RegionTarget target_;
+  State decode_state_;
+  Message message_;
+  // Bytes left in the nested message, or in the field being copied or
+  // skipped.
+  uint64_t message_left_;
+  uint64_t field_left_;
+  int field_;
+  int wire_type_;
+  uint64_t varint_;
+  int shift_;
+  bool has_start_;
+  bool has_length_;
+  uint8_t* dst_;
+  size_t dst_offset_;
+  RleDecoder rle_;
+  size_t region_bytes_;
+};
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_STATE_STREAM_H_ */
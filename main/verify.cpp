@@ -0,0 +1,159 @@
+#include "verify.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace retrostore {
+
+namespace {
+
+// A machine word: 32 bits on the ESP32.
+typedef uintptr_t Word;
+
+inline Word loadWord(const uint8_t* p) {
+  Word w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+// Little-endian, like both the ESP32 and the host.
+inline uint32_t load32(const uint8_t* p) {
+  uint32_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+inline uint32_t rotl(uint32_t x, int r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+// Tables for slicing-by-4: table[k][b] is the CRC of byte b followed by k
+// zero bytes, so four bytes are folded in with four lookups and no shifts
+// in between.
+struct CrcTables {
+  uint32_t table[4][256];
+
+  CrcTables() {
+    for (uint32_t b = 0; b < 256; ++b) {
+      uint32_t crc = b;
+      for (int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ (0xedb88320u & (0 - (crc & 1)));
+      table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+      for (int k = 1; k < 4; ++k) {
+        table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+      }
+    }
+  }
+};
+
+const CrcTables& crcTables() {
+  static const CrcTables tables;
+  return tables;
+}
+
+const uint32_t PRIME1 = 2654435761u;
+const uint32_t PRIME2 = 2246822519u;
+const uint32_t PRIME3 = 3266489917u;
+const uint32_t PRIME4 = 668265263u;
+const uint32_t PRIME5 = 374761393u;
+
+inline uint32_t xxRound(uint32_t acc, uint32_t input) {
+  return rotl(acc + input * PRIME2, 13) * PRIME1;
+}
+
+template <typename Region>
+int firstDifference(const Region& region, const uint8_t* want, int length) {
+  if (region.data == nullptr) return region.length == 0 && length == 0 ? -1 : 0;
+  int common = std::min(region.length, length);
+  int first = FirstDifference(region.data.get(), want, common);
+  if (first >= 0) return first;
+  return region.length == length ? -1 : common;
+}
+
+}  // namespace
+
+int FirstDifference(const uint8_t* a, const uint8_t* b, int length) {
+  int i = 0;
+  // Four words per iteration, so the loop overhead is paid once per 16
+  // bytes; the exact position is only looked for in a block that differs.
+  const int block = 4 * sizeof(Word);
+  for (; i + block <= length; i += block) {
+    Word diff = (loadWord(a + i) ^ loadWord(b + i)) |
+                (loadWord(a + i + sizeof(Word)) ^ loadWord(b + i + sizeof(Word))) |
+                (loadWord(a + i + 2 * sizeof(Word)) ^ loadWord(b + i + 2 * sizeof(Word))) |
+                (loadWord(a + i + 3 * sizeof(Word)) ^ loadWord(b + i + 3 * sizeof(Word)));
+    if (diff != 0) break;
+  }
+  for (; i < length; ++i) {
+    if (a[i] != b[i]) return i;
+  }
+  return -1;
+}
+
+int FirstDifference(const RsMemoryRegion& region, const uint8_t* want, int length) {
+  return firstDifference(region, want, length);
+}
+
+int FirstDifference(const RsMediaRegion& region, const uint8_t* want, int length) {
+  return firstDifference(region, want, length);
+}
+
+uint32_t Crc32(const uint8_t* data, size_t length, uint32_t crc) {
+  const auto& t = crcTables().table;
+  crc = ~crc;
+  size_t i = 0;
+  for (; i + 4 <= length; i += 4) {
+    crc ^= load32(data + i);
+    crc = t[3][crc & 0xff] ^ t[2][(crc >> 8) & 0xff] ^ t[1][(crc >> 16) & 0xff] ^ t[0][crc >> 24];
+  }
+  for (; i < length; ++i) crc = (crc >> 8) ^ t[0][(crc ^ data[i]) & 0xff];
+  return ~crc;
+}
+
+uint32_t Crc32(const RsMemoryRegion& region) {
+  return Crc32(region.data.get(), region.data == nullptr ? 0 : region.length);
+}
+
+uint32_t Crc32(const RsMediaRegion& region) {
+  return Crc32(region.data.get(), region.data == nullptr ? 0 : region.length);
+}
+
+uint32_t Hash32(const uint8_t* data, size_t length, uint32_t seed) {
+  size_t i = 0;
+  uint32_t h;
+  if (length >= 16) {
+    uint32_t v1 = seed + PRIME1 + PRIME2;
+    uint32_t v2 = seed + PRIME2;
+    uint32_t v3 = seed;
+    uint32_t v4 = seed - PRIME1;
+    for (; i + 16 <= length; i += 16) {
+      v1 = xxRound(v1, load32(data + i));
+      v2 = xxRound(v2, load32(data + i + 4));
+      v3 = xxRound(v3, load32(data + i + 8));
+      v4 = xxRound(v4, load32(data + i + 12));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+  } else {
+    h = seed + PRIME5;
+  }
+  h += (uint32_t) length;
+  for (; i + 4 <= length; i += 4) h = rotl(h + load32(data + i) * PRIME3, 17) * PRIME4;
+  for (; i < length; ++i) h = rotl(h + data[i] * PRIME5, 11) * PRIME1;
+  h ^= h >> 15;
+  h *= PRIME2;
+  h ^= h >> 13;
+  h *= PRIME3;
+  h ^= h >> 16;
+  return h;
+}
+
+uint32_t Hash32(const RsMemoryRegion& region) {
+  return Hash32(region.data.get(), region.data == nullptr ? 0 : region.length);
+}
+
+uint32_t Hash32(const RsMediaRegion& region) {
+  return Hash32(region.data.get(), region.data == nullptr ? 0 : region.length);
+}
+
+}  // namespace retrostore
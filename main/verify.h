@@ -0,0 +1,44 @@
+#pragma once
+
+#ifndef _RETROSTORE_VERIFY_H_
+#define _RETROSTORE_VERIFY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "retrostore.h"
+
+namespace retrostore {
+
+// Comparison and checksum kernels for checking states and media images.
+//
+// They work a machine word at a time rather than byte by byte, which is
+// what makes checking a 128 KB state cheap on the ESP32: it has no vector
+// unit, but a 32-bit load and compare costs about as much as an 8-bit one.
+// Unaligned buffers are fine.
+
+// Position of the first byte where `a` and `b` differ, or -1 if the first
+// `length` bytes are equal.
+int FirstDifference(const uint8_t* a, const uint8_t* b, int length);
+
+// Position of the first byte where the region differs from `want`, which
+// holds `length` bytes. A region of a different length differs at the end
+// of the shorter one; one without data at 0.
+int FirstDifference(const RsMemoryRegion& region, const uint8_t* want, int length);
+int FirstDifference(const RsMediaRegion& region, const uint8_t* want, int length);
+
+// The CRC-32 used by zip and Ethernet. Pass the previous result as `crc` to
+// continue a checksum over several pieces.
+uint32_t Crc32(const uint8_t* data, size_t length, uint32_t crc = 0);
+uint32_t Crc32(const RsMemoryRegion& region);
+uint32_t Crc32(const RsMediaRegion& region);
+
+// The xxHash32 of the data, several times faster than Crc32 but not
+// incremental. For telling apart content, not for detecting attacks.
+uint32_t Hash32(const uint8_t* data, size_t length, uint32_t seed = 0);
+uint32_t Hash32(const RsMemoryRegion& region);
+uint32_t Hash32(const RsMediaRegion& region);
+
+}  // namespace retrostore
+
+#endif /* _RETROSTORE_VERIFY_H_ */
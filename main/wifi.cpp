@@ -5,20 +5,24 @@
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "esp_wifi_default.h"
 #include "esp_event.h"
 #include "esp_log.h"
 
 #include "lwip/err.h"
+#include "lwip/ip_addr.h"
 #include "lwip/sys.h"
+#include "ping/ping_sock.h"
+
+#include "sdkconfig.h"
+#include "wifi_cache.h"
 
 namespace {
 
 ESP_EVENT_DEFINE_BASE(WINSTON_EVENT);
 
-#define MAXIMUM_RETRY  10
-
 /* FreeRTOS event group to signal when we are connected*/
 static EventGroupHandle_t s_wifi_event_group;
 
@@ -26,35 +30,167 @@ static EventGroupHandle_t s_wifi_event_group;
  * - are we connected to the AP with an IP? */
 static const int WIFI_CONNECTED_BIT = BIT0;
 static const char *TAG = "winston-wifi";
-static int s_retry_num = 0;
+
+static esp_netif_t* s_netif = nullptr;
+static std::string s_ssid;
+static WifiApCache* s_cache = nullptr;
+static WifiBackoff s_backoff;
+// Fires the next connection attempt, so that the event task never waits.
+static esp_timer_handle_t s_retry_timer = nullptr;
+// Whether the config points at the cached access point rather than the SSID.
+static bool s_fast_connect = false;
+// Whether the cached IP lease is in use instead of DHCP.
+static bool s_static_ip = false;
+// What is learned about the access point while connecting.
+static WifiApRecord s_record = {};
+
+static void retry_timer_callback(void* arg) {
+  esp_wifi_connect();
+}
+
+// Keeps the lease and tells the listeners that the connection is up.
+static void connected() {
+#ifdef CONFIG_RS_WIFI_FAST_CONNECT
+  s_cache->Save(s_ssid, s_record);
+#endif
+  xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+  // Fire off an event to let other event listener know that WIFI is
+  // now connected.
+  esp_event_post(WINSTON_EVENT, WIFI_CONNECTED, NULL, 0, portMAX_DELAY);
+}
+
+#ifdef CONFIG_RS_WIFI_REUSE_IP
+// Another device has the address, or the network changed: the replies go
+// elsewhere. DHCP hands out a fresh lease, which is then cached instead.
+static void drop_cached_lease() {
+  ESP_LOGI(TAG, "Gateway does not answer on the cached lease, asking DHCP.");
+  s_cache->Clear();
+  s_static_ip = false;
+  esp_netif_dhcpc_start(s_netif);
+}
+
+static void lease_check_end(esp_ping_handle_t ping, void* arg) {
+  uint32_t replies = 0;
+  esp_ping_get_profile(ping, ESP_PING_PROF_REPLY, &replies, sizeof(replies));
+  esp_ping_delete_session(ping);
+  if (replies > 0) {
+    connected();
+  } else {
+    drop_cached_lease();
+  }
+}
+
+// A cached lease counts only once the gateway answers a ping on it, so that a
+// stale one is neither used nor saved again.
+static void check_cached_lease(uint32_t gateway) {
+  esp_ping_config_t config = ESP_PING_DEFAULT_CONFIG();
+  ip_addr_set_ip4_u32(&config.target_addr, gateway);
+  config.count = WIFI_LEASE_CHECK_PINGS;
+  config.interval_ms = 200;
+  config.timeout_ms = 500;
+  esp_ping_callbacks_t callbacks = { };
+  callbacks.on_ping_end = &lease_check_end;
+  esp_ping_handle_t ping;
+  if (esp_ping_new_session(&config, &callbacks, &ping) != ESP_OK) {
+    drop_cached_lease();
+    return;
+  }
+  esp_ping_start(ping);
+}
+#endif
+
+// Points the config at the cached access point: no scan beyond its channel,
+// and with the cached IP lease no DHCP either.
+static void use_cached_ap(wifi_config_t* config, const WifiApRecord& record) {
+  memcpy(config->sta.bssid, record.bssid, sizeof(config->sta.bssid));
+  config->sta.bssid_set = true;
+  config->sta.channel = record.channel;
+  config->sta.scan_method = WIFI_FAST_SCAN;
+  s_fast_connect = true;
+#ifdef CONFIG_RS_WIFI_REUSE_IP
+  if (record.ip != 0 && esp_netif_dhcpc_stop(s_netif) == ESP_OK) {
+    esp_netif_ip_info_t ip_info = {};
+    ip_info.ip.addr = record.ip;
+    ip_info.netmask.addr = record.netmask;
+    ip_info.gw.addr = record.gateway;
+    esp_netif_dns_info_t dns = {};
+    dns.ip.type = ESP_IPADDR_TYPE_V4;
+    dns.ip.u_addr.ip4.addr = record.dns;
+    if (esp_netif_set_ip_info(s_netif, &ip_info) == ESP_OK) {
+      esp_netif_set_dns_info(s_netif, ESP_NETIF_DNS_MAIN, &dns);
+      s_static_ip = true;
+    } else {
+      esp_netif_dhcpc_start(s_netif);
+    }
+  }
+#endif
+}
+
+// Forgets the cached access point and looks for the SSID on every channel,
+// with a fresh lease from DHCP.
+static void use_full_scan() {
+  wifi_config_t config = { };
+  esp_wifi_get_config(WIFI_IF_STA, &config);
+  config.sta.bssid_set = false;
+  config.sta.channel = 0;
+  config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+  esp_wifi_set_config(WIFI_IF_STA, &config);
+  if (s_static_ip) esp_netif_dhcpc_start(s_netif);
+  s_fast_connect = false;
+  s_static_ip = false;
+  s_cache->Clear();
+}
 
 static void event_handler(void* arg, esp_event_base_t event_base,
                           int32_t event_id, void* event_data) {
   if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-    ESP_LOGI(TAG, "WIFI: Connection Start");
+    ESP_LOGI(TAG, "WIFI: Connection Start%s", s_fast_connect ? " (cached access point)" : "");
     esp_wifi_connect();
+  } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+    auto* event = (wifi_event_sta_connected_t*) event_data;
+    memcpy(s_record.bssid, event->bssid, sizeof(s_record.bssid));
+    s_record.channel = event->channel;
   } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-    ESP_LOGI(TAG, "WIFI: Disconnected");
-    if (s_retry_num < MAXIMUM_RETRY) {
-      esp_wifi_connect();
-      xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
-      s_retry_num++;
-      auto delay_millis = 5 * 1000;
-      vTaskDelay(delay_millis / portTICK_PERIOD_MS);
-      ESP_LOGI(TAG, "Retrying to connect to the AP, %d of %d tries",
-                    s_retry_num, MAXIMUM_RETRY);
-    } else {
+    auto* event = (wifi_event_sta_disconnected_t*) event_data;
+    ESP_LOGI(TAG, "WIFI: Disconnected (reason %d)", event->reason);
+    if (xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT) {
+      esp_event_post(WINSTON_EVENT, WIFI_DISCONNECTED, NULL, 0, portMAX_DELAY);
+    }
+    xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+    int delay_millis = s_backoff.Next();
+    if (delay_millis < 0) {
       ESP_LOGI(TAG, "Connection to the AP failed. Rebooting...");
       esp_restart();
     }
+    // The access point moved, went away or no longer takes the old lease.
+    if (s_fast_connect && (event->reason == WIFI_REASON_NO_AP_FOUND ||
+                           s_backoff.failures() >= WIFI_FAST_CONNECT_ATTEMPTS)) {
+      ESP_LOGI(TAG, "Cached access point unreachable, scanning.");
+      use_full_scan();
+    }
+    ESP_LOGI(TAG, "Retrying to connect to the AP in %d ms, %d of %d tries",
+             delay_millis, s_backoff.failures(), WIFI_MAX_RETRIES);
+    esp_timer_start_once(s_retry_timer, (uint64_t) delay_millis * 1000);
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-    ESP_LOGI(TAG, "got ip: " IPSTR, IP2STR(&event->ip_info.ip));
-    s_retry_num = 0;
-    xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
-    // Fire off an event to let other event listener know that WIFI is
-    // now connected.
-    esp_event_post(WINSTON_EVENT, WIFI_CONNECTED, NULL, 0, portMAX_DELAY);
+    ESP_LOGI(TAG, "got ip: " IPSTR " %d ms after boot%s", IP2STR(&event->ip_info.ip),
+             (int) (esp_timer_get_time() / 1000), s_static_ip ? " (cached lease)" : "");
+    s_backoff.Reset();
+    s_record.ip = event->ip_info.ip.addr;
+    s_record.netmask = event->ip_info.netmask.addr;
+    s_record.gateway = event->ip_info.gw.addr;
+    esp_netif_dns_info_t dns = {};
+    if (esp_netif_get_dns_info(s_netif, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK) {
+      s_record.dns = dns.ip.u_addr.ip4.addr;
+    }
+#ifdef CONFIG_RS_WIFI_REUSE_IP
+    if (s_static_ip) {
+      check_cached_lease(s_record.gateway);
+      return;
+    }
+#endif
+    connected();
   } else {
     ESP_LOGI(TAG, "WIFI: Unknown event.");
   }
@@ -64,12 +200,21 @@ static void event_handler(void* arg, esp_event_base_t event_base,
 // public
 void Wifi::connect(const std::string& ssid, const std::string& password) {
   s_wifi_event_group = xEventGroupCreate();
+  s_ssid = ssid;
+  s_cache = new WifiApCache();
 
   ESP_ERROR_CHECK(esp_netif_init());
-  esp_netif_create_default_wifi_sta();
+  s_netif = esp_netif_create_default_wifi_sta();
 
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+  // The config is set on every boot; keeping it out of flash saves a write.
+  ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+
+  esp_timer_create_args_t timer_args = { };
+  timer_args.callback = &retry_timer_callback;
+  timer_args.name = "wifi_retry";
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_retry_timer));
 
   ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
                                              &event_handler, NULL));
@@ -79,6 +224,13 @@ void Wifi::connect(const std::string& ssid, const std::string& password) {
   wifi_config_t wifi_config = { };
   strcpy((char*) wifi_config.sta.ssid, ssid.c_str());
   strcpy((char*) wifi_config.sta.password, password.c_str());
+  wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+
+#ifdef CONFIG_RS_WIFI_FAST_CONNECT
+  WifiApRecord record;
+  if (s_cache->Load(ssid, &record)) use_cached_ap(&wifi_config, record);
+#endif
 
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
   ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
@@ -7,6 +7,7 @@
 
 enum {
     WIFI_CONNECTED,
+    WIFI_DISCONNECTED,
 };
 
 
@@ -0,0 +1,89 @@
+#include "wifi_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "esp_log.h"
+
+namespace {
+
+static const char *TAG = "winston-wifi";
+
+#define RECORD_KEY "ap"
+#define RECORD_VERSION 1
+
+// The NVS blob: the version, the record, then the SSID.
+std::vector<uint8_t> serialize(const std::string& ssid, const WifiApRecord& record) {
+  std::vector<uint8_t> blob(sizeof(uint32_t) + sizeof(WifiApRecord) + ssid.size());
+  uint32_t version = RECORD_VERSION;
+  memcpy(blob.data(), &version, sizeof(version));
+  memcpy(blob.data() + sizeof(version), &record, sizeof(record));
+  memcpy(blob.data() + sizeof(version) + sizeof(record), ssid.data(), ssid.size());
+  return blob;
+}
+
+}  // namespace
+
+WifiApCache::WifiApCache(const char* nvs_namespace) : nvs_(0), nvs_open_(false) {
+  auto err = nvs_open(nvs_namespace, NVS_READWRITE, &nvs_);
+  if (err == ESP_OK) {
+    nvs_open_ = true;
+  } else {
+    ESP_LOGW(TAG, "Cannot open NVS namespace '%s' (0x%x), always scanning.", nvs_namespace, err);
+  }
+}
+
+WifiApCache::~WifiApCache() {
+  if (nvs_open_) nvs_close(nvs_);
+}
+
+bool WifiApCache::Load(const std::string& ssid, WifiApRecord* record) {
+  if (!nvs_open_) return false;
+  size_t length = 0;
+  if (nvs_get_blob(nvs_, RECORD_KEY, nullptr, &length) != ESP_OK) return false;
+  std::vector<uint8_t> blob(length);
+  if (length != sizeof(uint32_t) + sizeof(WifiApRecord) + ssid.size() ||
+      nvs_get_blob(nvs_, RECORD_KEY, blob.data(), &length) != ESP_OK) {
+    return false;
+  }
+  uint32_t version;
+  memcpy(&version, blob.data(), sizeof(version));
+  if (version != RECORD_VERSION ||
+      memcmp(blob.data() + sizeof(version) + sizeof(WifiApRecord), ssid.data(), ssid.size()) != 0) {
+    return false;
+  }
+  memcpy(record, blob.data() + sizeof(version), sizeof(WifiApRecord));
+  return true;
+}
+
+void WifiApCache::Save(const std::string& ssid, const WifiApRecord& record) {
+  if (!nvs_open_) return;
+  auto blob = serialize(ssid, record);
+  // Spare the flash: reconnecting to the same access point changes nothing.
+  size_t length = 0;
+  if (nvs_get_blob(nvs_, RECORD_KEY, nullptr, &length) == ESP_OK && length == blob.size()) {
+    std::vector<uint8_t> stored(length);
+    if (nvs_get_blob(nvs_, RECORD_KEY, stored.data(), &length) == ESP_OK && stored == blob) return;
+  }
+  auto err = nvs_set_blob(nvs_, RECORD_KEY, blob.data(), blob.size());
+  if (err == ESP_OK) err = nvs_commit(nvs_);
+  if (err != ESP_OK) ESP_LOGW(TAG, "Saving the access point failed (0x%x).", err);
+}
+
+void WifiApCache::Clear() {
+  if (!nvs_open_) return;
+  nvs_erase_key(nvs_, RECORD_KEY);
+  nvs_commit(nvs_);
+}
+
+WifiBackoff::WifiBackoff(int initial_ms, int max_ms, int max_attempts)
+    : initial_ms_(initial_ms), max_ms_(max_ms), max_attempts_(max_attempts), failures_(0) {}
+
+int WifiBackoff::Next() {
+  if (failures_ >= max_attempts_) return -1;
+  int delay = initial_ms_;
+  for (int i = 0; i < failures_ && delay < max_ms_; ++i) delay *= 2;
+  failures_++;
+  return std::min(delay, max_ms_);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#ifndef _WINSTON_WIFI_CACHE_H_
+#define _WINSTON_WIFI_CACHE_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "nvs.h"
+
+// NVS namespace that keeps the access point last connected to.
+#define WIFI_CACHE_NAMESPACE "wifi_cache"
+
+// Reconnect attempts before giving up, and the delays between them.
+#define WIFI_MAX_RETRIES 10
+#define WIFI_BACKOFF_INITIAL_MS 250
+#define WIFI_BACKOFF_MAX_MS 8000
+// Failed attempts at the cached access point before scanning for the SSID.
+#define WIFI_FAST_CONNECT_ATTEMPTS 2
+// Pings to the gateway that check a cached IP lease; one reply is enough.
+#define WIFI_LEASE_CHECK_PINGS 3
+
+// What is needed to reach an access point again without scanning and
+// without DHCP.
+struct WifiApRecord {
+  uint8_t bssid[6];
+  uint8_t channel;
+  // IPv4 addresses in network byte order, like esp_ip4_addr_t. The lease
+  // the access point last gave out, or all 0 if there was none.
+  uint32_t ip;
+  uint32_t netmask;
+  uint32_t gateway;
+  uint32_t dns;
+};
+
+// Remembers the access point and IP lease of the last connection in NVS, so
+// that the next boot can connect straight to its BSSID on its channel, which
+// takes a fraction of a full scan, and skip DHCP.
+//
+// Requires nvs_flash_init().
+class WifiApCache {
+ public:
+  explicit WifiApCache(const char* nvs_namespace = WIFI_CACHE_NAMESPACE);
+  ~WifiApCache();
+
+  // The record saved for `ssid`. Fails if there is none or it was saved for
+  // another network.
+  bool Load(const std::string& ssid, WifiApRecord* record);
+  // Writes to flash only if the record changed, which it rarely does.
+  void Save(const std::string& ssid, const WifiApRecord& record);
+  void Clear();
+
+ private:
+  nvs_handle_t nvs_;
+  bool nvs_open_;
+};
+
+// Exponential backoff between reconnect attempts: the delay doubles after
+// every failure, from WIFI_BACKOFF_INITIAL_MS up to WIFI_BACKOFF_MAX_MS.
+class WifiBackoff {
+ public:
+  WifiBackoff(int initial_ms = WIFI_BACKOFF_INITIAL_MS, int max_ms = WIFI_BACKOFF_MAX_MS,
+              int max_attempts = WIFI_MAX_RETRIES);
+
+  // Records a failed attempt and returns the delay before retrying, or -1
+  // once `max_attempts` retries have failed in a row.
+  int Next();
+  // Called once connected.
+  void Reset() { failures_ = 0; }
+  int failures() const { return failures_; }
+
+ private:
+  int initial_ms_;
+  int max_ms_;
+  int max_attempts_;
+  int failures_;
+};
+
+#endif /* _WINSTON_WIFI_CACHE_H_ */